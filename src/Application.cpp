@@ -147,124 +147,129 @@ void Application::run(void)
   {
     int32_t frame_start = SDL_GetTicks();
 
-    while (SDL_PollEvent(&event))
     {
-      switch (event.type)
+      utils::stats::ScopedTimer timer(m_profiler.phase(FrameProfiler::PHASE_EVENTS));
+
+      while (SDL_PollEvent(&event))
       {
-        case SDL_WINDOWEVENT:
-          {
-            switch (event.window.event)
+        switch (event.type)
+        {
+          case SDL_WINDOWEVENT:
             {
+              switch (event.window.event)
+              {
 #if 0
-              case SDL_WINDOWEVENT_HIDDEN:
-              case SDL_WINDOWEVENT_MINIMIZED:  // Stop redraw when minimized
-                std::cerr << "Window " << event.window.windowID << " DEActivated" << std::endl;
-                m_windows[event.window.windowID].second = false;
-                break;
+                case SDL_WINDOWEVENT_HIDDEN:
+                case SDL_WINDOWEVENT_MINIMIZED:  // Stop redraw when minimized
+                  std::cerr << "Window " << event.window.windowID << " DEActivated" << std::endl;
+                  m_windows[event.window.windowID].second = false;
+                  break;
               
-              case SDL_WINDOWEVENT_SHOWN:
-              case SDL_WINDOWEVENT_MAXIMIZED:
-              case SDL_WINDOWEVENT_RESTORED:
-                std::cerr << "Application Activated" << std::endl;
-                m_windows[event.window.windowID].second = true;
-                break;
+                case SDL_WINDOWEVENT_SHOWN:
+                case SDL_WINDOWEVENT_MAXIMIZED:
+                case SDL_WINDOWEVENT_RESTORED:
+                  std::cerr << "Application Activated" << std::endl;
+                  m_windows[event.window.windowID].second = true;
+                  break;
 #endif         
-              case SDL_WINDOWEVENT_RESIZED:
-                m_windows[event.window.windowID]->onResize(event.window.data1, event.window.data2);
-                break;
+                case SDL_WINDOWEVENT_RESIZED:
+                  m_windows[event.window.windowID]->onResize(event.window.data1, event.window.data2);
+                  break;
 
-              case SDL_WINDOWEVENT_CLOSE:
-                closeWindow(m_windows[event.window.windowID]);
-                break;
+                case SDL_WINDOWEVENT_CLOSE:
+                  closeWindow(m_windows[event.window.windowID]);
+                  break;
 
 #if 0
-              case SDL_WINDOWEVENT_ENTER:
-              case SDL_WINDOWEVENT_FOCUS_GAINED:
-                m_focused_window = m_windows[event.window.windowID];
-                break;
+                case SDL_WINDOWEVENT_ENTER:
+                case SDL_WINDOWEVENT_FOCUS_GAINED:
+                  m_focused_window = m_windows[event.window.windowID];
+                  break;
 #endif
+              }
             }
-          }
-          break;
+            break;
 
-        case SDL_KEYDOWN:
-          {
-            tWindowContainer::iterator it = m_windows.find(event.key.windowID);
-            if (it != m_windows.end())
+          case SDL_KEYDOWN:
             {
-              it->second->onKeyDown(event.key.keysym.sym, event.key.keysym.mod);
+              tWindowContainer::iterator it = m_windows.find(event.key.windowID);
+              if (it != m_windows.end())
+              {
+                it->second->onKeyDown(event.key.keysym.sym, event.key.keysym.mod);
+              }
             }
-          }
-          //m_focused_window->onKeyDown(event.key.keysym.sym, event.key.keysym.mod);
-          break;
-
-        case SDL_KEYUP:
-          {
-            tWindowContainer::iterator it = m_windows.find(event.key.windowID);
-            if (it != m_windows.end())
+            //m_focused_window->onKeyDown(event.key.keysym.sym, event.key.keysym.mod);
+            break;
+
+          case SDL_KEYUP:
             {
-              it->second->onKeyUp(event.key.keysym.sym, event.key.keysym.mod);
+              tWindowContainer::iterator it = m_windows.find(event.key.windowID);
+              if (it != m_windows.end())
+              {
+                it->second->onKeyUp(event.key.keysym.sym, event.key.keysym.mod);
+              }
             }
-          }
-          //m_focused_window->onKeyUp(event.key.keysym.sym, event.key.keysym.mod);
-          break;
-
-        case SDL_MOUSEMOTION:
-          {
-            tWindowContainer::iterator it = m_windows.find(event.motion.windowID);
-            if (it != m_windows.end())
+            //m_focused_window->onKeyUp(event.key.keysym.sym, event.key.keysym.mod);
+            break;
+
+          case SDL_MOUSEMOTION:
             {
-              it->second->onMouseMove(event.motion.state, event.motion.x, event.motion.y, event.motion.xrel, event.motion.yrel);
+              tWindowContainer::iterator it = m_windows.find(event.motion.windowID);
+              if (it != m_windows.end())
+              {
+                it->second->onMouseMove(event.motion.state, event.motion.x, event.motion.y, event.motion.xrel, event.motion.yrel);
+              }
             }
-          }
-          //m_focused_window->onMouseMove(event.motion.x, event.motion.y, event.motion.xrel, event.motion.yrel, event.motion.state);
-          break;
-
-        case SDL_MOUSEBUTTONDOWN:
-          {
-            tWindowContainer::iterator it = m_windows.find(event.button.windowID);
-            if (it != m_windows.end())
+            //m_focused_window->onMouseMove(event.motion.x, event.motion.y, event.motion.xrel, event.motion.yrel, event.motion.state);
+            break;
+
+          case SDL_MOUSEBUTTONDOWN:
             {
-              it->second->onMouseDown(event.button.button, event.button.x, event.button.y);
+              tWindowContainer::iterator it = m_windows.find(event.button.windowID);
+              if (it != m_windows.end())
+              {
+                it->second->onMouseDown(event.button.button, event.button.x, event.button.y);
+              }
             }
-          }
-          //m_focused_window->onMouseDown(event.button.button, event.button.x, event.button.y);
-          break;
-
-        case SDL_MOUSEBUTTONUP:
-          {
-            tWindowContainer::iterator it = m_windows.find(event.button.windowID);
-            if (it != m_windows.end())
+            //m_focused_window->onMouseDown(event.button.button, event.button.x, event.button.y);
+            break;
+
+          case SDL_MOUSEBUTTONUP:
             {
-              it->second->onMouseUp(event.button.button, event.button.x, event.button.y);
+              tWindowContainer::iterator it = m_windows.find(event.button.windowID);
+              if (it != m_windows.end())
+              {
+                it->second->onMouseUp(event.button.button, event.button.x, event.button.y);
+              }
             }
-          }
-          //m_focused_window->onMouseUp(event.button.button, event.button.x, event.button.y);
-          break;
-
-        case SDL_MOUSEWHEEL:
-          {
-            tWindowContainer::iterator it = m_windows.find(event.wheel.windowID);
-            if (it != m_windows.end())
+            //m_focused_window->onMouseUp(event.button.button, event.button.x, event.button.y);
+            break;
+
+          case SDL_MOUSEWHEEL:
             {
-              it->second->onMouseWheel(event.wheel.x, event.wheel.y);
+              tWindowContainer::iterator it = m_windows.find(event.wheel.windowID);
+              if (it != m_windows.end())
+              {
+                it->second->onMouseWheel(event.wheel.x, event.wheel.y);
+              }
             }
-          }
-          //m_focused_window->onMouseWheel(event.wheel.x, event.wheel.y);
-          break;
-
-        case SDL_QUIT:
-          std::clog << "SDL_QUIT" << std::endl;
-          quit();
-          running = false;
-          return;  // End main loop
-
-        default:  // Do nothing
-          break;
+            //m_focused_window->onMouseWheel(event.wheel.x, event.wheel.y);
+            break;
+
+          case SDL_QUIT:
+            std::clog << "SDL_QUIT" << std::endl;
+            quit();
+            running = false;
+            return;  // End main loop
+
+          default:  // Do nothing
+            break;
+        }
       }
     }
     
     // redraw every application window
+    // (the windows time the phases of their redraw themselves)
     for (auto & it : m_windows)
     {
       Window *wnd = it.second;
@@ -273,6 +278,7 @@ void Application::run(void)
         //std::cerr << "Redrawing window " << wnd->getID() << std::endl;
         SDL_GL_MakeCurrent(wnd->getSDLWindow(), wnd->getGLContext());
         wnd->onRedraw();
+        utils::stats::ScopedTimer timer(m_profiler.phase(FrameProfiler::PHASE_SWAP));
         wnd->refresh();
         //SDL_GL_SwapWindow(wnd->getSDLWindow());
       }
@@ -288,6 +294,8 @@ void Application::run(void)
     {
       SDL_Delay(sleep_time);
     }
+
+    m_profiler.nextFrame();
   }
 
   return;
@@ -21,6 +21,8 @@
 #ifndef APPLICATION_H
 #define APPLICATION_H
 
+#include "FrameProfiler.h"
+
 #include <unordered_map>
 #include <cstdint>
 
@@ -43,6 +45,12 @@ class Application
       return m_assets_dir;
     }
 
+    // the timing of the phases of the last frames
+    FrameProfiler & profiler(void)
+    {
+      return m_profiler;
+    }
+
     // registers a new window and takes ownership over it
     void registerWindow(Window *wnd);
 
@@ -61,9 +69,10 @@ class Application
   private:
     // Application object is a singleton, which is not copyable
     Application(void)
-      : //m_focused_window(nullptr),
+      : m_assets_dir(""),
+        //m_focused_window(nullptr),
         m_windows(),
-        m_assets_dir("")
+        m_profiler()
     {
     }
 
@@ -87,6 +96,7 @@ class Application
     const char *m_assets_dir;    /// a path to directory containing assets (GL/CL sources, fonts, ...)
     //Window *m_focused_window;    /// the currently active window (this could in theory be infered from SDL event)
     tWindowContainer m_windows;  /// a list of application windows
+    FrameProfiler m_profiler;    /// the timing of frames
 };
 
 #endif
\ No newline at end of file
@@ -0,0 +1,555 @@
+/*
+ * Copyright (C) 2014 Matus Fedorko <xfedor01@stud.fit.vutbr.cz>
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty.  In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+
+ * 1. The origin of this software must not be misrepresented; you must not
+ *    claim that you wrote the original software. If you use this software
+ *    in a product, an acknowledgment in the product documentation would be
+ *    appreciated but is not required.
+ * 2. Altered source versions must be plainly marked as such, and must not be
+ *    misrepresented as being the original software.
+ * 3. This notice may not be removed or altered from any source distribution.
+ */
+
+#include "BenchmarkSuite.h"
+#include "Application.h"
+#include "debug.h"
+#include "utils.h"
+
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+
+
+
+namespace {
+
+const unsigned int DEFAULT_PARTICLES[] = { 1000, 4000, 16000, 64000, 256000, 1000000 };
+
+const FluidSystem::NeighborSearch DEFAULT_MODES[] = {
+  FluidSystem::NEIGHBOR_SEARCH_BRUTE_FORCE,
+  FluidSystem::NEIGHBOR_SEARCH_TILED,
+  FluidSystem::NEIGHBOR_SEARCH_GRID,
+  FluidSystem::NEIGHBOR_SEARCH_VERLET
+};
+
+const char *modeToStr(FluidSystem::NeighborSearch ns)
+{
+  switch (ns)
+  {
+    case FluidSystem::NEIGHBOR_SEARCH_BRUTE_FORCE: return "brute";
+    case FluidSystem::NEIGHBOR_SEARCH_GRID:        return "grid";
+    case FluidSystem::NEIGHBOR_SEARCH_VERLET:      return "verlet";
+    case FluidSystem::NEIGHBOR_SEARCH_TILED:       return "tiled";
+    case FluidSystem::NEIGHBOR_SEARCH_AUTO:        return "auto";
+  }
+
+  return "unknown";
+}
+
+bool strToMode(const std::string & str, FluidSystem::NeighborSearch *ns)
+{
+  for (int i = 0; i <= FluidSystem::NEIGHBOR_SEARCH_AUTO; ++i)
+  {
+    if (str == modeToStr(FluidSystem::NeighborSearch(i)))
+    {
+      *ns = FluidSystem::NeighborSearch(i);
+      return true;
+    }
+  }
+
+  return false;
+}
+
+// whether the cost of the neighbour search grows quadratically with the particle count
+bool isQuadratic(FluidSystem::NeighborSearch ns)
+{
+  return (ns == FluidSystem::NEIGHBOR_SEARCH_BRUTE_FORCE) || (ns == FluidSystem::NEIGHBOR_SEARCH_TILED);
+}
+
+bool parseUInt(const char *str, unsigned int *value)
+{
+  char *end = nullptr;
+  unsigned long v = strtoul(str, &end, 10);
+  if ((*str == 0) || (*end != 0)) return false;
+  *value = (unsigned int) v;
+  return true;
+}
+
+// splits a comma separated list
+std::vector<std::string> splitList(const char *str)
+{
+  std::vector<std::string> items;
+  std::istringstream is(str);
+  std::string item;
+
+  while (std::getline(is, item, ','))
+  {
+    items.push_back(item);
+  }
+
+  return items;
+}
+
+void writeJSONString(std::ostream & os, const std::string & str)
+{
+  os << '"';
+  for (size_t i = 0; i < str.size(); ++i)
+  {
+    if ((str[i] == '"') || (str[i] == '\\')) os << '\\';
+    if ((unsigned char) str[i] >= 0x20) os << str[i];
+  }
+  os << '"';
+}
+
+/**
+ * The results are written one configuration per line, so the baseline
+ * is read line by line and these helpers look for the value of a key in a line
+ */
+bool findNumber(const std::string & line, const char *key, double *value)
+{
+  std::string pattern = std::string("\"") + key + "\":";
+  size_t pos = line.find(pattern);
+  if (pos == std::string::npos) return false;
+
+  const char *begin = line.c_str() + pos + pattern.size();
+  char *end = nullptr;
+  *value = strtod(begin, &end);
+  return end != begin;
+}
+
+bool findString(const std::string & line, const char *key, std::string *value)
+{
+  std::string pattern = std::string("\"") + key + "\":\"";
+  size_t pos = line.find(pattern);
+  if (pos == std::string::npos) return false;
+
+  size_t begin = pos + pattern.size();
+  size_t end = line.find('"', begin);
+  if (end == std::string::npos) return false;
+
+  *value = line.substr(begin, end - begin);
+  return true;
+}
+
+}
+
+
+bool BenchmarkSuite::parseArgs(int argc, char **argv, Options *opts)
+{
+  for (int i = 0; i < argc; ++i)
+  {
+    const char *arg = argv[i];
+    const char *val = (i + 1 < argc) ? argv[i + 1] : nullptr;
+
+    if ((strcmp(arg, "-h") == 0) || (strcmp(arg, "--help") == 0))
+    {
+      return false;
+    }
+
+    /* all the other options take a value */
+    if (val == nullptr)
+    {
+      ERROR("BenchmarkSuite: Missing value of option " << arg);
+      return false;
+    }
+
+    ++i;
+
+    if ((strcmp(arg, "-n") == 0) || (strcmp(arg, "--particles") == 0))
+    {
+      std::vector<std::string> items(splitList(val));
+      for (size_t k = 0; k < items.size(); ++k)
+      {
+        unsigned int n = 0;
+        if ((!parseUInt(items[k].c_str(), &n)) || (n == 0))
+        {
+          ERROR("BenchmarkSuite: Invalid particle count: " << items[k]);
+          return false;
+        }
+        opts->particles.push_back(n);
+      }
+    }
+    else if ((strcmp(arg, "-m") == 0) || (strcmp(arg, "--modes") == 0))
+    {
+      std::vector<std::string> items(splitList(val));
+      for (size_t k = 0; k < items.size(); ++k)
+      {
+        FluidSystem::NeighborSearch ns = FluidSystem::NEIGHBOR_SEARCH_AUTO;
+        if (!strToMode(items[k], &ns))
+        {
+          ERROR("BenchmarkSuite: Invalid neighbour search (expected brute|grid|verlet|tiled|auto): " << items[k]);
+          return false;
+        }
+        opts->modes.push_back(ns);
+      }
+    }
+    else if ((strcmp(arg, "-w") == 0) || (strcmp(arg, "--warmup") == 0))
+    {
+      if (!parseUInt(val, &opts->warmup_steps))
+      {
+        ERROR("BenchmarkSuite: Invalid warm-up step count: " << val);
+        return false;
+      }
+    }
+    else if ((strcmp(arg, "-s") == 0) || (strcmp(arg, "--steps") == 0))
+    {
+      if ((!parseUInt(val, &opts->steps)) || (opts->steps == 0))
+      {
+        ERROR("BenchmarkSuite: Invalid step count: " << val);
+        return false;
+      }
+    }
+    else if ((strcmp(arg, "-q") == 0) || (strcmp(arg, "--quadratic-limit") == 0))
+    {
+      if (!parseUInt(val, &opts->quadratic_limit))
+      {
+        ERROR("BenchmarkSuite: Invalid particle count: " << val);
+        return false;
+      }
+    }
+    else if ((strcmp(arg, "-o") == 0) || (strcmp(arg, "--output") == 0))
+    {
+      opts->output_file = val;
+    }
+    else if ((strcmp(arg, "-B") == 0) || (strcmp(arg, "--baseline") == 0))
+    {
+      opts->baseline_file = val;
+    }
+    else if ((strcmp(arg, "-t") == 0) || (strcmp(arg, "--threshold") == 0))
+    {
+      char *end = nullptr;
+      opts->threshold = strtod(val, &end);
+      if ((*val == 0) || (*end != 0) || (opts->threshold < 0.0))
+      {
+        ERROR("BenchmarkSuite: Invalid regression threshold: " << val);
+        return false;
+      }
+    }
+    else if ((strcmp(arg, "-d") == 0) || (strcmp(arg, "--device") == 0))
+    {
+      if (strcmp(val, "gpu") == 0) opts->device_type = CL_DEVICE_TYPE_GPU;
+      else if (strcmp(val, "cpu") == 0) opts->device_type = CL_DEVICE_TYPE_CPU;
+      else if (strcmp(val, "any") == 0) opts->device_type = CL_DEVICE_TYPE_ALL;
+      else
+      {
+        ERROR("BenchmarkSuite: Invalid device type (expected gpu|cpu|any): " << val);
+        return false;
+      }
+    }
+    else if ((strcmp(arg, "-a") == 0) || (strcmp(arg, "--assets") == 0))
+    {
+      opts->assets_dir = val;
+    }
+    else
+    {
+      ERROR("BenchmarkSuite: Unknown option " << arg);
+      return false;
+    }
+  }
+
+  if (opts->particles.empty())
+  {
+    opts->particles.assign(DEFAULT_PARTICLES, DEFAULT_PARTICLES + FLUIDSIM_COUNT(DEFAULT_PARTICLES));
+  }
+
+  if (opts->modes.empty())
+  {
+    opts->modes.assign(DEFAULT_MODES, DEFAULT_MODES + FLUIDSIM_COUNT(DEFAULT_MODES));
+  }
+
+  return true;
+}
+
+
+void BenchmarkSuite::printUsage(const char *program, std::ostream & os)
+{
+  os << "Usage: " << program << " --benchmark [options]\n"
+        "  -n, --particles LIST     comma separated particle counts\n"
+        "                           (default 1000,4000,16000,64000,256000,1000000)\n"
+        "  -m, --modes LIST         comma separated neighbour searches brute|grid|verlet|tiled|auto\n"
+        "                           (default brute,tiled,grid,verlet)\n"
+        "  -w, --warmup N           steps before each measurement (default 20)\n"
+        "  -s, --steps N            measured steps of each configuration (default 100)\n"
+        "  -q, --quadratic-limit N  skip brute and tiled searches above N particles (default 65536)\n"
+        "  -o, --output FILE        write the JSON results to FILE (default standard output)\n"
+        "  -B, --baseline FILE      compare with the results of an earlier run\n"
+        "  -t, --threshold PERCENT  report slowdowns above PERCENT as regressions (default 5),\n"
+        "                           the exit status is " << REGRESSION_STATUS << " when any configuration regressed\n"
+        "  -d, --device TYPE        gpu|cpu|any (default gpu)\n"
+        "  -a, --assets DIR         the directory with OpenCL sources (default .)" << std::endl;
+}
+
+
+int BenchmarkSuite::run(std::ostream & os)
+{
+  Application::instance().setAssetsRootDir(m_opts.assets_dir.c_str());
+
+  /* no OpenGL context and no window, the particle data stays in plain device buffers */
+  ocl::setHeadless(true);
+  ParticleSystem::setPreferredDeviceType(m_opts.device_type);
+
+  FluidSystem system;
+
+  cl_device_id device = nullptr;
+  char device_name[256] = { 0 };
+  clGetCommandQueueInfo(system.commandQueue()(), CL_QUEUE_DEVICE, sizeof(device), &device, nullptr);
+  clGetDeviceInfo(device, CL_DEVICE_NAME, sizeof(device_name) - 1, device_name, nullptr);
+
+  os << "Benchmark: " << device_name << ", " << m_opts.warmup_steps << " warm-up and "
+     << m_opts.steps << " measured steps per configuration" << std::endl;
+
+  std::vector<Result> results;
+
+  for (size_t i = 0; i < m_opts.particles.size(); ++i)
+  {
+    for (size_t k = 0; k < m_opts.modes.size(); ++k)
+    {
+      unsigned int n = m_opts.particles[i];
+      FluidSystem::NeighborSearch mode = m_opts.modes[k];
+
+      os << "  " << std::setw(8) << n << " particles, " << std::setw(6) << modeToStr(mode) << " : ";
+
+      if ((isQuadratic(mode)) && (n > m_opts.quadratic_limit))
+      {
+        os << "skipped (quadratic search)" << std::endl;
+        continue;
+      }
+
+      Result res;
+      if (!measure(system, n, mode, &res))
+      {
+        os << "failed" << std::endl;
+        ERROR("BenchmarkSuite: Failed to measure " << n << " particles with " << modeToStr(mode) << " search");
+        return 1;
+      }
+
+      os << res.steps_per_second << " steps/s, " << res.particle_steps_per_second << " particle steps/s" << std::endl;
+
+      results.push_back(res);
+    }
+  }
+
+  if (!writeResults(device_name, results))
+  {
+    return 1;
+  }
+
+  if (m_opts.baseline_file.empty())
+  {
+    return 0;
+  }
+
+  int regressions = compareBaseline(results, os);
+  if (regressions < 0)
+  {
+    return 1;
+  }
+
+  return (regressions > 0) ? REGRESSION_STATUS : 0;
+}
+
+
+bool BenchmarkSuite::measure(FluidSystem & system, unsigned int particles, FluidSystem::NeighborSearch mode, Result *res)
+{
+  typedef std::chrono::high_resolution_clock Clock;
+
+  system.setNeighborSearch(mode);
+  if (!system.reset(particles))
+  {
+    return false;
+  }
+
+  cl_command_queue queue = system.commandQueue()();
+
+  /* program builds, the first touch of buffers, neighbour lists, ... */
+  for (unsigned int i = 0; i < m_opts.warmup_steps; ++i)
+  {
+    system.update();
+  }
+
+  clFinish(queue);
+
+  // the kernel times are the differences of totals, so the records need not be cleared
+  std::vector<std::pair<std::string, unsigned long long> > before;
+  system.perfStats().totalExecTimes(before);
+
+  Clock::time_point start = Clock::now();
+
+  for (unsigned int i = 0; i < m_opts.steps; ++i)
+  {
+    system.update();
+  }
+
+  clFinish(queue);
+
+  double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+
+  std::vector<std::pair<std::string, unsigned long long> > after;
+  system.perfStats().totalExecTimes(after);
+
+  std::map<std::string, unsigned long long> prev(before.begin(), before.end());
+
+  res->particles = particles;
+  res->mode = mode;
+  res->seconds = seconds;
+  res->steps_per_second = (seconds > 0.0) ? (m_opts.steps / seconds) : 0.0;
+  res->particle_steps_per_second = res->steps_per_second * particles;
+  res->kernels.clear();
+
+  for (size_t i = 0; i < after.size(); ++i)
+  {
+    unsigned long long total = after[i].second - prev[after[i].first];
+    if (total > 0)
+    {
+      res->kernels[after[i].first] = total * 1.0e-6 / m_opts.steps;
+    }
+  }
+
+  return true;
+}
+
+
+bool BenchmarkSuite::writeResults(const std::string & device, const std::vector<Result> & results)
+{
+  std::ofstream file;
+  if (!m_opts.output_file.empty())
+  {
+    file.open(m_opts.output_file.c_str());
+    if (!file)
+    {
+      ERROR("BenchmarkSuite: Failed to create file " << m_opts.output_file);
+      return false;
+    }
+  }
+
+  std::ostream & os = m_opts.output_file.empty() ? std::cout : file;
+
+  // every configuration is on a single line (see compareBaseline)
+  os << "{\n";
+  os << "  \"device\": "; writeJSONString(os, device); os << ",\n";
+  os << "  \"warmup_steps\": " << m_opts.warmup_steps << ",\n";
+  os << "  \"steps\": " << m_opts.steps << ",\n";
+  os << "  \"results\": [";
+
+  for (size_t i = 0; i < results.size(); ++i)
+  {
+    const Result & r = results[i];
+
+    os << ((i > 0) ? ",\n" : "\n")
+       << "    {\"particles\":" << r.particles
+       << ",\"neighbor_search\":\"" << modeToStr(r.mode) << '"'
+       << ",\"seconds\":" << r.seconds
+       << ",\"steps_per_second\":" << r.steps_per_second
+       << ",\"particle_steps_per_second\":" << r.particle_steps_per_second
+       << ",\"kernels_ms_per_step\":{";
+
+    for (std::map<std::string, double>::const_iterator it = r.kernels.begin(); it != r.kernels.end(); ++it)
+    {
+      if (it != r.kernels.begin()) os << ',';
+      writeJSONString(os, it->first);
+      os << ':' << it->second;
+    }
+
+    os << "}}";
+  }
+
+  os << "\n  ]\n}" << std::endl;
+
+  if (!os)
+  {
+    ERROR("BenchmarkSuite: Failed to write the results");
+    return false;
+  }
+
+  return true;
+}
+
+
+int BenchmarkSuite::compareBaseline(const std::vector<Result> & results, std::ostream & os)
+{
+  std::ifstream file(m_opts.baseline_file.c_str());
+  if (!file)
+  {
+    ERROR("BenchmarkSuite: Failed to open baseline " << m_opts.baseline_file);
+    return -1;
+  }
+
+  /* the steps per second of each configuration in baseline */
+  std::map<std::pair<unsigned int, std::string>, double> baseline;
+  std::string line;
+
+  while (std::getline(file, line))
+  {
+    double particles = 0.0;
+    double steps_per_second = 0.0;
+    std::string mode;
+
+    if ((findNumber(line, "particles", &particles)) &&
+        (findString(line, "neighbor_search", &mode)) &&
+        (findNumber(line, "steps_per_second", &steps_per_second)))
+    {
+      baseline[std::make_pair((unsigned int) particles, mode)] = steps_per_second;
+    }
+  }
+
+  if (baseline.empty())
+  {
+    ERROR("BenchmarkSuite: No results found in baseline " << m_opts.baseline_file);
+    return -1;
+  }
+
+  os << "Comparison with " << m_opts.baseline_file << " (threshold " << m_opts.threshold << " %):" << std::endl;
+
+  int regressions = 0;
+
+  for (size_t i = 0; i < results.size(); ++i)
+  {
+    const Result & r = results[i];
+
+    os << "  " << std::setw(8) << r.particles << " particles, " << std::setw(6) << modeToStr(r.mode) << " : ";
+
+    std::map<std::pair<unsigned int, std::string>, double>::const_iterator it =
+        baseline.find(std::make_pair(r.particles, std::string(modeToStr(r.mode))));
+
+    if ((it == baseline.end()) || (it->second <= 0.0))
+    {
+      os << "not in baseline" << std::endl;
+      continue;
+    }
+
+    double change = (r.steps_per_second / it->second - 1.0) * 100.0;
+
+    std::ostringstream change_str;
+    change_str << std::showpos << std::fixed << std::setprecision(1) << change << " %";
+
+    os << change_str.str() << " (" << it->second << " -> " << r.steps_per_second << " steps/s)";
+
+    if (change < -m_opts.threshold)
+    {
+      os << " REGRESSION";
+      ++regressions;
+    }
+    else if (change > m_opts.threshold)
+    {
+      os << " improved";
+    }
+
+    os << std::endl;
+  }
+
+  os << regressions << " regressions" << std::endl;
+
+  return regressions;
+}
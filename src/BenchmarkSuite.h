@@ -0,0 +1,106 @@
+/*
+ * Copyright (C) 2014 Matus Fedorko <xfedor01@stud.fit.vutbr.cz>
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty.  In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+
+ * 1. The origin of this software must not be misrepresented; you must not
+ *    claim that you wrote the original software. If you use this software
+ *    in a product, an acknowledgment in the product documentation would be
+ *    appreciated but is not required.
+ * 2. Altered source versions must be plainly marked as such, and must not be
+ *    misrepresented as being the original software.
+ * 3. This notice may not be removed or altered from any source distribution.
+ */
+
+/**
+ * A benchmark of the fluid simulation that sweeps particle counts
+ * and neighbour search algorithms, without any window or OpenGL context
+ */
+
+#ifndef BENCHMARKSUITE_H
+#define BENCHMARKSUITE_H
+
+#include "FluidSystem.h"
+
+#include <map>
+#include <ostream>
+#include <string>
+#include <vector>
+
+
+class BenchmarkSuite
+{
+  public:
+    struct Options {
+      std::vector<unsigned int> particles;                    // the swept particle counts
+      std::vector<FluidSystem::NeighborSearch> modes;         // the swept neighbour search algorithms
+      unsigned int warmup_steps;     // steps before the measurement (program builds, neighbour lists, ...)
+      unsigned int steps;            // the measured steps of each configuration
+      unsigned int quadratic_limit;  // brute force and tiled searches are skipped above this particle count
+      std::string output_file;       // where the JSON results are written (standard output when empty)
+      std::string baseline_file;     // the results of an earlier run to compare with (nothing is compared when empty)
+      double threshold;              // a slowdown above this percentage is reported as a regression
+      cl_device_type device_type;    // the preferred type of OpenCL device
+      std::string assets_dir;
+
+      Options(void)
+        : particles()
+        , modes()
+        , warmup_steps(20)
+        , steps(100)
+        , quadratic_limit(65536)
+        , output_file()
+        , baseline_file()
+        , threshold(5.0)
+        , device_type(CL_DEVICE_TYPE_GPU)
+        , assets_dir(".")
+      {
+      }
+    };
+
+    // the measurement of a single configuration
+    struct Result {
+      unsigned int particles;
+      FluidSystem::NeighborSearch mode;
+      double seconds;                          // the duration of the measured steps
+      double steps_per_second;
+      double particle_steps_per_second;
+      std::map<std::string, double> kernels;   // the device time of each kernel in milliseconds per step
+    };
+
+  public:
+    explicit BenchmarkSuite(const Options & opts) : m_opts(opts) { }
+
+    // parses the command line arguments following the --benchmark switch
+    // (the default sweep is filled in when the lists are not given)
+    // @return false if the arguments are invalid (the usage should be printed)
+    static bool parseArgs(int argc, char **argv, Options *opts);
+    static void printUsage(const char *program, std::ostream & os);
+
+    // runs all configurations, writes the results and compares them with the baseline,
+    // the progress and the comparison are reported to the given stream
+    // @return the exit status of the program (REGRESSION_STATUS if any configuration regressed)
+    int run(std::ostream & os);
+
+    static const int REGRESSION_STATUS = 2;
+
+  private:
+    // measures a single configuration
+    bool measure(FluidSystem & system, unsigned int particles, FluidSystem::NeighborSearch mode, Result *res);
+
+    bool writeResults(const std::string & device, const std::vector<Result> & results);
+
+    // @return the number of regressions or a negative number on error
+    int compareBaseline(const std::vector<Result> & results, std::ostream & os);
+
+  private:
+    Options m_opts;
+};
+
+#endif
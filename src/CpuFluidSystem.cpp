@@ -0,0 +1,724 @@
+/*
+ * Copyright (C) 2014 Matus Fedorko <xfedor01@stud.fit.vutbr.cz>
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty.  In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+
+ * 1. The origin of this software must not be misrepresented; you must not
+ *    claim that you wrote the original software. If you use this software
+ *    in a product, an acknowledgment in the product documentation would be
+ *    appreciated but is not required.
+ * 2. Altered source versions must be plainly marked as such, and must not be
+ *    misrepresented as being the original software.
+ * 3. This notice may not be removed or altered from any source distribution.
+ */
+
+
+/**
+ * The code follows the OpenCL kernels in sph_compute_pressure.cl,
+ * sph_compute_force.cl and sph_compute_step.cl
+ */
+
+#include "CpuFluidSystem.h"
+#include "debug.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <ctime>
+#include <iomanip>
+#include <random>
+#include <thread>
+
+#if defined(__AVX512F__) || defined(__AVX2__)
+# include <immintrin.h>
+#endif
+
+
+
+namespace {
+
+#if defined(__AVX2__) && !defined(__AVX512F__)
+/** sums all the lanes of a vector */
+inline float horizontalSum(__m256 v)
+{
+  __m128 s = _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+  s = _mm_add_ps(s, _mm_movehl_ps(s, s));
+  s = _mm_add_ss(s, _mm_shuffle_ps(s, s, 1));
+  return _mm_cvtss_f32(s);
+}
+#endif
+
+}
+
+
+void CpuFluidSystem::setParams(const FluidSystem::Params & params)
+{
+  m_params = params;
+
+  /* the same constants as the build options of the OpenCL program (see FluidSystem::buildKernels) */
+  m_consts.sim_scale = params.sim_scale;
+  m_consts.smooth_radius = params.smooth_radius;
+  m_consts.radius2 = params.smooth_radius * params.smooth_radius;
+  m_consts.mass = params.mass;
+  m_consts.mass_polykern = (float) (params.mass * params.polyKernel());
+  m_consts.rest_density = params.rest_density;
+  m_consts.int_stiffness = params.int_stiffness;
+  m_consts.vterm = (float) (params.lapKernel() * params.viscosity);
+  m_consts.spikykern_half = (float) (params.spikyKernel() * -0.5);
+  m_consts.delta_time = params.delta_time;
+
+  /* the cell size is equal to the smoothing radius in world space coordinates */
+  m_grid_cell_size = params.smooth_radius / params.sim_scale;
+  for (int i = 0; i < 3; ++i)
+  {
+    m_grid_size[i] = std::max(1, (int) ceil((m_volume_max.s[i] - m_volume_min.s[i]) / m_grid_cell_size));
+  }
+  m_grid_num_cells = m_grid_size[0] * m_grid_size[1] * m_grid_size[2];
+  m_cell_start.assign(m_grid_num_cells + 1, 0);
+}
+
+
+void CpuFluidSystem::setNumThreads(unsigned int num_threads)
+{
+  if ((num_threads != 0) && (num_threads == m_pool->numThreads())) return;
+  m_pool.reset(new utils::tasks::ThreadPool(num_threads));
+}
+
+
+const char *CpuFluidSystem::simdName(void)
+{
+#if defined(__AVX512F__)
+  return "AVX-512";
+#elif defined(__AVX2__)
+  return "AVX2";
+#else
+  return "scalar";
+#endif
+}
+
+
+bool CpuFluidSystem::reset(unsigned int part_num)
+{
+  m_num_particles = part_num;
+  m_particle_layout = LAYOUT_SOA;
+  m_time = 0.0f;
+
+  for (int f = 0; f < FIELD_COUNT; ++f)
+  {
+    m_data[f].assign(part_num + PADDING, 0.0f);
+  }
+
+  m_tmp.assign(part_num + PADDING, 0.0f);
+  m_cell.assign(part_num, 0);
+  m_order.assign(part_num, 0);
+
+  /* random positions inside of the bounding volume (see sph_reset.cl) */
+  std::mt19937 rng((unsigned int) time(nullptr));
+
+  for (int c = 0; c < 3; ++c)
+  {
+    std::uniform_real_distribution<float> dist(m_volume_min.s[c], m_volume_max.s[c]);
+    float *pos = field((Field) (POS_X + c));
+    for (unsigned int i = 0; i < part_num; ++i)
+    {
+      pos[i] = dist(rng);
+    }
+  }
+
+  /* the vertex buffer for rendering */
+  if (!ocl::headless())
+  {
+    glBindBuffer(GL_ARRAY_BUFFER, m_particle_pos_buf.getGLID());
+    glBufferData(GL_ARRAY_BUFFER, 3 * part_num * sizeof(float), nullptr, GL_DYNAMIC_DRAW);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+    GLenum err = glGetError();
+    if (err != GL_NO_ERROR)
+    {
+      ERROR("CpuFluidSystem: Failed to allocate vertex buffer: " << ogl::errorToStr(err));
+      return false;
+    }
+
+    uploadPositions();
+  }
+
+  return true;
+}
+
+
+void CpuFluidSystem::update(float time_step)
+{
+  // check if the simulation is not paused
+  if (m_pause) return;
+
+  step(time_step);
+
+  if (!ocl::headless()) uploadPositions();
+}
+
+
+bool CpuFluidSystem::readPositions(std::vector<float> & positions)
+{
+  positions.resize(3 * m_num_particles);
+
+  for (int c = 0; c < 3; ++c)
+  {
+    const float *pos = field((Field) (POS_X + c));
+    std::copy(pos, pos + m_num_particles, positions.begin() + c * m_num_particles);
+  }
+
+  return true;
+}
+
+
+void CpuFluidSystem::step(float time_step)
+{
+  if (m_num_particles == 0) return;
+
+  buildGrid();
+
+  m_pool->parallelFor(m_grid_num_cells, CELL_GRAIN, [this] (size_t b, size_t e) { computePressure(b, e); });
+  m_pool->parallelFor(m_grid_num_cells, CELL_GRAIN, [this] (size_t b, size_t e) { computeForce(b, e); });
+  m_pool->parallelFor(m_num_particles, PARTICLE_GRAIN, [this] (size_t b, size_t e) { integrate(b, e); });
+
+  /* advance simulation time */
+  m_time += time_step;
+
+  // kill the wave after 50 frames
+  if (m_effects & FluidSystem::EFFECT_WAVE)
+  {
+    if ((m_time - m_wave_start) > (time_step * 50))
+    {
+      m_effects &= ~(FluidSystem::EFFECT_WAVE);
+    }
+  }
+}
+
+
+int CpuFluidSystem::cellIndex(size_t i) const
+{
+  /* the same clamping as sph_grid_cell_coords */
+  int c[3];
+  for (int k = 0; k < 3; ++k)
+  {
+    int v = (int) floor((field((Field) (POS_X + k))[i] - m_volume_min.s[k]) / m_grid_cell_size);
+    c[k] = std::min(std::max(v, 0), m_grid_size[k] - 1);
+  }
+
+  return (c[2] * m_grid_size[1] + c[1]) * m_grid_size[0] + c[0];
+}
+
+
+void CpuFluidSystem::buildGrid(void)
+{
+  size_t n = m_num_particles;
+
+  m_pool->parallelFor(n, PARTICLE_GRAIN, [this] (size_t b, size_t e) {
+    for (size_t i = b; i < e; ++i) m_cell[i] = cellIndex(i);
+  });
+
+  /* counting sort, the histogram and the scan are cheap compared to the SPH loops */
+  std::fill(m_cell_start.begin(), m_cell_start.end(), 0);
+  for (size_t i = 0; i < n; ++i)
+  {
+    ++m_cell_start[m_cell[i] + 1];
+  }
+
+  for (int c = 0; c < m_grid_num_cells; ++c)
+  {
+    m_cell_start[c + 1] += m_cell_start[c];
+  }
+
+  {
+    std::vector<unsigned int> offset(m_cell_start.begin(), m_cell_start.end() - 1);
+    for (size_t i = 0; i < n; ++i)
+    {
+      m_order[i] = offset[m_cell[i]]++;
+    }
+  }
+
+  /* gather the fields that survive to the next step */
+  for (int f = 0; f < SORTED_FIELD_COUNT; ++f)
+  {
+    const float *src = field((Field) f);
+    m_pool->parallelFor(n, PARTICLE_GRAIN, [&] (size_t b, size_t e) {
+      for (size_t i = b; i < e; ++i) m_tmp[m_order[i]] = src[i];
+    });
+    m_data[f].swap(m_tmp);
+  }
+}
+
+
+float CpuFluidSystem::densitySum(unsigned int i, unsigned int begin, unsigned int end) const
+{
+  const float *px = field(POS_X);
+  const float *py = field(POS_Y);
+  const float *pz = field(POS_Z);
+  const float scale = m_consts.sim_scale;
+  const float radius2 = m_consts.radius2;
+
+  float sum = 0.0f;
+  unsigned int j = begin;
+
+#if defined(__AVX512F__)
+  const __m512 vscale = _mm512_set1_ps(scale);
+  const __m512 vradius2 = _mm512_set1_ps(radius2);
+  const __m512 xi = _mm512_set1_ps(px[i]);
+  const __m512 yi = _mm512_set1_ps(py[i]);
+  const __m512 zi = _mm512_set1_ps(pz[i]);
+  const __m512i vi = _mm512_set1_epi32((int) i);
+  const __m512i vend = _mm512_set1_epi32((int) end);
+  const __m512i lanes = _mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+  __m512 acc = _mm512_setzero_ps();
+
+  for (; j < end; j += 16)
+  {
+    __m512i idx = _mm512_add_epi32(_mm512_set1_epi32((int) j), lanes);
+    __mmask16 valid = _mm512_cmplt_epi32_mask(idx, vend) & _mm512_cmpneq_epi32_mask(idx, vi);
+
+    __m512 dx = _mm512_mul_ps(_mm512_sub_ps(xi, _mm512_loadu_ps(px + j)), vscale);
+    __m512 dy = _mm512_mul_ps(_mm512_sub_ps(yi, _mm512_loadu_ps(py + j)), vscale);
+    __m512 dz = _mm512_mul_ps(_mm512_sub_ps(zi, _mm512_loadu_ps(pz + j)), vscale);
+    __m512 sqr = _mm512_fmadd_ps(dz, dz, _mm512_fmadd_ps(dy, dy, _mm512_mul_ps(dx, dx)));
+
+    __mmask16 m = valid & _mm512_cmp_ps_mask(sqr, vradius2, _CMP_LT_OQ);
+    __m512 c = _mm512_sub_ps(vradius2, sqr);
+    acc = _mm512_mask_add_ps(acc, m, acc, _mm512_mul_ps(_mm512_mul_ps(c, c), c));
+  }
+
+  sum = _mm512_reduce_add_ps(acc);
+#elif defined(__AVX2__)
+  const __m256 vscale = _mm256_set1_ps(scale);
+  const __m256 vradius2 = _mm256_set1_ps(radius2);
+  const __m256 xi = _mm256_set1_ps(px[i]);
+  const __m256 yi = _mm256_set1_ps(py[i]);
+  const __m256 zi = _mm256_set1_ps(pz[i]);
+  const __m256i vi = _mm256_set1_epi32((int) i);
+  const __m256i vend = _mm256_set1_epi32((int) end);
+  const __m256i lanes = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+  __m256 acc = _mm256_setzero_ps();
+
+  for (; j < end; j += 8)
+  {
+    __m256i idx = _mm256_add_epi32(_mm256_set1_epi32((int) j), lanes);
+    __m256i valid = _mm256_andnot_si256(_mm256_cmpeq_epi32(idx, vi), _mm256_cmpgt_epi32(vend, idx));
+
+    __m256 dx = _mm256_mul_ps(_mm256_sub_ps(xi, _mm256_loadu_ps(px + j)), vscale);
+    __m256 dy = _mm256_mul_ps(_mm256_sub_ps(yi, _mm256_loadu_ps(py + j)), vscale);
+    __m256 dz = _mm256_mul_ps(_mm256_sub_ps(zi, _mm256_loadu_ps(pz + j)), vscale);
+    __m256 sqr = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dx, dx), _mm256_mul_ps(dy, dy)), _mm256_mul_ps(dz, dz));
+
+    __m256 m = _mm256_and_ps(_mm256_castsi256_ps(valid), _mm256_cmp_ps(sqr, vradius2, _CMP_LT_OQ));
+    __m256 c = _mm256_sub_ps(vradius2, sqr);
+    acc = _mm256_add_ps(acc, _mm256_and_ps(m, _mm256_mul_ps(_mm256_mul_ps(c, c), c)));
+  }
+
+  sum = horizontalSum(acc);
+#else
+  for (; j < end; ++j)
+  {
+    if (j == i) continue;
+
+    float dx = (px[i] - px[j]) * scale;
+    float dy = (py[i] - py[j]) * scale;
+    float dz = (pz[i] - pz[j]) * scale;
+    float sqr = dx * dx + dy * dy + dz * dz;
+
+    if (radius2 > sqr)
+    {
+      float c = radius2 - sqr;
+      sum += c * c * c;
+    }
+  }
+#endif
+
+  return sum;
+}
+
+
+void CpuFluidSystem::forceSum(unsigned int i, unsigned int begin, unsigned int end, float force[3]) const
+{
+  const float *px = field(POS_X);
+  const float *py = field(POS_Y);
+  const float *pz = field(POS_Z);
+  const float *vx = field(VEL_X);
+  const float *vy = field(VEL_Y);
+  const float *vz = field(VEL_Z);
+  const float *inv_density = field(INV_DENSITY);
+  const float *pressure = field(PRESSURE);
+  const Constants & k = m_consts;
+
+  unsigned int j = begin;
+
+#if defined(__AVX512F__)
+  const __m512 vscale = _mm512_set1_ps(k.sim_scale);
+  const __m512 vradius2 = _mm512_set1_ps(k.radius2);
+  const __m512 vsmooth = _mm512_set1_ps(k.smooth_radius);
+  const __m512 vspiky = _mm512_set1_ps(k.spikykern_half);
+  const __m512 vvterm = _mm512_set1_ps(k.vterm);
+  const __m512 xi = _mm512_set1_ps(px[i]);
+  const __m512 yi = _mm512_set1_ps(py[i]);
+  const __m512 zi = _mm512_set1_ps(pz[i]);
+  const __m512 vxi = _mm512_set1_ps(vx[i]);
+  const __m512 vyi = _mm512_set1_ps(vy[i]);
+  const __m512 vzi = _mm512_set1_ps(vz[i]);
+  const __m512 inv_density_i = _mm512_set1_ps(inv_density[i]);
+  const __m512 pressure_i = _mm512_set1_ps(pressure[i]);
+  const __m512i vi = _mm512_set1_epi32((int) i);
+  const __m512i vend = _mm512_set1_epi32((int) end);
+  const __m512i lanes = _mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+  __m512 fx = _mm512_setzero_ps();
+  __m512 fy = _mm512_setzero_ps();
+  __m512 fz = _mm512_setzero_ps();
+
+  for (; j < end; j += 16)
+  {
+    __m512i idx = _mm512_add_epi32(_mm512_set1_epi32((int) j), lanes);
+    __mmask16 valid = _mm512_cmplt_epi32_mask(idx, vend) & _mm512_cmpneq_epi32_mask(idx, vi);
+
+    __m512 dx = _mm512_mul_ps(_mm512_sub_ps(xi, _mm512_loadu_ps(px + j)), vscale);
+    __m512 dy = _mm512_mul_ps(_mm512_sub_ps(yi, _mm512_loadu_ps(py + j)), vscale);
+    __m512 dz = _mm512_mul_ps(_mm512_sub_ps(zi, _mm512_loadu_ps(pz + j)), vscale);
+    __m512 sqr = _mm512_fmadd_ps(dz, dz, _mm512_fmadd_ps(dy, dy, _mm512_mul_ps(dx, dx)));
+
+    __mmask16 m = valid & _mm512_cmp_ps_mask(sqr, vradius2, _CMP_LT_OQ);
+    if (m == 0) continue;
+
+    __m512 r = _mm512_sqrt_ps(sqr);
+    __m512 c = _mm512_sub_ps(vsmooth, r);
+    __m512 pterm = _mm512_div_ps(_mm512_mul_ps(_mm512_mul_ps(c, vspiky), _mm512_add_ps(pressure_i, _mm512_loadu_ps(pressure + j))), r);
+    __m512 dterm = _mm512_mul_ps(_mm512_mul_ps(c, inv_density_i), _mm512_loadu_ps(inv_density + j));
+
+    __m512 tx = _mm512_mul_ps(_mm512_fmadd_ps(pterm, dx, _mm512_mul_ps(vvterm, _mm512_sub_ps(_mm512_loadu_ps(vx + j), vxi))), dterm);
+    __m512 ty = _mm512_mul_ps(_mm512_fmadd_ps(pterm, dy, _mm512_mul_ps(vvterm, _mm512_sub_ps(_mm512_loadu_ps(vy + j), vyi))), dterm);
+    __m512 tz = _mm512_mul_ps(_mm512_fmadd_ps(pterm, dz, _mm512_mul_ps(vvterm, _mm512_sub_ps(_mm512_loadu_ps(vz + j), vzi))), dterm);
+
+    fx = _mm512_mask_add_ps(fx, m, fx, tx);
+    fy = _mm512_mask_add_ps(fy, m, fy, ty);
+    fz = _mm512_mask_add_ps(fz, m, fz, tz);
+  }
+
+  force[0] += _mm512_reduce_add_ps(fx);
+  force[1] += _mm512_reduce_add_ps(fy);
+  force[2] += _mm512_reduce_add_ps(fz);
+#elif defined(__AVX2__)
+  const __m256 vscale = _mm256_set1_ps(k.sim_scale);
+  const __m256 vradius2 = _mm256_set1_ps(k.radius2);
+  const __m256 vsmooth = _mm256_set1_ps(k.smooth_radius);
+  const __m256 vspiky = _mm256_set1_ps(k.spikykern_half);
+  const __m256 vvterm = _mm256_set1_ps(k.vterm);
+  const __m256 xi = _mm256_set1_ps(px[i]);
+  const __m256 yi = _mm256_set1_ps(py[i]);
+  const __m256 zi = _mm256_set1_ps(pz[i]);
+  const __m256 vxi = _mm256_set1_ps(vx[i]);
+  const __m256 vyi = _mm256_set1_ps(vy[i]);
+  const __m256 vzi = _mm256_set1_ps(vz[i]);
+  const __m256 inv_density_i = _mm256_set1_ps(inv_density[i]);
+  const __m256 pressure_i = _mm256_set1_ps(pressure[i]);
+  const __m256i vi = _mm256_set1_epi32((int) i);
+  const __m256i vend = _mm256_set1_epi32((int) end);
+  const __m256i lanes = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+  __m256 fx = _mm256_setzero_ps();
+  __m256 fy = _mm256_setzero_ps();
+  __m256 fz = _mm256_setzero_ps();
+
+  for (; j < end; j += 8)
+  {
+    __m256i idx = _mm256_add_epi32(_mm256_set1_epi32((int) j), lanes);
+    __m256i valid = _mm256_andnot_si256(_mm256_cmpeq_epi32(idx, vi), _mm256_cmpgt_epi32(vend, idx));
+
+    __m256 dx = _mm256_mul_ps(_mm256_sub_ps(xi, _mm256_loadu_ps(px + j)), vscale);
+    __m256 dy = _mm256_mul_ps(_mm256_sub_ps(yi, _mm256_loadu_ps(py + j)), vscale);
+    __m256 dz = _mm256_mul_ps(_mm256_sub_ps(zi, _mm256_loadu_ps(pz + j)), vscale);
+    __m256 sqr = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dx, dx), _mm256_mul_ps(dy, dy)), _mm256_mul_ps(dz, dz));
+
+    __m256 m = _mm256_and_ps(_mm256_castsi256_ps(valid), _mm256_cmp_ps(sqr, vradius2, _CMP_LT_OQ));
+    if (_mm256_movemask_ps(m) == 0) continue;
+
+    /* the lanes masked out may divide by zero, their results are discarded */
+    __m256 r = _mm256_sqrt_ps(sqr);
+    __m256 c = _mm256_sub_ps(vsmooth, r);
+    __m256 pterm = _mm256_div_ps(_mm256_mul_ps(_mm256_mul_ps(c, vspiky), _mm256_add_ps(pressure_i, _mm256_loadu_ps(pressure + j))), r);
+    __m256 dterm = _mm256_mul_ps(_mm256_mul_ps(c, inv_density_i), _mm256_loadu_ps(inv_density + j));
+
+    __m256 tx = _mm256_mul_ps(_mm256_add_ps(_mm256_mul_ps(pterm, dx), _mm256_mul_ps(vvterm, _mm256_sub_ps(_mm256_loadu_ps(vx + j), vxi))), dterm);
+    __m256 ty = _mm256_mul_ps(_mm256_add_ps(_mm256_mul_ps(pterm, dy), _mm256_mul_ps(vvterm, _mm256_sub_ps(_mm256_loadu_ps(vy + j), vyi))), dterm);
+    __m256 tz = _mm256_mul_ps(_mm256_add_ps(_mm256_mul_ps(pterm, dz), _mm256_mul_ps(vvterm, _mm256_sub_ps(_mm256_loadu_ps(vz + j), vzi))), dterm);
+
+    fx = _mm256_add_ps(fx, _mm256_and_ps(m, tx));
+    fy = _mm256_add_ps(fy, _mm256_and_ps(m, ty));
+    fz = _mm256_add_ps(fz, _mm256_and_ps(m, tz));
+  }
+
+  force[0] += horizontalSum(fx);
+  force[1] += horizontalSum(fy);
+  force[2] += horizontalSum(fz);
+#else
+  for (; j < end; ++j)
+  {
+    if (j == i) continue;
+
+    float dx = (px[i] - px[j]) * k.sim_scale;
+    float dy = (py[i] - py[j]) * k.sim_scale;
+    float dz = (pz[i] - pz[j]) * k.sim_scale;
+    float sqr = dx * dx + dy * dy + dz * dz;
+
+    if (k.radius2 > sqr)
+    {
+      float r = sqrt(sqr);
+      float c = (k.smooth_radius - r);
+      float pterm = c * k.spikykern_half * (pressure[i] + pressure[j]) / r;
+      float dterm = c * inv_density[i] * inv_density[j];
+
+      force[0] += (pterm * dx + k.vterm * (vx[j] - vx[i])) * dterm;
+      force[1] += (pterm * dy + k.vterm * (vy[j] - vy[i])) * dterm;
+      force[2] += (pterm * dz + k.vterm * (vz[j] - vz[i])) * dterm;
+    }
+  }
+#endif
+}
+
+
+void CpuFluidSystem::computePressure(size_t cell_begin, size_t cell_end)
+{
+  float *inv_density = field(INV_DENSITY);
+  float *pressure = field(PRESSURE);
+  const int gx = m_grid_size[0];
+  const int gy = m_grid_size[1];
+  const int gz = m_grid_size[2];
+
+  for (size_t cell = cell_begin; cell < cell_end; ++cell)
+  {
+    int cx = (int) (cell % gx);
+    int cy = (int) ((cell / gx) % gy);
+    int cz = (int) (cell / (gx * gy));
+    int x0 = std::max(cx - 1, 0);
+    int x1 = std::min(cx + 1, gx - 1);
+
+    for (unsigned int i = m_cell_start[cell]; i < m_cell_start[cell + 1]; ++i)
+    {
+      float sum = 0.0f;
+
+      /* the 3 cells of each row are contiguous in memory */
+      for (int z = std::max(cz - 1, 0); z <= std::min(cz + 1, gz - 1); ++z)
+      {
+        for (int y = std::max(cy - 1, 0); y <= std::min(cy + 1, gy - 1); ++y)
+        {
+          int row = (z * gy + y) * gx;
+          sum += densitySum(i, m_cell_start[row + x0], m_cell_start[row + x1 + 1]);
+        }
+      }
+
+      float ro = sum * m_consts.mass_polykern;
+
+      inv_density[i] = 1.0f / ro;
+      pressure[i] = (ro - m_consts.rest_density) * m_consts.int_stiffness;
+    }
+  }
+}
+
+
+void CpuFluidSystem::computeForce(size_t cell_begin, size_t cell_end)
+{
+  float *fx = field(FORCE_X);
+  float *fy = field(FORCE_Y);
+  float *fz = field(FORCE_Z);
+  const int gx = m_grid_size[0];
+  const int gy = m_grid_size[1];
+  const int gz = m_grid_size[2];
+
+  for (size_t cell = cell_begin; cell < cell_end; ++cell)
+  {
+    int cx = (int) (cell % gx);
+    int cy = (int) ((cell / gx) % gy);
+    int cz = (int) (cell / (gx * gy));
+    int x0 = std::max(cx - 1, 0);
+    int x1 = std::min(cx + 1, gx - 1);
+
+    for (unsigned int i = m_cell_start[cell]; i < m_cell_start[cell + 1]; ++i)
+    {
+      float force[3] = { 0.0f, 0.0f, 0.0f };
+
+      for (int z = std::max(cz - 1, 0); z <= std::min(cz + 1, gz - 1); ++z)
+      {
+        for (int y = std::max(cy - 1, 0); y <= std::min(cy + 1, gy - 1); ++y)
+        {
+          int row = (z * gy + y) * gx;
+          forceSum(i, m_cell_start[row + x0], m_cell_start[row + x1 + 1], force);
+        }
+      }
+
+      fx[i] = force[0];
+      fy[i] = force[1];
+      fz[i] = force[2];
+    }
+  }
+}
+
+
+void CpuFluidSystem::integrate(size_t begin, size_t end)
+{
+  const FluidSystem::Params & p = m_params;
+  const float scale = p.sim_scale;
+  const float dt = m_consts.delta_time;
+  const float wave = sin(m_time * 10.0f) - 1.0f;
+  const float *vmin = m_volume_min.s;
+  const float *vmax = m_volume_max.s;
+
+  float *px = field(POS_X), *py = field(POS_Y), *pz = field(POS_Z);
+  float *vx = field(VEL_X), *vy = field(VEL_Y), *vz = field(VEL_Z);
+  float *pvx = field(PREV_VEL_X), *pvy = field(PREV_VEL_Y), *pvz = field(PREV_VEL_Z);
+  const float *fx = field(FORCE_X), *fy = field(FORCE_Y), *fz = field(FORCE_Z);
+
+  for (size_t i = begin; i < end; ++i)
+  {
+    float pos[3] = { px[i], py[i], pz[i] };
+    float prevvel[3] = { pvx[i], pvy[i], pvz[i] };
+    float accel[3] = { fx[i] * p.mass, fy[i] * p.mass, fz[i] * p.mass };
+
+    float speed = accel[0] * accel[0] + accel[1] * accel[1] + accel[2] * accel[2];
+    if (speed > (p.limit * p.limit))
+    {
+      float s = p.limit / sqrt(speed);
+      accel[0] *= s; accel[1] *= s; accel[2] *= s;
+    }
+
+    /* pushes the particle away from a wall with the given normal */
+#define WALL(diff, stiffness, nx, ny, nz) \
+    { \
+      float d = (diff); \
+      if (d > 0.0001f) \
+      { \
+        float adj = (stiffness) * d - p.ext_damping * ((nx) * prevvel[0] + (ny) * prevvel[1] + (nz) * prevvel[2]); \
+        accel[0] += adj * (nx); accel[1] += adj * (ny); accel[2] += adj * (nz); \
+      } \
+    }
+
+    /* Y-axis walls (the top wall pushes along -z exactly as in sph_integrate) */
+    WALL(2.0f * p.radius - (pos[1] - vmin[1] - (pos[0] - vmin[0]) * p.slope) * scale, p.ext_stiffness,
+         -p.slope, 1.0f - p.slope, 0.0f);
+    WALL(2.0f * p.radius - (vmax[1] - pos[1]) * scale, p.ext_stiffness, 0.0f, 0.0f, -1.0f);
+
+    /* X-axis walls */
+    WALL(2.0f * p.radius - (pos[0] - vmin[0] + (wave + (pos[1] * 0.025f) * 0.25f) * p.left_wave) * scale,
+         (p.left_wave + 1.0f) * p.ext_stiffness, 1.0f, 0.0f, 0.0f);
+    WALL(2.0f * p.radius - (vmax[0] - pos[0] + wave * p.right_wave) * scale,
+         (p.right_wave + 1.0f) * p.ext_stiffness, -1.0f, 0.0f, 0.0f);
+
+    /* Z-axis walls */
+    WALL(2.0f * p.radius - (pos[2] - vmin[2]) * scale, p.ext_stiffness, 0.0f, 0.0f, 1.0f);
+    WALL(2.0f * p.radius - (vmax[2] - pos[2]) * scale, p.ext_stiffness, 0.0f, 0.0f, -1.0f);
+
+#undef WALL
+
+    /* drain and fountain */
+    if (m_effects & (FluidSystem::EFFECT_DRAIN | FluidSystem::EFFECT_FOUNTAIN))
+    {
+      float dx = (0 - pos[0]) * scale;
+      float dy = (vmin[1] - pos[1]) * scale;
+      float dz = (0 - pos[2]) * scale;
+      float dsq = (dx * dx + dy * dy + dz * dz);
+
+      if ((m_effects & FluidSystem::EFFECT_DRAIN) && (0.0001f > dsq))
+      {
+        pos[0] = vmin[0] * 0.5f;
+        pos[1] = vmax[1] * 0.5f;
+        pos[2] = vmin[2];
+        accel[2] += 50;
+        accel[0] += 1;
+        accel[1] += 20;
+      }
+
+      if ((m_effects & FluidSystem::EFFECT_FOUNTAIN) && (0.0005f > dsq))
+      {
+        accel[1] += 140;
+      }
+    }
+
+    /* wave */
+    if ((m_effects & FluidSystem::EFFECT_WAVE) && (pos[0] < 0))
+    {
+      accel[0] += 20;
+    }
+
+    accel[1] += -9.8f;
+
+    /* leapfrog integration */
+    float *vel[3] = { &vx[i], &vy[i], &vz[i] };
+    float *prev[3] = { &pvx[i], &pvy[i], &pvz[i] };
+
+    for (int c = 0; c < 3; ++c)
+    {
+      float v = *vel[c];
+      float vnext = accel[c] * dt + v;   // v(t+1/2) = v(t-1/2) + a(t) dt
+      *prev[c] = (v + vnext) * 0.5f;     // v(t+1) = [v(t-1/2) + v(t+1/2)] * 0.5
+      *vel[c] = vnext;
+      pos[c] += vnext * (dt / scale);    // p(t+1) = p(t) + v(t+1/2) dt
+    }
+
+    px[i] = pos[0];
+    py[i] = pos[1];
+    pz[i] = pos[2];
+  }
+}
+
+
+void CpuFluidSystem::uploadPositions(void)
+{
+  size_t size = m_num_particles * sizeof(float);
+
+  glBindBuffer(GL_ARRAY_BUFFER, m_particle_pos_buf.getGLID());
+  glBufferSubData(GL_ARRAY_BUFFER, 0, size, field(POS_X));
+  glBufferSubData(GL_ARRAY_BUFFER, size, size, field(POS_Y));
+  glBufferSubData(GL_ARRAY_BUFFER, 2 * size, size, field(POS_Z));
+  glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+
+void CpuFluidSystem::benchmarkScaling(unsigned int steps, std::ostream & os)
+{
+  unsigned int num_threads = numThreads();
+  unsigned int max_threads = std::max(1u, std::thread::hardware_concurrency());
+
+  std::vector<unsigned int> counts;
+  for (unsigned int t = 1; t < max_threads; t *= 2) counts.push_back(t);
+  counts.push_back(max_threads);
+
+  os << "CPU SPH scaling (" << m_num_particles << " particles, " << steps
+     << " steps, " << simdName() << ")" << std::endl;
+
+  double base = 0.0;
+
+  for (unsigned int t : counts)
+  {
+    setNumThreads(t);
+
+    // warm up
+    step(1.0f);
+
+    std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+
+    for (unsigned int i = 0; i < steps; ++i)
+    {
+      step(1.0f);
+    }
+
+    std::chrono::duration<double> elapsed = std::chrono::high_resolution_clock::now() - start;
+    double rate = (double) m_num_particles * steps / elapsed.count();
+    if (t == 1) base = rate;
+
+    os << "  " << std::setw(3) << t << " threads : " << (rate / 1.0e6) << " Mparticles/s"
+       << ", speedup " << (rate / base) << "x"
+       << ", efficiency " << (100.0 * rate / (base * t)) << " %" << std::endl;
+  }
+
+  /* restore the settings */
+  setNumThreads(num_threads);
+  if (!ocl::headless()) uploadPositions();
+}
@@ -0,0 +1,171 @@
+/*
+ * Copyright (C) 2014 Matus Fedorko <xfedor01@stud.fit.vutbr.cz>
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty.  In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+
+ * 1. The origin of this software must not be misrepresented; you must not
+ *    claim that you wrote the original software. If you use this software
+ *    in a product, an acknowledgment in the product documentation would be
+ *    appreciated but is not required.
+ * 2. Altered source versions must be plainly marked as such, and must not be
+ *    misrepresented as being the original software.
+ * 3. This notice may not be removed or altered from any source distribution.
+ */
+
+
+/**
+ * A host side implementation of the SPH fluid simulation,
+ * it is a fallback for machines without a suitable OpenCL device
+ * and a numerical reference for the OpenCL kernels
+ */
+
+#ifndef CPUFLUIDSYSTEM_H
+#define CPUFLUIDSYSTEM_H
+
+#include "FluidSystem.h"
+
+#include <ostream>
+#include <vector>
+#include <memory>
+
+
+class CpuFluidSystem : public ParticleSystem
+{
+  public:
+    // @param num_threads the number of worker threads (0 means all hardware threads)
+    explicit CpuFluidSystem(unsigned int num_threads = 0)
+      : ParticleSystem(false)
+      , m_params()
+      , m_consts()
+      , m_pool(new utils::tasks::ThreadPool(num_threads))
+      , m_effects(FluidSystem::EFFECT_NONE)
+      , m_wave_start(0.0f)
+      , m_grid_cell_size(0.0f)
+      , m_grid_num_cells(0)
+      , m_cell_start()
+      , m_cell()
+      , m_order()
+      , m_tmp()
+    {
+      m_grid_size[0] = m_grid_size[1] = m_grid_size[2] = 0;
+      setParams(m_params);
+      m_use_uniform_color = true;
+    }
+
+    const FluidSystem::Params & params(void) const { return m_params; }
+    void setParams(const FluidSystem::Params & params);
+
+    void activateDrain(void) { deactivateFountain(); m_effects |= FluidSystem::EFFECT_DRAIN; }
+    void deactivateDrain(void) { m_effects &= ~(FluidSystem::EFFECT_DRAIN); }
+    bool toggleDrain(void) { deactivateFountain(); return (m_effects ^= FluidSystem::EFFECT_DRAIN) != 0; }
+
+    void emitWave(void) { m_effects |= FluidSystem::EFFECT_WAVE; m_wave_start = m_time; }
+
+    void activateFountain(void) { deactivateDrain(); m_effects |= FluidSystem::EFFECT_FOUNTAIN; }
+    void deactivateFountain(void) { m_effects &= ~(FluidSystem::EFFECT_FOUNTAIN); }
+    bool toggleFountain(void) { deactivateDrain(); return (m_effects ^= FluidSystem::EFFECT_FOUNTAIN) != 0; }
+
+    unsigned int numThreads(void) const { return m_pool->numThreads(); }
+    void setNumThreads(unsigned int num_threads);
+
+    // the instruction set of the vectorized inner loops (selected at compile time)
+    static const char *simdName(void);
+
+    // runs the given number of steps with 1, 2, 4, ... up to all hardware threads
+    // and reports the throughput in particles per second for each thread count
+    // (note that this advances the simulation)
+    void benchmarkScaling(unsigned int steps, std::ostream & os);
+
+    // reset the particle system
+    // initializes buffers and shared data
+    virtual bool reset(unsigned int part_num);
+
+    // recalculate the particle system
+    virtual void update(float time_step = 1.0f);
+
+    // the positions are kept in host memory in the SoA layout
+    virtual bool readPositions(std::vector<float> & positions);
+
+  private:
+    // the simulation constants derived from the parameters (see sph_params.cl)
+    struct Constants {
+      float sim_scale;
+      float smooth_radius;
+      float radius2;
+      float mass;
+      float mass_polykern;
+      float rest_density;
+      float int_stiffness;
+      float vterm;
+      float spikykern_half;
+      float delta_time;
+    };
+
+    // per particle data, each vector component is stored in a separate array,
+    // the arrays are padded, so that the vectorized loops may read past the end
+    enum Field {
+      POS_X, POS_Y, POS_Z,
+      VEL_X, VEL_Y, VEL_Z,
+      PREV_VEL_X, PREV_VEL_Y, PREV_VEL_Z,
+      INV_DENSITY, PRESSURE,
+      FORCE_X, FORCE_Y, FORCE_Z,
+      FIELD_COUNT,
+      SORTED_FIELD_COUNT = PREV_VEL_Z + 1   // the fields that survive to the next step
+    };
+
+    static const size_t PADDING = 16;        // the widest vector (AVX-512) in floats
+    static const size_t CELL_GRAIN = 16;     // the number of grid cells in a single task
+    static const size_t PARTICLE_GRAIN = 1024;
+
+  private:
+    // advances the simulation by one step without updating the vertex buffer
+    void step(float time_step);
+
+    // sorts the particles by their grid cells (counting sort), so that the particles
+    // of a row of 3 neighbouring cells are contiguous in memory
+    void buildGrid(void);
+    int cellIndex(size_t i) const;
+
+    // the inner loops over the neighbours j in [begin, end) of particle i
+    // (vectorized with AVX-512 or AVX2, when the compiler targets them)
+    float densitySum(unsigned int i, unsigned int begin, unsigned int end) const;
+    void forceSum(unsigned int i, unsigned int begin, unsigned int end, float force[3]) const;
+
+    void computePressure(size_t cell_begin, size_t cell_end);
+    void computeForce(size_t cell_begin, size_t cell_end);
+    void integrate(size_t begin, size_t end);
+
+    // copies the positions to the vertex buffer drawn by ParticleSystem::render
+    void uploadPositions(void);
+
+    float *field(Field f) { return &m_data[f][0]; }
+    const float *field(Field f) const { return &m_data[f][0]; }
+
+  private:
+    FluidSystem::Params m_params;
+    Constants m_consts;
+
+    std::unique_ptr<utils::tasks::ThreadPool> m_pool;
+
+    unsigned int m_effects;
+    float m_wave_start;
+
+    // uniform grid with the same geometry as in FluidSystem
+    float m_grid_cell_size;
+    int m_grid_size[3];
+    int m_grid_num_cells;
+    std::vector<unsigned int> m_cell_start;   // the first particle of each cell (num_cells + 1 entries)
+    std::vector<int> m_cell;                  // the cell of each particle
+    std::vector<unsigned int> m_order;        // the sorted position of each particle
+
+    std::vector<float> m_data[FIELD_COUNT];
+    std::vector<float> m_tmp;                 // scratch array for sorting
+};
+
+#endif
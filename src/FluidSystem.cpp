@@ -25,11 +25,22 @@
 
 #include <glm/gtc/type_ptr.hpp>
 #include <ctime>
+#include <cmath>
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <fstream>
+#include <sstream>
 
 
 
 
 const char *FluidSystem::m_sph_kernel_files[] = {
+  "/src/OpenCL/sph_params.cl",
+  "/src/OpenCL/sph_layout.cl",
+  "/src/OpenCL/sph_grid.cl",
+  "/src/OpenCL/sph_sort.cl",
+  "/src/OpenCL/sph_neighbors.cl",
   "/src/OpenCL/sph_reset.cl",
   "/src/OpenCL/sph_compute_pressure.cl",
   "/src/OpenCL/sph_compute_force.cl",
@@ -81,21 +92,149 @@ cl_float4 calcGravitationVector(int rx, int ry)
   return F; /* vektor gravitace */
 }
 
+
+/**
+ * The header of a checkpoint file, it is followed by the raw contents of device buffers
+ * (in the particle layout given by the header and in the byte order of the host):
+ *   positions        [num_particles] (particle vectors)
+ *   velocities       [num_particles] (particle vectors)
+ *   prev velocities  [num_particles] (particle vectors)
+ *   density/pressure [num_particles] (float2: inverse density, pressure)
+ */
+struct CheckpointHeader {
+  char magic[4];                  // "FCKP"
+  cl_uint version;                // CHECKPOINT_VERSION
+  cl_uint header_size;            // sizeof(CheckpointHeader), the offset of particle data
+  cl_uint layout;                 // ParticleSystem::ParticleLayout
+  cl_uint num_particles;
+  cl_uint effects;                // FluidSystem::Effects
+  cl_uint step_count;             // steps since the last reset
+  cl_float time;                  // simulation time
+  cl_float wave_start;
+  cl_float time_step;             // the time step of the next step
+  cl_uint reserved[2];
+  FluidSystem::Params params;
+};
+
+const char CHECKPOINT_MAGIC[4] = { 'F', 'C', 'K', 'P' };
+const cl_uint CHECKPOINT_VERSION = 1;
+
+}
+
+
+
+ocl::ProgramDefines FluidSystem::Params::defines(void) const
+{
+  // the lists are built with a radius enlarged by the skin and they
+  // have to be rebuilt when a particle moves more than half of the skin
+  cl_float skin = smooth_radius * neighbor_skin;
+  cl_float list_radius = smooth_radius + skin;
+
+  ocl::ProgramDefines defines;
+  defines.define("SPH_SIM_SCALE", sim_scale)
+         .define("SPH_SMOOTH_RADIUS", smooth_radius)
+         .define("SPH_RADIUS2", smooth_radius * smooth_radius)
+         .define("SPH_MASS", mass)
+         .define("SPH_MASS_POLYKERN", (cl_float) (mass * polyKernel()))
+         .define("SPH_REST_DENSITY", rest_density)
+         .define("SPH_INT_STIFFNESS", int_stiffness)
+         .define("SPH_VTERM", (cl_float) (lapKernel() * viscosity))
+         .define("SPH_SPIKYKERN_HALF", (cl_float) (spikyKernel() * -0.5))
+         .define("SPH_SLOPE", slope)
+         .define("SPH_LEFT_WAVE", left_wave)
+         .define("SPH_RIGHT_WAVE", right_wave)
+         .define("SPH_LIMIT", limit)
+         .define("SPH_EXT_STIFFNESS", ext_stiffness)
+         .define("SPH_EXT_DAMPING", ext_damping)
+         .define("SPH_RADIUS", radius)
+         .define("SPH_LIST_RADIUS2", list_radius * list_radius)
+         .define("SPH_MAX_DISPLACEMENT2", skin * skin * 0.25f);
+
+  return defines;
 }
 
 
+bool FluidSystem::Params::finite(void) const
+{
+  // the derived constants are checked as the floats they are passed as
+  cl_float values[] = {
+    sim_scale, smooth_radius, mass, rest_density, int_stiffness, viscosity,
+    slope, left_wave, right_wave, delta_time, limit, ext_stiffness, ext_damping,
+    radius, neighbor_skin,
+    // e.g. a zero smoothing radius makes the smoothing kernels infinite
+    (cl_float) (mass * polyKernel()), (cl_float) (lapKernel() * viscosity), (cl_float) (spikyKernel() * -0.5)
+  };
+
+  for (unsigned int i = 0; i < FLUIDSIM_COUNT(values); ++i)
+  {
+    if (!std::isfinite(values[i])) return false;
+  }
+
+  return true;
+}
+
 
 bool FluidSystem::init(void)
 {
-  /* create a program */
-  m_sph_prog = ocl::buildProgram(m_cl_ctx(), m_sph_kernel_files, m_sph_kernel_files_size);
+  /* the second position buffer for the fused step */
+  m_next_pos_buf.setCLContext(m_cl_ctx());
+
+  /* prepare the sorting primitive */
+  if (!m_radix_sort.init(m_cl_ctx()))
+  {
+    ERROR("Failed to initialize radix sort for SPH simulation");
+    return false;
+  }
+
+  /* the kernels are recompiled in reset if a different layout is requested */
+  return buildKernels(m_particle_layout, 0);
+}
+
+
+bool FluidSystem::buildKernels(ParticleLayout layout, size_t num_particles)
+{
+  /* simulation constants (see sph_params.cl) */
+  ocl::ProgramDefines defines(m_params.defines());
+
+  /* select the particle data layout (see sph_layout.cl) */
+  std::ostringstream load_expr;
+  const char *vec_type = "float";
+
+  switch (layout)
+  {
+    case LAYOUT_AOS:
+      defines.define("SPH_LAYOUT_AOS");
+      vec_type = "float4";
+      break;
+
+    case LAYOUT_PACKED:
+      defines.define("SPH_LAYOUT_PACKED");
+      load_expr << "((float4) (vload3((i), (p)), 0.0f))";
+      break;
+
+    case LAYOUT_SOA:
+      defines.define("SPH_LAYOUT_SOA").define("SPH_SOA_STRIDE", (unsigned int) num_particles);
+      load_expr << "((float4) ((p)[i], (p)[(i) + " << num_particles << "], "
+                << "(p)[(i) + " << (2 * num_particles) << "], 0.0f))";
+      break;
+  }
+
+  // the reductions depend only on the layout
+  bool layout_changed = (m_sph_prog() == nullptr) ||
+                        (layout != m_particle_layout) ||
+                        (num_particles != m_program_stride);
+
+  /* get a program, it is compiled only if these parameters were not used before */
+  m_sph_prog = m_program_cache.get(m_cl_ctx(), defines);
   if (m_sph_prog() == nullptr)
   {
     ERROR("Failed to create SPH OpenCL program");
     return false;
   }
 
-  /* create kernels */
+  /* create kernels (the old ones are released, so their handles may be reused) */
+  m_tuner.forgetKernels();
+
   cl_int err = CL_SUCCESS;
   m_sph_reset_kernel = cl::Kernel(m_sph_prog, "sph_reset", &err);
   if (err != CL_SUCCESS)
@@ -125,6 +264,192 @@ bool FluidSystem::init(void)
     return false;
   }
 
+  m_sph_grid_clear_kernel = cl::Kernel(m_sph_prog, "sph_grid_clear", &err);
+  if (err != CL_SUCCESS)
+  {
+    ERROR("Failed to create grid_clear kernel for SPH simulation: " << ocl::errorToStr(err));
+    return false;
+  }
+
+  m_sph_grid_insert_kernel = cl::Kernel(m_sph_prog, "sph_grid_insert", &err);
+  if (err != CL_SUCCESS)
+  {
+    ERROR("Failed to create grid_insert kernel for SPH simulation: " << ocl::errorToStr(err));
+    return false;
+  }
+
+  m_sph_grid_count_pairs_kernel = cl::Kernel(m_sph_prog, "sph_grid_count_pairs", &err);
+  if (err != CL_SUCCESS)
+  {
+    ERROR("Failed to create grid_count_pairs kernel for SPH simulation: " << ocl::errorToStr(err));
+    return false;
+  }
+
+  m_sph_compute_pressure_grid_kernel = cl::Kernel(m_sph_prog, "sph_compute_pressure_grid", &err);
+  if (err != CL_SUCCESS)
+  {
+    ERROR("Failed to create compute_pressure_grid kernel for SPH simulation: " << ocl::errorToStr(err));
+    return false;
+  }
+
+  m_sph_compute_force_grid_kernel = cl::Kernel(m_sph_prog, "sph_compute_force_grid", &err);
+  if (err != CL_SUCCESS)
+  {
+    ERROR("Failed to create compute_force_grid kernel for SPH simulation: " << ocl::errorToStr(err));
+    return false;
+  }
+
+  m_sph_sort_keys_kernel = cl::Kernel(m_sph_prog, "sph_sort_keys", &err);
+  if (err != CL_SUCCESS)
+  {
+    ERROR("Failed to create sort_keys kernel for SPH simulation: " << ocl::errorToStr(err));
+    return false;
+  }
+
+  m_sph_reorder_kernel = cl::Kernel(m_sph_prog, "sph_reorder", &err);
+  if (err != CL_SUCCESS)
+  {
+    ERROR("Failed to create reorder kernel for SPH simulation: " << ocl::errorToStr(err));
+    return false;
+  }
+
+  m_sph_neighbors_build_kernel = cl::Kernel(m_sph_prog, "sph_neighbors_build", &err);
+  if (err != CL_SUCCESS)
+  {
+    ERROR("Failed to create neighbors_build kernel for SPH simulation: " << ocl::errorToStr(err));
+    return false;
+  }
+
+  m_sph_neighbors_check_kernel = cl::Kernel(m_sph_prog, "sph_neighbors_check", &err);
+  if (err != CL_SUCCESS)
+  {
+    ERROR("Failed to create neighbors_check kernel for SPH simulation: " << ocl::errorToStr(err));
+    return false;
+  }
+
+  m_sph_compute_pressure_list_kernel = cl::Kernel(m_sph_prog, "sph_compute_pressure_list", &err);
+  if (err != CL_SUCCESS)
+  {
+    ERROR("Failed to create compute_pressure_list kernel for SPH simulation: " << ocl::errorToStr(err));
+    return false;
+  }
+
+  m_sph_compute_force_list_kernel = cl::Kernel(m_sph_prog, "sph_compute_force_list", &err);
+  if (err != CL_SUCCESS)
+  {
+    ERROR("Failed to create compute_force_list kernel for SPH simulation: " << ocl::errorToStr(err));
+    return false;
+  }
+
+  m_sph_compute_pressure_tiled_kernel = cl::Kernel(m_sph_prog, "sph_compute_pressure_tiled", &err);
+  if (err != CL_SUCCESS)
+  {
+    ERROR("Failed to create compute_pressure_tiled kernel for SPH simulation: " << ocl::errorToStr(err));
+    return false;
+  }
+
+  m_sph_compute_force_tiled_kernel = cl::Kernel(m_sph_prog, "sph_compute_force_tiled", &err);
+  if (err != CL_SUCCESS)
+  {
+    ERROR("Failed to create compute_force_tiled kernel for SPH simulation: " << ocl::errorToStr(err));
+    return false;
+  }
+
+  m_sph_compute_step_grid_kernel = cl::Kernel(m_sph_prog, "sph_compute_step_grid", &err);
+  if (err != CL_SUCCESS)
+  {
+    ERROR("Failed to create compute_step_grid kernel for SPH simulation: " << ocl::errorToStr(err));
+    return false;
+  }
+
+  m_sph_compute_step_tiled_kernel = cl::Kernel(m_sph_prog, "sph_compute_step_tiled", &err);
+  if (err != CL_SUCCESS)
+  {
+    ERROR("Failed to create compute_step_tiled kernel for SPH simulation: " << ocl::errorToStr(err));
+    return false;
+  }
+
+  m_sph_symmetric_clear_kernel = cl::Kernel(m_sph_prog, "sph_symmetric_clear", &err);
+  if (err != CL_SUCCESS)
+  {
+    ERROR("Failed to create symmetric_clear kernel for SPH simulation: " << ocl::errorToStr(err));
+    return false;
+  }
+
+  m_sph_compute_pressure_sym_kernel = cl::Kernel(m_sph_prog, "sph_compute_pressure_sym", &err);
+  if (err != CL_SUCCESS)
+  {
+    ERROR("Failed to create compute_pressure_sym kernel for SPH simulation: " << ocl::errorToStr(err));
+    return false;
+  }
+
+  m_sph_compute_pressure_finalize_kernel = cl::Kernel(m_sph_prog, "sph_compute_pressure_finalize", &err);
+  if (err != CL_SUCCESS)
+  {
+    ERROR("Failed to create compute_pressure_finalize kernel for SPH simulation: " << ocl::errorToStr(err));
+    return false;
+  }
+
+  m_sph_compute_force_sym_kernel = cl::Kernel(m_sph_prog, "sph_compute_force_sym", &err);
+  if (err != CL_SUCCESS)
+  {
+    ERROR("Failed to create compute_force_sym kernel for SPH simulation: " << ocl::errorToStr(err));
+    return false;
+  }
+
+  /* the tile size is limited by the work-group size the tiled kernels can run with */
+  {
+    cl_device_id device = nullptr;
+    err = clGetCommandQueueInfo(m_cl_queue(), CL_QUEUE_DEVICE, sizeof(device), &device, nullptr);
+    if (err != CL_SUCCESS)
+    {
+      ERROR("Failed to query the device of SPH command queue: " << ocl::errorToStr(err));
+      return false;
+    }
+
+    cl_kernel kernels[] = { m_sph_compute_pressure_tiled_kernel(),
+                            m_sph_compute_force_tiled_kernel(),
+                            m_sph_compute_step_tiled_kernel() };
+    m_tile_size = DEFAULT_TILE_SIZE;
+
+    for (unsigned int i = 0; i < FLUIDSIM_COUNT(kernels); ++i)
+    {
+      size_t wg_size = 0;
+      err = clGetKernelWorkGroupInfo(kernels[i], device, CL_KERNEL_WORK_GROUP_SIZE,
+                                     sizeof(wg_size), &wg_size, nullptr);
+      if (err != CL_SUCCESS)
+      {
+        ERROR("Failed to query work-group size of tiled SPH kernels: " << ocl::errorToStr(err));
+        return false;
+      }
+
+      m_tile_size = std::min(m_tile_size, wg_size);
+    }
+  }
+
+  /* prepare the reductions for time stepping and diagnostics,
+     they read the particle data in the same layout as the kernels */
+  if (layout_changed)
+  {
+    typedef ocl::ReductionBase tRed;
+    std::string load_str(load_expr.str());
+    const char *load = load_str.empty() ? nullptr : load_str.c_str();
+
+    if ((!m_max_speed2.init(m_cl_ctx(), tRed::MAX, "dot(x.xyz, x.xyz)", vec_type, nullptr, load)) ||
+        (!m_max_dvelocity2.init(m_cl_ctx(), tRed::MAX, "dot((x - y).xyz, (x - y).xyz)", vec_type, vec_type, load)) ||
+        (!m_speed2_sum.init(m_cl_ctx(), tRed::SUM, "dot(x.xyz, x.xyz)", vec_type, nullptr, load)) ||
+        (!m_nan_count_sum.init(m_cl_ctx(), tRed::SUM, "any(isnan(x)) ? 1u : 0u", vec_type, nullptr, load)) ||
+        (!m_pair_count_sum.init(m_cl_ctx(), tRed::SUM)))
+    {
+      ERROR("Failed to initialize reductions for SPH simulation");
+      m_sph_prog = cl::Program();
+      return false;
+    }
+  }
+
+  m_particle_layout = layout;
+  m_program_stride = num_particles;
+
   return true;
 }
 
@@ -135,19 +460,39 @@ bool FluidSystem::reset(unsigned int part_num)
 
   m_num_particles = part_num;
 
-  /* initialize OpenGL shared buffer with particle positions */
-  if (!m_particle_pos_buf.bufferData(nullptr, part_num * sizeof(cl_float4), ocl::GLBuffer::WRITE_ONLY))
+  /* the SoA layout has the stride compiled into the kernels */
+  if ((m_next_layout != m_particle_layout) ||
+      ((m_next_layout == LAYOUT_SOA) && (m_program_stride != part_num)))
+  {
+    if (!buildKernels(m_next_layout, part_num))
+    {
+      ERROR("SPH: Failed to compile kernels for the new particle layout");
+      return false;
+    }
+  }
+
+  size_t vec_size = particleVectorSize(m_particle_layout);
+
+  /* initialize OpenGL shared buffers with particle positions,
+     the buffers swap their roles when the fused step is used, so both are read and written */
+  if (!m_particle_pos_buf.bufferData(nullptr, part_num * vec_size, ocl::GLBuffer::READ_WRITE))
   {
     ERROR("SPH: Failed to initialize position GLBuffer");
     return false;
   }
 
+  if (!m_next_pos_buf.bufferData(nullptr, part_num * vec_size, ocl::GLBuffer::READ_WRITE))
+  {
+    ERROR("SPH: Failed to initialize next position GLBuffer");
+    return false;
+  }
+
   cl_int err = CL_SUCCESS;
 
-#define ALLOC_BUF(buf, data_type, err_msg) \
+#define ALLOC_BUF(buf, elem_size, err_msg) \
   { \
     buf = cl::Buffer(m_cl_ctx, CL_MEM_READ_WRITE /* | CL_MEM_HOST_NO_ACCESS */, \
-                     part_num * sizeof(data_type), nullptr, &err); \
+                     part_num * (elem_size), nullptr, &err); \
     if (err != CL_SUCCESS) \
     { \
       std::cerr << err_msg << ocl::errorToStr(err) << std::endl; \
@@ -156,115 +501,50 @@ bool FluidSystem::reset(unsigned int part_num)
   }
 
   /* allocate buffers on GPU */
-  ALLOC_BUF(m_velocity_buf, cl_float4, "SPH: Failed to allocate velocity buffer: ");
-  ALLOC_BUF(m_prev_velocity_buf, cl_float4, "SPH: Failed to allocate prev velocity buffer: ");
-  ALLOC_BUF(m_pressure_buf, cl_float, "SPH: Failed to allocate pressure buffer: ");
-  ALLOC_BUF(m_density_buf, cl_float, "SPH: Failed to allocate density buffer: ");
-  ALLOC_BUF(m_force_buf, cl_float4, "SPH: Failed to allocate force buffer: ");
+  ALLOC_BUF(m_velocity_buf, vec_size, "SPH: Failed to allocate velocity buffer: ");
+  ALLOC_BUF(m_prev_velocity_buf, vec_size, "SPH: Failed to allocate prev velocity buffer: ");
+  ALLOC_BUF(m_next_velocity_buf, vec_size, "SPH: Failed to allocate next velocity buffer: ");
+  ALLOC_BUF(m_density_pressure_buf, sizeof(cl_float2), "SPH: Failed to allocate density and pressure buffer: ");
+  ALLOC_BUF(m_force_buf, sizeof(cl_float4), "SPH: Failed to allocate force buffer: ");
+  ALLOC_BUF(m_grid_cell_next_buf, sizeof(cl_int), "SPH: Failed to allocate grid cell list buffer: ");
+  ALLOC_BUF(m_sort_keys_buf, sizeof(cl_uint), "SPH: Failed to allocate sort key buffer: ");
+  ALLOC_BUF(m_sort_values_buf, sizeof(cl_uint), "SPH: Failed to allocate sort value buffer: ");
+  ALLOC_BUF(m_sorted_pos_buf, vec_size, "SPH: Failed to allocate sorted position buffer: ");
+  ALLOC_BUF(m_sorted_velocity_buf, vec_size, "SPH: Failed to allocate sorted velocity buffer: ");
+  ALLOC_BUF(m_sorted_prev_velocity_buf, vec_size, "SPH: Failed to allocate sorted prev velocity buffer: ");
+  ALLOC_BUF(m_neighbor_count_buf, sizeof(cl_uint), "SPH: Failed to allocate neighbour count buffer: ");
+  ALLOC_BUF(m_neighbor_build_pos_buf, sizeof(cl_float4), "SPH: Failed to allocate neighbour position buffer: ");
+  ALLOC_BUF(m_pair_count_buf, sizeof(cl_uint), "SPH: Failed to allocate pair count buffer: ");
 
 #undef ALLOC_BUF
 
-  /* set kernel parameters that do not change once the simulation is prepared */
-  
-#define SIM_SCALE ((cl_float) (0.004f))
-#define SMOOTH_RADIUS ((cl_float) (0.01f))
-#define RADIUS2 ((cl_float) ((SMOOTH_RADIUS) * (SMOOTH_RADIUS)))
-
-// m = Ro * (V / n)
-// Ro   ... hustota tekutiny
-// V    ... objem
-// n    ... pocet castic
-#define MASS ((cl_float) (0.00020543f))
-#define POLYKERN ((cl_float) (315.0f / (64.0f * 3.141592 * pow(SMOOTH_RADIUS, 9))))
-#define RESTDENSITY ((cl_float) (600.0f))
-#define INTSTIFFNESS ((cl_float) (1.0f))
-#define MASS_POLYKERN ((cl_float) ((MASS) * (POLYKERN)))
-
-#define VISCOSITY ((cl_float) (0.2f))
-#define LAPKERN ((cl_float) (45.0f / (3.141592 * pow(SMOOTH_RADIUS, 6))))
-#define VTERM ((cl_float) ((LAPKERN) * (VISCOSITY)))
-#define SPIKEYKERN ((cl_float) (-45.0f / (3.141592 * pow(SMOOTH_RADIUS, 6))))
-#define SPIKEYKERN_HALF ((cl_float) ((SPIKEYKERN) * (-0.5f)))
-
-#define SLOPE ((cl_float) (0.0f))        // ???
-#define LEFTWAVE ((cl_float) (0.0f))     // ???
-#define RIGHTWAVE ((cl_float) (0.0f))   // ???
-#define DELTATIME ((cl_float) (.003f))   // ???
-#define LIMIT ((cl_float) (200.0f))
-#define EXTSTIFFNESS ((cl_float) (10000.0f))
-#define EXTDAMPING ((cl_float) (256.0f))
-#define RADIUS ((cl_float) (0.004f))
-
-  /* compute pressure kernel's arguments */
-  if (!ocl::KernelArgs(m_sph_compute_pressure_kernel, "m_sph_compute_pressure_kernel")
-            .arg(m_particle_pos_buf.getCLID())
-            .arg(m_density_buf)
-            .arg(m_pressure_buf)
-            .arg(SIM_SCALE)
-            //.arg(SMOOTH_RADIUS)
-            .arg(RADIUS2)
-            //.arg(MASS)
-            //.arg(POLYKERN)
-            .arg(MASS_POLYKERN)
-            .arg(RESTDENSITY)
-            .arg(INTSTIFFNESS)
-            .arg((unsigned int) (m_num_particles)))
+  /* setup the Verlet lists, these will be built in the first step */
+  m_neighbor_status_buf = cl::Buffer(m_cl_ctx, CL_MEM_READ_WRITE, sizeof(cl_uint), nullptr, &err);
+  if (err != CL_SUCCESS)
   {
+    ERROR("SPH: Failed to allocate neighbour status buffer: " << ocl::errorToStr(err));
     return false;
   }
 
-  /* compute force kernel's arguments */
-  if (!ocl::KernelArgs(m_sph_compute_force_kernel, "m_sph_compute_force_kernel")
-            .arg(m_particle_pos_buf.getCLID())
-            .arg(m_density_buf)
-            .arg(m_pressure_buf)
-            .arg(m_force_buf)
-            .arg(m_velocity_buf)
-            .arg(SIM_SCALE)
-            .arg(SMOOTH_RADIUS)
-            .arg(RADIUS2)
-            //.arg(VISCOSITY)
-            //.arg(LAPKERN)
-            .arg(VTERM)
-            .arg(SPIKEYKERN_HALF)
-            .arg((unsigned int) (m_num_particles)))
-  {
-    return false;
-  }
+  m_neighbor_status_event = ocl::Event();
+  m_neighbor_status = 0;
+  m_neighbor_compressed = true;
+  m_neighbors_valid = false;
 
-  /* compute step kernel's arguments */
-  if (!ocl::KernelArgs(m_sph_compute_step_kernel, "m_sph_compute_step_kernel")
-            .arg(m_particle_pos_buf.getCLID())
-            .arg(m_force_buf)
-            .arg(m_velocity_buf)
-            .arg(m_prev_velocity_buf)
-            .arg(SLOPE)
-            .arg(LEFTWAVE)
-            .arg(RIGHTWAVE)
-            .arg(DELTATIME)
-            .arg(LIMIT)
-            .arg(EXTSTIFFNESS)
-            .arg(EXTDAMPING)
-            .arg(RADIUS)
-            .arg(m_volume_min)
-            .arg(m_volume_max)
-            .arg(SIM_SCALE)
-            .arg(MASS))
-  {
-    return false;
-  }
+  // reorder the randomly placed particles right in the first step
+  m_steps_since_sort = m_sort_interval;
+  m_step_count = 0;
+  ++m_particle_order;
 
-  /* reset kernel's arguments */
-  if (!ocl::KernelArgs(m_sph_reset_kernel, "m_sph_reset_kernel")
-            .arg(m_particle_pos_buf.getCLID())
-            .arg(m_velocity_buf)
-            .arg(m_prev_velocity_buf)
-            .arg(m_pressure_buf)
-            .arg(m_density_buf)
-            .arg(m_force_buf)
-            .arg(m_volume_min)
-            .arg(m_volume_max)
-            .arg((cl_ulong) (time(nullptr))))
+  m_kinetic_energy = 0.0f;
+  m_nan_count = 0;
+
+  m_pair_count_pending = NEIGHBOR_SEARCH_AUTO;
+  m_pair_count_mode = NEIGHBOR_SEARCH_AUTO;
+  m_pair_count = 0;
+
+  /* bind the new buffers to kernels */
+  if (!setupSimulation())
   {
     return false;
   }
@@ -281,90 +561,1427 @@ bool FluidSystem::reset(unsigned int part_num)
   if (!sync) return false;
 #endif
 
-  err = clEnqueueNDRangeKernel(queue, m_sph_reset_kernel(), 1,
-                               nullptr, &m_num_particles, nullptr,
-                               0, nullptr, m_stats.event("sph_reset"));
+  err = m_tuner.enqueue(queue, m_sph_reset_kernel(), "sph_reset", m_num_particles, m_stats);
   if (err != CL_SUCCESS)
   {
     WARN("Failed to enqueue SPH reset kernel");
   }
 
+  /* the previous frame in display buffers may have a different size or layout */
+  if (m_pipelined)
+  {
+    m_display_pos_buf.reset();
+    if (!publishPositions(queue))
+    {
+      WARN("FluidSystem: Failed to publish particle positions");
+    }
+  }
+
   return true;
 }
 
 
-void FluidSystem::update(float time_step)
+bool FluidSystem::setupSimulation(void)
 {
-  // check if the simulation is not paused
-  if (m_pause) return;
+  cl_int err = CL_SUCCESS;
 
-  /* set kernel arguments that change every frame */
-  cl_int err = m_sph_compute_step_kernel.setArg(16, (cl_float) (m_time));
-  if (err != CL_SUCCESS)
+  /* setup the uniform grid, the cell size is equal to the smoothing radius
+     in world space coordinates, so only the 27 neighbouring cells need to be searched */
+  m_grid_cell_size = m_params.smooth_radius / m_params.sim_scale;
+  for (int i = 0; i < 3; ++i)
   {
-    WARN("FluidSystem: Failed to set time argument: " << ocl::errorToStr(err));
-    return;
+    m_grid_size.s[i] = std::max(1, (cl_int) ceil((m_volume_max.s[i] - m_volume_min.s[i]) / m_grid_cell_size));
   }
+  m_grid_size.s[3] = 1;
+  m_grid_num_cells = m_grid_size.s[0] * m_grid_size.s[1] * m_grid_size.s[2];
 
-  err = m_sph_compute_step_kernel.setArg(17, (cl_uint) (m_effects));
+  m_grid_cell_head_buf = cl::Buffer(m_cl_ctx, CL_MEM_READ_WRITE, m_grid_num_cells * sizeof(cl_int), nullptr, &err);
   if (err != CL_SUCCESS)
   {
-    WARN("FluidSystem: Failed to set flags argument: " << ocl::errorToStr(err));
-    return;
+    ERROR("SPH: Failed to allocate grid cell buffer: " << ocl::errorToStr(err));
+    return false;
   }
 
-  //err = m_sph_compute_step_kernel.setArg(18, calcGravitationVector(m_rx, m_ry));
-  //if (err != CL_SUCCESS)
-  //{
-  //  WARN("FluidSystem: Failed to set gravitation argument: " << ocl::errorToStr(err));
-  //  return;
-  //}
+  /* the number of bits of Morton codes needed to address all cells */
+  {
+    cl_int max_size = std::max(m_grid_size.s[0], std::max(m_grid_size.s[1], m_grid_size.s[2]));
+    unsigned int bits = 0;
+    while ((bits < 10) && ((1 << bits) < max_size)) ++bits;
+    m_sort_key_bits = 3 * bits;
+  }
 
-  /* synchronise with OpenGL */
-  cl_command_queue queue = m_cl_queue();
-  cl_mem buffers[] = { m_particle_pos_buf.getCLID() };
+  /* setup the adaptive time stepping, the next step uses the default time step */
+  m_step_limits_dt = 0.0f;
+  m_default_time_step = m_params.delta_time;
+  m_time_step = m_params.delta_time;
+  m_smooth_radius = m_params.smooth_radius;
 
-  ocl::GLSyncHandler sync(queue, FLUIDSIM_COUNT(buffers), buffers);
-  if (!sync) return;
+  m_particle_mass = m_params.mass;
 
-  /* compute pressure */
-  err = clEnqueueNDRangeKernel(queue, m_sph_compute_pressure_kernel(), 1,
-                               nullptr, &m_num_particles, nullptr,
-                               0, nullptr, m_stats.event("sph_compute_pressure"));
-  if (err != CL_SUCCESS)
+  if (!allocNeighborLists())
   {
-    WARN("Failed to enqueue test simulation kernel: " << ocl::errorToStr(err));
+    return false;
   }
 
-  /* compute force */
-  err = clEnqueueNDRangeKernel(queue, m_sph_compute_force_kernel(), 1,
-                               nullptr, &m_num_particles, nullptr,
-                               0, nullptr, m_stats.event("sph_compute_force"));
-  if (err != CL_SUCCESS)
+  /* the global sizes are padded to a multiple of the work-group size,
+     so all 1D kernels get the number of elements to check the bounds */
+  cl_uint num_particles = (cl_uint) (m_num_particles);
+
+  /* compute pressure kernel's arguments */
+  if (!ocl::KernelArgs(m_sph_compute_pressure_kernel, "m_sph_compute_pressure_kernel")
+            .arg(m_particle_pos_buf.getCLID())
+            .arg(m_density_pressure_buf)
+            //.arg(SMOOTH_RADIUS)
+            //.arg(MASS)
+            //.arg(POLYKERN)
+            .arg(num_particles))
   {
-    WARN("Failed to enqueue test simulation kernel: " << ocl::errorToStr(err));
+    return false;
   }
 
-  /* integrate */
-  err = clEnqueueNDRangeKernel(queue, m_sph_compute_step_kernel(), 1,
-                               nullptr, &m_num_particles, nullptr,
-                               0, nullptr, m_stats.event("sph_compute_step"));
-  if (err != CL_SUCCESS)
+  /* compute force kernel's arguments */
+  if (!ocl::KernelArgs(m_sph_compute_force_kernel, "m_sph_compute_force_kernel")
+            .arg(m_particle_pos_buf.getCLID())
+            .arg(m_density_pressure_buf)
+            .arg(m_force_buf)
+            .arg(m_velocity_buf)
+            //.arg(VISCOSITY)
+            //.arg(LAPKERN)
+            .arg(num_particles))
   {
-    WARN("Failed to enqueue test simulation kernel: " << ocl::errorToStr(err));
+    return false;
   }
 
-  /* advance simulation time */
-  m_time += time_step;   // 3.0f;
-
-  // kill the wave after 50 frames
-  if (m_effects & EFFECT_WAVE)
+  /* grid kernels' arguments */
+  if (!ocl::KernelArgs(m_sph_grid_clear_kernel, "m_sph_grid_clear_kernel")
+            .arg(m_grid_cell_head_buf)
+            .arg((cl_uint) (m_grid_num_cells)))
   {
-    if ((m_time - m_wave_start) > (time_step * 50))
-    {
-      m_effects &= ~(EFFECT_WAVE);
-    }
+    return false;
   }
 
+  if (!ocl::KernelArgs(m_sph_grid_insert_kernel, "m_sph_grid_insert_kernel")
+            .arg(m_particle_pos_buf.getCLID())
+            .arg(m_grid_cell_head_buf)
+            .arg(m_grid_cell_next_buf)
+            .arg(m_volume_min)
+            .arg(m_grid_cell_size)
+            .arg(m_grid_size)
+            .arg(num_particles))
+  {
+    return false;
+  }
+
+  if (!ocl::KernelArgs(m_sph_grid_count_pairs_kernel, "m_sph_grid_count_pairs_kernel")
+            .arg(m_particle_pos_buf.getCLID())
+            .arg(m_grid_cell_head_buf)
+            .arg(m_grid_cell_next_buf)
+            .arg(m_pair_count_buf)
+            .arg(m_volume_min)
+            .arg(m_grid_cell_size)
+            .arg(m_grid_size)
+            .arg(num_particles))
+  {
+    return false;
+  }
+
+  if (!ocl::KernelArgs(m_sph_compute_pressure_grid_kernel, "m_sph_compute_pressure_grid_kernel")
+            .arg(m_particle_pos_buf.getCLID())
+            .arg(m_density_pressure_buf)
+            .arg(m_grid_cell_head_buf)
+            .arg(m_grid_cell_next_buf)
+            .arg(m_volume_min)
+            .arg(m_grid_cell_size)
+            .arg(m_grid_size)
+            .arg(num_particles))
+  {
+    return false;
+  }
+
+  if (!ocl::KernelArgs(m_sph_compute_force_grid_kernel, "m_sph_compute_force_grid_kernel")
+            .arg(m_particle_pos_buf.getCLID())
+            .arg(m_density_pressure_buf)
+            .arg(m_force_buf)
+            .arg(m_velocity_buf)
+            .arg(m_grid_cell_head_buf)
+            .arg(m_grid_cell_next_buf)
+            .arg(m_volume_min)
+            .arg(m_grid_cell_size)
+            .arg(m_grid_size)
+            .arg(num_particles))
+  {
+    return false;
+  }
+
+  /* neighbour list kernels' arguments,
+     the arguments related to list storage are set in allocNeighborLists */
+  if (!ocl::KernelArgs(m_sph_neighbors_build_kernel, "m_sph_neighbors_build_kernel")
+            .arg(m_particle_pos_buf.getCLID())
+            .arg(m_neighbor_build_pos_buf)
+            .arg(m_grid_cell_head_buf)
+            .arg(m_grid_cell_next_buf)
+            .arg(m_neighbor_count_buf, 6)
+            .arg(m_neighbor_status_buf)
+            .arg(m_volume_min)
+            .arg(m_grid_cell_size)
+            .arg(m_grid_size)
+            .arg(num_particles, 13))
+  {
+    return false;
+  }
+
+  if (!ocl::KernelArgs(m_sph_neighbors_check_kernel, "m_sph_neighbors_check_kernel")
+            .arg(m_particle_pos_buf.getCLID())
+            .arg(m_neighbor_build_pos_buf)
+            .arg(m_neighbor_status_buf)
+            .arg(num_particles))
+  {
+    return false;
+  }
+
+  if (!ocl::KernelArgs(m_sph_compute_pressure_list_kernel, "m_sph_compute_pressure_list_kernel")
+            .arg(m_particle_pos_buf.getCLID())
+            .arg(m_density_pressure_buf)
+            .arg(m_neighbor_count_buf, 4)
+            .arg(num_particles, 6))
+  {
+    return false;
+  }
+
+  if (!ocl::KernelArgs(m_sph_compute_force_list_kernel, "m_sph_compute_force_list_kernel")
+            .arg(m_particle_pos_buf.getCLID())
+            .arg(m_density_pressure_buf)
+            .arg(m_force_buf)
+            .arg(m_velocity_buf)
+            .arg(m_neighbor_count_buf, 6)
+            .arg(num_particles, 8))
+  {
+    return false;
+  }
+
+  /* tiled kernels' arguments */
+  if (!ocl::KernelArgs(m_sph_compute_pressure_tiled_kernel, "m_sph_compute_pressure_tiled_kernel")
+            .arg(m_particle_pos_buf.getCLID())
+            .arg(m_density_pressure_buf)
+            .arg(cl::Local(m_tile_size * sizeof(cl_float4)))
+            .arg(num_particles))
+  {
+    return false;
+  }
+
+  if (!ocl::KernelArgs(m_sph_compute_force_tiled_kernel, "m_sph_compute_force_tiled_kernel")
+            .arg(m_particle_pos_buf.getCLID())
+            .arg(m_density_pressure_buf)
+            .arg(m_force_buf)
+            .arg(m_velocity_buf)
+            .arg(cl::Local(m_tile_size * sizeof(cl_float4)))
+            .arg(cl::Local(m_tile_size * sizeof(cl_float4)))
+            .arg(cl::Local(m_tile_size * sizeof(cl_float2)))
+            .arg(num_particles))
+  {
+    return false;
+  }
+
+  /* sorting kernels' arguments */
+  if (!ocl::KernelArgs(m_sph_sort_keys_kernel, "m_sph_sort_keys_kernel")
+            .arg(m_particle_pos_buf.getCLID())
+            .arg(m_sort_keys_buf)
+            .arg(m_sort_values_buf)
+            .arg(m_volume_min)
+            .arg(m_grid_cell_size)
+            .arg(m_grid_size)
+            .arg(num_particles))
+  {
+    return false;
+  }
+
+  if (!ocl::KernelArgs(m_sph_reorder_kernel, "m_sph_reorder_kernel")
+            .arg(m_sort_values_buf)
+            .arg(m_particle_pos_buf.getCLID())
+            .arg(m_velocity_buf)
+            .arg(m_prev_velocity_buf)
+            .arg(m_sorted_pos_buf)
+            .arg(m_sorted_velocity_buf)
+            .arg(m_sorted_prev_velocity_buf)
+            .arg(num_particles))
+  {
+    return false;
+  }
+
+  /* compute step kernel's arguments, time and flags are set in update */
+  if (!ocl::KernelArgs(m_sph_compute_step_kernel, "m_sph_compute_step_kernel")
+            .arg(m_particle_pos_buf.getCLID())
+            .arg(m_force_buf)
+            .arg(m_velocity_buf)
+            .arg(m_prev_velocity_buf)
+            .arg(m_time_step)
+            .arg(m_volume_min)
+            .arg(m_volume_max)
+            .arg(num_particles, 9))
+  {
+    return false;
+  }
+
+  /* symmetric kernels' arguments */
+  if (!ocl::KernelArgs(m_sph_symmetric_clear_kernel, "m_sph_symmetric_clear_kernel")
+            .arg(m_density_pressure_buf)
+            .arg(m_force_buf)
+            .arg(num_particles))
+  {
+    return false;
+  }
+
+  if (!ocl::KernelArgs(m_sph_compute_pressure_sym_kernel, "m_sph_compute_pressure_sym_kernel")
+            .arg(m_particle_pos_buf.getCLID())
+            .arg(m_density_pressure_buf)
+            .arg(m_grid_cell_head_buf)
+            .arg(m_grid_cell_next_buf)
+            .arg(m_volume_min)
+            .arg(m_grid_cell_size)
+            .arg(m_grid_size)
+            .arg(num_particles))
+  {
+    return false;
+  }
+
+  if (!ocl::KernelArgs(m_sph_compute_pressure_finalize_kernel, "m_sph_compute_pressure_finalize_kernel")
+            .arg(m_density_pressure_buf)
+            .arg(num_particles))
+  {
+    return false;
+  }
+
+  if (!ocl::KernelArgs(m_sph_compute_force_sym_kernel, "m_sph_compute_force_sym_kernel")
+            .arg(m_particle_pos_buf.getCLID())
+            .arg(m_density_pressure_buf)
+            .arg(m_force_buf)
+            .arg(m_velocity_buf)
+            .arg(m_grid_cell_head_buf)
+            .arg(m_grid_cell_next_buf)
+            .arg(m_volume_min)
+            .arg(m_grid_cell_size)
+            .arg(m_grid_size)
+            .arg(num_particles))
+  {
+    return false;
+  }
+
+  /* fused step kernels' arguments, time and flags are set in update */
+  if (!ocl::KernelArgs(m_sph_compute_step_grid_kernel, "m_sph_compute_step_grid_kernel")
+            .arg(m_particle_pos_buf.getCLID())
+            .arg(m_next_pos_buf.getCLID())
+            .arg(m_velocity_buf)
+            .arg(m_next_velocity_buf)
+            .arg(m_prev_velocity_buf)
+            .arg(m_density_pressure_buf)
+            .arg(m_grid_cell_head_buf)
+            .arg(m_grid_cell_next_buf)
+            .arg(m_grid_cell_size)
+            .arg(m_grid_size)
+            .arg(m_time_step)
+            .arg(m_volume_min)
+            .arg(m_volume_max)
+            .arg(num_particles))
+  {
+    return false;
+  }
+
+  if (!ocl::KernelArgs(m_sph_compute_step_tiled_kernel, "m_sph_compute_step_tiled_kernel")
+            .arg(m_particle_pos_buf.getCLID())
+            .arg(m_next_pos_buf.getCLID())
+            .arg(m_velocity_buf)
+            .arg(m_next_velocity_buf)
+            .arg(m_prev_velocity_buf)
+            .arg(m_density_pressure_buf)
+            .arg(cl::Local(m_tile_size * sizeof(cl_float4)))
+            .arg(cl::Local(m_tile_size * sizeof(cl_float4)))
+            .arg(cl::Local(m_tile_size * sizeof(cl_float2)))
+            .arg(m_time_step)
+            .arg(m_volume_min)
+            .arg(m_volume_max)
+            .arg(num_particles))
+  {
+    return false;
+  }
+
+  /* reset kernel's arguments */
+  if (!ocl::KernelArgs(m_sph_reset_kernel, "m_sph_reset_kernel")
+            .arg(m_particle_pos_buf.getCLID())
+            .arg(m_velocity_buf)
+            .arg(m_prev_velocity_buf)
+            .arg(m_density_pressure_buf)
+            .arg(m_force_buf)
+            .arg(m_volume_min)
+            .arg(m_volume_max)
+            .arg((cl_ulong) (time(nullptr)))
+            .arg(num_particles))
+  {
+    return false;
+  }
+
+  declareKernelCosts();
+
+  return true;
+}
+
+
+bool FluidSystem::setParams(const Params & params)
+{
+  if (!params.finite())
+  {
+    ERROR("SPH: The simulation parameters have to be finite numbers");
+    return false;
+  }
+
+  m_params = params;
+
+  if (!buildKernels(m_particle_layout, m_program_stride))
+  {
+    ERROR("SPH: Failed to compile kernels for the new simulation parameters");
+    return false;
+  }
+
+  // the kernels were recreated, so their arguments have to be set again
+  // (unless there are no particle buffers yet, reset will set them then)
+  if (m_num_particles == 0) return true;
+
+  return setupSimulation();
+}
+
+
+bool FluidSystem::saveCheckpoint(const char *filename)
+{
+  if (m_num_particles == 0)
+  {
+    ERROR("SPH: Nothing to checkpoint, the simulation was not reset yet");
+    return false;
+  }
+
+  CheckpointHeader header;
+  std::memcpy(header.magic, CHECKPOINT_MAGIC, sizeof(header.magic));
+  header.version = CHECKPOINT_VERSION;
+  header.header_size = sizeof(CheckpointHeader);
+  header.layout = m_particle_layout;
+  header.num_particles = (cl_uint) m_num_particles;
+  header.effects = m_effects;
+  header.step_count = m_step_count;
+  header.time = m_time;
+  header.wave_start = m_wave_start;
+  header.time_step = m_time_step;
+  header.reserved[0] = 0;
+  header.reserved[1] = 0;
+  header.params = m_params;
+
+  size_t vec_size = particleVectorSize(m_particle_layout) * m_num_particles;
+
+  struct {
+    cl_mem buf;
+    size_t size;
+  } sections[] = {
+    { m_particle_pos_buf.getCLID(), vec_size },
+    { m_velocity_buf(), vec_size },
+    { m_prev_velocity_buf(), vec_size },
+    { m_density_pressure_buf(), m_num_particles * sizeof(cl_float2) }
+  };
+
+  std::ofstream ofs(filename, std::ios::out | std::ios::binary | std::ios::trunc);
+  if (!ofs.is_open())
+  {
+    ERROR("SPH: Failed to open checkpoint file " << filename);
+    return false;
+  }
+
+  ofs.write((const char *) &header, sizeof(header));
+
+  /* read back the particle data, the simulation is not running meanwhile,
+     so the buffers are consistent with each other */
+  cl_command_queue queue = m_cl_queue();
+
+  cl_mem gl_buffers[] = { m_particle_pos_buf.getCLID() };
+  ocl::GLSyncHandler sync(queue, FLUIDSIM_COUNT(gl_buffers), gl_buffers);
+  if (!sync) return false;
+
+  std::vector<char> data;
+  for (size_t i = 0; i < FLUIDSIM_COUNT(sections); ++i)
+  {
+    data.resize(sections[i].size);
+    cl_int err = clEnqueueReadBuffer(queue, sections[i].buf, CL_TRUE, 0, sections[i].size,
+                                     data.data(), 0, nullptr, nullptr);
+    if (err != CL_SUCCESS)
+    {
+      ERROR("SPH: Failed to read particle data for checkpoint: " << ocl::errorToStr(err));
+      return false;
+    }
+
+    ofs.write(data.data(), data.size());
+  }
+
+  if (!ofs)
+  {
+    ERROR("SPH: Failed to write checkpoint file " << filename);
+    return false;
+  }
+
+  INFO("SPH: Saved checkpoint of " << m_num_particles << " particles at time " << m_time << " to " << filename);
+
+  return true;
+}
+
+
+bool FluidSystem::loadCheckpoint(const char *filename)
+{
+  utils::fs::MappedFile file;
+  if (!file.open(filename))
+  {
+    ERROR("SPH: Failed to open checkpoint file " << filename);
+    return false;
+  }
+
+  /* validate the header */
+  CheckpointHeader header;
+  if (file.size() < sizeof(header))
+  {
+    ERROR("SPH: " << filename << " is not a checkpoint file (too short)");
+    return false;
+  }
+
+  std::memcpy(&header, file.data(), sizeof(header));
+
+  if (std::memcmp(header.magic, CHECKPOINT_MAGIC, sizeof(header.magic)) != 0)
+  {
+    ERROR("SPH: " << filename << " is not a checkpoint file");
+    return false;
+  }
+
+  if ((header.version != CHECKPOINT_VERSION) || (header.header_size != sizeof(header)))
+  {
+    ERROR("SPH: Unsupported checkpoint version " << header.version);
+    return false;
+  }
+
+  if ((header.layout > LAYOUT_SOA) || (header.num_particles == 0))
+  {
+    ERROR("SPH: Corrupted checkpoint header in " << filename);
+    return false;
+  }
+
+  ParticleLayout layout = (ParticleLayout) header.layout;
+  size_t n = header.num_particles;
+  size_t vec_size = particleVectorSize(layout) * n;
+
+  if (file.size() != sizeof(header) + 3 * vec_size + n * sizeof(cl_float2))
+  {
+    ERROR("SPH: Checkpoint file " << filename << " is truncated or corrupted");
+    return false;
+  }
+
+  /* rebuild the simulation for the saved parameters and layout,
+     the freshly reset particle data is overwritten below */
+  if (!setParams(header.params))
+  {
+    return false;
+  }
+
+  setParticleLayout(layout);
+  if (!reset((unsigned int) n))
+  {
+    return false;
+  }
+
+  /* upload the particle data straight from the mapped file,
+     the pages are faulted in by the driver as it copies them */
+  const unsigned char *data = file.data() + sizeof(header);
+
+  struct {
+    cl_mem buf;
+    size_t size;
+  } sections[] = {
+    { m_particle_pos_buf.getCLID(), vec_size },
+    { m_velocity_buf(), vec_size },
+    { m_prev_velocity_buf(), vec_size },
+    { m_density_pressure_buf(), n * sizeof(cl_float2) }
+  };
+
+  cl_command_queue queue = m_cl_queue();
+
+  {
+    cl_mem gl_buffers[] = { m_particle_pos_buf.getCLID() };
+    ocl::GLSyncHandler sync(queue, FLUIDSIM_COUNT(gl_buffers), gl_buffers);
+    if (!sync) return false;
+
+    for (size_t i = 0; i < FLUIDSIM_COUNT(sections); ++i)
+    {
+      // blocking, because the mapping is released when this function returns
+      cl_int err = clEnqueueWriteBuffer(queue, sections[i].buf, CL_TRUE, 0, sections[i].size,
+                                        data, 0, nullptr, nullptr);
+      if (err != CL_SUCCESS)
+      {
+        ERROR("SPH: Failed to upload particle data from checkpoint: " << ocl::errorToStr(err));
+        return false;
+      }
+
+      data += sections[i].size;
+    }
+
+    if ((m_pipelined) && (!publishPositions(queue)))
+    {
+      WARN("FluidSystem: Failed to publish particle positions");
+    }
+  }
+
+  /* restore the simulation state */
+  m_time = header.time;
+  m_effects = header.effects;
+  m_wave_start = header.wave_start;
+  m_time_step = header.time_step;
+  m_step_count = header.step_count;
+
+  INFO("SPH: Loaded checkpoint of " << n << " particles at time " << m_time << " from " << filename);
+
+  return true;
+}
+
+
+bool FluidSystem::sortParticles(cl_command_queue queue)
+{
+  /* compute the Morton codes of particle cells */
+  cl_int err = m_tuner.enqueue(queue, m_sph_sort_keys_kernel(), "sph_sort_keys", m_num_particles, m_stats);
+  if (err != CL_SUCCESS)
+  {
+    WARN("Failed to enqueue sort keys kernel: " << ocl::errorToStr(err));
+    return false;
+  }
+
+  /* sort the particle indices by the codes */
+  if (!m_radix_sort.sort(queue, m_sort_keys_buf(), m_sort_values_buf(),
+                         m_num_particles, m_sort_key_bits, &m_stats))
+  {
+    return false;
+  }
+
+  /* gather the particle data into temporary buffers */
+  err = m_tuner.enqueue(queue, m_sph_reorder_kernel(), "sph_reorder", m_num_particles, m_stats);
+  if (err != CL_SUCCESS)
+  {
+    WARN("Failed to enqueue reorder kernel: " << ocl::errorToStr(err));
+    return false;
+  }
+
+  /* and copy them back, pressure, density and forces are not copied,
+     because they are recomputed from scratch in each step */
+  size_t size = m_num_particles * particleVectorSize(m_particle_layout);
+
+  err = clEnqueueCopyBuffer(queue, m_sorted_pos_buf(), m_particle_pos_buf.getCLID(),
+                            0, 0, size, 0, nullptr, nullptr);
+  if (err == CL_SUCCESS)
+  {
+    err = clEnqueueCopyBuffer(queue, m_sorted_velocity_buf(), m_velocity_buf(),
+                              0, 0, size, 0, nullptr, nullptr);
+  }
+
+  if (err == CL_SUCCESS)
+  {
+    err = clEnqueueCopyBuffer(queue, m_sorted_prev_velocity_buf(), m_prev_velocity_buf(),
+                              0, 0, size, 0, nullptr, nullptr);
+  }
+
+  if (err != CL_SUCCESS)
+  {
+    WARN("Failed to copy reordered particle data: " << ocl::errorToStr(err));
+    return false;
+  }
+
+  // the lists and snapshot keyframes refer to the old particle order
+  m_neighbors_valid = false;
+  ++m_particle_order;
+
+  return true;
+}
+
+
+bool FluidSystem::bindParticleBuffers(void)
+{
+  cl_mem pos = m_particle_pos_buf.getCLID();
+  cl_mem vel = m_velocity_buf();
+
+  /* the kernels and the indices of their position and velocity arguments (-1 when not used) */
+  struct {
+    cl_kernel kernel;
+    cl_int pos_arg;
+    cl_int vel_arg;
+  } bindings[] = {
+    { m_sph_reset_kernel(),                  0,  1 },
+    { m_sph_compute_pressure_kernel(),       0, -1 },
+    { m_sph_compute_pressure_grid_kernel(),  0, -1 },
+    { m_sph_compute_pressure_list_kernel(),  0, -1 },
+    { m_sph_compute_pressure_tiled_kernel(), 0, -1 },
+    { m_sph_compute_pressure_sym_kernel(),   0, -1 },
+    { m_sph_compute_force_kernel(),          0,  3 },
+    { m_sph_compute_force_grid_kernel(),     0,  3 },
+    { m_sph_compute_force_list_kernel(),     0,  3 },
+    { m_sph_compute_force_tiled_kernel(),    0,  3 },
+    { m_sph_compute_force_sym_kernel(),      0,  3 },
+    { m_sph_compute_step_kernel(),           0,  2 },
+    { m_sph_grid_insert_kernel(),            0, -1 },
+    { m_sph_grid_count_pairs_kernel(),       0, -1 },
+    { m_sph_sort_keys_kernel(),              0, -1 },
+    { m_sph_reorder_kernel(),                1,  2 },
+    { m_sph_neighbors_build_kernel(),        0, -1 },
+    { m_sph_neighbors_check_kernel(),        0, -1 }
+  };
+
+  for (unsigned int i = 0; i < FLUIDSIM_COUNT(bindings); ++i)
+  {
+    ocl::KernelArgs args(bindings[i].kernel);
+    if (bindings[i].pos_arg >= 0) args.arg(pos, bindings[i].pos_arg);
+    if (bindings[i].vel_arg >= 0) args.arg(vel, bindings[i].vel_arg);
+    if (!args) return false;
+  }
+
+  /* the fused kernels read the current buffers and write the other ones */
+  cl_kernel fused[] = { m_sph_compute_step_grid_kernel(), m_sph_compute_step_tiled_kernel() };
+
+  for (unsigned int i = 0; i < FLUIDSIM_COUNT(fused); ++i)
+  {
+    if (!ocl::KernelArgs(fused[i])
+              .arg(pos)
+              .arg(m_next_pos_buf.getCLID())
+              .arg(vel)
+              .arg(m_next_velocity_buf()))
+    {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+
+bool FluidSystem::updateTimeStep(void)
+{
+  /* consume the maxima computed after the previous step */
+  if (m_max_speed2.pending() || m_max_dvelocity2.pending())
+  {
+    cl_float max_vel2 = 0.0f;
+    cl_float max_dvel2 = 0.0f;
+    bool ok = m_max_speed2.result(max_vel2);
+    ok = m_max_dvelocity2.result(max_dvel2) && ok;
+
+    if (ok && (m_step_limits_dt > 0.0f))
+    {
+      float max_vel = std::sqrt(max_vel2);
+      float max_accel = 2.0f * std::sqrt(max_dvel2) / m_step_limits_dt;
+
+      float dt = m_max_time_step;
+      if (max_vel > 0.0f) dt = std::min(dt, m_cfl_factor * m_smooth_radius / max_vel);
+      if (max_accel > 0.0f) dt = std::min(dt, m_force_factor * std::sqrt(m_smooth_radius / max_accel));
+
+      m_time_step = std::max(dt, m_min_time_step);
+    }
+  }
+
+  if (!m_adaptive_time_step)
+  {
+    m_time_step = m_default_time_step;
+  }
+
+  /* pass it to the integration kernels */
+  return ocl::KernelArgs(m_sph_compute_step_kernel, "m_sph_compute_step_kernel")
+             .arg(m_time_step, 4) &&
+         ocl::KernelArgs(m_sph_compute_step_grid_kernel, "m_sph_compute_step_grid_kernel")
+             .arg(m_time_step, 10) &&
+         ocl::KernelArgs(m_sph_compute_step_tiled_kernel, "m_sph_compute_step_tiled_kernel")
+             .arg(m_time_step, 9);
+}
+
+
+bool FluidSystem::computeStepLimits(cl_command_queue queue)
+{
+  // the results are read asynchronously and consumed in the next update
+  if ((!m_max_speed2.enqueue(queue, m_velocity_buf(), m_num_particles, nullptr,
+                             &m_stats, "sph_reduce_max_velocity")) ||
+      (!m_max_dvelocity2.enqueue(queue, m_velocity_buf(), m_num_particles, m_prev_velocity_buf(),
+                                 &m_stats, "sph_reduce_max_dvelocity")))
+  {
+    WARN("Failed to compute step limits");
+    return false;
+  }
+
+  m_step_limits_dt = m_time_step;
+
+  return true;
+}
+
+
+void FluidSystem::updateDiagnostics(void)
+{
+  cl_float speed2_sum = 0.0f;
+  if (m_speed2_sum.pending() && m_speed2_sum.result(speed2_sum))
+  {
+    m_kinetic_energy = 0.5f * m_particle_mass * speed2_sum;
+  }
+
+  cl_uint nan_count = 0;
+  if (m_nan_count_sum.pending() && m_nan_count_sum.result(nan_count))
+  {
+    if ((nan_count > 0) && (m_nan_count == 0))
+    {
+      WARN("FluidSystem: " << nan_count << " particles have invalid positions");
+    }
+    m_nan_count = nan_count;
+  }
+}
+
+
+bool FluidSystem::computeDiagnostics(cl_command_queue queue)
+{
+  // the results are read asynchronously and consumed in the next update
+  if ((!m_speed2_sum.enqueue(queue, m_velocity_buf(), m_num_particles, nullptr,
+                             &m_stats, "sph_reduce_kinetic_energy")) ||
+      (!m_nan_count_sum.enqueue(queue, m_particle_pos_buf.getCLID(), m_num_particles, nullptr,
+                                &m_stats, "sph_reduce_nan_count")))
+  {
+    WARN("Failed to compute simulation diagnostics");
+    return false;
+  }
+
+  return true;
+}
+
+
+void FluidSystem::updatePairCount(void)
+{
+  cl_uint pair_count = 0;
+  if (m_pair_count_sum.pending() && m_pair_count_sum.result(pair_count))
+  {
+    m_pair_count = pair_count;
+    m_pair_count_mode = m_pair_count_pending;
+  }
+}
+
+
+bool FluidSystem::countPairs(cl_command_queue queue, NeighborSearch neighbor_search)
+{
+  /* sample periodically and right after the neighbour search has changed */
+  if (m_pair_count_sum.pending()) return true;
+  if (((m_step_count % PAIR_COUNT_INTERVAL) != 0) && (m_pair_count_mode == neighbor_search)) return true;
+
+  cl_mem counts = m_neighbor_count_buf();
+
+  if (neighbor_search == NEIGHBOR_SEARCH_GRID)
+  {
+    cl_int err = m_tuner.enqueue(queue, m_sph_grid_count_pairs_kernel(), "sph_grid_count_pairs", m_num_particles, m_stats);
+    if (err != CL_SUCCESS)
+    {
+      WARN("Failed to enqueue pair count kernel: " << ocl::errorToStr(err));
+      return false;
+    }
+
+    counts = m_pair_count_buf();
+  }
+
+  // the result is read asynchronously and consumed in the next update
+  if (!m_pair_count_sum.enqueue(queue, counts, m_num_particles, nullptr, &m_stats, "sph_reduce_pair_count"))
+  {
+    WARN("Failed to count particle pairs");
+    return false;
+  }
+
+  m_pair_count_pending = neighbor_search;
+
+  return true;
+}
+
+
+unsigned long long FluidSystem::pairsPerStep(NeighborSearch neighbor_search) const
+{
+  unsigned long long n = m_num_particles;
+
+  switch (neighbor_search)
+  {
+    case NEIGHBOR_SEARCH_BRUTE_FORCE:
+    case NEIGHBOR_SEARCH_TILED:
+      return (n > 0) ? n * (n - 1) : 0;
+
+    case NEIGHBOR_SEARCH_GRID:
+    case NEIGHBOR_SEARCH_VERLET:
+      // nothing is reported until the first sample for this search arrives
+      return (m_pair_count_mode == neighbor_search) ? m_pair_count : 0;
+
+    default:
+      return 0;
+  }
+}
+
+
+void FluidSystem::declareKernelCosts(void)
+{
+  typedef ocl::PerfStats::KernelCost tCost;
+
+  double v = (double) particleVectorSize(m_particle_layout);     // a position or velocity
+  double dp = sizeof(cl_float2);                                 // inverse density and pressure
+  double f = sizeof(cl_float4);                                  // force
+  double link = sizeof(cl_int);                                  // a grid cell link
+  double cells = 27.0 * sizeof(cl_int);                          // the heads of the visited cells
+  double entry = m_neighbor_compressed ? sizeof(cl_short) : sizeof(cl_int);   // a Verlet list entry
+  double tile = (double) std::max<size_t>(m_tile_size, 1);       // tiles are loaded once per work-group
+
+  /* the global memory traffic requested by the kernels (per particle and per visited pair)
+     and a rough count of their floating point operations, the pair costs of the fused
+     step kernels are the same as the ones of the force kernels */
+  const struct {
+    const char *name;
+    tCost cost;
+  } costs[] = {
+    { "sph_compute_pressure",          tCost(v + dp,                    5.0,  v,                         20.0) },
+    { "sph_compute_pressure_grid",     tCost(v + dp + cells,            15.0, v + link,                  20.0) },
+    { "sph_compute_pressure_list",     tCost(v + dp + link,             5.0,  v + entry,                 20.0) },
+    { "sph_compute_pressure_tiled",    tCost(v + dp,                    5.0,  v / tile,                  20.0) },
+    { "sph_compute_pressure_sym",      tCost(v + link + cells,          15.0, v + 3 * link,              22.0) },
+    { "sph_compute_pressure_finalize", tCost(link + dp,                 5.0) },
+    { "sph_symmetric_clear",           tCost(link + f) },
+    { "sph_compute_force",             tCost(2 * v + dp + f,            10.0, 2 * v + dp,                40.0) },
+    { "sph_compute_force_grid",        tCost(2 * v + dp + f + cells,    20.0, 2 * v + dp + link,         40.0) },
+    { "sph_compute_force_list",        tCost(2 * v + dp + f + link,     10.0, 2 * v + dp + entry,        40.0) },
+    { "sph_compute_force_tiled",       tCost(2 * v + dp + f,            10.0, (2 * v + dp) / tile,       40.0) },
+    { "sph_compute_force_sym",         tCost(2 * v + dp + link + cells, 20.0, 2 * v + dp + link + 2 * f, 46.0) },
+    { "sph_compute_step",              tCost(6 * v + f,                 60.0) },
+    { "sph_compute_step_grid",         tCost(7 * v + dp + cells,        80.0, 2 * v + dp + link,         40.0) },
+    { "sph_compute_step_tiled",        tCost(7 * v + dp,                70.0, (2 * v + dp) / tile,       40.0) },
+    { "sph_grid_clear",                tCost(link) },
+    { "sph_grid_insert",               tCost(v + 3 * link,              10.0) },
+    { "sph_grid_count_pairs",          tCost(v + link + cells,          10.0) },
+    { "sph_sort_keys",                 tCost(v + 2 * link,              40.0) },
+    { "sph_reorder",                   tCost(link + 6 * v) },
+    { "sph_neighbors_check",           tCost(2 * v + link,              10.0) }
+  };
+
+  for (unsigned int i = 0; i < FLUIDSIM_COUNT(costs); ++i)
+  {
+    m_stats.declareCost(costs[i].name, costs[i].cost);
+  }
+}
+
+
+bool FluidSystem::buildGrid(cl_command_queue queue)
+{
+  cl_int err = m_tuner.enqueue(queue, m_sph_grid_clear_kernel(), "sph_grid_clear", m_grid_num_cells, m_stats);
+  if (err != CL_SUCCESS)
+  {
+    WARN("Failed to enqueue grid clear kernel: " << ocl::errorToStr(err));
+    return false;
+  }
+
+  err = m_tuner.enqueue(queue, m_sph_grid_insert_kernel(), "sph_grid_insert", m_num_particles, m_stats);
+  if (err != CL_SUCCESS)
+  {
+    WARN("Failed to enqueue grid insert kernel: " << ocl::errorToStr(err));
+    return false;
+  }
+
+  return true;
+}
+
+
+bool FluidSystem::allocNeighborLists(void)
+{
+  size_t elem_size = m_neighbor_compressed ? sizeof(cl_short) : sizeof(cl_int);
+
+  cl_int err = CL_SUCCESS;
+  m_neighbor_list_buf = cl::Buffer(m_cl_ctx, CL_MEM_READ_WRITE,
+                                   m_num_particles * m_max_neighbors * elem_size,
+                                   nullptr, &err);
+  if (err != CL_SUCCESS)
+  {
+    ERROR("SPH: Failed to allocate neighbour list buffer: " << ocl::errorToStr(err));
+    return false;
+  }
+
+  // the same buffer is bound to both the 32-bit and the 16-bit list argument,
+  // the kernels only access the one selected by the compressed flag
+  cl_uint compressed = m_neighbor_compressed ? 1 : 0;
+
+  if (!ocl::KernelArgs(m_sph_neighbors_build_kernel, "m_sph_neighbors_build_kernel")
+            .arg(m_neighbor_list_buf, 4)
+            .arg(m_neighbor_list_buf)
+            .arg((cl_uint) (m_max_neighbors), 11)
+            .arg(compressed))
+  {
+    return false;
+  }
+
+  if (!ocl::KernelArgs(m_sph_compute_pressure_list_kernel, "m_sph_compute_pressure_list_kernel")
+            .arg(m_neighbor_list_buf, 2)
+            .arg(m_neighbor_list_buf)
+            .arg(compressed, 5))
+  {
+    return false;
+  }
+
+  if (!ocl::KernelArgs(m_sph_compute_force_list_kernel, "m_sph_compute_force_list_kernel")
+            .arg(m_neighbor_list_buf, 4)
+            .arg(m_neighbor_list_buf)
+            .arg(compressed, 7))
+  {
+    return false;
+  }
+
+  m_neighbors_valid = false;
+
+  // the lists may have switched between 16-bit and 32-bit indices
+  declareKernelCosts();
+
+  return true;
+}
+
+
+bool FluidSystem::updateNeighborLists(cl_command_queue queue)
+{
+  /* consume the result of the displacement check from the previous step */
+  cl_event ev = m_neighbor_status_event;
+  if (ev != nullptr)
+  {
+    cl_int err = clWaitForEvents(1, &ev);
+    m_neighbor_status_event = ocl::Event();
+    if ((err != CL_SUCCESS) || (m_neighbor_status & NEIGHBORS_REBUILD))
+    {
+      m_neighbors_valid = false;
+    }
+  }
+
+  ++m_steps_since_sort;
+
+  if (m_neighbors_valid) return true;
+
+  /* reordering invalidates the lists, so the particles
+     are sorted only when the lists are rebuilt anyway */
+  if ((m_sort_interval > 0) && (m_steps_since_sort >= m_sort_interval))
+  {
+    m_steps_since_sort = 0;
+    if (!sortParticles(queue))
+    {
+      WARN("FluidSystem: Failed to reorder particles");
+    }
+  }
+
+  if (!buildGrid(queue)) return false;
+
+  for (;;)
+  {
+    static const cl_uint zero = 0;
+    cl_uint status = 0;
+
+    cl_int err = clEnqueueWriteBuffer(queue, m_neighbor_status_buf(), CL_FALSE, 0,
+                                      sizeof(cl_uint), &zero, 0, nullptr, nullptr);
+    if (err != CL_SUCCESS)
+    {
+      WARN("Failed to clear neighbour list status: " << ocl::errorToStr(err));
+      return false;
+    }
+
+    err = m_tuner.enqueue(queue, m_sph_neighbors_build_kernel(), "sph_neighbors_build", m_num_particles, m_stats);
+    if (err != CL_SUCCESS)
+    {
+      WARN("Failed to enqueue neighbour list build kernel: " << ocl::errorToStr(err));
+      return false;
+    }
+
+    // the lists are rebuilt only occasionally, so it is cheaper
+    // to wait here than to simulate a step with truncated lists
+    err = clEnqueueReadBuffer(queue, m_neighbor_status_buf(), CL_TRUE, 0,
+                              sizeof(cl_uint), &status, 0, nullptr, nullptr);
+    if (err != CL_SUCCESS)
+    {
+      WARN("Failed to read neighbour list status: " << ocl::errorToStr(err));
+      return false;
+    }
+
+    if ((status & (NEIGHBORS_TOO_MANY | NEIGHBORS_OUT_OF_RANGE)) == 0) break;
+
+    /* the lists did not fit, so enlarge them and try again */
+    if (status & NEIGHBORS_OUT_OF_RANGE)
+    {
+      INFO("FluidSystem: Neighbour indices do not fit into 16 bits, switching to 32-bit indices");
+      m_neighbor_compressed = false;
+    }
+
+    if (status & NEIGHBORS_TOO_MANY)
+    {
+      m_max_neighbors = (unsigned int) std::min<size_t>(m_max_neighbors * 2, m_num_particles);
+      INFO("FluidSystem: Increasing the neighbour list capacity to " << m_max_neighbors);
+    }
+
+    if (!allocNeighborLists()) return false;
+  }
+
+  m_neighbors_valid = true;
+
+  return true;
+}
+
+
+void FluidSystem::benchmarkSymmetricPairs(unsigned int steps, std::ostream & os)
+{
+  if (steps == 0) return;
+
+  /* save the settings */
+  NeighborSearch neighbor_search = m_neighbor_search;
+  bool symmetric_pairs = m_symmetric_pairs;
+  bool fused_step = m_fused_step;
+  bool pause = m_pause;
+
+  m_neighbor_search = NEIGHBOR_SEARCH_GRID;
+  m_fused_step = false;
+  m_pause = false;
+
+  double step_time[2] = { 0.0, 0.0 };
+
+  for (int mode = 0; mode < 2; ++mode)
+  {
+    m_symmetric_pairs = (mode == 1);
+
+    // warm up
+    update();
+    clFinish(m_cl_queue());
+
+    std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+
+    for (unsigned int i = 0; i < steps; ++i)
+    {
+      update();
+    }
+
+    clFinish(m_cl_queue());
+
+    std::chrono::duration<double, std::milli> elapsed = std::chrono::high_resolution_clock::now() - start;
+    step_time[mode] = elapsed.count() / steps;
+  }
+
+  /* restore the settings */
+  m_neighbor_search = neighbor_search;
+  m_symmetric_pairs = symmetric_pairs;
+  m_fused_step = fused_step;
+  m_pause = pause;
+
+  os << "Symmetric pair evaluation benchmark (" << m_num_particles << " particles, "
+     << steps << " steps)" << std::endl;
+  os << "  two-sided grid kernels : " << step_time[0] << " ms/step" << std::endl;
+  os << "  symmetric grid kernels : " << step_time[1] << " ms/step" << std::endl;
+  os << "  speedup                : " << (step_time[0] / step_time[1]) << "x" << std::endl;
+  os << "  (the symmetric kernels evaluate half of the particle pairs)" << std::endl;
+}
+
+
+void FluidSystem::update(float time_step)
+{
+  // check if the simulation is not paused
+  if (m_pause) return;
+
+  /* set kernel arguments that change every frame */
+  cl_int err = m_sph_compute_step_kernel.setArg(7, (cl_float) (m_time));
+  if (err != CL_SUCCESS)
+  {
+    WARN("FluidSystem: Failed to set time argument: " << ocl::errorToStr(err));
+    return;
+  }
+
+  err = m_sph_compute_step_kernel.setArg(8, (cl_uint) (m_effects));
+  if (err != CL_SUCCESS)
+  {
+    WARN("FluidSystem: Failed to set flags argument: " << ocl::errorToStr(err));
+    return;
+  }
+
+  if (!updateTimeStep())
+  {
+    WARN("FluidSystem: Failed to set time step argument");
+    return;
+  }
+
+  updateDiagnostics();
+  updatePairCount();
+
+  if ((!ocl::KernelArgs(m_sph_compute_step_grid_kernel, "m_sph_compute_step_grid_kernel")
+            .arg((cl_float) (m_time), 14)
+            .arg((cl_uint) (m_effects))) ||
+      (!ocl::KernelArgs(m_sph_compute_step_tiled_kernel, "m_sph_compute_step_tiled_kernel")
+            .arg((cl_float) (m_time), 13)
+            .arg((cl_uint) (m_effects))))
+  {
+    WARN("FluidSystem: Failed to set time and flags arguments of fused kernels");
+    return;
+  }
+
+  //err = m_sph_compute_step_kernel.setArg(9, calcGravitationVector(m_rx, m_ry));
+  //if (err != CL_SUCCESS)
+  //{
+  //  WARN("FluidSystem: Failed to set gravitation argument: " << ocl::errorToStr(err));
+  //  return;
+  //}
+
+  /* synchronise with OpenGL, in pipelined and threaded mode OpenGL draws
+     a copy of the positions, so there is no need to wait for it
+     (a threaded update does not even have an OpenGL context to wait on) */
+  cl_command_queue queue = m_cl_queue();
+  cl_mem buffers[] = { m_particle_pos_buf.getCLID(), m_next_pos_buf.getCLID() };
+
+  ocl::GLSyncHandler sync(queue, FLUIDSIM_COUNT(buffers), buffers, !m_pipelined && !m_threaded);
+  if (!sync) return;
+
+  /* the frame is begun only after the checks above, so that it is ended
+     on every path (there are no early returns below this point) */
+  m_stats.trace().beginFrame();
+
+  NeighborSearch neighbor_search = activeNeighborSearch();
+  bool fused = false;   // whether the integration has already been done by a fused kernel
+
+  if (neighbor_search == NEIGHBOR_SEARCH_VERLET)
+  {
+    if (!updateNeighborLists(queue))
+    {
+      WARN("FluidSystem: Failed to build neighbour lists, falling back to uniform grid");
+      m_neighbor_search = neighbor_search = NEIGHBOR_SEARCH_GRID;
+    }
+  }
+
+  // the particle pairs visited by the kernels of this step (for the roofline report)
+  unsigned long long pairs = pairsPerStep(neighbor_search);
+
+  if (neighbor_search == NEIGHBOR_SEARCH_TILED)
+  {
+    /* pad the global size to a multiple of the tile size */
+    size_t global = ((m_num_particles + m_tile_size - 1) / m_tile_size) * m_tile_size;
+
+    /* compute pressure */
+    err = clEnqueueNDRangeKernel(queue, m_sph_compute_pressure_tiled_kernel(), 1,
+                                 nullptr, &global, &m_tile_size,
+                                 0, nullptr, m_stats.event("sph_compute_pressure_tiled"));
+    if (err != CL_SUCCESS)
+    {
+      WARN("Failed to enqueue tiled pressure kernel: " << ocl::errorToStr(err));
+    }
+    else
+    {
+      m_stats.addWork("sph_compute_pressure_tiled", m_num_particles, pairs);
+    }
+
+    if (m_fused_step)
+    {
+      /* compute force and integrate */
+      err = clEnqueueNDRangeKernel(queue, m_sph_compute_step_tiled_kernel(), 1,
+                                   nullptr, &global, &m_tile_size,
+                                   0, nullptr, m_stats.event("sph_compute_step_tiled"));
+      if (err != CL_SUCCESS)
+      {
+        WARN("Failed to enqueue fused tiled step kernel: " << ocl::errorToStr(err));
+      }
+      else
+      {
+        m_stats.addWork("sph_compute_step_tiled", m_num_particles, pairs);
+      }
+      fused = (err == CL_SUCCESS);
+    }
+    else
+    {
+      /* compute force */
+      err = clEnqueueNDRangeKernel(queue, m_sph_compute_force_tiled_kernel(), 1,
+                                   nullptr, &global, &m_tile_size,
+                                   0, nullptr, m_stats.event("sph_compute_force_tiled"));
+      if (err != CL_SUCCESS)
+      {
+        WARN("Failed to enqueue tiled force kernel: " << ocl::errorToStr(err));
+      }
+      else
+      {
+        m_stats.addWork("sph_compute_force_tiled", m_num_particles, pairs);
+      }
+    }
+  }
+  else if (neighbor_search == NEIGHBOR_SEARCH_VERLET)
+  {
+    countPairs(queue, neighbor_search);
+
+    /* compute pressure */
+    err = m_tuner.enqueue(queue, m_sph_compute_pressure_list_kernel(), "sph_compute_pressure_list", m_num_particles, m_stats, pairs);
+    if (err != CL_SUCCESS)
+    {
+      WARN("Failed to enqueue list pressure kernel: " << ocl::errorToStr(err));
+    }
+
+    /* compute force */
+    err = m_tuner.enqueue(queue, m_sph_compute_force_list_kernel(), "sph_compute_force_list", m_num_particles, m_stats, pairs);
+    if (err != CL_SUCCESS)
+    {
+      WARN("Failed to enqueue list force kernel: " << ocl::errorToStr(err));
+    }
+  }
+  else if (neighbor_search == NEIGHBOR_SEARCH_GRID)
+  {
+    /* keep spatial neighbours close in memory */
+    if ((m_sort_interval > 0) && (++m_steps_since_sort >= m_sort_interval))
+    {
+      m_steps_since_sort = 0;
+      if (!sortParticles(queue))
+      {
+        WARN("FluidSystem: Failed to reorder particles");
+      }
+    }
+
+    /* rebuild the uniform grid */
+    buildGrid(queue);
+    countPairs(queue, neighbor_search);
+
+    if (m_symmetric_pairs)
+    {
+      /* compute pressure and force, each pair is evaluated only once,
+         the forces are complete only after all work-items have finished,
+         so the integration can not be fused in this case */
+      struct {
+        cl_kernel kernel;
+        const char *name;
+        unsigned long long pairs;
+      } passes[] = {
+        { m_sph_symmetric_clear_kernel(),           "sph_symmetric_clear",           0 },
+        { m_sph_compute_pressure_sym_kernel(),      "sph_compute_pressure_sym",      pairs / 2 },
+        { m_sph_compute_pressure_finalize_kernel(), "sph_compute_pressure_finalize", 0 },
+        { m_sph_compute_force_sym_kernel(),         "sph_compute_force_sym",         pairs / 2 }
+      };
+
+      for (unsigned int i = 0; i < FLUIDSIM_COUNT(passes); ++i)
+      {
+        err = m_tuner.enqueue(queue, passes[i].kernel, passes[i].name, m_num_particles, m_stats, passes[i].pairs);
+        if (err != CL_SUCCESS)
+        {
+          WARN("Failed to enqueue " << passes[i].name << " kernel: " << ocl::errorToStr(err));
+        }
+      }
+    }
+    else
+    {
+      /* compute pressure */
+      err = m_tuner.enqueue(queue, m_sph_compute_pressure_grid_kernel(), "sph_compute_pressure_grid", m_num_particles, m_stats, pairs);
+      if (err != CL_SUCCESS)
+      {
+        WARN("Failed to enqueue grid pressure kernel: " << ocl::errorToStr(err));
+      }
+
+      if (m_fused_step)
+      {
+        /* compute force and integrate */
+        err = m_tuner.enqueue(queue, m_sph_compute_step_grid_kernel(), "sph_compute_step_grid", m_num_particles, m_stats, pairs);
+        if (err != CL_SUCCESS)
+        {
+          WARN("Failed to enqueue fused grid step kernel: " << ocl::errorToStr(err));
+        }
+        fused = (err == CL_SUCCESS);
+      }
+      else
+      {
+        /* compute force */
+        err = m_tuner.enqueue(queue, m_sph_compute_force_grid_kernel(), "sph_compute_force_grid", m_num_particles, m_stats, pairs);
+        if (err != CL_SUCCESS)
+        {
+          WARN("Failed to enqueue grid force kernel: " << ocl::errorToStr(err));
+        }
+      }
+    }
+  }
+  else
+  {
+    /* compute pressure */
+    err = m_tuner.enqueue(queue, m_sph_compute_pressure_kernel(), "sph_compute_pressure", m_num_particles, m_stats, pairs);
+    if (err != CL_SUCCESS)
+    {
+      WARN("Failed to enqueue test simulation kernel: " << ocl::errorToStr(err));
+    }
+
+    /* compute force */
+    err = m_tuner.enqueue(queue, m_sph_compute_force_kernel(), "sph_compute_force", m_num_particles, m_stats, pairs);
+    if (err != CL_SUCCESS)
+    {
+      WARN("Failed to enqueue test simulation kernel: " << ocl::errorToStr(err));
+    }
+  }
+
+  if (fused)
+  {
+    /* the new positions and velocities are in the other buffers */
+    m_particle_pos_buf.swap(m_next_pos_buf);
+    std::swap(m_velocity_buf, m_next_velocity_buf);
+    if (!bindParticleBuffers())
+    {
+      WARN("FluidSystem: Failed to rebind particle buffers");
+    }
+  }
+  else
+  {
+    /* integrate */
+    err = m_tuner.enqueue(queue, m_sph_compute_step_kernel(), "sph_compute_step", m_num_particles, m_stats);
+    if (err != CL_SUCCESS)
+    {
+      WARN("Failed to enqueue test simulation kernel: " << ocl::errorToStr(err));
+    }
+  }
+
+  /* find the limits for the next time step */
+  if (m_adaptive_time_step)
+  {
+    computeStepLimits(queue);
+  }
+
+  if (m_diagnostics)
+  {
+    computeDiagnostics(queue);
+  }
+
+  /* check whether the neighbour lists will still be valid in the next step,
+     the result is read asynchronously and consumed in the next update */
+  if (neighbor_search == NEIGHBOR_SEARCH_VERLET)
+  {
+    err = m_tuner.enqueue(queue, m_sph_neighbors_check_kernel(), "sph_neighbors_check", m_num_particles, m_stats);
+    if (err == CL_SUCCESS)
+    {
+      m_neighbor_status_event = ocl::Event();
+      err = clEnqueueReadBuffer(queue, m_neighbor_status_buf(), CL_FALSE, 0,
+                                sizeof(cl_uint), &m_neighbor_status,
+                                0, nullptr, m_neighbor_status_event);
+    }
+
+    if (err != CL_SUCCESS)
+    {
+      WARN("Failed to check neighbour lists: " << ocl::errorToStr(err));
+      m_neighbors_valid = false;
+    }
+  }
+
+  /* stream the state after the step to disk, the copies do not block the queue */
+  ++m_step_count;
+  if ((m_snapshot_writer != nullptr) && ((m_step_count % m_snapshot_interval) == 0))
+  {
+    m_snapshot_writer->capture(queue, m_particle_pos_buf.getCLID(), m_velocity_buf(), m_density_pressure_buf(),
+                               m_num_particles, m_particle_layout, m_step_count, m_time + time_step,
+                               m_volume_min, m_volume_max, m_particle_order, &m_stats);
+  }
+
+  /* hand the new positions over to the renderer */
+  if ((m_pipelined) && (!m_threaded) && (!publishPositions(queue)))
+  {
+    WARN("FluidSystem: Failed to publish particle positions");
+  }
+
+  /* advance simulation time */
+  m_time += time_step;   // 3.0f;
+
+  // kill the wave after 50 frames
+  if (m_effects & EFFECT_WAVE)
+  {
+    if ((m_time - m_wave_start) > (time_step * 50))
+    {
+      m_effects &= ~(EFFECT_WAVE);
+    }
+  }
+
+  m_stats.trace().endFrame();
+
   return;
 }
\ No newline at end of file
@@ -22,6 +22,10 @@
 #define FLUIDSYSTEM_H
 
 #include "ParticleSystem.h"
+#include "SnapshotWriter.h"
+
+#include <algorithm>
+#include <cmath>
 
 
 
@@ -35,23 +39,162 @@ class FluidSystem : public ParticleSystem
       EFFECT_NONE     = (0 << 0)
     };
 
+    enum NeighborSearch {
+      NEIGHBOR_SEARCH_BRUTE_FORCE,   // every particle is tested against all the other particles
+      NEIGHBOR_SEARCH_GRID,          // only particles from the neighbouring cells of a uniform grid are tested
+      NEIGHBOR_SEARCH_VERLET,        // per particle neighbour lists are built from the grid and reused across steps
+      NEIGHBOR_SEARCH_TILED,         // brute force with particle data staged in local memory
+      NEIGHBOR_SEARCH_AUTO           // tiled for small particle counts, uniform grid otherwise
+    };
+
+    // simulation parameters, these are compiled into the SPH kernels as constants
+    // (see sph_params.cl), so changing them selects a different build of the program
+    struct Params {
+      cl_float sim_scale;        // the scale of simulation space to world space
+      cl_float smooth_radius;    // the smoothing radius (in simulation space)
+      cl_float mass;             // the mass of a particle (m = rest density * volume / particle count)
+      cl_float rest_density;     // the rest density of the fluid
+      cl_float int_stiffness;    // the internal (gas) stiffness
+      cl_float viscosity;
+      cl_float slope;            // the slope of the bottom wall
+      cl_float left_wave;        // the amplitudes of wave generators at the left and right wall
+      cl_float right_wave;
+      cl_float delta_time;       // the default time step
+      cl_float limit;            // the acceleration limit
+      cl_float ext_stiffness;    // the stiffness and damping of the boundary walls
+      cl_float ext_damping;
+      cl_float radius;           // the particle radius used by wall collisions
+      cl_float neighbor_skin;    // the skin of Verlet lists relative to the smoothing radius
+
+      Params(void)
+        : sim_scale(0.004f)
+        , smooth_radius(0.01f)
+        , mass(0.00020543f)
+        , rest_density(600.0f)
+        , int_stiffness(1.0f)
+        , viscosity(0.2f)
+        , slope(0.0f)
+        , left_wave(0.0f)
+        , right_wave(0.0f)
+        , delta_time(0.003f)
+        , limit(200.0f)
+        , ext_stiffness(10000.0f)
+        , ext_damping(256.0f)
+        , radius(0.004f)
+        , neighbor_skin(0.2f)
+      {
+      }
+
+      // the constants of the poly6, viscosity laplacian and spiky gradient smoothing kernels
+      double polyKernel(void) const { return 315.0 / (64.0 * 3.141592 * pow((double) smooth_radius, 9)); }
+      double lapKernel(void) const { return 45.0 / (3.141592 * pow((double) smooth_radius, 6)); }
+      double spikyKernel(void) const { return -45.0 / (3.141592 * pow((double) smooth_radius, 6)); }
+
+      // the constants of the SPH program (see sph_params.cl), without the particle layout
+      ocl::ProgramDefines defines(void) const;
+      // whether all the parameters and the constants derived from them are finite numbers
+      bool finite(void) const;
+    };
+
+  public:
+    // the sources of the SPH program (relative to the assets directory)
+    static const char *m_sph_kernel_files[];
+    static const unsigned int m_sph_kernel_files_size;
+
   public:
     FluidSystem(void)
       : ParticleSystem()
+      , m_params()
+      , m_program_cache(m_sph_kernel_files, m_sph_kernel_files_size)
       , m_sph_prog()
       , m_sph_reset_kernel()
       , m_sph_compute_step_kernel()
       , m_sph_compute_force_kernel()
       , m_sph_compute_pressure_kernel()
+      , m_sph_grid_clear_kernel()
+      , m_sph_grid_insert_kernel()
+      , m_sph_compute_pressure_grid_kernel()
+      , m_sph_compute_force_grid_kernel()
+      , m_sph_sort_keys_kernel()
+      , m_sph_reorder_kernel()
+      , m_radix_sort()
       , m_velocity_buf()
-      , m_pressure_buf()
-      , m_density_buf()
+      , m_density_pressure_buf()
       , m_force_buf()
       , m_prev_velocity_buf()
+      , m_grid_cell_head_buf()
+      , m_grid_cell_next_buf()
+      , m_grid_cell_size(0.0f)
+      , m_grid_size()
+      , m_grid_num_cells(0)
+      , m_neighbor_search(NEIGHBOR_SEARCH_AUTO)
+      , m_sph_neighbors_build_kernel()
+      , m_sph_neighbors_check_kernel()
+      , m_sph_compute_pressure_list_kernel()
+      , m_sph_compute_force_list_kernel()
+      , m_neighbor_list_buf()
+      , m_neighbor_count_buf()
+      , m_neighbor_build_pos_buf()
+      , m_neighbor_status_buf()
+      , m_neighbor_status_event()
+      , m_neighbor_status(0)
+      , m_max_neighbors(DEFAULT_MAX_NEIGHBORS)
+      , m_neighbor_compressed(true)
+      , m_neighbors_valid(false)
+      , m_sph_compute_pressure_tiled_kernel()
+      , m_sph_compute_force_tiled_kernel()
+      , m_tile_size(DEFAULT_TILE_SIZE)
+      , m_sph_compute_step_grid_kernel()
+      , m_sph_compute_step_tiled_kernel()
+      , m_next_pos_buf()
+      , m_next_velocity_buf()
+      , m_fused_step(true)
+      , m_sph_symmetric_clear_kernel()
+      , m_sph_compute_pressure_sym_kernel()
+      , m_sph_compute_pressure_finalize_kernel()
+      , m_sph_compute_force_sym_kernel()
+      , m_symmetric_pairs(false)
+      , m_max_speed2()
+      , m_max_dvelocity2()
+      , m_step_limits_dt(0.0f)
+      , m_adaptive_time_step(true)
+      , m_time_step(0.0f)
+      , m_default_time_step(0.0f)
+      , m_min_time_step(0.0005f)
+      , m_max_time_step(0.005f)
+      , m_cfl_factor(0.4f)
+      , m_force_factor(0.25f)
+      , m_smooth_radius(0.0f)
+      , m_speed2_sum()
+      , m_nan_count_sum()
+      , m_diagnostics(true)
+      , m_kinetic_energy(0.0f)
+      , m_nan_count(0)
+      , m_particle_mass(0.0f)
+      , m_sort_keys_buf()
+      , m_sort_values_buf()
+      , m_sorted_pos_buf()
+      , m_sorted_velocity_buf()
+      , m_sorted_prev_velocity_buf()
+      , m_sort_key_bits(0)
+      , m_sort_interval(DEFAULT_SORT_INTERVAL)
+      , m_steps_since_sort(0)
+      , m_next_layout(LAYOUT_AOS)
+      , m_program_stride(0)
       , m_effects(EFFECT_NONE)
       , m_wave_start(0.0f)
       , m_rx(0)
       , m_ry(0)
+      , m_snapshot_writer(nullptr)
+      , m_snapshot_interval(0)
+      , m_step_count(0)
+      , m_particle_order(0)
+      , m_sph_grid_count_pairs_kernel()
+      , m_pair_count_buf()
+      , m_pair_count_sum()
+      , m_pair_count_pending(NEIGHBOR_SEARCH_AUTO)
+      , m_pair_count_mode(NEIGHBOR_SEARCH_AUTO)
+      , m_pair_count(0)
     {
 #if 0
       std::cerr << "this: " << (void *) this << std::endl;
@@ -70,8 +213,7 @@ class FluidSystem : public ParticleSystem
       std::cerr << "&m_particle_pos_buf            : " << &m_particle_pos_buf << std::endl;
       std::cerr << "&m_particle_col_buf            : " << &m_particle_col_buf << std::endl;
       std::cerr << "&m_velocity_buf                : " << &m_velocity_buf << std::endl;
-      std::cerr << "&m_pressure_buf                : " << &m_pressure_buf << std::endl;
-      std::cerr << "&m_density_buf                 : " << &m_density_buf << std::endl;
+      std::cerr << "&m_density_pressure_buf        : " << &m_density_pressure_buf << std::endl;
       std::cerr << "&m_force_buf                   : " << &m_force_buf << std::endl;
       std::cerr << "&m_prev_velocity_buf           : " << &m_prev_velocity_buf << std::endl;
       std::cerr << "&m_num_particles               : " << &m_num_particles << std::endl;
@@ -100,6 +242,99 @@ class FluidSystem : public ParticleSystem
 
     void setRotation(float rx, float ry) { m_rx = rx; m_ry = ry; }
 
+    NeighborSearch neighborSearch(void) const { return m_neighbor_search; }
+    void setNeighborSearch(NeighborSearch ns) { m_neighbor_search = ns; m_neighbors_valid = false; }
+    // switches to the next neighbour search algorithm (brute force -> grid -> verlet lists -> tiled -> auto)
+    NeighborSearch nextNeighborSearch(void)
+    {
+      setNeighborSearch((NeighborSearch) ((m_neighbor_search + 1) % (NEIGHBOR_SEARCH_AUTO + 1)));
+      return m_neighbor_search;
+    }
+    // the algorithm that is actually used (resolves NEIGHBOR_SEARCH_AUTO)
+    NeighborSearch activeNeighborSearch(void) const
+    {
+      if (m_neighbor_search != NEIGHBOR_SEARCH_AUTO) return m_neighbor_search;
+      return (m_num_particles < TILED_MAX_PARTICLES) ? NEIGHBOR_SEARCH_TILED : NEIGHBOR_SEARCH_GRID;
+    }
+
+    // whether the force computation and integration are done in a single kernel
+    // (only for grid and tiled neighbour search, the split path is kept for debugging)
+    bool fusedStep(void) const { return m_fused_step; }
+    void setFusedStep(bool fused) { m_fused_step = fused; }
+    bool toggleFusedStep(void) { return m_fused_step = !m_fused_step; }
+
+    // whether each pair of particles is evaluated only once and the result is
+    // scattered to both particles (only for grid neighbour search, disables the fused step)
+    bool symmetricPairs(void) const { return m_symmetric_pairs; }
+    void setSymmetricPairs(bool symmetric) { m_symmetric_pairs = symmetric; }
+    bool toggleSymmetricPairs(void) { return m_symmetric_pairs = !m_symmetric_pairs; }
+
+    // runs the given number of simulation steps with the two-sided
+    // and with the symmetric grid kernels and reports the step times
+    // (note that this advances the simulation)
+    void benchmarkSymmetricPairs(unsigned int steps, std::ostream & os);
+
+    // adaptive time stepping, the time step is derived from the maximal velocity (CFL condition)
+    // and from the maximal acceleration in the previous step and clamped to [min, max],
+    // when disabled the default time step given by simulation parameters is used
+    float timeStep(void) const { return m_time_step; }
+    bool adaptiveTimeStep(void) const { return m_adaptive_time_step; }
+    void setAdaptiveTimeStep(bool adaptive) { m_adaptive_time_step = adaptive; }
+    bool toggleAdaptiveTimeStep(void) { return m_adaptive_time_step = !m_adaptive_time_step; }
+    void setTimeStepBounds(float min_dt, float max_dt) { m_min_time_step = min_dt; m_max_time_step = max_dt; }
+    void setTimeStepFactors(float cfl, float force) { m_cfl_factor = cfl; m_force_factor = force; }
+
+    // simulation diagnostics computed on GPU after each step (the total kinetic
+    // energy and the number of particles with invalid positions), the values
+    // lag one step behind, because they are read back asynchronously
+    bool diagnostics(void) const { return m_diagnostics; }
+    void setDiagnostics(bool enabled) { m_diagnostics = enabled; }
+    bool toggleDiagnostics(void) { return m_diagnostics = !m_diagnostics; }
+    float kineticEnergy(void) const { return m_kinetic_energy; }
+    unsigned int nanCount(void) const { return m_nan_count; }
+
+    // the capacity of a single Verlet list and whether the lists store
+    // 16-bit relative indices (both are adjusted automatically on overflow)
+    unsigned int maxNeighbors(void) const { return m_max_neighbors; }
+    bool compressedNeighbors(void) const { return m_neighbor_compressed; }
+
+    // the layout of particle positions and velocities in memory,
+    // a new layout takes effect on the next reset (the kernels are recompiled)
+    void setParticleLayout(ParticleLayout layout) { m_next_layout = layout; }
+    ParticleLayout nextParticleLayout(void) const { return m_next_layout; }
+
+    // the simulation parameters, new parameters take effect immediately without resetting
+    // the particles, the kernels are recompiled unless the same parameters were used before
+    const Params & params(void) const { return m_params; }
+    bool setParams(const Params & params);
+    // the number of distinct builds of the SPH program compiled so far
+    size_t programVariants(void) const { return m_program_cache.size(); }
+
+    // streams the positions, velocities and densities to the writer every interval steps
+    // (nullptr stops the streaming), the writer has to outlive the fluid system or be detached
+    void setSnapshotWriter(SnapshotWriter *writer, unsigned int interval = 1)
+    {
+      m_snapshot_writer = writer;
+      m_snapshot_interval = std::max(interval, 1u);
+    }
+    SnapshotWriter *snapshotWriter(void) const { return m_snapshot_writer; }
+
+    // saves the complete simulation state (particle data, time, effects and parameters)
+    // to a file, the simulation must not be running in another thread meanwhile
+    bool saveCheckpoint(const char *filename);
+    // restores the state saved by saveCheckpoint, this resets the simulation with
+    // the saved parameters, particle layout and particle count
+    bool loadCheckpoint(const char *filename);
+
+    // particles are reordered along the Morton curve of their grid cells
+    // every sort_interval steps (0 disables the reordering)
+    unsigned int sortInterval(void) const { return m_sort_interval; }
+    void setSortInterval(unsigned int sort_interval) { m_sort_interval = sort_interval; }
+
+    // changes whenever the particles are reordered or reset, the particle
+    // at a given index is the same only as long as this stays the same
+    unsigned int particleOrder(void) const { return m_particle_order; }
+
     // reset the particle system
     // initializes buffers and shared data
     virtual bool reset(unsigned int part_num);
@@ -112,16 +347,64 @@ class FluidSystem : public ParticleSystem
     // @param proj projection matrix
     void render(const glm::mat4 & mv = glm::mat4(), const glm::mat4 & proj = glm::mat4());
 
+  protected:
+    // the positions are published to the display buffer at the end of update
+    virtual bool supportsPipelinedInterop(void) const { return true; }
+
   private:
     // initializes the OpenCL program and kernel for SPH simulation
     bool init(void);
+    // compiles the SPH program for the layout of particle data and current parameters and creates the kernels
+    bool buildKernels(ParticleLayout layout, size_t num_particles);
+    // sets up the grid and binds the buffers and parameters to kernels (particle data is left intact)
+    bool setupSimulation(void);
+    // reorders the particle data, so that spatial neighbours are also neighbours in memory
+    bool sortParticles(cl_command_queue queue);
+    // rebinds the position and velocity buffers to kernels after they were swapped
+    bool bindParticleBuffers(void);
+    // chooses the time step for the next step and passes it to the kernels
+    bool updateTimeStep(void);
+    // computes the maximal velocity and acceleration for the next time step
+    bool computeStepLimits(cl_command_queue queue);
+    // collects the diagnostics of the previous step
+    void updateDiagnostics(void);
+    // computes the kinetic energy and counts invalid particles
+    bool computeDiagnostics(cl_command_queue queue);
+    // rebuilds the uniform grid
+    bool buildGrid(cl_command_queue queue);
+    // (re)allocates the Verlet lists according to current capacity and compression
+    bool allocNeighborLists(void);
+    // rebuilds the Verlet lists if any particle moved too far since the last build
+    bool updateNeighborLists(cl_command_queue queue);
+    // collects the number of particle pairs sampled in the previous step
+    void updatePairCount(void);
+    // counts the particle pairs visited by the grid or Verlet list kernels (every PAIR_COUNT_INTERVAL steps)
+    bool countPairs(cl_command_queue queue, NeighborSearch neighbor_search);
+    // the particle pairs visited by the pressure or force kernels in one step
+    unsigned long long pairsPerStep(NeighborSearch neighbor_search) const;
+    // declares the memory traffic and arithmetic of kernels for the roofline report
+    void declareKernelCosts(void);
 
   private:
-    static const char *m_sph_kernel_files[];
-    static const unsigned int m_sph_kernel_files_size;
+    static const unsigned int DEFAULT_SORT_INTERVAL = 10;
+    static const unsigned int DEFAULT_MAX_NEIGHBORS = 64;
+    static const unsigned int DEFAULT_TILE_SIZE = 128;
+    // below this particle count the tiled brute force beats the uniform grid
+    static const unsigned int TILED_MAX_PARTICLES = 10000;
+    // how often (in steps) the visited particle pairs are counted
+    static const unsigned int PAIR_COUNT_INTERVAL = 32;
+
+    // flags reported by the neighbour list kernels (see sph_neighbors.cl)
+    static const cl_uint NEIGHBORS_REBUILD = (1 << 0);
+    static const cl_uint NEIGHBORS_TOO_MANY = (1 << 1);
+    static const cl_uint NEIGHBORS_OUT_OF_RANGE = (1 << 2);
 
   private:
+    // simulation parameters
+    Params m_params;
+
     // OpenCL programs
+    ocl::ProgramCache m_program_cache;   // the builds of SPH program for different parameters
     cl::Program m_sph_prog;     // OpenCL program
 
     // OpenCL kernels
@@ -129,19 +412,118 @@ class FluidSystem : public ParticleSystem
     cl::Kernel m_sph_compute_step_kernel;      // a kernel to compute a single SPH step
     cl::Kernel m_sph_compute_force_kernel;     // kernel for computing forces
     cl::Kernel m_sph_compute_pressure_kernel;  // kernel for computing the pressure inside of the fluid
+    cl::Kernel m_sph_grid_clear_kernel;              // a kernel to mark all grid cells as empty
+    cl::Kernel m_sph_grid_insert_kernel;             // a kernel to sort particles into grid cells
+    cl::Kernel m_sph_compute_pressure_grid_kernel;   // pressure computation using the uniform grid
+    cl::Kernel m_sph_compute_force_grid_kernel;      // force computation using the uniform grid
+    cl::Kernel m_sph_sort_keys_kernel;               // computes Morton codes of particle cells
+    cl::Kernel m_sph_reorder_kernel;                 // permutes the particle data according to sorted keys
+
+    // radix sort to order particles by their Morton codes
+    ocl::RadixSort m_radix_sort;
 
     // buffers for SPH simulation
     cl::Buffer m_velocity_buf;
-    cl::Buffer m_pressure_buf;
-    cl::Buffer m_density_buf;
+    cl::Buffer m_density_pressure_buf;   // interleaved inverse density and pressure
     cl::Buffer m_force_buf;
     cl::Buffer m_prev_velocity_buf;
 
+    // uniform grid for neighbour search
+    cl::Buffer m_grid_cell_head_buf;   // the index of the first particle in each cell
+    cl::Buffer m_grid_cell_next_buf;   // the index of the next particle in the same cell
+    cl_float m_grid_cell_size;         // the edge length of a grid cell (equals to smoothing radius)
+    cl_int4 m_grid_size;               // the number of cells along each axis
+    size_t m_grid_num_cells;           // the total number of cells in grid
+    NeighborSearch m_neighbor_search;  // the neighbour search algorithm
+
+    // Verlet neighbour lists
+    cl::Kernel m_sph_neighbors_build_kernel;         // builds the lists from the uniform grid
+    cl::Kernel m_sph_neighbors_check_kernel;         // checks whether the lists are still valid
+    cl::Kernel m_sph_compute_pressure_list_kernel;   // pressure computation using the lists
+    cl::Kernel m_sph_compute_force_list_kernel;      // force computation using the lists
+    cl::Buffer m_neighbor_list_buf;                  // the lists (either 32-bit or 16-bit relative indices)
+    cl::Buffer m_neighbor_count_buf;                 // the number of neighbours of each particle
+    cl::Buffer m_neighbor_build_pos_buf;             // particle positions at the time of the last build
+    cl::Buffer m_neighbor_status_buf;                // NEIGHBORS_* flags
+    ocl::Event m_neighbor_status_event;              // pending read of the flags
+    cl_uint m_neighbor_status;                       // host copy of the flags
+    unsigned int m_max_neighbors;                    // the capacity of a single list
+    bool m_neighbor_compressed;                      // whether the lists use 16-bit relative indices
+    bool m_neighbors_valid;                          // false when the lists have to be rebuilt
+
+    // tiled brute force
+    cl::Kernel m_sph_compute_pressure_tiled_kernel;  // pressure computation with local memory tiles
+    cl::Kernel m_sph_compute_force_tiled_kernel;     // force computation with local memory tiles
+    size_t m_tile_size;                              // the number of particles in a tile (= work-group size)
+
+    // fused force computation and integration
+    cl::Kernel m_sph_compute_step_grid_kernel;       // fused step using the uniform grid
+    cl::Kernel m_sph_compute_step_tiled_kernel;      // fused step using local memory tiles
+    ocl::GLBuffer m_next_pos_buf;                    // positions after the step (swapped with m_particle_pos_buf)
+    cl::Buffer m_next_velocity_buf;                  // velocities after the step (swapped with m_velocity_buf)
+    bool m_fused_step;                               // whether to use the fused kernels
+
+    // pair symmetric evaluation
+    cl::Kernel m_sph_symmetric_clear_kernel;           // clears the density and force accumulators
+    cl::Kernel m_sph_compute_pressure_sym_kernel;      // accumulates the density kernel sums
+    cl::Kernel m_sph_compute_pressure_finalize_kernel; // computes pressure and density from the sums
+    cl::Kernel m_sph_compute_force_sym_kernel;         // accumulates the forces
+    bool m_symmetric_pairs;                            // whether to use the symmetric kernels
+
+    // adaptive time stepping
+    ocl::Reduction<cl_float> m_max_speed2;           // the maximal squared velocity
+    ocl::Reduction<cl_float> m_max_dvelocity2;       // the maximal squared change of velocity
+    cl_float m_step_limits_dt;                       // the time step of the step the maxima come from
+    bool m_adaptive_time_step;                       // whether the time step is adaptive
+    cl_float m_time_step;                            // the current time step
+    cl_float m_default_time_step;                    // the fixed time step given by simulation parameters
+    cl_float m_min_time_step;                        // the bounds of the adaptive time step
+    cl_float m_max_time_step;
+    cl_float m_cfl_factor;                           // dt <= cfl * h / max |v|
+    cl_float m_force_factor;                         // dt <= force * sqrt(h / max |a|)
+    cl_float m_smooth_radius;                        // the smoothing radius h (in simulation scale)
+
+    // diagnostics
+    ocl::Reduction<cl_float> m_speed2_sum;           // the sum of squared velocities
+    ocl::Reduction<cl_uint> m_nan_count_sum;         // the number of particles with NaN positions
+    bool m_diagnostics;                              // whether the diagnostics are computed
+    float m_kinetic_energy;                          // the total kinetic energy of the previous step
+    unsigned int m_nan_count;                        // the number of invalid particles in the previous step
+    cl_float m_particle_mass;                        // the mass of a single particle
+
+    // spatial reordering of particles
+    cl::Buffer m_sort_keys_buf;             // Morton codes of particle cells
+    cl::Buffer m_sort_values_buf;           // the permutation of particles
+    cl::Buffer m_sorted_pos_buf;            // temporary buffers for the reordered particle data
+    cl::Buffer m_sorted_velocity_buf;
+    cl::Buffer m_sorted_prev_velocity_buf;
+    unsigned int m_sort_key_bits;           // the number of significant bits in sorting keys
+    unsigned int m_sort_interval;           // how often (in steps) the particles are reordered
+    unsigned int m_steps_since_sort;        // the number of steps since the last reordering
+
+    // particle data layout
+    ParticleLayout m_next_layout;           // the layout to be used after the next reset
+    size_t m_program_stride;                // the SoA stride the program was compiled for
+
     // simulation settings
     unsigned int m_effects;
     float m_wave_start;
     int m_rx;
     int m_ry;
+
+    // snapshot streaming
+    SnapshotWriter *m_snapshot_writer;      // not owned by the fluid system
+    unsigned int m_snapshot_interval;
+    unsigned int m_step_count;              // the number of steps since the last reset
+    unsigned int m_particle_order;          // incremented whenever the particles are reordered or reset
+
+    // pair counts for the roofline report (NEIGHBOR_SEARCH_AUTO means no count)
+    cl::Kernel m_sph_grid_count_pairs_kernel;    // counts the candidates in the 27 grid cells of each particle
+    cl::Buffer m_pair_count_buf;                 // the number of candidates of each particle
+    ocl::Reduction<cl_uint> m_pair_count_sum;    // the total number of visited pairs
+    NeighborSearch m_pair_count_pending;         // the neighbour search of the pending sum
+    NeighborSearch m_pair_count_mode;            // the neighbour search m_pair_count was counted for
+    unsigned long long m_pair_count;             // the pairs visited in one step (the last sample)
 };
 
 #endif
\ No newline at end of file
@@ -0,0 +1,111 @@
+/*
+ * Copyright (C) 2014 Matus Fedorko <xfedor01@stud.fit.vutbr.cz>
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty.  In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+
+ * 1. The origin of this software must not be misrepresented; you must not
+ *    claim that you wrote the original software. If you use this software
+ *    in a product, an acknowledgment in the product documentation would be
+ *    appreciated but is not required.
+ * 2. Altered source versions must be plainly marked as such, and must not be
+ *    misrepresented as being the original software.
+ * 3. This notice may not be removed or altered from any source distribution.
+ */
+
+/**
+ * Timing of the phases of a single frame of the application
+ * (event handling, simulation update, rendering, ...)
+ */
+
+#ifndef FRAMEPROFILER_H
+#define FRAMEPROFILER_H
+
+#include "utils/utils_stats.h"
+
+
+class FrameProfiler
+{
+  public:
+    enum Phase {
+      PHASE_EVENTS,   // SDL event polling and handling
+      PHASE_UPDATE,   // the simulation step
+      PHASE_RENDER,   // rendering of the scene
+      PHASE_TEXT,     // rendering of the text and graphs
+      PHASE_SWAP,     // buffer swap (includes waiting for the GPU)
+      PHASE_COUNT
+    };
+
+    static const unsigned int DEFAULT_HISTORY = 240;   // the number of remembered frames
+
+  public:
+    explicit FrameProfiler(unsigned int history = DEFAULT_HISTORY)
+      : m_frame_start(utils::stats::ScopedTimer::tClock::now())
+      , m_frame_times(history)
+    {
+      for (unsigned int i = 0; i < PHASE_COUNT; ++i)
+      {
+        m_cur[i] = 0.0;
+        m_phase_times[i] = utils::stats::RollingSeries(history);
+      }
+    }
+
+    static const char *phaseName(Phase phase)
+    {
+      switch (phase)
+      {
+        case PHASE_EVENTS: return "events";
+        case PHASE_UPDATE: return "update";
+        case PHASE_RENDER: return "render";
+        case PHASE_TEXT:   return "text";
+        case PHASE_SWAP:   return "swap";
+        case PHASE_COUNT:  break;
+      }
+
+      return "unknown";
+    }
+
+    /**
+     * The accumulator of the given phase in the current frame,
+     * meant to be passed to utils::stats::ScopedTimer
+     */
+    double & phase(Phase phase) { return m_cur[phase]; }
+
+    /**
+     * Finishes the current frame and starts a new one,
+     * the frame time is the whole period between two calls (including the idle time)
+     */
+    void nextFrame(void)
+    {
+      utils::stats::ScopedTimer::tClock::time_point now = utils::stats::ScopedTimer::tClock::now();
+      m_frame_times.add((float) std::chrono::duration<double, std::milli>(now - m_frame_start).count());
+      m_frame_start = now;
+
+      for (unsigned int i = 0; i < PHASE_COUNT; ++i)
+      {
+        m_phase_times[i].add((float) m_cur[i]);
+        m_cur[i] = 0.0;
+      }
+    }
+
+    // the times of the last frames in milliseconds
+    const utils::stats::RollingSeries & frameTimes(void) const { return m_frame_times; }
+    const utils::stats::RollingSeries & phaseTimes(Phase phase) const { return m_phase_times[phase]; }
+
+  private:
+    FrameProfiler(const FrameProfiler & );
+    FrameProfiler & operator=(const FrameProfiler & );
+
+  private:
+    utils::stats::ScopedTimer::tClock::time_point m_frame_start;   /// the start of the current frame
+    double m_cur[PHASE_COUNT];                                       /// the phase times of the current frame
+    utils::stats::RollingSeries m_frame_times;                       /// the whole frame times
+    utils::stats::RollingSeries m_phase_times[PHASE_COUNT];          /// the times of each phase
+};
+
+#endif
@@ -0,0 +1,802 @@
+/*
+ * Copyright (C) 2014 Matus Fedorko <xfedor01@stud.fit.vutbr.cz>
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty.  In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+
+ * 1. The origin of this software must not be misrepresented; you must not
+ *    claim that you wrote the original software. If you use this software
+ *    in a product, an acknowledgment in the product documentation would be
+ *    appreciated but is not required.
+ * 2. Altered source versions must be plainly marked as such, and must not be
+ *    misrepresented as being the original software.
+ * 3. This notice may not be removed or altered from any source distribution.
+ */
+
+
+#include "HeadlessSimulation.h"
+#include "Application.h"
+#include "debug.h"
+#include "utils.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <sstream>
+
+
+
+namespace {
+
+bool parseUInt(const char *str, unsigned int *value)
+{
+  char *end = nullptr;
+  unsigned long v = strtoul(str, &end, 10);
+  if ((*str == 0) || (*end != 0)) return false;
+  *value = (unsigned int) v;
+  return true;
+}
+
+bool isEffect(const std::string & name)
+{
+  return (name == "drain") || (name == "fountain") || (name == "wave") || (name == "none");
+}
+
+bool compareStep(const HeadlessSimulation::ScheduledEffect & a, const HeadlessSimulation::ScheduledEffect & b)
+{
+  return a.step < b.step;
+}
+
+/**
+ * Prints the average size of compressed keyframes and delta frames (including their headers),
+ * keyframes of particles that are not in Morton order carry the order too, so they are larger
+ */
+void printFrameSizes(std::ostream & os, const SnapshotWriter::Stats & stats, size_t num_particles)
+{
+  unsigned int deltas = stats.frames_written - stats.keyframes_written;
+  double particles = (double) std::max<size_t>(num_particles, 1);
+
+  os << "keyframes "
+     << ((stats.keyframes_written > 0) ? 8.0 * stats.keyframe_bytes / stats.keyframes_written / particles : 0.0)
+     << " bits/particle, delta frames "
+     << ((deltas > 0) ? 8.0 * (stats.bytes_written - stats.keyframe_bytes) / deltas / particles : 0.0)
+     << " bits/particle";
+}
+
+}
+
+
+bool HeadlessSimulation::parseArgs(int argc, char **argv, Options *opts)
+{
+  for (int i = 0; i < argc; ++i)
+  {
+    const char *arg = argv[i];
+    const char *val = (i + 1 < argc) ? argv[i + 1] : nullptr;
+
+    if ((strcmp(arg, "-h") == 0) || (strcmp(arg, "--help") == 0))
+    {
+      return false;
+    }
+
+    /* all the other options take a value */
+    if (val == nullptr)
+    {
+      ERROR("HeadlessSimulation: Missing value of option " << arg);
+      return false;
+    }
+
+    ++i;
+
+    if ((strcmp(arg, "-n") == 0) || (strcmp(arg, "--particles") == 0))
+    {
+      if ((!parseUInt(val, &opts->particles)) || (opts->particles == 0))
+      {
+        ERROR("HeadlessSimulation: Invalid particle count: " << val);
+        return false;
+      }
+    }
+    else if ((strcmp(arg, "-s") == 0) || (strcmp(arg, "--steps") == 0))
+    {
+      if (!parseUInt(val, &opts->steps))
+      {
+        ERROR("HeadlessSimulation: Invalid step count: " << val);
+        return false;
+      }
+    }
+    else if ((strcmp(arg, "-e") == 0) || (strcmp(arg, "--effect") == 0))
+    {
+      /* STEP:EFFECT */
+      const char *sep = strchr(val, ':');
+      ScheduledEffect effect;
+
+      if ((sep == nullptr) ||
+          (!parseUInt(std::string(val, sep).c_str(), &effect.step)) ||
+          (!isEffect(effect.effect = sep + 1)))
+      {
+        ERROR("HeadlessSimulation: Invalid effect (expected STEP:drain|fountain|wave|none): " << val);
+        return false;
+      }
+
+      opts->effects.push_back(effect);
+    }
+    else if ((strcmp(arg, "-o") == 0) || (strcmp(arg, "--output") == 0))
+    {
+      opts->output_dir = val;
+    }
+    else if ((strcmp(arg, "-i") == 0) || (strcmp(arg, "--output-interval") == 0))
+    {
+      if (!parseUInt(val, &opts->output_interval))
+      {
+        ERROR("HeadlessSimulation: Invalid output interval: " << val);
+        return false;
+      }
+    }
+    else if ((strcmp(arg, "-d") == 0) || (strcmp(arg, "--device") == 0))
+    {
+      if (strcmp(val, "gpu") == 0) opts->device_type = CL_DEVICE_TYPE_GPU;
+      else if (strcmp(val, "cpu") == 0) opts->device_type = CL_DEVICE_TYPE_CPU;
+      else if (strcmp(val, "any") == 0) opts->device_type = CL_DEVICE_TYPE_ALL;
+      else
+      {
+        ERROR("HeadlessSimulation: Invalid device type (expected gpu|cpu|any): " << val);
+        return false;
+      }
+    }
+    else if ((strcmp(arg, "-b") == 0) || (strcmp(arg, "--backend") == 0))
+    {
+      if (strcmp(val, "opencl") == 0) opts->backend = BACKEND_OPENCL;
+      else if (strcmp(val, "cpu") == 0) opts->backend = BACKEND_CPU;
+      else if (strcmp(val, "multi") == 0) opts->backend = BACKEND_MULTI_DEVICE;
+      else
+      {
+        ERROR("HeadlessSimulation: Invalid backend (expected opencl|cpu|multi): " << val);
+        return false;
+      }
+    }
+    else if ((strcmp(arg, "-t") == 0) || (strcmp(arg, "--threads") == 0))
+    {
+      if (!parseUInt(val, &opts->threads))
+      {
+        ERROR("HeadlessSimulation: Invalid thread count: " << val);
+        return false;
+      }
+    }
+    else if ((strcmp(arg, "-m") == 0) || (strcmp(arg, "--devices") == 0))
+    {
+      if (!parseUInt(val, &opts->devices))
+      {
+        ERROR("HeadlessSimulation: Invalid device count: " << val);
+        return false;
+      }
+    }
+    else if ((strcmp(arg, "-p") == 0) || (strcmp(arg, "--snapshot-interval") == 0))
+    {
+      if (!parseUInt(val, &opts->snapshot_interval))
+      {
+        ERROR("HeadlessSimulation: Invalid snapshot interval: " << val);
+        return false;
+      }
+    }
+    else if ((strcmp(arg, "-r") == 0) || (strcmp(arg, "--snapshot-slots") == 0))
+    {
+      if ((!parseUInt(val, &opts->snapshot_slots)) || (opts->snapshot_slots == 0))
+      {
+        ERROR("HeadlessSimulation: Invalid number of snapshot staging buffers: " << val);
+        return false;
+      }
+    }
+    else if ((strcmp(arg, "-B") == 0) || (strcmp(arg, "--snapshot-benchmark") == 0))
+    {
+      if (!parseUInt(val, &opts->snapshot_benchmark))
+      {
+        ERROR("HeadlessSimulation: Invalid step count of snapshot benchmark: " << val);
+        return false;
+      }
+    }
+    else if ((strcmp(arg, "-q") == 0) || (strcmp(arg, "--snapshot-bits") == 0))
+    {
+      if ((!parseUInt(val, &opts->snapshot_bits)) ||
+          ((opts->snapshot_bits != 0) && ((opts->snapshot_bits < 8) ||
+                                          (opts->snapshot_bits > SnapshotWriter::MAX_QUANTIZATION_BITS))))
+      {
+        ERROR("HeadlessSimulation: Invalid snapshot quantization (expected 0 or 8 to "
+              << SnapshotWriter::MAX_QUANTIZATION_BITS << " bits): " << val);
+        return false;
+      }
+    }
+    else if ((strcmp(arg, "-K") == 0) || (strcmp(arg, "--keyframe-interval") == 0))
+    {
+      if ((!parseUInt(val, &opts->keyframe_interval)) || (opts->keyframe_interval == 0))
+      {
+        ERROR("HeadlessSimulation: Invalid keyframe interval: " << val);
+        return false;
+      }
+    }
+    else if ((strcmp(arg, "-c") == 0) || (strcmp(arg, "--checkpoint") == 0))
+    {
+      opts->checkpoint_in = val;
+    }
+    else if ((strcmp(arg, "-C") == 0) || (strcmp(arg, "--save-checkpoint") == 0))
+    {
+      opts->checkpoint_out = val;
+    }
+    else if ((strcmp(arg, "-T") == 0) || (strcmp(arg, "--trace") == 0))
+    {
+      /* FIRST:LAST */
+      const char *sep = strchr(val, ':');
+
+      if ((sep == nullptr) ||
+          (!parseUInt(std::string(val, sep).c_str(), &opts->trace_first)) ||
+          (!parseUInt(sep + 1, &opts->trace_last)) ||
+          (opts->trace_last < opts->trace_first))
+      {
+        ERROR("HeadlessSimulation: Invalid range of traced steps (expected FIRST:LAST): " << val);
+        return false;
+      }
+
+      opts->trace = true;
+    }
+    else if ((strcmp(arg, "-w") == 0) || (strcmp(arg, "--stats-window") == 0))
+    {
+      if (!parseUInt(val, &opts->stats_window))
+      {
+        ERROR("HeadlessSimulation: Invalid statistics window: " << val);
+        return false;
+      }
+    }
+    else if ((strcmp(arg, "-F") == 0) || (strcmp(arg, "--peak-gflops") == 0))
+    {
+      char *end = nullptr;
+      opts->peak_gflops = strtod(val, &end);
+      if ((*val == 0) || (*end != 0) || (!(opts->peak_gflops >= 0.0)))
+      {
+        ERROR("HeadlessSimulation: Invalid arithmetic peak: " << val);
+        return false;
+      }
+    }
+    else if ((strcmp(arg, "-a") == 0) || (strcmp(arg, "--assets") == 0))
+    {
+      opts->assets_dir = val;
+    }
+    else
+    {
+      ERROR("HeadlessSimulation: Unknown option " << arg);
+      return false;
+    }
+  }
+
+  /* the snapshots are read directly from the buffers of the OpenCL backend */
+  if ((opts->snapshot_interval > 0) || (opts->snapshot_benchmark > 0))
+  {
+    if (opts->output_dir.empty())
+    {
+      ERROR("HeadlessSimulation: Snapshots need an output directory (-o)");
+      return false;
+    }
+
+    if (opts->backend != BACKEND_OPENCL)
+    {
+      ERROR("HeadlessSimulation: Snapshots are supported only by the opencl backend");
+      return false;
+    }
+  }
+
+  /* the trace is written next to the other output */
+  if (opts->trace)
+  {
+    if (opts->output_dir.empty())
+    {
+      ERROR("HeadlessSimulation: Tracing needs an output directory (-o)");
+      return false;
+    }
+
+    if (opts->backend != BACKEND_OPENCL)
+    {
+      ERROR("HeadlessSimulation: Tracing is supported only by the opencl backend");
+      return false;
+    }
+  }
+
+  if (((!opts->checkpoint_in.empty()) || (!opts->checkpoint_out.empty())) &&
+      (opts->backend != BACKEND_OPENCL))
+  {
+    ERROR("HeadlessSimulation: Checkpoints are supported only by the opencl backend");
+    return false;
+  }
+
+  /* the effects are applied in the order of steps, the order of
+     the command line is kept for the effects scheduled for the same step */
+  std::stable_sort(opts->effects.begin(), opts->effects.end(), compareStep);
+
+  return true;
+}
+
+
+void HeadlessSimulation::printUsage(const char *program, std::ostream & os)
+{
+  os << "Usage: " << program << " --headless [options]\n"
+        "  -n, --particles N        the number of particles (default 2025)\n"
+        "  -s, --steps N            the number of simulation steps (default 1000)\n"
+        "  -e, --effect STEP:NAME   switch effects before the given step, NAME is one of\n"
+        "                           drain, fountain, wave or none (may be repeated)\n"
+        "  -o, --output DIR         write particle positions to DIR/positions_STEP.csv\n"
+        "  -i, --output-interval N  write positions every N steps (default 0, the final state only)\n"
+        "  -d, --device TYPE        preferred OpenCL device: gpu, cpu or any (default gpu)\n"
+        "  -b, --backend NAME       simulation backend: opencl, cpu or multi (all OpenCL devices,\n"
+        "                           the volume is split into slabs) (default opencl)\n"
+        "  -t, --threads N          the number of threads of the cpu backend (default 0, all cores)\n"
+        "  -m, --devices N          the number of devices of the multi backend (default 0, all devices)\n"
+        "  -p, --snapshot-interval N  stream positions, velocities and densities to\n"
+        "                           DIR/snapshots.bin every N steps (default 0, disabled)\n"
+        "  -r, --snapshot-slots N   the number of pinned staging buffers for snapshots (default 3)\n"
+        "  -B, --snapshot-benchmark N  measure the cost of snapshots at various intervals,\n"
+        "                           N steps each, instead of running the simulation\n"
+        "  -q, --snapshot-bits N    write compressed snapshots with positions only, quantized\n"
+        "                           to N bits per axis, e.g. 16 or 21 (default 0, raw snapshots)\n"
+        "  -K, --keyframe-interval N  the maximal distance of keyframes of compressed snapshots\n"
+        "                           (default 16)\n"
+        "  -c, --checkpoint FILE    resume from a checkpoint (its particle count, layout and\n"
+        "                           parameters override the other options)\n"
+        "  -C, --save-checkpoint FILE  save the final state of the simulation to a checkpoint\n"
+        "  -T, --trace FIRST:LAST   write the timeline of OpenCL commands in the given steps\n"
+        "                           to DIR/trace.json (Chrome trace, see chrome://tracing)\n"
+        "  -w, --stats-window N     the kernel time percentiles printed at exit cover only\n"
+        "                           the last N seconds (default 0, the whole run)\n"
+        "  -F, --peak-gflops N      the arithmetic peak of the device in the roofline report\n"
+        "                           (default 0, estimated from the device type)\n"
+        "  -a, --assets DIR         the directory with OpenCL sources (default .)" << std::endl;
+}
+
+
+template <typename T>
+void HeadlessSimulation::applyEffects(T & system, unsigned int step)
+{
+  for (const ScheduledEffect & e : m_opts.effects)
+  {
+    if (e.step != step) continue;
+
+    if (e.effect == "drain") system.activateDrain();
+    else if (e.effect == "fountain") system.activateFountain();
+    else if (e.effect == "wave") system.emitWave();
+    else
+    {
+      system.deactivateDrain();
+      system.deactivateFountain();
+    }
+
+    INFO("HeadlessSimulation: Step " << step << ": " << e.effect);
+  }
+}
+
+
+bool HeadlessSimulation::writePositions(ParticleSystem & system, unsigned int step)
+{
+  if (!system.readPositions(m_positions))
+  {
+    return false;
+  }
+
+  std::ostringstream file_name;
+  file_name << m_opts.output_dir << "/positions_" << std::setw(6) << std::setfill('0') << step << ".csv";
+
+  std::ofstream stream(file_name.str().c_str());
+  if (!stream)
+  {
+    ERROR("HeadlessSimulation: Failed to create file " << file_name.str());
+    return false;
+  }
+
+  /* the positions are read in the layout of the simulation */
+  size_t n = system.numParticles();
+  ParticleSystem::ParticleLayout layout = system.particleLayout();
+
+  stream << "x,y,z\n";
+
+  for (size_t i = 0; i < n; ++i)
+  {
+    if (layout == ParticleSystem::LAYOUT_SOA)
+    {
+      stream << m_positions[i] << ',' << m_positions[n + i] << ',' << m_positions[2 * n + i] << '\n';
+    }
+    else
+    {
+      const float *p = &m_positions[(layout == ParticleSystem::LAYOUT_AOS) ? (i * 4) : (i * 3)];
+      stream << p[0] << ',' << p[1] << ',' << p[2] << '\n';
+    }
+  }
+
+  return !stream.fail();
+}
+
+
+int HeadlessSimulation::run(std::ostream & os)
+{
+  Application::instance().setAssetsRootDir(m_opts.assets_dir.c_str());
+
+  if ((!m_opts.output_dir.empty()) && (!utils::fs::makeDirectory(m_opts.output_dir.c_str())))
+  {
+    ERROR("HeadlessSimulation: Failed to create output directory " << m_opts.output_dir);
+    return 1;
+  }
+
+  /* no OpenGL context and no window, the particle data stays in plain device buffers */
+  ocl::setHeadless(true);
+  ocl::setPeakGFlops(m_opts.peak_gflops);
+  ParticleSystem::setPreferredDeviceType(m_opts.device_type);
+
+  if (m_opts.backend == BACKEND_MULTI_DEVICE)
+  {
+    MultiDeviceFluidSystem system(m_opts.devices);
+    int ret = simulate(system, os);
+    system.printSlabs(os);
+    return ret;
+  }
+
+  if (m_opts.backend == BACKEND_CPU)
+  {
+    CpuFluidSystem system(m_opts.threads);
+    os << "CPU backend: " << system.numThreads() << " threads, " << CpuFluidSystem::simdName() << std::endl;
+    return simulate(system, os);
+  }
+
+  FluidSystem system;
+
+  if (m_opts.snapshot_benchmark > 0)
+  {
+    return benchmarkSnapshots(system, os);
+  }
+
+  SnapshotWriter writer(m_opts.snapshot_slots);
+
+  if (m_opts.snapshot_interval > 0)
+  {
+    writer.setCompression(m_opts.snapshot_bits, m_opts.keyframe_interval);
+    if (!writer.open(m_opts.output_dir + "/snapshots.bin"))
+    {
+      return 1;
+    }
+
+    system.setSnapshotWriter(&writer, m_opts.snapshot_interval);
+  }
+
+  ocl::TraceRecorder & trace = system.perfStats().trace();
+  if ((m_opts.trace) &&
+      (!trace.requestDump(system.commandQueue()(), m_opts.trace_first, m_opts.trace_last,
+                          m_opts.output_dir + "/trace.json")))
+  {
+    return 1;
+  }
+
+  int ret = simulate(system, os);
+
+  // the run may end before the trace is complete
+  if (trace.dumpPending())
+  {
+    trace.finishDump();
+  }
+
+  if ((ret == 0) && (!m_opts.checkpoint_out.empty()) && (!system.saveCheckpoint(m_opts.checkpoint_out.c_str())))
+  {
+    ret = 1;
+  }
+
+  if (writer.isOpen())
+  {
+    writer.close();
+    system.setSnapshotWriter(nullptr);
+
+    SnapshotWriter::Stats stats = writer.stats();
+    os << "Snapshots: " << stats.frames_written << " frames (" << (stats.bytes_written / 1.0e6) << " MB) written to "
+       << writer.fileName() << ", " << stats.frames_dropped << " dropped" << std::endl;
+
+    if (writer.compressionBits() > 0)
+    {
+      os << "  " << writer.compressionBits() << " bits per axis, " << stats.keyframes_written << " keyframes, "
+         << "compression ratio " << ((stats.bytes_written > 0) ? (double) stats.raw_bytes / stats.bytes_written : 0.0)
+         << " against raw float32 positions (";
+      printFrameSizes(os, stats, system.numParticles());
+      os << "), encoding "
+         << ((stats.encode_seconds > 0.0) ? stats.raw_bytes / stats.encode_seconds / 1.0e6 : 0.0)
+         << " MB/s of raw positions" << std::endl;
+    }
+  }
+
+  return ret;
+}
+
+
+template <typename T>
+bool HeadlessSimulation::prepare(T & system)
+{
+  return system.reset(m_opts.particles);
+}
+
+
+bool HeadlessSimulation::prepare(FluidSystem & system)
+{
+  if (m_opts.checkpoint_in.empty())
+  {
+    return system.reset(m_opts.particles);
+  }
+
+  return system.loadCheckpoint(m_opts.checkpoint_in.c_str());
+}
+
+
+int HeadlessSimulation::benchmarkSnapshots(FluidSystem & system, std::ostream & os)
+{
+  if (!prepare(system))
+  {
+    ERROR("HeadlessSimulation: Failed to prepare fluid simulator");
+    return 1;
+  }
+
+  cl_command_queue queue = system.commandQueue()();
+  std::string file_name = m_opts.output_dir + "/snapshot_benchmark.bin";
+  unsigned int steps = m_opts.snapshot_benchmark;
+  unsigned int bits = m_opts.snapshot_bits;
+
+  // the last interval has to be 1, it is compared with raw frames
+  static const unsigned int intervals[] = { 100, 50, 20, 10, 5, 2, 1 };
+
+  /* warm up (program builds, first touch of buffers) */
+  for (unsigned int i = 0; i < 10; ++i)
+  {
+    system.update();
+  }
+
+  clFinish(queue);
+
+  os << "Snapshot streaming: " << system.numParticles() << " particles, " << steps << " steps per measurement, "
+     << m_opts.snapshot_slots << " staging buffers, ";
+  if (bits > 0) os << bits << "-bit compressed positions" << std::endl;
+  else os << "raw frames" << std::endl;
+
+  // the simulation alone
+  double base_seconds = measureSnapshots(system, 0, 0, file_name, nullptr);
+  if (base_seconds < 0.0)
+  {
+    return 1;
+  }
+
+  double base_ms = base_seconds * 1000.0 / steps;
+  os << "  no snapshots      : " << base_ms << " ms/step" << std::endl;
+
+  unsigned int best_interval = 0;
+  double best_rate = 0.0;
+  double best_bandwidth = 0.0;
+  SnapshotWriter::Stats stats;
+  double ms = 0.0;
+
+  for (unsigned int k = 0; k < FLUIDSIM_COUNT(intervals); ++k)
+  {
+    unsigned int interval = intervals[k];
+
+    double seconds = measureSnapshots(system, interval, bits, file_name, &stats);
+    if (seconds < 0.0)
+    {
+      return 1;
+    }
+
+    ms = seconds * 1000.0 / steps;
+    double overhead = (base_ms > 0.0) ? (ms / base_ms - 1.0) * 100.0 : 0.0;
+    double rate = stats.frames_written / seconds;
+    double bandwidth = stats.bytes_written / seconds / 1.0e6;
+
+    os << "  every " << std::setw(3) << interval << " steps : " << ms << " ms/step, "
+       << rate << " frames/s, " << bandwidth << " MB/s, overhead " << overhead << " %, "
+       << stats.frames_dropped << " dropped";
+    if ((bits > 0) && (stats.bytes_written > 0))
+    {
+      os << ", ratio " << ((double) stats.raw_bytes / stats.bytes_written);
+    }
+    os << std::endl;
+
+    if ((overhead < MAX_SNAPSHOT_OVERHEAD) && (stats.frames_dropped == 0))
+    {
+      best_interval = interval;
+      best_rate = rate;
+      best_bandwidth = bandwidth;
+    }
+  }
+
+  /* the round trip of compressed frames, this run is not timed */
+  if ((bits > 0) && (!verifySnapshots(system, file_name, os)))
+  {
+    std::remove(file_name.c_str());
+    return 1;
+  }
+
+  /* compare the compressed frames of every step with raw dumps */
+  if ((bits > 0) && (stats.frames_written > 0))
+  {
+    SnapshotWriter::Stats raw_stats;
+    double raw_seconds = measureSnapshots(system, 1, 0, file_name, &raw_stats);
+    if (raw_seconds < 0.0)
+    {
+      return 1;
+    }
+
+    double raw_ms = raw_seconds * 1000.0 / steps;
+    unsigned int raw_frames = std::max(raw_stats.frames_written, 1u);
+
+    os << "Every step, raw frames        : " << raw_ms << " ms/step, "
+       << (raw_stats.bytes_written / raw_frames) << " bytes/frame, "
+       << ((raw_stats.write_seconds > 0.0) ? raw_stats.bytes_written / raw_stats.write_seconds / 1.0e6 : 0.0)
+       << " MB/s converted and written" << std::endl;
+    os << "Every step, compressed frames : " << ms << " ms/step, "
+       << (stats.bytes_written / stats.frames_written) << " bytes/frame ("
+       << ((double) raw_stats.bytes_written / raw_frames) / ((double) stats.bytes_written / stats.frames_written)
+       << "x smaller, " << ((double) stats.raw_bytes / stats.bytes_written) << "x against positions only), "
+       << ((stats.encode_seconds > 0.0) ? stats.raw_bytes / stats.encode_seconds / 1.0e6 : 0.0)
+       << " MB/s of positions sorted and entropy coded, " << stats.keyframes_written << " keyframes" << std::endl;
+    os << "  ";
+    printFrameSizes(os, stats, system.numParticles());
+    os << std::endl;
+  }
+
+  std::remove(file_name.c_str());
+
+  if (best_interval > 0)
+  {
+    os << "Highest dump rate under " << MAX_SNAPSHOT_OVERHEAD << " % overhead: every " << best_interval
+       << " steps (" << best_rate << " frames/s, " << best_bandwidth << " MB/s)" << std::endl;
+  }
+  else
+  {
+    os << "No tested dump rate stays under " << MAX_SNAPSHOT_OVERHEAD << " % overhead" << std::endl;
+  }
+
+  return 0;
+}
+
+
+double HeadlessSimulation::measureSnapshots(FluidSystem & system, unsigned int interval, unsigned int bits,
+                                            const std::string & file_name, SnapshotWriter::Stats *stats,
+                                            bool verify)
+{
+  typedef std::chrono::high_resolution_clock Clock;
+
+  cl_command_queue queue = system.commandQueue()();
+  SnapshotWriter writer(m_opts.snapshot_slots);
+
+  if (interval > 0)
+  {
+    writer.setCompression(bits, m_opts.keyframe_interval);
+    writer.setVerification(verify);
+    if (!writer.open(file_name))
+    {
+      return -1.0;
+    }
+
+    system.setSnapshotWriter(&writer, interval);
+  }
+
+  Clock::time_point start = Clock::now();
+
+  for (unsigned int i = 0; i < m_opts.snapshot_benchmark; ++i)
+  {
+    system.update();
+  }
+
+  // the frames still in flight are part of the cost
+  clFinish(queue);
+  writer.close();
+
+  double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+  system.setSnapshotWriter(nullptr);
+
+  if (stats != nullptr) *stats = writer.stats();
+
+  return seconds;
+}
+
+
+bool HeadlessSimulation::verifySnapshots(FluidSystem & system, const std::string & file_name, std::ostream & os)
+{
+  SnapshotWriter::Stats stats;
+  if (measureSnapshots(system, 1, m_opts.snapshot_bits, file_name, &stats, true) < 0.0)
+  {
+    return false;
+  }
+
+  /* the file is decoded independently of the writer */
+  SnapshotReader reader;
+  SnapshotReader::Frame frame;
+  unsigned int frames_read = 0;
+  unsigned int keyframes_read = 0;
+
+  if (!reader.open(file_name))
+  {
+    return false;
+  }
+
+  while (reader.readFrame(frame))
+  {
+    ++frames_read;
+    if (frame.keyframe) ++keyframes_read;
+  }
+
+  os << "Round trip of compressed frames: " << stats.frames_verified << " frames verified, "
+     << stats.frames_mismatched << " mismatched, " << frames_read << " frames ("
+     << keyframes_read << " keyframes) read back" << std::endl;
+
+  if ((!reader.atEnd()) || (stats.frames_mismatched > 0) ||
+      (stats.frames_verified != stats.frames_written) || (frames_read != stats.frames_written))
+  {
+    ERROR("HeadlessSimulation: Compressed snapshots do not decode to the quantized positions");
+    return false;
+  }
+
+  return true;
+}
+
+
+template <typename T>
+int HeadlessSimulation::simulate(T & system, std::ostream & os)
+{
+  if (!prepare(system))
+  {
+    ERROR("HeadlessSimulation: Failed to prepare fluid simulator");
+    return 1;
+  }
+
+  /* the CPU backend has no command queue and its steps are synchronous */
+  cl_command_queue queue = system.commandQueue()();
+  if (queue != nullptr) clFinish(queue);
+
+  // the statistics are printed when the system is destroyed
+  system.perfStats().setWindow(m_opts.stats_window);
+
+  /* the time spent writing the output is not counted as simulation time */
+  typedef std::chrono::high_resolution_clock Clock;
+
+  Clock::duration sim_time = Clock::duration::zero();
+  Clock::time_point start = Clock::now();
+
+  for (unsigned int step = 0; step < m_opts.steps; ++step)
+  {
+    applyEffects(system, step);
+
+    system.update();
+
+    bool last = (step + 1 == m_opts.steps);
+    if ((!m_opts.output_dir.empty()) &&
+        (last || ((m_opts.output_interval > 0) && ((step + 1) % m_opts.output_interval == 0))))
+    {
+      if (queue != nullptr) clFinish(queue);
+      Clock::time_point write_start = Clock::now();
+      sim_time += write_start - start;
+
+      if (!writePositions(system, step + 1))
+      {
+        ERROR("HeadlessSimulation: Failed to write positions after step " << (step + 1));
+        return 1;
+      }
+
+      start = Clock::now();
+    }
+  }
+
+  if (queue != nullptr) clFinish(queue);
+  sim_time += Clock::now() - start;
+
+  double seconds = std::chrono::duration<double>(sim_time).count();
+  double steps_per_second = (seconds > 0.0) ? (m_opts.steps / seconds) : 0.0;
+
+  os << "Headless simulation: " << system.numParticles() << " particles, "
+     << m_opts.steps << " steps in " << seconds << " s" << std::endl;
+  os << "  steps per second          : " << steps_per_second << std::endl;
+  os << "  particle steps per second : " << (steps_per_second * system.numParticles()) << std::endl;
+
+  return 0;
+}
@@ -0,0 +1,153 @@
+/*
+ * Copyright (C) 2014 Matus Fedorko <xfedor01@stud.fit.vutbr.cz>
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty.  In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+
+ * 1. The origin of this software must not be misrepresented; you must not
+ *    claim that you wrote the original software. If you use this software
+ *    in a product, an acknowledgment in the product documentation would be
+ *    appreciated but is not required.
+ * 2. Altered source versions must be plainly marked as such, and must not be
+ *    misrepresented as being the original software.
+ * 3. This notice may not be removed or altered from any source distribution.
+ */
+
+
+/**
+ * Batch simulation without any window or OpenGL context
+ */
+
+#ifndef HEADLESSSIMULATION_H
+#define HEADLESSSIMULATION_H
+
+#include "FluidSystem.h"
+#include "CpuFluidSystem.h"
+#include "MultiDeviceFluidSystem.h"
+
+#include <ostream>
+#include <string>
+#include <vector>
+
+
+class HeadlessSimulation
+{
+  public:
+    enum Backend {
+      BACKEND_OPENCL,         // FluidSystem on a single OpenCL device
+      BACKEND_CPU,            // CpuFluidSystem
+      BACKEND_MULTI_DEVICE    // MultiDeviceFluidSystem on all OpenCL devices
+    };
+
+    // a change of fluid effects scheduled before the given step
+    struct ScheduledEffect {
+      unsigned int step;
+      std::string effect;   // drain, fountain, wave or none
+    };
+
+    struct Options {
+      unsigned int particles;        // the number of simulated particles
+      unsigned int steps;            // the number of simulation steps
+      std::vector<ScheduledEffect> effects;
+      std::string output_dir;        // where the particle positions are written (nothing is written when empty)
+      unsigned int output_interval;  // write positions every N steps (0 writes only the final state)
+      cl_device_type device_type;    // the preferred type of OpenCL device
+      Backend backend;
+      unsigned int threads;          // the number of threads of the CPU backend (0 uses all cores)
+      unsigned int devices;          // the number of devices of the multi-device backend (0 uses all devices)
+      unsigned int snapshot_interval;   // stream snapshots to the output directory every N steps (0 disables it)
+      unsigned int snapshot_slots;      // the number of staging buffers of the snapshot writer
+      unsigned int snapshot_benchmark;  // the number of steps per measurement of the snapshot benchmark (0 disables it)
+      unsigned int snapshot_bits;       // bits per axis of compressed snapshot positions (0 writes raw snapshots)
+      unsigned int keyframe_interval;   // the maximal distance of keyframes in compressed snapshots
+      std::string checkpoint_in;        // the simulation resumes from this checkpoint instead of a reset
+      std::string checkpoint_out;       // the final state is saved to this checkpoint
+      unsigned int stats_window;        // report kernel times of the last N seconds only (0 - the whole run)
+      double peak_gflops;               // the arithmetic peak of the device for the roofline report (0 - estimated)
+      bool trace;                       // whether to write a timeline of OpenCL commands to the output directory
+      unsigned int trace_first;         // the range of traced steps
+      unsigned int trace_last;
+      std::string assets_dir;
+
+      Options(void)
+        : particles(2025)
+        , steps(1000)
+        , effects()
+        , output_dir()
+        , output_interval(0)
+        , device_type(CL_DEVICE_TYPE_GPU)
+        , backend(BACKEND_OPENCL)
+        , threads(0)
+        , devices(0)
+        , snapshot_interval(0)
+        , snapshot_slots(SnapshotWriter::DEFAULT_SLOTS)
+        , snapshot_benchmark(0)
+        , snapshot_bits(0)
+        , keyframe_interval(SnapshotWriter::DEFAULT_KEYFRAME_INTERVAL)
+        , checkpoint_in()
+        , checkpoint_out()
+        , stats_window(0)
+        , peak_gflops(0.0)
+        , trace(false)
+        , trace_first(0)
+        , trace_last(0)
+        , assets_dir(".")
+      {
+      }
+    };
+
+  public:
+    explicit HeadlessSimulation(const Options & opts) : m_opts(opts) { }
+
+    // parses the command line arguments following the --headless switch
+    // @return false if the arguments are invalid (the usage should be printed)
+    static bool parseArgs(int argc, char **argv, Options *opts);
+    static void printUsage(const char *program, std::ostream & os);
+
+    // runs the simulation and reports its speed to the given stream
+    // @return the exit status of the program
+    int run(std::ostream & os);
+
+  private:
+    // resets the simulation to its initial state (the OpenCL backend may resume from a checkpoint)
+    template <typename T>
+    bool prepare(T & system);
+    bool prepare(FluidSystem & system);
+
+    // runs the simulation loop with either of the fluid backends
+    template <typename T>
+    int simulate(T & system, std::ostream & os);
+
+    // measures the cost of snapshot streaming at various intervals and reports
+    // the highest dump rate that slows the simulation down by less than MAX_SNAPSHOT_OVERHEAD
+    int benchmarkSnapshots(FluidSystem & system, std::ostream & os);
+    // runs the benchmark steps with snapshots every interval steps (0 disables them),
+    // verify decodes the compressed frames again (see SnapshotWriter::setVerification)
+    // @return the duration in seconds or a negative number on error
+    double measureSnapshots(FluidSystem & system, unsigned int interval, unsigned int bits,
+                            const std::string & file_name, SnapshotWriter::Stats *stats,
+                            bool verify = false);
+    // writes compressed frames of every step with verification and reads the file back
+    bool verifySnapshots(FluidSystem & system, const std::string & file_name, std::ostream & os);
+
+    // applies all the effects scheduled before the given step
+    template <typename T>
+    void applyEffects(T & system, unsigned int step);
+
+    // writes the current particle positions as x,y,z lines to a file in the output directory
+    bool writePositions(ParticleSystem & system, unsigned int step);
+
+  private:
+    static const unsigned int MAX_SNAPSHOT_OVERHEAD = 5;   // in percent of the simulation time
+
+  private:
+    Options m_opts;
+    std::vector<float> m_positions;
+};
+
+#endif
@@ -19,9 +19,51 @@
  */
 
 #include "MainWindow.h"
+#include "Application.h"
 
 #include <glm/glm.hpp>
 #include <glm/gtc/matrix_transform.hpp>
+#include <algorithm>
+#include <sstream>
+
+
+
+namespace {
+
+// the checkpoint of the fluid simulation (relative to the working directory)
+const char *CHECKPOINT_FILE = "fluid.checkpoint";
+
+// the timeline of OpenCL commands (relative to the working directory)
+const char *TRACE_FILE = "fluid_trace.json";
+const unsigned int TRACE_FRAMES = 60;
+
+const char *neighborSearchToStr(FluidSystem::NeighborSearch ns)
+{
+  switch (ns)
+  {
+    case FluidSystem::NEIGHBOR_SEARCH_BRUTE_FORCE: return "brute force";
+    case FluidSystem::NEIGHBOR_SEARCH_GRID:        return "uniform grid";
+    case FluidSystem::NEIGHBOR_SEARCH_VERLET:      return "Verlet lists";
+    case FluidSystem::NEIGHBOR_SEARCH_TILED:       return "tiled brute force";
+    case FluidSystem::NEIGHBOR_SEARCH_AUTO:        return "automatic";
+  }
+
+  return "unknown";
+}
+
+const char *particleLayoutToStr(ParticleSystem::ParticleLayout layout)
+{
+  switch (layout)
+  {
+    case ParticleSystem::LAYOUT_AOS:    return "float4 (AoS)";
+    case ParticleSystem::LAYOUT_PACKED: return "packed float3";
+    case ParticleSystem::LAYOUT_SOA:    return "SoA";
+  }
+
+  return "unknown";
+}
+
+}
 
 
 
@@ -33,11 +75,44 @@ int MainWindow::displayInfo(int height)
   if (m_cur_ps == m_fluid_system.get())
   {
     m_text_renderer.render(10, height, "Fluid System simulator");
+    height += 30;
+    std::string ns_str("Neighbour search: ");
+    ns_str += neighborSearchToStr(m_fluid_system->neighborSearch());
+    if (m_fluid_system->neighborSearch() == FluidSystem::NEIGHBOR_SEARCH_AUTO)
+    {
+      ns_str += std::string(" (") + neighborSearchToStr(m_fluid_system->activeNeighborSearch()) + ")";
+    }
+    m_text_renderer.render(10, height, ns_str.c_str());
+    height += 30;
+    std::ostringstream dt_str;
+    dt_str << "Time step: " << (m_fluid_system->timeStep() * 1000.0f) << " ms"
+           << (m_fluid_system->adaptiveTimeStep() ? " (adaptive)" : " (fixed)");
+    m_text_renderer.render(10, height, dt_str.str().c_str());
+    height += 30;
+    std::string layout_str("Particle layout: ");
+    layout_str += particleLayoutToStr(m_fluid_system->particleLayout());
+    m_text_renderer.render(10, height, layout_str.c_str());
+    if (m_fluid_system->diagnostics())
+    {
+      height += 30;
+      std::ostringstream diag_str;
+      diag_str << "Kinetic energy: " << m_fluid_system->kineticEnergy();
+      if (m_fluid_system->nanCount() > 0) diag_str << " (" << m_fluid_system->nanCount() << " invalid particles)";
+      m_text_renderer.render(10, height, diag_str.str().c_str());
+    }
   }
   else if (m_cur_ps == m_test_system.get())
   {
     m_text_renderer.render(10, height, "Test System simulator");
   }
+  else if (m_cur_ps == m_cpu_system.get())
+  {
+    m_text_renderer.render(10, height, "CPU Fluid System simulator");
+    height += 30;
+    std::ostringstream cpu_str;
+    cpu_str << "Threads: " << m_cpu_system->numThreads() << " (" << CpuFluidSystem::simdName() << ")";
+    m_text_renderer.render(10, height, cpu_str.str().c_str());
+  }
   else
   {
     m_text_renderer.render(10, height, "Unknown simulator");
@@ -55,6 +130,22 @@ int MainWindow::displayHelp(int height)
     "Press D to toggle drain effect On/Off",
     "Press F to toggle fountain effect On/Off",
     "Press W to emit wave",
+    "Press G to switch neighbour search (brute force/grid/Verlet lists/tiled/auto)",
+    "Press U to toggle fused force and integration kernel",
+    "Press P to toggle symmetric pair evaluation",
+    "Press N to benchmark symmetric pair evaluation",
+    "Press T to toggle adaptive time step",
+    "Press L to switch particle data layout (float4/packed float3/SoA) and restart",
+    "Press V to toggle high viscosity",
+    "Press K to toggle work-group size tuning",
+    "Press O to toggle pipelined OpenCL/OpenGL interoperability",
+    "Press M to benchmark pipelined OpenCL/OpenGL interoperability",
+    "Press X to toggle running the fluid simulation in a separate thread",
+    "Press C to benchmark the scaling of the CPU fluid simulator across cores",
+    "Press F5 to save a checkpoint of the fluid simulation, F9 to load it",
+    "Press J to save a Chrome trace of OpenCL commands in the next 60 frames",
+    "Press F3 to toggle On/Off the graphs of frame and kernel times",
+    "Press Ctrl+S to switch simulator (fluid/test/CPU fluid)",
     "Press H to toggle On/Off this help message",
     "Press I to toggle On/Off status information display",
     "Press B to show/hide bounding volume box",
@@ -97,16 +188,47 @@ void MainWindow::onRedraw(void)
 
   glm::mat4 proj = glm::perspective(45.0f, float(m_wnd_w) / float(m_wnd_h), 0.1f, 1000.0f);
 
-  /* update the fluid system */
-  m_cur_ps->update();
+  FrameProfiler & profiler = Application::instance().profiler();
+
+  /* update the fluid system, unless it is updated by the simulation thread */
+  if (m_sim_thread->running())
+  {
+    utils::stats::ScopedTimer timer(profiler.phase(FrameProfiler::PHASE_RENDER));
+    m_sim_thread->render(mv, proj);
+  }
+  else
+  {
+    {
+      utils::stats::ScopedTimer timer(profiler.phase(FrameProfiler::PHASE_UPDATE));
+      m_cur_ps->update();
+    }
+
+    utils::stats::ScopedTimer timer(profiler.phase(FrameProfiler::PHASE_RENDER));
+    m_cur_ps->render(mv, proj);
+  }
 
-  m_cur_ps->render(mv, proj);
+  // the kernel times are sampled even when hidden, so the graphs are complete once shown
+  m_perf_hud.update(&m_cur_ps->perfStats());
 
   /* display messages */
+  utils::stats::ScopedTimer timer(profiler.phase(FrameProfiler::PHASE_TEXT));
+
   m_text_renderer.renderSmall(10, 10, "Press 'H' to display help");
   m_text_renderer.renderSmall(10, 40, "Press 'I' to display status information");
 
-  displayInfo(displayHelp(110));
+  {
+    // the status information is read from the fluid system
+    std::unique_lock<std::mutex> lock;
+    if (m_sim_thread->running()) lock = m_sim_thread->lock();
+
+    displayInfo(displayHelp(110));
+  }
+
+  if (m_display_perf)
+  {
+    // the graphs are placed to the top right corner, their legend is on the right side
+    m_perf_hud.render(std::max(10, m_wnd_w - PerfHud::GRAPH_WIDTH - 260), 10, profiler);
+  }
 
   return;
 }
@@ -121,8 +243,36 @@ void MainWindow::onResize(int32_t width, int32_t height)
 }
 
 
+void MainWindow::toggleSimulationThread(void)
+{
+  if (m_sim_thread->running())
+  {
+    m_sim_thread->stop();
+    std::cerr << "Simulation thread: off" << std::endl;
+  }
+  else if (m_cur_ps != m_fluid_system.get())
+  {
+    std::cerr << "MainWindow: Only the fluid simulator can run in a separate thread" << std::endl;
+  }
+  else
+  {
+    std::cerr << "Simulation thread: " << (m_sim_thread->start() ? "on" : "off") << std::endl;
+  }
+}
+
+
 void MainWindow::onKeyDown(SDL_Keycode key, uint16_t mod)
 {
+  if (key == SDLK_x)
+  {
+    toggleSimulationThread();
+    return;
+  }
+
+  /* the fluid system must not be changed in the middle of a simulation step */
+  std::unique_lock<std::mutex> lock;
+  if (m_sim_thread->running()) lock = m_sim_thread->lock();
+
   switch (key)
   {
     // TODO: fix this with numeric keypad
@@ -135,9 +285,92 @@ void MainWindow::onKeyDown(SDL_Keycode key, uint16_t mod)
     
     case SDLK_5: m_x_angle = 0.0f; m_y_angle = 0.0f; m_z_angle = 0.0f; break;
 
-    case SDLK_d:     m_fluid_system->toggleDrain();    break;
-    case SDLK_f:     m_fluid_system->toggleFountain(); break;
-    case SDLK_w:     m_fluid_system->emitWave();       break;
+    case SDLK_d:
+      if (m_cur_ps == m_cpu_system.get()) m_cpu_system->toggleDrain();
+      else m_fluid_system->toggleDrain();
+      break;
+    case SDLK_f:
+      if (m_cur_ps == m_cpu_system.get()) m_cpu_system->toggleFountain();
+      else m_fluid_system->toggleFountain();
+      break;
+    case SDLK_w:
+      if (m_cur_ps == m_cpu_system.get()) m_cpu_system->emitWave();
+      else m_fluid_system->emitWave();
+      break;
+    case SDLK_c:
+      if (m_cur_ps == m_cpu_system.get()) m_cpu_system->benchmarkScaling(100, std::cerr);
+      else std::cerr << "MainWindow: Switch to the CPU fluid simulator (Ctrl+S) to benchmark it" << std::endl;
+      break;
+    case SDLK_g:
+      std::cerr << "Neighbour search: " << neighborSearchToStr(m_fluid_system->nextNeighborSearch()) << std::endl;
+      break;
+    case SDLK_u:
+      std::cerr << "Fused step: " << (m_fluid_system->toggleFusedStep() ? "on" : "off") << std::endl;
+      break;
+    case SDLK_p:
+      std::cerr << "Symmetric pairs: " << (m_fluid_system->toggleSymmetricPairs() ? "on" : "off") << std::endl;
+      break;
+    case SDLK_n:
+      m_fluid_system->benchmarkSymmetricPairs(200, std::cerr);
+      break;
+    case SDLK_t:
+      std::cerr << "Adaptive time step: " << (m_fluid_system->toggleAdaptiveTimeStep() ? "on" : "off") << std::endl;
+      break;
+    case SDLK_l:
+      m_fluid_system->setParticleLayout((ParticleSystem::ParticleLayout)
+                                        ((m_fluid_system->nextParticleLayout() + 1) % (ParticleSystem::LAYOUT_SOA + 1)));
+      std::cerr << "Particle layout: " << particleLayoutToStr(m_fluid_system->nextParticleLayout()) << std::endl;
+      if ((m_cur_ps == m_fluid_system.get()) && (!m_fluid_system->reset(PARTICLE_COUNT)))
+      {
+        std::cerr << "MainWindow: failed to reset fluid simulator" << std::endl;
+      }
+      break;
+    case SDLK_v:
+      {
+        // switches between the default and a thick fluid, both variants of kernels stay cached
+        FluidSystem::Params params(m_fluid_system->params());
+        float default_viscosity = FluidSystem::Params().viscosity;
+        params.viscosity = (params.viscosity == default_viscosity) ? 5.0f * default_viscosity : default_viscosity;
+        if (!m_fluid_system->setParams(params))
+        {
+          std::cerr << "MainWindow: failed to change fluid viscosity" << std::endl;
+        }
+        std::cerr << "Viscosity: " << m_fluid_system->params().viscosity
+                  << " (" << m_fluid_system->programVariants() << " program variants compiled)" << std::endl;
+      }
+      break;
+    case SDLK_k:
+      std::cerr << "Work-group size tuning: " << (m_cur_ps->toggleWorkGroupTuning() ? "on" : "off") << std::endl;
+      break;
+    case SDLK_o:
+      std::cerr << "Pipelined interoperability: " << (m_cur_ps->togglePipelinedInterop() ? "on" : "off") << std::endl;
+      break;
+    case SDLK_m:
+      m_cur_ps->benchmarkInterop(200, std::cerr);
+      break;
+    case SDLK_j:
+      {
+        ocl::TraceRecorder & trace = m_fluid_system->perfStats().trace();
+        unsigned int first = trace.frames();
+        if (trace.requestDump(m_fluid_system->commandQueue()(), first, first + TRACE_FRAMES - 1, TRACE_FILE))
+        {
+          std::cerr << "Tracing frames " << first << " - " << (first + TRACE_FRAMES - 1)
+                    << " to " << TRACE_FILE << std::endl;
+        }
+      }
+      break;
+    case SDLK_F3:
+      m_display_perf = !m_display_perf;
+      break;
+    case SDLK_F5:
+      m_fluid_system->saveCheckpoint(CHECKPOINT_FILE);
+      break;
+    case SDLK_F9:
+      if (m_fluid_system->loadCheckpoint(CHECKPOINT_FILE))
+      {
+        m_cur_ps = m_fluid_system.get();
+      }
+      break;
     case SDLK_s:     m_test_system->toggleSpiral();    break;
     case SDLK_h:     m_display_help = !m_display_help; break;
     case SDLK_i:     m_display_info = !m_display_info; break;
@@ -148,7 +381,7 @@ void MainWindow::onKeyDown(SDL_Keycode key, uint16_t mod)
       break;
 
     case SDLK_r:
-      if (!m_cur_ps->reset(2025)) //20025))
+      if (!m_cur_ps->reset(PARTICLE_COUNT))
       {
         std::cerr << "MainWindow: failed to reset fluid simulator" << std::endl;
       }
@@ -159,6 +392,13 @@ void MainWindow::onKeyDown(SDL_Keycode key, uint16_t mod)
   {
     if (key == SDLK_s)
     {
+      /* the test simulator always runs on the render thread */
+      if (m_sim_thread->running())
+      {
+        lock.unlock();
+        toggleSimulationThread();
+      }
+
       if (m_cur_ps == m_fluid_system.get())
       {
         std::cerr << "MainWindow: Switching to Fluid simulator" << std::endl;
@@ -166,7 +406,12 @@ void MainWindow::onKeyDown(SDL_Keycode key, uint16_t mod)
       }
       else if (m_cur_ps == m_test_system.get())
       {
-        std::cerr << "MainWindow: Switching to Test simulator" << std::endl;
+        std::cerr << "MainWindow: Switching to CPU Fluid simulator" << std::endl;
+        m_cur_ps = m_cpu_system.get();
+      }
+      else if (m_cur_ps == m_cpu_system.get())
+      {
+        std::cerr << "MainWindow: Switching to Fluid simulator" << std::endl;
         m_cur_ps = m_fluid_system.get();
       }
       else
@@ -175,7 +420,9 @@ void MainWindow::onKeyDown(SDL_Keycode key, uint16_t mod)
         return;
       }
 
-      if (!m_cur_ps->reset(2025)) //20025))
+      m_perf_hud.clear();
+
+      if (!m_cur_ps->reset(PARTICLE_COUNT))
       {
         std::cerr << "MainWindow: failed to reset fluid simulator" << std::endl;
       }
@@ -23,9 +23,12 @@
 
 #include "FluidSystem.h"
 #include "TestSystem.h"
+#include "CpuFluidSystem.h"
+#include "SimulationThread.h"
 #include "Window.h"
 #include "ogl_lib.h"
 #include "TextRenderer.h"
+#include "PerfHud.h"
 #include "utils.h"
 
 #include <stdexcept>
@@ -38,9 +41,12 @@ class MainWindow : public Window
     MainWindow(const char *window_title, unsigned width, unsigned height)
       : Window(window_title, width, height)
       , m_text_renderer(this)
+      , m_perf_hud(this, m_text_renderer)
       , m_fluid_system(new FluidSystem)
       , m_test_system(new TestSystem)
+      , m_cpu_system(new CpuFluidSystem)
       , m_cur_ps(m_fluid_system.get())
+      , m_sim_thread(new SimulationThread(*m_fluid_system))
       , m_wnd_w(0)
       , m_wnd_h(0)
       , m_x_angle(0.0f)
@@ -49,10 +55,10 @@ class MainWindow : public Window
       , m_z_dist(-80.0f)
       , m_display_info(false)
       , m_display_help(false)
+      , m_display_perf(false)
     {
       /* prepare simulator */
-      if (!m_cur_ps->reset(2025)) //20025))
-      //if (!m_cur_ps->reset(10000))
+      if (!m_cur_ps->reset(PARTICLE_COUNT))
       {
         throw std::runtime_error("MainWindow: failed to prepare fluid simulator");
       }
@@ -82,16 +88,23 @@ class MainWindow : public Window
     int displayInfo(int height);
     int displayHelp(int height);
 
+    // starts or stops simulating the fluid system in a separate thread
+    void toggleSimulationThread(void);
+
   private:
     static const int SMALL_FONT_HEIGHT = 10;
     static const int NORMAL_FONT_HEIGHT = 12;
     static const int LARGE_FONT_HEIGHT = 20;
+    static const unsigned int PARTICLE_COUNT = 2025;   // the number of simulated particles
 
   private:
     TextRenderer m_text_renderer;
+    PerfHud m_perf_hud;
     std::unique_ptr<FluidSystem> m_fluid_system;
     std::unique_ptr<TestSystem> m_test_system;
+    std::unique_ptr<CpuFluidSystem> m_cpu_system;
     ParticleSystem *m_cur_ps;
+    std::unique_ptr<SimulationThread> m_sim_thread;  // has to be destroyed before the fluid system
     int m_wnd_w;
     int m_wnd_h;
     float m_x_angle;
@@ -100,6 +113,7 @@ class MainWindow : public Window
     float m_z_dist;
     bool m_display_info;
     bool m_display_help;
+    bool m_display_perf;
 };
 
 #endif
\ No newline at end of file
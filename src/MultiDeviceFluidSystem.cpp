@@ -0,0 +1,922 @@
+/*
+ * Copyright (C) 2014 Matus Fedorko <xfedor01@stud.fit.vutbr.cz>
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty.  In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+
+ * 1. The origin of this software must not be misrepresented; you must not
+ *    claim that you wrote the original software. If you use this software
+ *    in a product, an acknowledgment in the product documentation would be
+ *    appreciated but is not required.
+ * 2. Altered source versions must be plainly marked as such, and must not be
+ *    misrepresented as being the original software.
+ * 3. This notice may not be removed or altered from any source distribution.
+ */
+
+
+
+#include "MultiDeviceFluidSystem.h"
+#include "debug.h"
+
+#include <algorithm>
+#include <cmath>
+#include <ctime>
+#include <iomanip>
+#include <limits>
+#include <random>
+
+
+
+namespace {
+
+/** enqueues a one dimensional kernel, the kernels check the number of elements themselves */
+cl_int enqueueKernel(cl_command_queue queue, cl_kernel kernel, size_t n, cl_event *event)
+{
+  size_t global = std::max<size_t>(n, 1);
+  return clEnqueueNDRangeKernel(queue, kernel, 1, nullptr, &global, nullptr, 0, nullptr, event);
+}
+
+}
+
+
+bool MultiDeviceFluidSystem::init(unsigned int max_devices)
+{
+  std::vector<cl::Platform> platform_list;
+
+  /* every device of every platform gets a slab */
+  cl_int err = cl::Platform::get(&platform_list);
+  if (err != CL_SUCCESS)
+  {
+    ERROR("Failed to retrieve a list of available platforms: " << ocl::errorToStr(err));
+    return false;
+  }
+
+  for (cl::Platform p : platform_list)
+  {
+    std::vector<cl::Device> device_list;
+    if (p.getDevices(CL_DEVICE_TYPE_ALL, &device_list) != CL_SUCCESS) continue;
+
+    for (cl::Device d : device_list)
+    {
+      if ((max_devices > 0) && (m_slabs.size() >= max_devices)) break;
+
+      std::unique_ptr<Slab> slab(new Slab);
+      if (!initSlab(*slab, d()))
+      {
+        WARN("MultiDeviceFluidSystem: Skipping device " << slab->name);
+        continue;
+      }
+
+      INFO("MultiDeviceFluidSystem: Using device " << slab->name);
+      m_slabs.push_back(std::move(slab));
+    }
+  }
+
+  if (m_slabs.empty())
+  {
+    ERROR("MultiDeviceFluidSystem: No usable OpenCL device");
+    return false;
+  }
+
+  /* the positions are gathered on host, so they are uploaded as float4 */
+  m_particle_layout = LAYOUT_AOS;
+
+  return true;
+}
+
+
+bool MultiDeviceFluidSystem::initSlab(Slab & slab, cl_device_id device)
+{
+  char name[256] = { 0 };
+  clGetDeviceInfo(device, CL_DEVICE_NAME, sizeof(name) - 1, name, nullptr);
+  slab.name = name;
+
+  cl_platform_id platform = nullptr;
+  cl_int err = clGetDeviceInfo(device, CL_DEVICE_PLATFORM, sizeof(platform), &platform, nullptr);
+  if (err != CL_SUCCESS)
+  {
+    ERROR("Failed to query the platform of device " << slab.name << ": " << ocl::errorToStr(err));
+    return false;
+  }
+
+  cl_context_properties props[] = {
+    CL_CONTEXT_PLATFORM, (cl_context_properties) platform,
+    0
+  };
+
+  std::vector<cl::Device> device_list(1, device);
+
+  slab.ctx = cl::Context(device_list, props, nullptr, nullptr, &err);
+  if (err != CL_SUCCESS)
+  {
+    ERROR("Failed to create OpenCL context: " << ocl::errorToStr(err));
+    return false;
+  }
+
+  // the profiling information drives the rebalancing
+  slab.queue = cl::CommandQueue(slab.ctx, device, CL_QUEUE_PROFILING_ENABLE, &err);
+  if (err != CL_SUCCESS)
+  {
+    ERROR("Failed to create OpenCL command queue: " << ocl::errorToStr(err));
+    return false;
+  }
+
+  return true;
+}
+
+
+bool MultiDeviceFluidSystem::buildKernels(Slab & slab)
+{
+  ocl::ProgramDefines defines(m_params.defines());
+  defines.define("SPH_LAYOUT_AOS");
+
+  slab.prog = cl::Program(ocl::buildProgram(slab.ctx(),
+                                            FluidSystem::m_sph_kernel_files,
+                                            FluidSystem::m_sph_kernel_files_size,
+                                            defines));
+  if (slab.prog() == nullptr)
+  {
+    ERROR("Failed to create SPH OpenCL program for device " << slab.name);
+    return false;
+  }
+
+  struct {
+    cl::Kernel *kernel;
+    const char *name;
+  } kernels[] = {
+    { &slab.grid_clear_kernel,       "sph_grid_clear"            },
+    { &slab.grid_insert_kernel,      "sph_grid_insert"           },
+    { &slab.compute_pressure_kernel, "sph_compute_pressure_grid" },
+    { &slab.compute_force_kernel,    "sph_compute_force_grid"    },
+    { &slab.compute_step_kernel,     "sph_compute_step"          },
+    { &slab.slab_keys_kernel,        "sph_slab_keys"             },
+    { &slab.reorder_kernel,          "sph_reorder"               }
+  };
+
+  for (unsigned int i = 0; i < FLUIDSIM_COUNT(kernels); ++i)
+  {
+    cl_int err = CL_SUCCESS;
+    *kernels[i].kernel = cl::Kernel(slab.prog, kernels[i].name, &err);
+    if (err != CL_SUCCESS)
+    {
+      ERROR("Failed to create " << kernels[i].name << " kernel for SPH simulation: " << ocl::errorToStr(err));
+      return false;
+    }
+  }
+
+  // the owned particles are partitioned on the device after each step
+  if (!slab.sort.init(slab.ctx()))
+  {
+    ERROR("Failed to initialize radix sort for device " << slab.name);
+    return false;
+  }
+
+  return true;
+}
+
+
+bool MultiDeviceFluidSystem::reserve(Slab & slab, size_t n, size_t keep)
+{
+  if (n <= slab.capacity) return true;
+
+  // grow with some slack, the particle counts change every step
+  size_t capacity = std::max<size_t>(std::max(n, slab.capacity + slab.capacity / 2), 256);
+  cl_int err[11] = { CL_SUCCESS };
+
+  cl::Buffer pos_buf(slab.ctx, CL_MEM_READ_WRITE, capacity * sizeof(cl_float4), nullptr, &err[0]);
+  cl::Buffer vel_buf(slab.ctx, CL_MEM_READ_WRITE, capacity * sizeof(cl_float4), nullptr, &err[1]);
+  cl::Buffer prev_vel_buf(slab.ctx, CL_MEM_READ_WRITE, capacity * sizeof(cl_float4), nullptr, &err[2]);
+  slab.sorted_pos_buf = cl::Buffer(slab.ctx, CL_MEM_READ_WRITE, capacity * sizeof(cl_float4), nullptr, &err[3]);
+  slab.sorted_vel_buf = cl::Buffer(slab.ctx, CL_MEM_READ_WRITE, capacity * sizeof(cl_float4), nullptr, &err[4]);
+  slab.sorted_prev_vel_buf = cl::Buffer(slab.ctx, CL_MEM_READ_WRITE, capacity * sizeof(cl_float4), nullptr, &err[5]);
+  slab.keys_buf = cl::Buffer(slab.ctx, CL_MEM_READ_WRITE, capacity * sizeof(cl_uint), nullptr, &err[6]);
+  slab.values_buf = cl::Buffer(slab.ctx, CL_MEM_READ_WRITE, capacity * sizeof(cl_uint), nullptr, &err[7]);
+  slab.density_pressure_buf = cl::Buffer(slab.ctx, CL_MEM_READ_WRITE, capacity * sizeof(cl_float2), nullptr, &err[8]);
+  slab.force_buf = cl::Buffer(slab.ctx, CL_MEM_READ_WRITE, capacity * sizeof(cl_float4), nullptr, &err[9]);
+  slab.cell_next_buf = cl::Buffer(slab.ctx, CL_MEM_READ_WRITE, capacity * sizeof(cl_int), nullptr, &err[10]);
+
+  for (unsigned int i = 0; i < FLUIDSIM_COUNT(err); ++i)
+  {
+    if (err[i] != CL_SUCCESS)
+    {
+      ERROR("MultiDeviceFluidSystem: Failed to allocate particle buffers on " << slab.name
+            << ": " << ocl::errorToStr(err[i]));
+      slab.capacity = 0;
+      return false;
+    }
+  }
+
+  /* the resident particles move to the new buffers, the old ones are released once the copies complete */
+  if (keep > 0)
+  {
+    size_t size = keep * sizeof(cl_float4);
+    cl_int copy_err = clEnqueueCopyBuffer(slab.queue(), slab.pos_buf(), pos_buf(), 0, 0, size, 0, nullptr, nullptr);
+    if (copy_err == CL_SUCCESS) copy_err = clEnqueueCopyBuffer(slab.queue(), slab.vel_buf(), vel_buf(), 0, 0, size, 0, nullptr, nullptr);
+    if (copy_err == CL_SUCCESS) copy_err = clEnqueueCopyBuffer(slab.queue(), slab.prev_vel_buf(), prev_vel_buf(), 0, 0, size, 0, nullptr, nullptr);
+    if (copy_err != CL_SUCCESS)
+    {
+      ERROR("MultiDeviceFluidSystem: Failed to move particles to the grown buffers on " << slab.name
+            << ": " << ocl::errorToStr(copy_err));
+      slab.capacity = 0;
+      return false;
+    }
+  }
+
+  slab.pos_buf = pos_buf;
+  slab.vel_buf = vel_buf;
+  slab.prev_vel_buf = prev_vel_buf;
+  slab.capacity = capacity;
+
+  return true;
+}
+
+
+bool MultiDeviceFluidSystem::reset(unsigned int part_num)
+{
+  m_num_particles = part_num;
+  m_time = 0.0f;
+  m_steps_since_rebalance = 0;
+
+  /* the uniform grid of the whole volume, the same as in FluidSystem */
+  m_grid_cell_size = m_params.smooth_radius / m_params.sim_scale;
+  for (int i = 0; i < 3; ++i)
+  {
+    m_grid_size.s[i] = std::max(1, (cl_int) ceil((m_volume_max.s[i] - m_volume_min.s[i]) / m_grid_cell_size));
+  }
+  m_grid_size.s[3] = 1;
+  m_grid_num_cells = m_grid_size.s[0] * m_grid_size.s[1] * m_grid_size.s[2];
+
+  // the densities of halo particles within one smoothing radius of the slab
+  // are exact only if all their neighbours are present as well
+  m_halo_width = 2.0f * m_grid_cell_size;
+
+  /* split the volume along its longest axis into equally wide slabs */
+  m_axis = 0;
+  for (int i = 1; i < 3; ++i)
+  {
+    if ((m_volume_max.s[i] - m_volume_min.s[i]) > (m_volume_max.s[m_axis] - m_volume_min.s[m_axis])) m_axis = i;
+  }
+
+  float width = (m_volume_max.s[m_axis] - m_volume_min.s[m_axis]) / m_slabs.size();
+
+  for (size_t k = 0; k < m_slabs.size(); ++k)
+  {
+    Slab & slab = *m_slabs[k];
+
+    if (!buildKernels(slab))
+    {
+      return false;
+    }
+
+    cl_int err = CL_SUCCESS;
+    slab.cell_head_buf = cl::Buffer(slab.ctx, CL_MEM_READ_WRITE, m_grid_num_cells * sizeof(cl_int), nullptr, &err);
+    if (err == CL_SUCCESS) slab.counts_buf = cl::Buffer(slab.ctx, CL_MEM_READ_WRITE, sizeof(slab.counts), nullptr, &err);
+    if (err != CL_SUCCESS)
+    {
+      ERROR("MultiDeviceFluidSystem: Failed to allocate grid buffers on " << slab.name << ": " << ocl::errorToStr(err));
+      return false;
+    }
+
+    slab.lo = m_volume_min.s[m_axis] + k * width;
+    slab.hi = m_volume_min.s[m_axis] + (k + 1) * width;
+    slab.num_owned = 0;
+    slab.num_halo = 0;
+    slab.step_time = 0.0;
+  }
+
+  /* random positions inside of the bounding volume (see sph_reset.cl) */
+  std::mt19937 rng((unsigned int) time(nullptr));
+  std::uniform_real_distribution<float> dist[3] = {
+    std::uniform_real_distribution<float>(m_volume_min.s[0], m_volume_max.s[0]),
+    std::uniform_real_distribution<float>(m_volume_min.s[1], m_volume_max.s[1]),
+    std::uniform_real_distribution<float>(m_volume_min.s[2], m_volume_max.s[2])
+  };
+
+  m_pos.resize(part_num);
+
+  for (unsigned int i = 0; i < part_num; ++i)
+  {
+    m_pos[i].s[0] = dist[0](rng);
+    m_pos[i].s[1] = dist[1](rng);
+    m_pos[i].s[2] = dist[2](rng);
+    m_pos[i].s[3] = 1.0f;
+  }
+
+  if (!distribute())
+  {
+    return false;
+  }
+
+  /* the vertex buffer for rendering */
+  if (!ocl::headless())
+  {
+    glBindBuffer(GL_ARRAY_BUFFER, m_particle_pos_buf.getGLID());
+    glBufferData(GL_ARRAY_BUFFER, part_num * sizeof(cl_float4), nullptr, GL_DYNAMIC_DRAW);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+    GLenum err = glGetError();
+    if (err != GL_NO_ERROR)
+    {
+      ERROR("MultiDeviceFluidSystem: Failed to allocate vertex buffer: " << ogl::errorToStr(err));
+      return false;
+    }
+
+    uploadPositions();
+  }
+
+  return true;
+}
+
+
+unsigned int MultiDeviceFluidSystem::ownerOf(float c) const
+{
+  // the outer slabs own also the particles outside of the volume
+  unsigned int owner = 0;
+  while ((owner + 1 < m_slabs.size()) && (c >= m_slabs[owner]->hi)) ++owner;
+  return owner;
+}
+
+
+bool MultiDeviceFluidSystem::distribute(void)
+{
+  size_t num_slabs = m_slabs.size();
+  cl_float4 zero = { { 0.0f, 0.0f, 0.0f, 0.0f } };
+
+  for (size_t k = 0; k < num_slabs; ++k)
+  {
+    m_slabs[k]->in_pos.clear();
+    m_slabs[k]->in_vel.clear();
+    m_slabs[k]->in_prev_vel.clear();
+  }
+
+  /* every particle arrives to its owner, the particles start at rest */
+  std::vector<unsigned int> owner(m_num_particles);
+
+  for (unsigned int i = 0; i < m_num_particles; ++i)
+  {
+    owner[i] = ownerOf(m_pos[i].s[m_axis]);
+
+    Slab & slab = *m_slabs[owner[i]];
+    slab.in_pos.push_back(m_pos[i]);
+    slab.in_vel.push_back(zero);
+    slab.in_prev_vel.push_back(zero);
+  }
+
+  /* halo exchange */
+  for (unsigned int i = 0; i < m_num_particles; ++i)
+  {
+    float c = m_pos[i].s[m_axis];
+
+    for (size_t k = 0; k < num_slabs; ++k)
+    {
+      Slab & slab = *m_slabs[k];
+      if ((k != owner[i]) && (c >= slab.lo - m_halo_width) && (c < slab.hi + m_halo_width))
+      {
+        slab.in_pos.push_back(m_pos[i]);
+        slab.in_vel.push_back(zero);
+      }
+    }
+  }
+
+  /* upload the particles to devices */
+  for (size_t k = 0; k < num_slabs; ++k)
+  {
+    Slab & slab = *m_slabs[k];
+    if (!upload(slab, 0, slab.in_prev_vel.size()))
+    {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+
+bool MultiDeviceFluidSystem::enqueueStep(Slab & slab)
+{
+  cl_uint num_total = (cl_uint) slab.numParticles();
+  cl_uint num_owned = (cl_uint) slab.num_owned;
+
+  /* the grid and the densities cover the halo, the forces and the integration only the owned particles */
+  if ((!ocl::KernelArgs(slab.grid_clear_kernel, "grid_clear_kernel")
+            .arg(slab.cell_head_buf)
+            .arg(m_grid_num_cells)) ||
+      (!ocl::KernelArgs(slab.grid_insert_kernel, "grid_insert_kernel")
+            .arg(slab.pos_buf)
+            .arg(slab.cell_head_buf)
+            .arg(slab.cell_next_buf)
+            .arg(m_volume_min)
+            .arg(m_grid_cell_size)
+            .arg(m_grid_size)
+            .arg(num_total)) ||
+      (!ocl::KernelArgs(slab.compute_pressure_kernel, "compute_pressure_kernel")
+            .arg(slab.pos_buf)
+            .arg(slab.density_pressure_buf)
+            .arg(slab.cell_head_buf)
+            .arg(slab.cell_next_buf)
+            .arg(m_volume_min)
+            .arg(m_grid_cell_size)
+            .arg(m_grid_size)
+            .arg(num_total)) ||
+      (!ocl::KernelArgs(slab.compute_force_kernel, "compute_force_kernel")
+            .arg(slab.pos_buf)
+            .arg(slab.density_pressure_buf)
+            .arg(slab.force_buf)
+            .arg(slab.vel_buf)
+            .arg(slab.cell_head_buf)
+            .arg(slab.cell_next_buf)
+            .arg(m_volume_min)
+            .arg(m_grid_cell_size)
+            .arg(m_grid_size)
+            .arg(num_owned)) ||
+      (!ocl::KernelArgs(slab.compute_step_kernel, "compute_step_kernel")
+            .arg(slab.pos_buf)
+            .arg(slab.force_buf)
+            .arg(slab.vel_buf)
+            .arg(slab.prev_vel_buf)
+            .arg(m_params.delta_time)
+            .arg(m_volume_min)
+            .arg(m_volume_max)
+            .arg((cl_float) (m_time))
+            .arg((cl_uint) (m_effects))
+            .arg(num_owned)))
+  {
+    return false;
+  }
+
+  cl_command_queue queue = slab.queue();
+  slab.first_event = ocl::Event();
+  slab.last_event = ocl::Event();
+
+  cl_int err = enqueueKernel(queue, slab.grid_clear_kernel(), m_grid_num_cells, m_stats.event(slab.first_event, "mdev_grid_clear"));
+  if (err == CL_SUCCESS) err = enqueueKernel(queue, slab.grid_insert_kernel(), num_total, m_stats.event("mdev_grid_insert"));
+  if (err == CL_SUCCESS) err = enqueueKernel(queue, slab.compute_pressure_kernel(), num_total, m_stats.event("mdev_compute_pressure"));
+  if (err == CL_SUCCESS) err = enqueueKernel(queue, slab.compute_force_kernel(), num_owned, m_stats.event("mdev_compute_force"));
+  if (err == CL_SUCCESS) err = enqueueKernel(queue, slab.compute_step_kernel(), num_owned, m_stats.event(slab.last_event, "mdev_compute_step"));
+  if (err != CL_SUCCESS)
+  {
+    WARN("MultiDeviceFluidSystem: Failed to enqueue SPH kernels on " << slab.name << ": " << ocl::errorToStr(err));
+    return false;
+  }
+
+  // start the device right away, the other devices are enqueued after it
+  clFlush(queue);
+
+  return true;
+}
+
+
+bool MultiDeviceFluidSystem::partition(size_t k)
+{
+  Slab & slab = *m_slabs[k];
+  cl_command_queue queue = slab.queue();
+  cl_uint n = (cl_uint) slab.num_owned;
+
+  // the outer slabs own also the particles outside of the volume
+  cl_float lo = (k == 0) ? -std::numeric_limits<cl_float>::max() : slab.lo;
+  cl_float hi = (k + 1 == m_slabs.size()) ? std::numeric_limits<cl_float>::max() : slab.hi;
+
+  std::fill(slab.counts, slab.counts + PART_COUNT, 0);
+  if (n == 0) return true;
+
+  if (!ocl::KernelArgs(slab.slab_keys_kernel, "slab_keys_kernel")
+            .arg(slab.pos_buf)
+            .arg(slab.keys_buf)
+            .arg(slab.values_buf)
+            .arg(slab.counts_buf)
+            .arg((cl_uint) m_axis)
+            .arg(lo)
+            .arg(hi)
+            .arg(m_halo_width)
+            .arg(n))
+  {
+    return false;
+  }
+
+  /* classify the owned particles */
+  cl_int err = clEnqueueWriteBuffer(queue, slab.counts_buf(), CL_FALSE, 0, sizeof(slab.counts), slab.counts, 0, nullptr, nullptr);
+  if (err == CL_SUCCESS) err = enqueueKernel(queue, slab.slab_keys_kernel(), n, m_stats.event("mdev_slab_keys"));
+  if (err != CL_SUCCESS)
+  {
+    WARN("MultiDeviceFluidSystem: Failed to enqueue slab keys kernel on " << slab.name << ": " << ocl::errorToStr(err));
+    return false;
+  }
+
+  /* the sort is stable, so the interior keeps its order and the parts to export end up at the back */
+  if (!slab.sort.sort(queue, slab.keys_buf(), slab.values_buf(), n, 2, &m_stats))
+  {
+    return false;
+  }
+
+  if (!ocl::KernelArgs(slab.reorder_kernel, "reorder_kernel")
+            .arg(slab.values_buf)
+            .arg(slab.pos_buf)
+            .arg(slab.vel_buf)
+            .arg(slab.prev_vel_buf)
+            .arg(slab.sorted_pos_buf)
+            .arg(slab.sorted_vel_buf)
+            .arg(slab.sorted_prev_vel_buf)
+            .arg(n))
+  {
+    return false;
+  }
+
+  err = enqueueKernel(queue, slab.reorder_kernel(), n, m_stats.event("mdev_reorder"));
+  if (err != CL_SUCCESS)
+  {
+    WARN("MultiDeviceFluidSystem: Failed to enqueue reorder kernel on " << slab.name << ": " << ocl::errorToStr(err));
+    return false;
+  }
+
+  // the halo behind the owned particles is replaced anyway, so the buffers are just swapped
+  std::swap(slab.pos_buf, slab.sorted_pos_buf);
+  std::swap(slab.vel_buf, slab.sorted_vel_buf);
+  std::swap(slab.prev_vel_buf, slab.sorted_prev_vel_buf);
+
+  err = clEnqueueReadBuffer(queue, slab.counts_buf(), CL_FALSE, 0, sizeof(slab.counts), slab.counts, 0, nullptr, nullptr);
+  if (err != CL_SUCCESS)
+  {
+    ERROR("MultiDeviceFluidSystem: Failed to read part sizes from " << slab.name << ": " << ocl::errorToStr(err));
+    return false;
+  }
+
+  clFlush(queue);
+
+  return true;
+}
+
+
+bool MultiDeviceFluidSystem::exchange(void)
+{
+  size_t num_slabs = m_slabs.size();
+
+  /* all devices partition their particles concurrently */
+  for (size_t k = 0; k < num_slabs; ++k)
+  {
+    if (!partition(k))
+    {
+      return false;
+    }
+  }
+
+  /* read back only the border bands and the leaving particles, they are at the end of the owned ones */
+  bool ok = true;
+
+  for (size_t k = 0; k < num_slabs; ++k)
+  {
+    Slab & slab = *m_slabs[k];
+    clFinish(slab.queue());
+    measureStepTime(slab);
+
+    size_t begin = slab.counts[PART_INTERIOR];
+    size_t n = slab.counts[PART_BORDER] + slab.counts[PART_LEAVING];
+
+    if (begin + n != slab.num_owned)
+    {
+      ERROR("MultiDeviceFluidSystem: The parts of " << slab.name << " do not add up to its "
+            << slab.num_owned << " particles");
+      return false;
+    }
+
+    slab.out_pos.resize(n);
+    slab.out_vel.resize(n);
+    slab.out_prev_vel.resize(slab.counts[PART_LEAVING]);
+
+    if (n == 0) continue;
+
+    size_t offset = begin * sizeof(cl_float4);
+    size_t size = n * sizeof(cl_float4);
+    cl_int err = clEnqueueReadBuffer(slab.queue(), slab.pos_buf(), CL_FALSE, offset, size, &slab.out_pos.front(), 0, nullptr, m_stats.event("mdev_read_border"));
+    if (err == CL_SUCCESS) err = clEnqueueReadBuffer(slab.queue(), slab.vel_buf(), CL_FALSE, offset, size, &slab.out_vel.front(), 0, nullptr, m_stats.event("mdev_read_border"));
+    if ((err == CL_SUCCESS) && (!slab.out_prev_vel.empty()))
+    {
+      err = clEnqueueReadBuffer(slab.queue(), slab.prev_vel_buf(), CL_FALSE,
+                                offset + slab.counts[PART_BORDER] * sizeof(cl_float4),
+                                slab.out_prev_vel.size() * sizeof(cl_float4), &slab.out_prev_vel.front(),
+                                0, nullptr, m_stats.event("mdev_read_border"));
+    }
+
+    if (err != CL_SUCCESS)
+    {
+      ERROR("MultiDeviceFluidSystem: Failed to read particles from " << slab.name << ": " << ocl::errorToStr(err));
+      ok = false;
+    }
+
+    clFlush(slab.queue());
+  }
+
+  for (size_t k = 0; k < num_slabs; ++k)
+  {
+    clFinish(m_slabs[k]->queue());
+  }
+
+  if (!ok)
+  {
+    return false;
+  }
+
+  /* migration, the leaving particles arrive to their new owners */
+  for (size_t k = 0; k < num_slabs; ++k)
+  {
+    m_slabs[k]->in_pos.clear();
+    m_slabs[k]->in_vel.clear();
+    m_slabs[k]->in_prev_vel.clear();
+  }
+
+  for (size_t k = 0; k < num_slabs; ++k)
+  {
+    Slab & slab = *m_slabs[k];
+    size_t num_border = slab.counts[PART_BORDER];
+
+    slab.out_owner.resize(slab.out_pos.size());
+
+    for (size_t j = 0; j < slab.out_pos.size(); ++j)
+    {
+      // the slab keys were computed against the same borders, so a leaving particle always has a new owner
+      unsigned int owner = (j < num_border) ? (unsigned int) k : ownerOf(slab.out_pos[j].s[m_axis]);
+      slab.out_owner[j] = owner;
+      if (j < num_border) continue;
+
+      Slab & dest = *m_slabs[owner];
+      dest.in_pos.push_back(slab.out_pos[j]);
+      dest.in_vel.push_back(slab.out_vel[j]);
+      dest.in_prev_vel.push_back(slab.out_prev_vel[j - num_border]);
+    }
+  }
+
+  /* halo exchange, any particle within the halo width of a slab was read back by its owner,
+     because it is either in the border band of its owner or it has just left its slab */
+  for (size_t k = 0; k < num_slabs; ++k)
+  {
+    const Slab & src = *m_slabs[k];
+
+    for (size_t j = 0; j < src.out_pos.size(); ++j)
+    {
+      float c = src.out_pos[j].s[m_axis];
+
+      for (size_t m = 0; m < num_slabs; ++m)
+      {
+        Slab & slab = *m_slabs[m];
+        if ((m != src.out_owner[j]) && (c >= slab.lo - m_halo_width) && (c < slab.hi + m_halo_width))
+        {
+          slab.in_pos.push_back(src.out_pos[j]);
+          slab.in_vel.push_back(src.out_vel[j]);
+        }
+      }
+    }
+  }
+
+  /* the leaving particles of a slab (and its old halo) are overwritten by the incoming ones */
+  for (size_t k = 0; k < num_slabs; ++k)
+  {
+    Slab & slab = *m_slabs[k];
+    if (!upload(slab, slab.counts[PART_INTERIOR] + slab.counts[PART_BORDER], slab.in_prev_vel.size()))
+    {
+      return false;
+    }
+  }
+
+  return true;
+}
+bool MultiDeviceFluidSystem::upload(Slab & slab, size_t keep, size_t num_arriving)
+{
+  size_t n = slab.in_pos.size();
+
+  if (!reserve(slab, keep + n, keep))
+  {
+    return false;
+  }
+
+  slab.num_owned = keep + num_arriving;
+  slab.num_halo = n - num_arriving;
+
+  if (n == 0) return true;
+
+  // the staging arrays are not touched until the next exchange waits for the device
+  size_t offset = keep * sizeof(cl_float4);
+  size_t size = n * sizeof(cl_float4);
+  cl_int err = clEnqueueWriteBuffer(slab.queue(), slab.pos_buf(), CL_FALSE, offset, size, &slab.in_pos.front(), 0, nullptr, m_stats.event("mdev_write_halo"));
+  if (err == CL_SUCCESS) err = clEnqueueWriteBuffer(slab.queue(), slab.vel_buf(), CL_FALSE, offset, size, &slab.in_vel.front(), 0, nullptr, m_stats.event("mdev_write_halo"));
+  if ((err == CL_SUCCESS) && (num_arriving > 0))
+  {
+    err = clEnqueueWriteBuffer(slab.queue(), slab.prev_vel_buf(), CL_FALSE, offset, num_arriving * sizeof(cl_float4),
+                               &slab.in_prev_vel.front(), 0, nullptr, m_stats.event("mdev_write_halo"));
+  }
+
+  if (err != CL_SUCCESS)
+  {
+    ERROR("MultiDeviceFluidSystem: Failed to upload particles to " << slab.name << ": " << ocl::errorToStr(err));
+    return false;
+  }
+
+  clFlush(slab.queue());
+
+  return true;
+}
+
+
+void MultiDeviceFluidSystem::measureStepTime(Slab & slab)
+{
+  /* the device time of the step (from the start of the first to the end of the last kernel) */
+  cl_ulong start = 0;
+  cl_ulong end = 0;
+
+  if (((cl_event) slab.first_event != nullptr) && ((cl_event) slab.last_event != nullptr) &&
+      (clGetEventProfilingInfo(slab.first_event, CL_PROFILING_COMMAND_START, sizeof(start), &start, nullptr) == CL_SUCCESS) &&
+      (clGetEventProfilingInfo(slab.last_event, CL_PROFILING_COMMAND_END, sizeof(end), &end, nullptr) == CL_SUCCESS) &&
+      (end > start))
+  {
+    double ms = (end - start) * 1.0e-6;
+    slab.step_time = (slab.step_time == 0.0) ? ms : (0.8 * slab.step_time + 0.2 * ms);
+  }
+
+  // measured only once per step
+  slab.first_event = ocl::Event();
+  slab.last_event = ocl::Event();
+}
+
+
+bool MultiDeviceFluidSystem::gatherPositions(void)
+{
+  m_pos.resize(m_num_particles);
+
+  /* the reads are enqueued on all devices before waiting for any of them */
+  size_t offset = 0;
+  bool ok = true;
+
+  for (size_t k = 0; k < m_slabs.size(); ++k)
+  {
+    Slab & slab = *m_slabs[k];
+    if (slab.num_owned == 0) continue;
+
+    if (offset + slab.num_owned > m_num_particles)
+    {
+      ERROR("MultiDeviceFluidSystem: The slabs own more than " << m_num_particles << " particles");
+      ok = false;
+      break;
+    }
+
+    cl_int err = clEnqueueReadBuffer(slab.queue(), slab.pos_buf(), CL_FALSE, 0, slab.num_owned * sizeof(cl_float4),
+                                     &m_pos[offset], 0, nullptr, nullptr);
+    if (err != CL_SUCCESS)
+    {
+      ERROR("MultiDeviceFluidSystem: Failed to read positions from " << slab.name << ": " << ocl::errorToStr(err));
+      ok = false;
+    }
+
+    offset += slab.num_owned;
+    clFlush(slab.queue());
+  }
+
+  for (size_t k = 0; k < m_slabs.size(); ++k)
+  {
+    clFinish(m_slabs[k]->queue());
+  }
+
+  if ((ok) && (offset != m_num_particles))
+  {
+    ERROR("MultiDeviceFluidSystem: The slabs own " << offset << " of " << m_num_particles << " particles");
+    ok = false;
+  }
+
+  return ok;
+}
+
+
+void MultiDeviceFluidSystem::rebalanceSlabs(void)
+{
+  size_t num_slabs = m_slabs.size();
+  if ((num_slabs < 2) || (m_num_particles == 0)) return;
+
+  /* the particle throughput of each device */
+  std::vector<double> share(num_slabs);
+  double total = 0.0;
+
+  for (size_t k = 0; k < num_slabs; ++k)
+  {
+    const Slab & slab = *m_slabs[k];
+    if (slab.step_time <= 0.0) return;   // not measured yet
+
+    share[k] = std::max<size_t>(slab.num_owned, 1) / slab.step_time;
+    total += share[k];
+  }
+
+  /* the new borders are the quantiles of particle coordinates given by the throughputs */
+  std::vector<float> coords(m_num_particles);
+  for (unsigned int i = 0; i < m_num_particles; ++i)
+  {
+    coords[i] = m_pos[i].s[m_axis];
+  }
+
+  std::sort(coords.begin(), coords.end());
+
+  size_t min_count = std::min<size_t>(MIN_SLAB_PARTICLES, m_num_particles / num_slabs);
+  double cumulative = 0.0;
+
+  for (size_t k = 0; k + 1 < num_slabs; ++k)
+  {
+    cumulative += share[k] / total;
+
+    size_t count = (size_t) (cumulative * m_num_particles + 0.5);
+    count = std::max(count, (k + 1) * min_count);
+    count = std::min(count, m_num_particles - (num_slabs - k - 1) * min_count);
+
+    // the border moves only half way, so that the noise in the measured times does not make it oscillate
+    float target = coords[std::min<size_t>(count, m_num_particles - 1)];
+    float border = m_slabs[k]->hi + 0.5f * (target - m_slabs[k]->hi);
+    border = std::max(border, m_slabs[k]->lo);
+
+    m_slabs[k]->hi = border;
+    m_slabs[k + 1]->lo = border;
+  }
+}
+
+
+void MultiDeviceFluidSystem::update(float time_step)
+{
+  // check if the simulation is not paused
+  if (m_pause) return;
+
+  /* all devices work concurrently */
+  for (size_t k = 0; k < m_slabs.size(); ++k)
+  {
+    if (!enqueueStep(*m_slabs[k]))
+    {
+      return;
+    }
+  }
+
+  // the quantiles of the new borders need the positions of all particles
+  if ((m_rebalance) && (++m_steps_since_rebalance >= REBALANCE_INTERVAL))
+  {
+    if (gatherPositions()) rebalanceSlabs();
+    m_steps_since_rebalance = 0;
+  }
+
+  if (!exchange())
+  {
+    return;
+  }
+
+  /* advance simulation time */
+  m_time += time_step;
+
+  // kill the wave after 50 frames
+  if (m_effects & FluidSystem::EFFECT_WAVE)
+  {
+    if ((m_time - m_wave_start) > (time_step * 50))
+    {
+      m_effects &= ~(FluidSystem::EFFECT_WAVE);
+    }
+  }
+
+  if ((!ocl::headless()) && (gatherPositions())) uploadPositions();
+}
+
+
+bool MultiDeviceFluidSystem::readPositions(std::vector<float> & positions)
+{
+  if (!gatherPositions())
+  {
+    return false;
+  }
+
+  positions.resize(4 * m_num_particles);
+  if (m_num_particles > 0)
+  {
+    std::copy(m_pos.front().s, m_pos.front().s + 4 * m_num_particles, positions.begin());
+  }
+
+  return true;
+}
+
+
+void MultiDeviceFluidSystem::uploadPositions(void)
+{
+  if (m_num_particles == 0) return;
+
+  glBindBuffer(GL_ARRAY_BUFFER, m_particle_pos_buf.getGLID());
+  glBufferSubData(GL_ARRAY_BUFFER, 0, m_num_particles * sizeof(cl_float4), &m_pos.front());
+  glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+
+void MultiDeviceFluidSystem::printSlabs(std::ostream & os) const
+{
+  static const char axis_names[] = { 'x', 'y', 'z' };
+
+  os << "Slabs along " << axis_names[m_axis] << " axis (halo width " << m_halo_width << "):" << std::endl;
+
+  for (size_t k = 0; k < m_slabs.size(); ++k)
+  {
+    const Slab & slab = *m_slabs[k];
+    os << "  [" << k << "] " << std::setw(8) << slab.lo << " .. " << std::setw(8) << slab.hi
+       << " : " << slab.num_owned << " owned, " << slab.num_halo << " halo, "
+       << slab.step_time << " ms/step (" << slab.name << ")" << std::endl;
+  }
+}
@@ -0,0 +1,238 @@
+/*
+ * Copyright (C) 2014 Matus Fedorko <xfedor01@stud.fit.vutbr.cz>
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty.  In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+
+ * 1. The origin of this software must not be misrepresented; you must not
+ *    claim that you wrote the original software. If you use this software
+ *    in a product, an acknowledgment in the product documentation would be
+ *    appreciated but is not required.
+ * 2. Altered source versions must be plainly marked as such, and must not be
+ *    misrepresented as being the original software.
+ * 3. This notice may not be removed or altered from any source distribution.
+ */
+
+
+/**
+ * The SPH fluid simulation distributed over several OpenCL devices
+ * (e.g. two GPUs, or a GPU and the CPU device).
+ *
+ * The bounding volume is split into slabs along its longest axis,
+ * each device owns the particles of one slab. Before each step every device
+ * receives copies of the particles from the other slabs that lie within
+ * two smoothing radii of its slab (the halo), so that the densities
+ * of the halo particles next to the slab, and therefore the forces acting
+ * on the owned particles, are the same as in a single device simulation.
+ * After the step the particles that left their slab migrate to the new owner
+ * and the slab borders are moved according to the measured step times.
+ *
+ * The owned particles stay in device memory. After each step every device
+ * partitions them into the interior of the slab, the bands within the halo
+ * width of its borders and the particles that left the slab, and only the last
+ * two parts are read back. The host then uploads only the migrating particles
+ * and the new halo of each slab.
+ */
+
+#ifndef MULTIDEVICEFLUIDSYSTEM_H
+#define MULTIDEVICEFLUIDSYSTEM_H
+
+#include "FluidSystem.h"
+
+#include <algorithm>
+#include <memory>
+#include <ostream>
+#include <string>
+#include <vector>
+
+
+class MultiDeviceFluidSystem : public ParticleSystem
+{
+  public:
+    // @param max_devices the maximal number of devices to use (0 means all devices)
+    explicit MultiDeviceFluidSystem(unsigned int max_devices = 0)
+      : ParticleSystem(false)
+      , m_params()
+      , m_slabs()
+      , m_axis(0)
+      , m_halo_width(0.0f)
+      , m_grid_cell_size(0.0f)
+      , m_grid_num_cells(0)
+      , m_rebalance(true)
+      , m_steps_since_rebalance(0)
+      , m_effects(FluidSystem::EFFECT_NONE)
+      , m_wave_start(0.0f)
+      , m_pos()
+    {
+      if (!init(max_devices))
+      {
+        throw std::runtime_error("Failed to construct MultiDeviceFluidSystem: OpenCL initialization failed");
+      }
+
+      m_use_uniform_color = true;
+    }
+
+    void activateDrain(void) { deactivateFountain(); m_effects |= FluidSystem::EFFECT_DRAIN; }
+    void deactivateDrain(void) { m_effects &= ~(FluidSystem::EFFECT_DRAIN); }
+    bool toggleDrain(void) { deactivateFountain(); return (m_effects ^= FluidSystem::EFFECT_DRAIN) != 0; }
+
+    void emitWave(void) { m_effects |= FluidSystem::EFFECT_WAVE; m_wave_start = m_time; }
+
+    void activateFountain(void) { deactivateDrain(); m_effects |= FluidSystem::EFFECT_FOUNTAIN; }
+    void deactivateFountain(void) { m_effects &= ~(FluidSystem::EFFECT_FOUNTAIN); }
+    bool toggleFountain(void) { deactivateDrain(); return (m_effects ^= FluidSystem::EFFECT_FOUNTAIN) != 0; }
+
+    // the simulation parameters take effect on the next reset
+    const FluidSystem::Params & params(void) const { return m_params; }
+    void setParams(const FluidSystem::Params & params) { m_params = params; }
+
+    // whether the slab borders follow the measured step times of the devices
+    bool rebalance(void) const { return m_rebalance; }
+    void setRebalance(bool rebalance) { m_rebalance = rebalance; }
+    bool toggleRebalance(void) { return m_rebalance = !m_rebalance; }
+
+    size_t numDevices(void) const { return m_slabs.size(); }
+
+    // prints the bounds, particle counts and step times of all slabs
+    void printSlabs(std::ostream & os) const;
+
+    // reset the particle system
+    virtual bool reset(unsigned int part_num);
+
+    // recalculate the particle system
+    virtual void update(float time_step = 1.0f);
+
+    // gathers the positions of the owned particles from all devices
+    virtual bool readPositions(std::vector<float> & positions);
+
+  private:
+    // the parts of the owned particles of a slab after a step (see sph_slab_keys in sph_sort.cl)
+    enum Part {
+      PART_INTERIOR = 0,   // stay in the slab and are not in any halo
+      PART_BORDER,         // stay in the slab, but are in the halo of a neighbour
+      PART_LEAVING,        // moved to another slab
+      PART_COUNT
+    };
+
+    // the part of the simulation that runs on a single device
+    struct Slab
+    {
+      std::string name;              // the name of the device
+      cl::Context ctx;               // each device gets its own context, they may come from different platforms
+      cl::CommandQueue queue;
+      cl::Program prog;
+      cl::Kernel grid_clear_kernel;
+      cl::Kernel grid_insert_kernel;
+      cl::Kernel compute_pressure_kernel;
+      cl::Kernel compute_force_kernel;
+      cl::Kernel compute_step_kernel;
+      cl::Kernel slab_keys_kernel;
+      cl::Kernel reorder_kernel;
+      ocl::RadixSort sort;           // partitions the owned particles after each step
+      cl::Buffer pos_buf;            // owned particles first, halo particles after them
+      cl::Buffer vel_buf;
+      cl::Buffer prev_vel_buf;
+      cl::Buffer sorted_pos_buf;     // the partitioned owned particles, swapped with the above
+      cl::Buffer sorted_vel_buf;
+      cl::Buffer sorted_prev_vel_buf;
+      cl::Buffer keys_buf;           // the part of each owned particle
+      cl::Buffer values_buf;         // the permutation that partitions the owned particles
+      cl::Buffer counts_buf;         // the number of owned particles in each part
+      cl::Buffer density_pressure_buf;
+      cl::Buffer force_buf;
+      cl::Buffer cell_head_buf;
+      cl::Buffer cell_next_buf;
+      size_t capacity;               // the number of particles the buffers can hold
+      float lo;                      // the slab bounds along the split axis
+      float hi;
+      size_t num_owned;              // the number of particles resident on the device
+      size_t num_halo;
+      cl_uint counts[PART_COUNT];    // the parts of the owned particles after the last step
+      std::vector<cl_float4> out_pos;       // the border band and the leaving particles read back
+      std::vector<cl_float4> out_vel;
+      std::vector<cl_float4> out_prev_vel;  // of the leaving particles only
+      std::vector<unsigned int> out_owner;  // the slab owning each exported particle
+      std::vector<cl_float4> in_pos;        // the arriving particles first, the halo after them
+      std::vector<cl_float4> in_vel;
+      std::vector<cl_float4> in_prev_vel;   // of the arriving particles only
+      double step_time;              // the smoothed execution time of a step in milliseconds
+      ocl::Event first_event;        // the first and the last kernel of the current step
+      ocl::Event last_event;
+
+      Slab(void)
+        : name(), ctx(), queue(), prog()
+        , grid_clear_kernel(), grid_insert_kernel()
+        , compute_pressure_kernel(), compute_force_kernel(), compute_step_kernel()
+        , slab_keys_kernel(), reorder_kernel(), sort()
+        , pos_buf(), vel_buf(), prev_vel_buf()
+        , sorted_pos_buf(), sorted_vel_buf(), sorted_prev_vel_buf()
+        , keys_buf(), values_buf(), counts_buf()
+        , density_pressure_buf(), force_buf()
+        , cell_head_buf(), cell_next_buf()
+        , capacity(0), lo(0.0f), hi(0.0f)
+        , num_owned(0), num_halo(0)
+        , out_pos(), out_vel(), out_prev_vel(), out_owner()
+        , in_pos(), in_vel(), in_prev_vel()
+        , step_time(0.0)
+        , first_event(), last_event()
+      {
+        std::fill(counts, counts + PART_COUNT, 0);
+      }
+
+      size_t numParticles(void) const { return num_owned + num_halo; }
+    };
+
+  private:
+    // creates a context, a command queue and the SPH program for each device
+    bool init(unsigned int max_devices);
+    bool initSlab(Slab & slab, cl_device_id device);
+    // compiles the SPH program with the current parameters for the device of the slab
+    bool buildKernels(Slab & slab);
+    // makes sure the buffers of the slab can hold n particles, the first keep particles are preserved
+    bool reserve(Slab & slab, size_t n, size_t keep);
+    // the slab that owns the given coordinate along the split axis
+    unsigned int ownerOf(float c) const;
+    // assigns the initial particles in m_pos to slabs and uploads them to devices
+    bool distribute(void);
+    // enqueues a single simulation step over the particles of the slab
+    bool enqueueStep(Slab & slab);
+    // sorts the owned particles of the k-th slab by their part and reads back the part sizes
+    bool partition(size_t k);
+    // migrates the particles that left their slab and refreshes the halos of all slabs
+    bool exchange(void);
+    // writes the incoming particles of the slab after its first keep owned particles
+    bool upload(Slab & slab, size_t keep, size_t num_arriving);
+    // updates the smoothed step time of the slab from the profiling information of the last step
+    void measureStepTime(Slab & slab);
+    // reads the positions of the owned particles of all slabs to m_pos
+    bool gatherPositions(void);
+    // moves the slab borders, so that the devices take equally long to make a step
+    void rebalanceSlabs(void);
+    // uploads the positions to the vertex buffer
+    void uploadPositions(void);
+
+  private:
+    static const unsigned int REBALANCE_INTERVAL = 20;   // steps between slab border updates
+    static const unsigned int MIN_SLAB_PARTICLES = 64;   // a slab never gets fewer particles than this
+
+  private:
+    FluidSystem::Params m_params;
+    std::vector<std::unique_ptr<Slab>> m_slabs;
+    int m_axis;                          // the axis the volume is split along
+    float m_halo_width;                  // two smoothing radii in world space coordinates
+    cl_float m_grid_cell_size;           // all devices share the same uniform grid of the whole volume
+    cl_int4 m_grid_size;
+    cl_uint m_grid_num_cells;
+    bool m_rebalance;
+    unsigned int m_steps_since_rebalance;
+    cl_uint m_effects;
+    float m_wave_start;
+    std::vector<cl_float4> m_pos;        // the gathered positions of all particles
+};
+
+#endif
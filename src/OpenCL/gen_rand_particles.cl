@@ -65,9 +65,10 @@ __constant float4 part_positions[] = {
 #endif
 
 
-__kernel void gen_part_positions(__global float4 *positions, __global float4 *colors, ulong seed)
+__kernel void gen_part_positions(__global float4 *positions, __global float4 *colors, ulong seed, uint numparticles)
 {
   ulong gid = get_global_id(0);
+  if (gid >= numparticles) return;
   //ulong gid0 = get_global_id(0);
   //ulong gid = gid0 << 1;
   //unsigned long seed = (gid + 1) << 16;
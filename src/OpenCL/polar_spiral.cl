@@ -35,9 +35,11 @@ inline float random(ulong *seed, float min, float max)
 __kernel void polar_spiral(__global float4 *positions,
                            __global float4 *colors,
                            float3 position,
-                           ulong seed)
+                           ulong seed,
+                           uint numparticles)
 {
   uint gid = get_global_id(0);
+  if (gid >= numparticles) return;
   float gidf = gid * 0.1;
   
   //seed = srand(seed, gid);
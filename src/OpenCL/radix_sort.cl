@@ -0,0 +1,173 @@
+/*
+ * Copyright (C) 2014 Matus Fedorko <xfedor01@stud.fit.vutbr.cz>
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty.  In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+
+ * 1. The origin of this software must not be misrepresented; you must not
+ *    claim that you wrote the original software. If you use this software
+ *    in a product, an acknowledgment in the product documentation would be
+ *    appreciated but is not required.
+ * 2. Altered source versions must be plainly marked as such, and must not be
+ *    misrepresented as being the original software.
+ * 3. This notice may not be removed or altered from any source distribution.
+ */
+
+/**
+ * Least significant digit radix sort of (key, value) pairs.
+ *
+ * Every work-item owns a contiguous block of RADIX_BLOCK elements,
+ * so the sort is stable without any need for local memory ranking.
+ * A single pass consists of:
+ *   1) radix_histogram - counts digits in each block
+ *   2) radix_scan_*    - an exclusive prefix sum over the digit-major histogram
+ *   3) radix_scatter   - moves each element to its final position for this digit
+ *
+ * The following constants are passed as build options by ocl::RadixSort:
+ *   RADIX_BITS   - the number of bits processed in one pass
+ *   RADIX_BLOCK  - the number of elements processed by a single work-item
+ *   SCAN_WG      - the work-group size of scan kernels
+ */
+
+#define RADIX_BUCKETS (1 << RADIX_BITS)
+#define RADIX_MASK (RADIX_BUCKETS - 1)
+
+
+
+__kernel void radix_histogram(__global const uint *keys,
+                              __global uint *histogram,
+                              uint n,
+                              uint shift)
+{
+  uint item = get_global_id(0);
+  uint num_items = get_global_size(0);
+
+  uint counts[RADIX_BUCKETS];
+  for (uint d = 0; d < RADIX_BUCKETS; ++d)
+  {
+    counts[d] = 0;
+  }
+
+  uint begin = item * RADIX_BLOCK;
+  uint end = min(begin + RADIX_BLOCK, n);
+  for (uint i = begin; i < end; ++i)
+  {
+    counts[(keys[i] >> shift) & RADIX_MASK]++;
+  }
+
+  // store the histogram digit-major, so that the exclusive scan
+  // gives the final offset of each (digit, block) pair
+  for (uint d = 0; d < RADIX_BUCKETS; ++d)
+  {
+    histogram[d * num_items + item] = counts[d];
+  }
+}
+
+
+/**
+ * Blelloch exclusive scan of 2 * SCAN_WG elements per work-group.
+ * The total of each work-group is stored to block_sums.
+ */
+__kernel void radix_scan_local(__global uint *data,
+                               __global uint *block_sums,
+                               __local uint *tmp,
+                               uint n)
+{
+  uint lid = get_local_id(0);
+  uint group = get_group_id(0);
+  uint base = group * (2 * SCAN_WG);
+  uint ai = base + lid;
+  uint bi = base + lid + SCAN_WG;
+
+  tmp[lid] = (ai < n) ? data[ai] : 0;
+  tmp[lid + SCAN_WG] = (bi < n) ? data[bi] : 0;
+
+  /* up-sweep */
+  uint offset = 1;
+  for (uint d = SCAN_WG; d > 0; d >>= 1)
+  {
+    barrier(CLK_LOCAL_MEM_FENCE);
+    if (lid < d)
+    {
+      uint a = offset * (2 * lid + 1) - 1;
+      uint b = offset * (2 * lid + 2) - 1;
+      tmp[b] += tmp[a];
+    }
+    offset <<= 1;
+  }
+
+  if (lid == 0)
+  {
+    block_sums[group] = tmp[2 * SCAN_WG - 1];
+    tmp[2 * SCAN_WG - 1] = 0;
+  }
+
+  /* down-sweep */
+  for (uint d = 1; d <= SCAN_WG; d <<= 1)
+  {
+    offset >>= 1;
+    barrier(CLK_LOCAL_MEM_FENCE);
+    if (lid < d)
+    {
+      uint a = offset * (2 * lid + 1) - 1;
+      uint b = offset * (2 * lid + 2) - 1;
+      uint t = tmp[a];
+      tmp[a] = tmp[b];
+      tmp[b] += t;
+    }
+  }
+
+  barrier(CLK_LOCAL_MEM_FENCE);
+
+  if (ai < n) data[ai] = tmp[lid];
+  if (bi < n) data[bi] = tmp[lid + SCAN_WG];
+}
+
+
+/**
+ * Adds the scanned block totals to each element of the block
+ */
+__kernel void radix_scan_add(__global uint *data,
+                             __global const uint *block_sums,
+                             uint n)
+{
+  uint i = get_global_id(0);
+  if (i < n)
+  {
+    data[i] += block_sums[i / (2 * SCAN_WG)];
+  }
+}
+
+
+__kernel void radix_scatter(__global const uint *keys_in,
+                            __global const uint *values_in,
+                            __global uint *keys_out,
+                            __global uint *values_out,
+                            __global const uint *offsets,
+                            uint n,
+                            uint shift)
+{
+  uint item = get_global_id(0);
+  uint num_items = get_global_size(0);
+
+  uint dst[RADIX_BUCKETS];
+  for (uint d = 0; d < RADIX_BUCKETS; ++d)
+  {
+    dst[d] = offsets[d * num_items + item];
+  }
+
+  uint begin = item * RADIX_BLOCK;
+  uint end = min(begin + RADIX_BLOCK, n);
+  for (uint i = begin; i < end; ++i)
+  {
+    uint key = keys_in[i];
+    uint pos = dst[(key >> shift) & RADIX_MASK]++;
+    keys_out[pos] = key;
+    values_out[pos] = values_in[i];
+  }
+}
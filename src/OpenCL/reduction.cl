@@ -0,0 +1,110 @@
+/*
+ * Copyright (C) 2014 Matus Fedorko <xfedor01@stud.fit.vutbr.cz>
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty.  In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+
+ * 1. The origin of this software must not be misrepresented; you must not
+ *    claim that you wrote the original software. If you use this software
+ *    in a product, an acknowledgment in the product documentation would be
+ *    appreciated but is not required.
+ * 2. Altered source versions must be plainly marked as such, and must not be
+ *    misrepresented as being the original software.
+ * 3. This notice may not be removed or altered from any source distribution.
+ */
+
+
+/**
+ * A generic work-group reduction, the actual types and operation are given
+ * by the following macros that are generated by ocl::Reduction:
+ *   RED_T                  - the type of the result
+ *   RED_IN_T               - the type of input elements
+ *   RED_IN2_T              - the type of elements of the optional second input
+ *   RED_LOAD(p, i)         - loads the i-th element of an input buffer
+ *   RED_MAP(x, y)          - converts the loaded input element(s) to RED_T
+ *   RED_PREPARE(v)         - applied to each mapped value before combining (e.g. squaring)
+ *   RED_COMBINE(a, b)      - the reduction operator
+ *   RED_IDENTITY           - the identity element of the reduction operator
+ *   RED_SUBGROUP_REDUCE(v) - the same reduction across a sub-group
+ *
+ * Each work-group writes a single partial result, the partial results
+ * are combined on host, which is cheaper than another kernel launch
+ * for the small number of work-groups used.
+ * Without sub-groups the work-group size has to be a power of two.
+ */
+
+#ifdef cl_khr_subgroups
+#  pragma OPENCL EXTENSION cl_khr_subgroups : enable
+#  define RED_USE_SUBGROUPS
+#endif
+
+
+
+__kernel void reduce(__global const RED_IN_T *input,
+#ifdef RED_IN2_T
+                     __global const RED_IN2_T *input2,
+#endif
+                     __global RED_T *partial,
+                     __local RED_T *scratch,
+                     uint n)
+{
+  uint lid = get_local_id(0);
+
+  /* each work-item reduces a strided subset of the input */
+  RED_T acc = RED_IDENTITY;
+
+  for (uint i = get_global_id(0); i < n; i += get_global_size(0))
+  {
+#ifdef RED_IN2_T
+    RED_T v = RED_MAP(RED_LOAD(input, i), RED_LOAD(input2, i));
+#else
+    RED_T v = RED_MAP(RED_LOAD(input, i), 0);
+#endif
+    acc = RED_COMBINE(acc, RED_PREPARE(v));
+  }
+
+#ifdef RED_USE_SUBGROUPS
+  /* reduce within sub-groups and then the results of sub-groups */
+  acc = RED_SUBGROUP_REDUCE(acc);
+
+  if (get_sub_group_local_id() == 0)
+  {
+    scratch[get_sub_group_id()] = acc;
+  }
+
+  barrier(CLK_LOCAL_MEM_FENCE);
+
+  if (lid == 0)
+  {
+    for (uint s = 1; s < get_num_sub_groups(); ++s)
+    {
+      acc = RED_COMBINE(acc, scratch[s]);
+    }
+
+    partial[get_group_id(0)] = acc;
+  }
+#else
+  /* a tree reduction in local memory */
+  scratch[lid] = acc;
+  barrier(CLK_LOCAL_MEM_FENCE);
+
+  for (uint s = get_local_size(0) / 2; s > 0; s >>= 1)
+  {
+    if (lid < s)
+    {
+      scratch[lid] = RED_COMBINE(scratch[lid], scratch[lid + s]);
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+  }
+
+  if (lid == 0)
+  {
+    partial[get_group_id(0)] = scratch[0];
+  }
+#endif
+}
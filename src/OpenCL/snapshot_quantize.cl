@@ -0,0 +1,99 @@
+/*
+ * Copyright (C) 2014 Matus Fedorko <xfedor01@stud.fit.vutbr.cz>
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty.  In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+
+ * 1. The origin of this software must not be misrepresented; you must not
+ *    claim that you wrote the original software. If you use this software
+ *    in a product, an acknowledgment in the product documentation would be
+ *    appreciated but is not required.
+ * 2. Altered source versions must be plainly marked as such, and must not be
+ *    misrepresented as being the original software.
+ * 3. This notice may not be removed or altered from any source distribution.
+ */
+
+/**
+ * Quantization of particle positions for compressed snapshots (see SnapshotWriter.h).
+ * Depends on the particle layout helpers from sph_layout.cl.
+ *
+ * The positions are quantized to an integer grid over the bounding volume
+ * (with up to 21 bits per axis) and the result is either a keyframe or a delta frame:
+ *   keyframe    - the quantized positions are stored to the keyframe buffer and
+ *                 codes[2i, 2i + 1] hold the (low, high) words of the Morton code of particle i,
+ *                 the codes are sorted and differenced by the writer thread, because
+ *                 only the grid mode of the simulation keeps the particles in Morton order
+ *   delta frame - codes[i], codes[n + i] and codes[2n + i] hold the zigzag encoded
+ *                 differences of x, y and z from the position of particle i in the last keyframe
+ */
+
+/** Quantizes a position to the integer grid */
+uint4 snapshot_quantize_pos(float4 pos, float4 volumemin, float4 scale, uint maxcoord)
+{
+  float4 q = clamp((pos - volumemin) * scale, 0.0f, (float) maxcoord);
+  return convert_uint4_sat_rte(q);
+}
+
+/** Inserts two zero bits after each of the lowest 21 bits of v */
+ulong snapshot_morton_expand_bits(ulong v)
+{
+  v &= 0x1FFFFFul;
+  v = (v | (v << 32)) & 0x001F00000000FFFFul;
+  v = (v | (v << 16)) & 0x001F0000FF0000FFul;
+  v = (v | (v << 8))  & 0x100F00F00F00F00Ful;
+  v = (v | (v << 4))  & 0x10C30C30C30C30C3ul;
+  v = (v | (v << 2))  & 0x1249249249249249ul;
+  return v;
+}
+
+ulong snapshot_morton_code(uint4 q)
+{
+  return (snapshot_morton_expand_bits(q.z) << 2) |
+         (snapshot_morton_expand_bits(q.y) << 1) |
+          snapshot_morton_expand_bits(q.x);
+}
+
+/** Maps signed differences to unsigned numbers (0, -1, 1, -2, ... -> 0, 1, 2, 3, ...) */
+uint snapshot_zigzag(int d)
+{
+  return ((uint) d << 1) ^ (uint) (d >> 31);
+}
+
+
+__kernel void snapshot_quantize(__global const sph_vec_t *pos,
+                                __global uint *keyframe,
+                                __global uint *codes,
+                                float4 volumemin,
+                                float4 scale,
+                                uint maxcoord,
+                                uint numparticles,
+                                int is_keyframe)
+{
+  uint i = get_global_id(0);
+  if (i >= numparticles) return;
+
+  uint4 q = snapshot_quantize_pos(sph_load(pos, i), volumemin, scale, maxcoord);
+
+  if (is_keyframe)
+  {
+    ulong code = snapshot_morton_code(q);
+
+    keyframe[i] = q.x;
+    keyframe[numparticles + i] = q.y;
+    keyframe[2 * numparticles + i] = q.z;
+
+    codes[2 * i] = (uint) code;
+    codes[2 * i + 1] = (uint) (code >> 32);
+  }
+  else
+  {
+    codes[i] = snapshot_zigzag((int) (q.x - keyframe[i]));
+    codes[numparticles + i] = snapshot_zigzag((int) (q.y - keyframe[numparticles + i]));
+    codes[2 * numparticles + i] = snapshot_zigzag((int) (q.z - keyframe[2 * numparticles + i]));
+  }
+}
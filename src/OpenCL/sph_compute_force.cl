@@ -24,21 +24,20 @@
  * and http://joeyfladderak.com/portfolio-items/sph-fluid-simulation/
  */
  
-__kernel void sph_compute_force(__global float4* pos,
-                                __global float* density,
-                                __global float* pressure,
+__kernel void sph_compute_force(__global sph_vec_t* pos,
+                                __global float2* density_pressure,
                                 __global float4* forces,
-                                __global float4* vel,
-                                float simscale,
-                                float smoothradius,
-                                float radius2,
+                                __global sph_vec_t* vel,
                                 //float viscosity,
                                 //float lapkern,
-                                float vterm,
-                                float spikykern_half,
                                 unsigned int numparticles)
 {
   unsigned int i = get_global_id(0);
+  if (i >= numparticles) return;
+
+  float4 pos_i = sph_load(pos, i);
+  float4 vel_i = sph_load(vel, i);
+  float2 dp_i = density_pressure[i];
 
   float4 force = (float4) (0.0f, 0.0f, 0.0f, 0.0f);
 
@@ -46,38 +45,325 @@ __kernel void sph_compute_force(__global float4* pos,
 
   for (int j = 0; j < i; ++j)
   {
-    float4 d = (pos[i] - pos[j]) * simscale;
+    float4 d = (pos_i - sph_load(pos, j)) * SPH_SIM_SCALE;
     float sqr = dot(d, d);
 
-    if (radius2 > sqr)
+    if (SPH_RADIUS2 > sqr)
     {
+      float2 dp_j = density_pressure[j];
       float r = sqrt(sqr);
-      float c = (smoothradius - r);
+      float c = (SPH_SMOOTH_RADIUS - r);
       //float pterm = -0.5f * c * spikeykern * (pressure[i] + pressure[j]) / r;
-      float pterm = c * spikykern_half * (pressure[i] + pressure[j]) / r;
-      float dterm = c * density[i] * density[j];
+      float pterm = c * SPH_SPIKYKERN_HALF * (dp_i.y + dp_j.y) / r;
+      float dterm = c * dp_i.x * dp_j.x;
     
-      force += (pterm * d + vterm * (vel[j] - vel[i])) * dterm;
+      force += (pterm * d + SPH_VTERM * (sph_load(vel, j) - vel_i)) * dterm;
     }
   }
 
   for (int j = i + 1; j < numparticles; ++j)
   {
-    float4 d = (pos[i] - pos[j]) * simscale;
+    float4 d = (pos_i - sph_load(pos, j)) * SPH_SIM_SCALE;
     float sqr = dot(d, d);
     
-    if (radius2 > sqr)
+    if (SPH_RADIUS2 > sqr)
     {
+      float2 dp_j = density_pressure[j];
       float r = sqrt(sqr);
-      float c = (smoothradius - r);
+      float c = (SPH_SMOOTH_RADIUS - r);
       //float pterm = -0.5f * c * spikeykern * (pressure[i] + pressure[j]) / r;
-      float pterm = c * spikykern_half * (pressure[i] + pressure[j]) / r;
-      float dterm = c * density[i] * density[j];
+      float pterm = c * SPH_SPIKYKERN_HALF * (dp_i.y + dp_j.y) / r;
+      float dterm = c * dp_i.x * dp_j.x;
 
-      force += (pterm * d + vterm * (vel[j] - vel[i])) * dterm;
+      force += (pterm * d + SPH_VTERM * (sph_load(vel, j) - vel_i)) * dterm;
     }
   }
   
   forces[i] = force;
 }
- 
\ No newline at end of file
+ 
+
+/**
+ * Accumulates the force acting on particle i from the particles
+ * in the 27 grid cells surrounding particle's own cell (see sph_grid.cl)
+ */
+float4 sph_force_grid(int i,
+                      __global sph_vec_t* pos,
+                      __global float2* density_pressure,
+                      __global sph_vec_t* vel,
+                      __global int* cell_head,
+                      __global int* cell_next,
+                      float4 volumemin,
+                      float cellsize,
+                      int4 gridsize)
+{
+  float4 pos_i = sph_load(pos, i);
+  float4 vel_i = sph_load(vel, i);
+  float2 dp_i = density_pressure[i];
+  int4 cell = sph_grid_cell_coords(pos_i, volumemin, cellsize, gridsize);
+  int4 cmin = max(cell - (int4) (1), (int4) (0));
+  int4 cmax = min(cell + (int4) (1), gridsize - (int4) (1));
+
+  float4 force = (float4) (0.0f, 0.0f, 0.0f, 0.0f);
+
+  for (int z = cmin.z; z <= cmax.z; ++z)
+  {
+    for (int y = cmin.y; y <= cmax.y; ++y)
+    {
+      for (int x = cmin.x; x <= cmax.x; ++x)
+      {
+        int j = cell_head[sph_grid_cell_index((int4) (x, y, z, 0), gridsize)];
+
+        while (j != GRID_END_OF_LIST)
+        {
+          if (j != i)
+          {
+            float4 d = (pos_i - sph_load(pos, j)) * SPH_SIM_SCALE;
+            float sqr = dot(d, d);
+
+            if (SPH_RADIUS2 > sqr)
+            {
+              float2 dp_j = density_pressure[j];
+              float r = sqrt(sqr);
+              float c = (SPH_SMOOTH_RADIUS - r);
+              float pterm = c * SPH_SPIKYKERN_HALF * (dp_i.y + dp_j.y) / r;
+              float dterm = c * dp_i.x * dp_j.x;
+
+              force += (pterm * d + SPH_VTERM * (sph_load(vel, j) - vel_i)) * dterm;
+            }
+          }
+
+          j = cell_next[j];
+        }
+      }
+    }
+  }
+
+  return force;
+}
+
+/**
+ * The same calculation as above, but only the particles from the 27 grid cells
+ * surrounding particle's own cell are visited
+ */
+__kernel void sph_compute_force_grid(__global sph_vec_t* pos,
+                                     __global float2* density_pressure,
+                                     __global float4* forces,
+                                     __global sph_vec_t* vel,
+                                     __global int* cell_head,
+                                     __global int* cell_next,
+                                     float4 volumemin,
+                                     float cellsize,
+                                     int4 gridsize,
+                                     uint numparticles)
+{
+  int i = get_global_id(0);
+  if (i >= numparticles) return;
+
+  forces[i] = sph_force_grid(i, pos, density_pressure, vel,
+                             cell_head, cell_next, volumemin, cellsize, gridsize);
+}
+
+
+/**
+ * The same calculation as above, but only the particles from the particle's
+ * Verlet neighbour list are visited (see sph_neighbors.cl)
+ */
+__kernel void sph_compute_force_list(__global sph_vec_t* pos,
+                                     __global float2* density_pressure,
+                                     __global float4* forces,
+                                     __global sph_vec_t* vel,
+                                     __global int* list32,
+                                     __global short* list16,
+                                     __global uint* count,
+                                     uint compressed,
+                                     uint numparticles)
+{
+  int i = get_global_id(0);
+  if (i >= numparticles) return;
+
+  float4 pos_i = sph_load(pos, i);
+  float4 vel_i = sph_load(vel, i);
+  float2 dp_i = density_pressure[i];
+  int num = count[i];
+
+  float4 force = (float4) (0.0f, 0.0f, 0.0f, 0.0f);
+
+  for (int k = 0; k < num; ++k)
+  {
+    int j = sph_neighbor_load(i, k, list32, list16, compressed, numparticles);
+    float4 d = (pos_i - sph_load(pos, j)) * SPH_SIM_SCALE;
+    float sqr = dot(d, d);
+
+    if (SPH_RADIUS2 > sqr)
+    {
+      float2 dp_j = density_pressure[j];
+      float r = sqrt(sqr);
+      float c = (SPH_SMOOTH_RADIUS - r);
+      float pterm = c * SPH_SPIKYKERN_HALF * (dp_i.y + dp_j.y) / r;
+      float dterm = c * dp_i.x * dp_j.x;
+
+      force += (pterm * d + SPH_VTERM * (sph_load(vel, j) - vel_i)) * dterm;
+    }
+  }
+
+  forces[i] = force;
+}
+
+
+/**
+ * Accumulates the force acting on particle i from all particles, the particle
+ * data are processed in tiles staged in local memory (see sph_compute_pressure_tiled).
+ * Has to be called by all work-items of the work-group, including the padding ones.
+ */
+float4 sph_force_tiled(uint i,
+                       __global sph_vec_t* pos,
+                       __global float2* density_pressure,
+                       __global sph_vec_t* vel,
+                       __local float4* tile_pos,
+                       __local float4* tile_vel,
+                       __local float2* tile_dp,
+                       uint numparticles)
+{
+  uint lid = get_local_id(0);
+  uint tile_size = get_local_size(0);
+
+  bool valid = (i < numparticles);
+  float4 pos_i = valid ? sph_load(pos, i) : (float4) (0.0f);
+  float4 vel_i = valid ? sph_load(vel, i) : (float4) (0.0f);
+  float2 dp_i = valid ? density_pressure[i] : (float2) (0.0f);
+
+  float4 force = (float4) (0.0f, 0.0f, 0.0f, 0.0f);
+
+  for (uint base = 0; base < numparticles; base += tile_size)
+  {
+    /* stage the tile */
+    uint j = base + lid;
+    if (j < numparticles)
+    {
+      tile_pos[lid] = sph_load(pos, j);
+      tile_vel[lid] = sph_load(vel, j);
+      tile_dp[lid] = density_pressure[j];
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    uint count = min(tile_size, numparticles - base);
+    for (uint k = 0; k < count; ++k)
+    {
+      float4 d = (pos_i - tile_pos[k]) * SPH_SIM_SCALE;
+      float sqr = dot(d, d);
+
+      if ((SPH_RADIUS2 > sqr) && (base + k != i))
+      {
+        float r = sqrt(sqr);
+        float c = (SPH_SMOOTH_RADIUS - r);
+        float pterm = c * SPH_SPIKYKERN_HALF * (dp_i.y + tile_dp[k].y) / r;
+        float dterm = c * dp_i.x * tile_dp[k].x;
+
+        force += (pterm * d + SPH_VTERM * (tile_vel[k] - vel_i)) * dterm;
+      }
+    }
+
+    barrier(CLK_LOCAL_MEM_FENCE);
+  }
+
+  return force;
+}
+
+/**
+ * The same calculation as the brute force version, but the particle data
+ * are processed in tiles staged in local memory
+ */
+__kernel void sph_compute_force_tiled(__global sph_vec_t* pos,
+                                      __global float2* density_pressure,
+                                      __global float4* forces,
+                                      __global sph_vec_t* vel,
+                                      __local float4* tile_pos,
+                                      __local float4* tile_vel,
+                                      __local float2* tile_dp,
+                                      uint numparticles)
+{
+  uint i = get_global_id(0);
+
+  float4 force = sph_force_tiled(i, pos, density_pressure, vel,
+                                 tile_pos, tile_vel, tile_dp, numparticles);
+
+  if (i < numparticles)
+  {
+    forces[i] = force;
+  }
+}
+
+
+/**
+ * Pair symmetric version of sph_compute_force_grid (see sph_compute_pressure_sym).
+ * The force between two particles is antisymmetric, so each pair is evaluated
+ * only once, the force is added to particle i and subtracted from particle j.
+ * The forces buffer has to be cleared before.
+ */
+__kernel void sph_compute_force_sym(__global sph_vec_t* pos,
+                                    __global float2* density_pressure,
+                                    __global float4* forces,
+                                    __global sph_vec_t* vel,
+                                    __global int* cell_head,
+                                    __global int* cell_next,
+                                    float4 volumemin,
+                                    float cellsize,
+                                    int4 gridsize,
+                                    uint numparticles)
+{
+  int i = get_global_id(0);
+  if (i >= numparticles) return;
+
+  float4 pos_i = sph_load(pos, i);
+  float4 vel_i = sph_load(vel, i);
+  float2 dp_i = density_pressure[i];
+  int4 cell = sph_grid_cell_coords(pos_i, volumemin, cellsize, gridsize);
+
+  float4 force = (float4) (0.0f, 0.0f, 0.0f, 0.0f);
+
+  for (int dz = 0; dz <= 1; ++dz)
+  {
+    for (int dy = -1; dy <= 1; ++dy)
+    {
+      for (int dx = -1; dx <= 1; ++dx)
+      {
+        int4 nc = cell + (int4) (dx, dy, dz, 0);
+        if (!sph_grid_half_stencil(dx, dy, dz) ||
+            any(nc.xyz < (int3) (0)) || any(nc.xyz >= gridsize.xyz))
+        {
+          continue;
+        }
+
+        bool own_cell = (dx == 0) && (dy == 0) && (dz == 0);
+        int j = cell_head[sph_grid_cell_index(nc, gridsize)];
+
+        while (j != GRID_END_OF_LIST)
+        {
+          if (!own_cell || (j > i))
+          {
+            float4 d = (pos_i - sph_load(pos, j)) * SPH_SIM_SCALE;
+            float sqr = dot(d, d);
+
+            if (SPH_RADIUS2 > sqr)
+            {
+              float2 dp_j = density_pressure[j];
+              float r = sqrt(sqr);
+              float c = (SPH_SMOOTH_RADIUS - r);
+              float pterm = c * SPH_SPIKYKERN_HALF * (dp_i.y + dp_j.y) / r;
+              float dterm = c * dp_i.x * dp_j.x;
+              float4 f = (pterm * d + SPH_VTERM * (sph_load(vel, j) - vel_i)) * dterm;
+
+              force += f;
+              sph_atomic_add_float4(&forces[j], -f);
+            }
+          }
+
+          j = cell_next[j];
+        }
+      }
+    }
+  }
+
+  sph_atomic_add_float4(&forces[i], force);
+}
@@ -24,20 +24,17 @@
  * and http://joeyfladderak.com/portfolio-items/sph-fluid-simulation/
  */
 
-__kernel void sph_compute_pressure(__global float4* pos,
-                                   __global float* density,
-                                   __global float* pressure,
-                                   float simscale,
+__kernel void sph_compute_pressure(__global sph_vec_t* pos,
+                                   __global float2* density_pressure,
                                    //float smoothradius,
-                                   float radius2,
                                    //float mass,
                                    //float polykern,
-                                   float mass_polykern,
-                                   float restdensity,
-                                   float intstiffness,
                                    uint numparticles)
 {
   uint i = get_global_id(0);
+  if (i >= numparticles) return;
+
+  float4 pos_i = sph_load(pos, i);
   
   // The calculation is split in two loops to avoid
   // computing with self and to avoid an unnecessary
@@ -47,7 +44,7 @@ __kernel void sph_compute_pressure(__global float4* pos,
 
   for (int j = 0; j < i; ++j)
   {
-    float4 d = (pos[i] - pos[j]) * simscale;
+    float4 d = (pos_i - sph_load(pos, j)) * SPH_SIM_SCALE;
 
     // note for myself:
     // the dot product of float4 is defined as x*x + y*y + z*z + w*w,
@@ -58,29 +55,309 @@ __kernel void sph_compute_pressure(__global float4* pos,
     // to dsq = dot(d.xyz, d.xyz) or something similar
     float sqr = dot(d, d);
 
-    if (radius2 > sqr)
+    if (SPH_RADIUS2 > sqr)
     {
-      float c = radius2 - sqr;
+      float c = SPH_RADIUS2 - sqr;
       sum += c * c * c;
     }
   }
 
   for (int j = i + 1; j < numparticles; ++j)
   {
-    float4 d = (pos[i] - pos[j]) * simscale;
+    float4 d = (pos_i - sph_load(pos, j)) * SPH_SIM_SCALE;
     float sqr = dot(d, d);
 
-    if (radius2 > sqr)
+    if (SPH_RADIUS2 > sqr)
     {
-      float c = radius2 - sqr;
+      float c = SPH_RADIUS2 - sqr;
       sum += c * c * c;
     }
   }
 
   // polykern konstanta
-  float ro = sum * mass_polykern; //mass * polykern;
+  float ro = sum * SPH_MASS_POLYKERN; //mass * polykern;
   
   //                          kludova hustota vody pri 20 C     plynova konstanta (ci sa to bude chovat skor ako plyn)
-  pressure[i] = (ro - restdensity) * intstiffness;   // vzorec
-  density[i] = 1.0f / ro;
-}
\ No newline at end of file
+  density_pressure[i] = (float2) (1.0f / ro,
+                                  (ro - SPH_REST_DENSITY) * SPH_INT_STIFFNESS);   // vzorec
+}
+
+/**
+ * The same calculation as above, but only the particles from the 27 grid cells
+ * surrounding particle's own cell are visited (see sph_grid.cl)
+ */
+__kernel void sph_compute_pressure_grid(__global sph_vec_t* pos,
+                                        __global float2* density_pressure,
+                                        __global int* cell_head,
+                                        __global int* cell_next,
+                                        float4 volumemin,
+                                        float cellsize,
+                                        int4 gridsize,
+                                        uint numparticles)
+{
+  int i = get_global_id(0);
+  if (i >= numparticles) return;
+
+  float4 pos_i = sph_load(pos, i);
+  int4 cell = sph_grid_cell_coords(pos_i, volumemin, cellsize, gridsize);
+  int4 cmin = max(cell - (int4) (1), (int4) (0));
+  int4 cmax = min(cell + (int4) (1), gridsize - (int4) (1));
+
+  float sum = 0.0f;
+
+  for (int z = cmin.z; z <= cmax.z; ++z)
+  {
+    for (int y = cmin.y; y <= cmax.y; ++y)
+    {
+      for (int x = cmin.x; x <= cmax.x; ++x)
+      {
+        int j = cell_head[sph_grid_cell_index((int4) (x, y, z, 0), gridsize)];
+
+        while (j != GRID_END_OF_LIST)
+        {
+          if (j != i)
+          {
+            float4 d = (pos_i - sph_load(pos, j)) * SPH_SIM_SCALE;
+            float sqr = dot(d, d);
+
+            if (SPH_RADIUS2 > sqr)
+            {
+              float c = SPH_RADIUS2 - sqr;
+              sum += c * c * c;
+            }
+          }
+
+          j = cell_next[j];
+        }
+      }
+    }
+  }
+
+  float ro = sum * SPH_MASS_POLYKERN;
+
+  density_pressure[i] = (float2) (1.0f / ro, (ro - SPH_REST_DENSITY) * SPH_INT_STIFFNESS);
+}
+
+/**
+ * The same calculation as above, but only the particles from the particle's
+ * Verlet neighbour list are visited (see sph_neighbors.cl)
+ */
+__kernel void sph_compute_pressure_list(__global sph_vec_t* pos,
+                                        __global float2* density_pressure,
+                                        __global int* list32,
+                                        __global short* list16,
+                                        __global uint* count,
+                                        uint compressed,
+                                        uint numparticles)
+{
+  int i = get_global_id(0);
+  if (i >= numparticles) return;
+
+  float4 pos_i = sph_load(pos, i);
+  int num = count[i];
+
+  float sum = 0.0f;
+
+  for (int k = 0; k < num; ++k)
+  {
+    int j = sph_neighbor_load(i, k, list32, list16, compressed, numparticles);
+    float4 d = (pos_i - sph_load(pos, j)) * SPH_SIM_SCALE;
+    float sqr = dot(d, d);
+
+    if (SPH_RADIUS2 > sqr)
+    {
+      float c = SPH_RADIUS2 - sqr;
+      sum += c * c * c;
+    }
+  }
+
+  float ro = sum * SPH_MASS_POLYKERN;
+
+  density_pressure[i] = (float2) (1.0f / ro, (ro - SPH_REST_DENSITY) * SPH_INT_STIFFNESS);
+}
+
+/**
+ * The same calculation as the brute force version, but the positions are
+ * processed in tiles of get_local_size(0) particles that are first staged
+ * in local memory and then shared by all work-items of the work-group.
+ * The global size may be padded to a multiple of the work-group size,
+ * the padding work-items only help to load the tiles.
+ */
+__kernel void sph_compute_pressure_tiled(__global sph_vec_t* pos,
+                                         __global float2* density_pressure,
+                                         __local float4* tile_pos,
+                                         uint numparticles)
+{
+  uint i = get_global_id(0);
+  uint lid = get_local_id(0);
+  uint tile_size = get_local_size(0);
+
+  float4 pos_i = (i < numparticles) ? sph_load(pos, i) : (float4) (0.0f);
+
+  float sum = 0.0f;
+
+  for (uint base = 0; base < numparticles; base += tile_size)
+  {
+    /* stage the tile */
+    uint j = base + lid;
+    tile_pos[lid] = (j < numparticles) ? sph_load(pos, j) : (float4) (0.0f);
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    uint count = min(tile_size, numparticles - base);
+    for (uint k = 0; k < count; ++k)
+    {
+      float4 d = (pos_i - tile_pos[k]) * SPH_SIM_SCALE;
+      float sqr = dot(d, d);
+
+      if ((SPH_RADIUS2 > sqr) && (base + k != i))
+      {
+        float c = SPH_RADIUS2 - sqr;
+        sum += c * c * c;
+      }
+    }
+
+    barrier(CLK_LOCAL_MEM_FENCE);
+  }
+
+  if (i < numparticles)
+  {
+    float ro = sum * SPH_MASS_POLYKERN;
+
+    density_pressure[i] = (float2) (1.0f / ro, (ro - SPH_REST_DENSITY) * SPH_INT_STIFFNESS);
+  }
+}
+
+
+/**
+ * Atomically adds a value to a float in global memory.
+ * OpenCL 1.1 has no floating point atomics, so the addition
+ * is emulated with a compare and exchange loop on the bit pattern.
+ */
+void sph_atomic_add_float(volatile __global float *p, float val)
+{
+  union { uint u; float f; } old_val, new_val;
+
+  do
+  {
+    old_val.f = *p;
+    new_val.f = old_val.f + val;
+  }
+  while (atomic_cmpxchg((volatile __global uint *) p, old_val.u, new_val.u) != old_val.u);
+}
+
+/** Atomically adds the xyz components of a vector to a float4 in global memory */
+void sph_atomic_add_float4(__global float4 *p, float4 val)
+{
+  volatile __global float *pf = (volatile __global float *) p;
+
+  sph_atomic_add_float(pf + 0, val.x);
+  sph_atomic_add_float(pf + 1, val.y);
+  sph_atomic_add_float(pf + 2, val.z);
+}
+
+/**
+ * Returns true for the cells of the half stencil, i.e. the particle's own cell
+ * and the 13 neighbouring cells that are "after" it. Every pair of neighbouring
+ * cells appears in exactly one of their half stencils.
+ */
+bool sph_grid_half_stencil(int dx, int dy, int dz)
+{
+  return (dz > 0) || ((dz == 0) && ((dy > 0) || ((dy == 0) && (dx >= 0))));
+}
+
+
+/**
+ * Clears the accumulators of the symmetric kernels
+ */
+__kernel void sph_symmetric_clear(__global float2* density_pressure,
+                                  __global float4* forces,
+                                  uint numparticles)
+{
+  int i = get_global_id(0);
+  if (i >= numparticles) return;
+
+  density_pressure[i] = (float2) (0.0f, 0.0f);
+  forces[i] = (float4) (0.0f, 0.0f, 0.0f, 0.0f);
+}
+
+
+/**
+ * Pair symmetric version of sph_compute_pressure_grid, every pair of particles
+ * is evaluated only once and the contribution is added to both particles.
+ * The density buffer has to be cleared before and its x components contain only
+ * the sums of the kernel, sph_compute_pressure_finalize computes the actual values.
+ */
+__kernel void sph_compute_pressure_sym(__global sph_vec_t* pos,
+                                       __global float2* density_pressure,
+                                       __global int* cell_head,
+                                       __global int* cell_next,
+                                       float4 volumemin,
+                                       float cellsize,
+                                       int4 gridsize,
+                                       uint numparticles)
+{
+  int i = get_global_id(0);
+  if (i >= numparticles) return;
+
+  float4 pos_i = sph_load(pos, i);
+  int4 cell = sph_grid_cell_coords(pos_i, volumemin, cellsize, gridsize);
+
+  float sum = 0.0f;
+
+  for (int dz = 0; dz <= 1; ++dz)
+  {
+    for (int dy = -1; dy <= 1; ++dy)
+    {
+      for (int dx = -1; dx <= 1; ++dx)
+      {
+        int4 nc = cell + (int4) (dx, dy, dz, 0);
+        if (!sph_grid_half_stencil(dx, dy, dz) ||
+            any(nc.xyz < (int3) (0)) || any(nc.xyz >= gridsize.xyz))
+        {
+          continue;
+        }
+
+        bool own_cell = (dx == 0) && (dy == 0) && (dz == 0);
+        int j = cell_head[sph_grid_cell_index(nc, gridsize)];
+
+        while (j != GRID_END_OF_LIST)
+        {
+          // in particle's own cell each pair is visited from the lower index only
+          if (!own_cell || (j > i))
+          {
+            float4 d = (pos_i - sph_load(pos, j)) * SPH_SIM_SCALE;
+            float sqr = dot(d, d);
+
+            if (SPH_RADIUS2 > sqr)
+            {
+              float w = SPH_RADIUS2 - sqr;
+              w = w * w * w;
+              sum += w;
+              sph_atomic_add_float((__global float *) &density_pressure[j], w);
+            }
+          }
+
+          j = cell_next[j];
+        }
+      }
+    }
+  }
+
+  sph_atomic_add_float((__global float *) &density_pressure[i], sum);
+}
+
+
+/**
+ * Converts the kernel sums accumulated by sph_compute_pressure_sym
+ * to pressure and (inverse) density
+ */
+__kernel void sph_compute_pressure_finalize(__global float2* density_pressure,
+                                            uint numparticles)
+{
+  int i = get_global_id(0);
+  if (i >= numparticles) return;
+
+  float ro = density_pressure[i].x * SPH_MASS_POLYKERN;
+
+  density_pressure[i] = (float2) (1.0f / ro, (ro - SPH_REST_DENSITY) * SPH_INT_STIFFNESS);
+}
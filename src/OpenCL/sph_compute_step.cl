@@ -30,107 +30,99 @@
 
 
 
-__kernel void sph_compute_step(__global float4* position,
-                               __global float4* forces,
-                               __global float4* velocity,
-                               __global float4* prevvelocity,
-                               float slope,
-                               float leftwave,
-                               float rightwave,
-                               float deltatime,
-                               float limit,
-                               float extstiffness,
-                               float extdamping,
-                               float radius,
-                               float4 volumemin,
-                               float4 volumemax,
-                               float simscale,
-                               float mass,
-                               float time,
-                               uint flags)
-                               //float4 gravitation)
+/**
+ * Applies the boundary conditions and effects to the force acting
+ * on a particle and advances the particle by a single leapfrog step
+ */
+void sph_integrate(float4 force,
+                   float4* position,
+                   float4* velocity,
+                   float4* prevvelocity,
+                   float deltatime,
+                   float4 volumemin,
+                   float4 volumemax,
+                   float time,
+                   uint flags)
 {
-  unsigned int i = get_global_id(0);
-  
   float4 norm = (float4) (0.0f, 0.0f, 0.0f, 0.0f);
   float diff; 
   
-  float4 pos = position[i];
-  float4 prevvel = prevvelocity[i];
-  float4 accel = forces[i] * mass;
+  float4 pos = *position;
+  float4 prevvel = *prevvelocity;
+  float4 accel = force * SPH_MASS;
   
   float speed = accel.x * accel.x + accel.y * accel.y + accel.z * accel.z;
-  if (speed > (limit * limit))
+  if (speed > (SPH_LIMIT * SPH_LIMIT))
   {
-    accel *= limit / sqrt(speed);
+    accel *= SPH_LIMIT / sqrt(speed);
   }
   
   /* Y-axis wall */
-  diff = 2.0f * radius - (pos.y - volumemin.y - (pos.x - volumemin.x) * slope) * simscale;
+  diff = 2.0f * SPH_RADIUS - (pos.y - volumemin.y - (pos.x - volumemin.x) * SPH_SLOPE) * SPH_SIM_SCALE;
   if (diff > 0.0001f)
   {
-    float4 norm = (float4) (-slope, 1.0f - slope, 0.0f, 0.0f);
+    float4 norm = (float4) (-SPH_SLOPE, 1.0f - SPH_SLOPE, 0.0f, 0.0f);
     //norm.x = -slope;
     //norm.z = 0.0f;
     //norm.y = 1.0f - slope;  // = float4(-0, 0, 1.0 - 0, 0);
-    float adj = extstiffness * diff - extdamping * dot(norm, prevvel);
+    float adj = SPH_EXT_STIFFNESS * diff - SPH_EXT_DAMPING * dot(norm, prevvel);
     accel += adj * norm;
   }
   
-  diff = 2.0f * radius - (volumemax.y - pos.y) * simscale;
+  diff = 2.0f * SPH_RADIUS - (volumemax.y - pos.y) * SPH_SIM_SCALE;
   if (diff > 0.0001f)
   {
     float4 norm = (float4) (0.0f, 0.0f, -1.0f, 0.0f);
     //norm.x = 0.0f;
     //norm.z = -1.0f;
     //norm.y = 0.0f;  //float4( 0, 0, -1, 0 );
-    float adj = extstiffness * diff - extdamping * dot(norm, prevvel);
+    float adj = SPH_EXT_STIFFNESS * diff - SPH_EXT_DAMPING * dot(norm, prevvel);
     accel += adj * norm;
   }
   
   /* X-axis walls */
-  diff = 2.0f * radius - (pos.x - volumemin.x + (sin(time * 10.0f) - 1.0f + (pos.y * 0.025f) * 0.25f) * leftwave) * simscale;   
+  diff = 2.0f * SPH_RADIUS - (pos.x - volumemin.x + (sin(time * 10.0f) - 1.0f + (pos.y * 0.025f) * 0.25f) * SPH_LEFT_WAVE) * SPH_SIM_SCALE;   
   if (diff > 0.0001f)
   {
     float4 norm = (float4) (1.0f, 0.0f, 0.0f, 0.0f);
     //norm.x = 1.0f;
     //norm.y = 0.0f;
     //norm.z = 0.0f;  //float4( 1.0, 0, 0, 0 );
-    float adj = (leftwave + 1.0f) * extstiffness * diff - extdamping * dot(norm, prevvel);
+    float adj = (SPH_LEFT_WAVE + 1.0f) * SPH_EXT_STIFFNESS * diff - SPH_EXT_DAMPING * dot(norm, prevvel);
     accel += adj * norm;                
   }
   
-  diff = 2.0f * radius - (volumemax.x - pos.x + (sin(time * 10.0f) - 1.0f) * rightwave) * simscale;  
+  diff = 2.0f * SPH_RADIUS - (volumemax.x - pos.x + (sin(time * 10.0f) - 1.0f) * SPH_RIGHT_WAVE) * SPH_SIM_SCALE;  
   if (diff > 0.0001f)
   {
     float4 norm = (float4) (-1.0f, 0.0f, 0.0f, 0.0f);
     //norm.x = -1.0f;
     //norm.y = 0.0f;
     //norm.z = 0.0f;  //float4( -1, 0, 0, 0 );
-    float adj = (rightwave + 1.0f) * extstiffness * diff - extdamping * dot(norm, prevvel);
+    float adj = (SPH_RIGHT_WAVE + 1.0f) * SPH_EXT_STIFFNESS * diff - SPH_EXT_DAMPING * dot(norm, prevvel);
     accel += adj * norm;
   }
   
   /* Z-axis walls */
-  diff = 2.0f * radius - (pos.z - volumemin.z) * simscale;
+  diff = 2.0f * SPH_RADIUS - (pos.z - volumemin.z) * SPH_SIM_SCALE;
   if (diff > 0.0001f)
   {
     float4 norm = (float4) (0.0f, 0.0f, 1.0f, 0.0f);
     //norm.x = 0.0f;
     //norm.z = 1.0f;
     //norm.y = 0.0f;  //float4( 0, 1, 0, 0 );
-    float adj = extstiffness * diff - extdamping * dot(norm, prevvel);
+    float adj = SPH_EXT_STIFFNESS * diff - SPH_EXT_DAMPING * dot(norm, prevvel);
     accel += adj * norm;
   }
   
-  diff = 2.0f * radius - (volumemax.z - pos.z) * simscale;
+  diff = 2.0f * SPH_RADIUS - (volumemax.z - pos.z) * SPH_SIM_SCALE;
   if (diff > 0.0001f)
   {
     float4 norm = (float4) (0.0f, 0.0f, -1.0f, 0.0f);
     //norm.x = 0.0f;
     //norm.z = -1.0f;
     //norm.y = 0.0f;  //float4( 0, -1, 0, 0 );
-    float adj = extstiffness * diff - extdamping * dot(norm, prevvel);
+    float adj = SPH_EXT_STIFFNESS * diff - SPH_EXT_DAMPING * dot(norm, prevvel);
     accel += adj * norm;
   }
 
@@ -138,9 +130,9 @@ __kernel void sph_compute_step(__global float4* position,
 #if 1
   if (flags & DRAIN_MASK)
   {
-    float dx = (0 - pos.x) * simscale;            // dist in cm
-    float dy = (volumemin.y - pos.y) * simscale;
-    float dz = (0 - pos.z) * simscale;
+    float dx = (0 - pos.x) * SPH_SIM_SCALE;            // dist in cm
+    float dy = (volumemin.y - pos.y) * SPH_SIM_SCALE;
+    float dz = (0 - pos.z) * SPH_SIM_SCALE;
     float dsq = (dx * dx + dy * dy + dz * dz);
     if (0.0001f > dsq)
     {
@@ -155,12 +147,12 @@ __kernel void sph_compute_step(__global float4* position,
 #else
   if (flags & DRAIN_MASK)
   {
-    diff = 2 * radius - (pos.z - volumemin.z - 15) * simscale;
-    if (diff < 2 * radius && diff > 0.0001f && (fabs(pos.x) > 3 || fabs(pos.y) > 3))
+    diff = 2 * SPH_RADIUS - (pos.z - volumemin.z - 15) * SPH_SIM_SCALE;
+    if (diff < 2 * SPH_RADIUS && diff > 0.0001f && (fabs(pos.x) > 3 || fabs(pos.y) > 3))
     {
       norm = (float4) (0, 0, 1, 0);
-      //adj = stiff * diff - damp * dot(norm, prevvelocity[i]);
-      float adj = extstiffness * diff - extdamping * dot(norm, prevvelocity[i]);
+      //adj = stiff * diff - damp * dot(norm, prevvel);
+      float adj = SPH_EXT_STIFFNESS * diff - SPH_EXT_DAMPING * dot(norm, prevvel);
       accel.x += adj * norm.x; accel.y += adj * norm.y; accel.z += adj * norm.z;
     }
   }
@@ -175,9 +167,9 @@ __kernel void sph_compute_step(__global float4* position,
   /* fountain */
   if (flags & FOUNTAIN_MASK)
   {
-    float dx = (0 - pos.x) * simscale;            // dist in cm
-    float dy = (volumemin.y - pos.y) * simscale;
-    float dz = (0 - pos.z) * simscale;
+    float dx = (0 - pos.x) * SPH_SIM_SCALE;            // dist in cm
+    float dy = (volumemin.y - pos.y) * SPH_SIM_SCALE;
+    float dz = (0 - pos.z) * SPH_SIM_SCALE;
     float dsq = (dx * dx + dy * dy + dz * dz);
     if (0.0005f > dsq)
     {
@@ -189,14 +181,124 @@ __kernel void sph_compute_step(__global float4* position,
   //accel += gravitation;
   
   // Leapfrog Integration ----------------------------
-  float4 vel = velocity[i];
+  float4 vel = *velocity;
   float4 vnext = accel * deltatime + vel;  // v(t+1/2) = v(t-1/2) + a(t) dt
   prevvel = (vel + vnext) * 0.5f;          // v(t+1) = [v(t-1/2) + v(t+1/2)] * 0.5     used to compute forces later
   vel = vnext;
-  vnext *= deltatime / simscale;
+  vnext *= deltatime / SPH_SIM_SCALE;
   pos += vnext;                       // p(t+1) = p(t) + v(t+1/2) dt
-  
-  velocity[i] = vel;
-  prevvelocity[i] = prevvel;
-  position[i] = pos;
-}
\ No newline at end of file
+
+  *velocity = vel;
+  *prevvelocity = prevvel;
+  *position = pos;
+}
+
+
+__kernel void sph_compute_step(__global sph_vec_t* position,
+                               __global float4* forces,
+                               __global sph_vec_t* velocity,
+                               __global sph_vec_t* prevvelocity,
+                               float deltatime,
+                               float4 volumemin,
+                               float4 volumemax,
+                               float time,
+                               uint flags,
+                               uint numparticles)
+                               //float4 gravitation)
+{
+  unsigned int i = get_global_id(0);
+  if (i >= numparticles) return;
+
+  float4 pos = sph_load(position, i);
+  float4 vel = sph_load(velocity, i);
+  float4 prevvel = sph_load(prevvelocity, i);
+
+  sph_integrate(forces[i], &pos, &vel, &prevvel,
+                deltatime, volumemin, volumemax, time, flags);
+
+  sph_store(velocity, i, vel);
+  sph_store(prevvelocity, i, prevvel);
+  sph_store(position, i, pos);
+}
+
+
+/**
+ * Fused force computation and integration using the uniform grid.
+ * The positions and velocities are double buffered, so that
+ * the neighbours are always read before the step.
+ */
+__kernel void sph_compute_step_grid(__global sph_vec_t* position_in,
+                                    __global sph_vec_t* position_out,
+                                    __global sph_vec_t* velocity_in,
+                                    __global sph_vec_t* velocity_out,
+                                    __global sph_vec_t* prevvelocity,
+                                    __global float2* density_pressure,
+                                    __global int* cell_head,
+                                    __global int* cell_next,
+                                    float cellsize,
+                                    int4 gridsize,
+                                    float deltatime,
+                                    float4 volumemin,
+                                    float4 volumemax,
+                                    uint numparticles,
+                                    float time,
+                                    uint flags)
+{
+  int i = get_global_id(0);
+  if (i >= numparticles) return;
+
+  float4 force = sph_force_grid(i, position_in, density_pressure, velocity_in,
+                                cell_head, cell_next, volumemin, cellsize, gridsize);
+
+  float4 pos = sph_load(position_in, i);
+  float4 vel = sph_load(velocity_in, i);
+  float4 prevvel = sph_load(prevvelocity, i);
+
+  sph_integrate(force, &pos, &vel, &prevvel,
+                deltatime, volumemin, volumemax, time, flags);
+
+  sph_store(velocity_out, i, vel);
+  sph_store(prevvelocity, i, prevvel);
+  sph_store(position_out, i, pos);
+}
+
+
+/**
+ * Fused force computation and integration using local memory tiles
+ * (the same double buffering as in sph_compute_step_grid applies)
+ */
+__kernel void sph_compute_step_tiled(__global sph_vec_t* position_in,
+                                     __global sph_vec_t* position_out,
+                                     __global sph_vec_t* velocity_in,
+                                     __global sph_vec_t* velocity_out,
+                                     __global sph_vec_t* prevvelocity,
+                                     __global float2* density_pressure,
+                                     __local float4* tile_pos,
+                                     __local float4* tile_vel,
+                                     __local float2* tile_dp,
+                                     float deltatime,
+                                     float4 volumemin,
+                                     float4 volumemax,
+                                     uint numparticles,
+                                     float time,
+                                     uint flags)
+{
+  uint i = get_global_id(0);
+
+  float4 force = sph_force_tiled(i, position_in, density_pressure, velocity_in,
+                                 tile_pos, tile_vel, tile_dp, numparticles);
+
+  if (i < numparticles)
+  {
+    float4 pos = sph_load(position_in, i);
+    float4 vel = sph_load(velocity_in, i);
+    float4 prevvel = sph_load(prevvelocity, i);
+
+    sph_integrate(force, &pos, &vel, &prevvel,
+                  deltatime, volumemin, volumemax, time, flags);
+
+    sph_store(velocity_out, i, vel);
+    sph_store(prevvelocity, i, prevvel);
+    sph_store(position_out, i, pos);
+  }
+}
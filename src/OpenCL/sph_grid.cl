@@ -0,0 +1,132 @@
+/*
+ * Copyright (C) 2014 Matus Fedorko <xfedor01@stud.fit.vutbr.cz>
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty.  In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+
+ * 1. The origin of this software must not be misrepresented; you must not
+ *    claim that you wrote the original software. If you use this software
+ *    in a product, an acknowledgment in the product documentation would be
+ *    appreciated but is not required.
+ * 2. Altered source versions must be plainly marked as such, and must not be
+ *    misrepresented as being the original software.
+ * 3. This notice may not be removed or altered from any source distribution.
+ */
+
+/**
+ * A uniform grid to accelerate the neighbour search in SPH kernels.
+ *
+ * The cell size equals to the smoothing radius (in world space coordinates),
+ * so all the neighbours of a particle are guaranteed to lie in the 27 cells
+ * surrounding the particle's own cell.
+ * Each cell is represented as a singly linked list of particle indices,
+ * cell_head contains the index of the first particle in cell (or -1 if the
+ * cell is empty) and cell_next contains the index of the next particle
+ * in the same cell (or -1 at the end of the list).
+ *
+ * Note: this file has to follow sph_layout.cl and precede the other
+ * SPH kernels, because its helper functions are used by them.
+ */
+
+#define GRID_END_OF_LIST (-1)
+
+
+/**
+ * Calculates the integer coordinates of the cell that contains the given position.
+ * Particles outside of the bounding volume are clamped to the border cells,
+ * this still gives correct results, because the clamping never moves two
+ * particles that are within the smoothing radius more than one cell apart.
+ */
+int4 sph_grid_cell_coords(float4 pos, float4 volumemin, float cellsize, int4 gridsize)
+{
+  int4 c = convert_int4_rtn((pos - volumemin) / cellsize);
+  return clamp(c, (int4) (0), gridsize - (int4) (1));
+}
+
+/** Converts cell coordinates to a linear cell index */
+int sph_grid_cell_index(int4 c, int4 gridsize)
+{
+  return (c.z * gridsize.y + c.y) * gridsize.x + c.x;
+}
+
+
+/**
+ * Marks all cells in grid as empty
+ */
+__kernel void sph_grid_clear(__global int *cell_head,
+                             uint numcells)
+{
+  int i = get_global_id(0);
+  if (i >= numcells) return;
+
+  cell_head[i] = GRID_END_OF_LIST;
+}
+
+
+/**
+ * Inserts each particle into the linked list of its cell
+ */
+__kernel void sph_grid_insert(__global sph_vec_t *pos,
+                              __global int *cell_head,
+                              __global int *cell_next,
+                              float4 volumemin,
+                              float cellsize,
+                              int4 gridsize,
+                              uint numparticles)
+{
+  int i = get_global_id(0);
+  if (i >= numparticles) return;
+
+  int cell = sph_grid_cell_index(sph_grid_cell_coords(sph_load(pos, i), volumemin, cellsize, gridsize), gridsize);
+
+  cell_next[i] = atomic_xchg(&cell_head[cell], i);
+}
+
+
+/**
+ * Counts the candidate neighbours of each particle, i.e. all the other
+ * particles in the 27 cells the grid kernels visit (regardless of distance).
+ * This is only used to estimate the memory traffic of grid kernels.
+ */
+__kernel void sph_grid_count_pairs(__global sph_vec_t *pos,
+                                   __global int *cell_head,
+                                   __global int *cell_next,
+                                   __global uint *pair_count,
+                                   float4 volumemin,
+                                   float cellsize,
+                                   int4 gridsize,
+                                   uint numparticles)
+{
+  int i = get_global_id(0);
+  if (i >= numparticles) return;
+
+  int4 cell = sph_grid_cell_coords(sph_load(pos, i), volumemin, cellsize, gridsize);
+  int4 cmin = max(cell - (int4) (1), (int4) (0));
+  int4 cmax = min(cell + (int4) (1), gridsize - (int4) (1));
+
+  uint count = 0;
+
+  for (int z = cmin.z; z <= cmax.z; ++z)
+  {
+    for (int y = cmin.y; y <= cmax.y; ++y)
+    {
+      for (int x = cmin.x; x <= cmax.x; ++x)
+      {
+        int j = cell_head[sph_grid_cell_index((int4) (x, y, z, 0), gridsize)];
+
+        while (j != GRID_END_OF_LIST)
+        {
+          count += (j != i) ? 1 : 0;
+          j = cell_next[j];
+        }
+      }
+    }
+  }
+
+  pair_count[i] = count;
+}
@@ -0,0 +1,84 @@
+/*
+ * Copyright (C) 2014 Matus Fedorko <xfedor01@stud.fit.vutbr.cz>
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty.  In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+
+ * 1. The origin of this software must not be misrepresented; you must not
+ *    claim that you wrote the original software. If you use this software
+ *    in a product, an acknowledgment in the product documentation would be
+ *    appreciated but is not required.
+ * 2. Altered source versions must be plainly marked as such, and must not be
+ *    misrepresented as being the original software.
+ * 3. This notice may not be removed or altered from any source distribution.
+ */
+
+
+/**
+ * Access to per particle vector data (positions and velocities)
+ * in the layout selected by FluidSystem via one of the build options:
+ *   SPH_LAYOUT_AOS    - an array of float4, the w component is unused (default)
+ *   SPH_LAYOUT_PACKED - an array of tightly packed float3
+ *   SPH_LAYOUT_SOA    - separate arrays of x, y and z components,
+ *                       each of them SPH_SOA_STRIDE elements long
+ * The kernels declare such buffers as sph_vec_t pointers and access them
+ * only through sph_load and sph_store, which always work with float4
+ * (with the w component set to 0 for the packed and SoA layouts).
+ *
+ * Density and pressure are always read together, so they are interleaved
+ * in a single float2 buffer (x is the inverse density and y the pressure).
+ *
+ * Note: this file has to follow sph_params.cl and precede the other
+ * SPH kernels, because all of them depend on it.
+ */
+
+#if defined(SPH_LAYOUT_SOA)
+
+typedef float sph_vec_t;
+
+float4 sph_load(__global const sph_vec_t *p, uint i)
+{
+  return (float4) (p[i], p[i + SPH_SOA_STRIDE], p[i + 2 * SPH_SOA_STRIDE], 0.0f);
+}
+
+void sph_store(__global sph_vec_t *p, uint i, float4 v)
+{
+  p[i] = v.x;
+  p[i + SPH_SOA_STRIDE] = v.y;
+  p[i + 2 * SPH_SOA_STRIDE] = v.z;
+}
+
+#elif defined(SPH_LAYOUT_PACKED)
+
+typedef float sph_vec_t;
+
+float4 sph_load(__global const sph_vec_t *p, uint i)
+{
+  return (float4) (vload3(i, p), 0.0f);
+}
+
+void sph_store(__global sph_vec_t *p, uint i, float4 v)
+{
+  vstore3(v.xyz, i, p);
+}
+
+#else
+
+typedef float4 sph_vec_t;
+
+float4 sph_load(__global const sph_vec_t *p, uint i)
+{
+  return p[i];
+}
+
+void sph_store(__global sph_vec_t *p, uint i, float4 v)
+{
+  p[i] = v;
+}
+
+#endif
@@ -0,0 +1,161 @@
+/*
+ * Copyright (C) 2014 Matus Fedorko <xfedor01@stud.fit.vutbr.cz>
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty.  In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+
+ * 1. The origin of this software must not be misrepresented; you must not
+ *    claim that you wrote the original software. If you use this software
+ *    in a product, an acknowledgment in the product documentation would be
+ *    appreciated but is not required.
+ * 2. Altered source versions must be plainly marked as such, and must not be
+ *    misrepresented as being the original software.
+ * 3. This notice may not be removed or altered from any source distribution.
+ */
+
+
+/**
+ * Verlet neighbour lists for SPH kernels.
+ *
+ * The list of each particle contains all particles closer than the smoothing
+ * radius plus a skin margin, so the list stays valid until some particle
+ * moves more than half of the skin from the position where the list was built.
+ *
+ * The lists are stored interleaved (the k-th neighbour of particle i is
+ * at index k * numparticles + i) to get coalesced memory accesses.
+ * The neighbours are either stored as full 32-bit indices, or in compressed
+ * form as 16-bit offsets relative to the particle's own index, which works
+ * well when the particles are sorted along a space filling curve (see sph_sort.cl).
+ *
+ * Depends on helper functions from sph_grid.cl.
+ */
+
+#define NEIGHBORS_REBUILD      (1 << 0)   // some particle moved too far, the lists are invalid
+#define NEIGHBORS_TOO_MANY     (1 << 1)   // some list did not fit into max_neighbors entries
+#define NEIGHBORS_OUT_OF_RANGE (1 << 2)   // some relative index did not fit into 16 bits
+
+
+/** Loads the k-th neighbour of particle i out of numparticles */
+int sph_neighbor_load(int i, int k,
+                      __global const int *list32,
+                      __global const short *list16,
+                      uint compressed,
+                      uint numparticles)
+{
+  int idx = k * numparticles + i;
+  return compressed ? (i + list16[idx]) : list32[idx];
+}
+
+
+/**
+ * Builds the neighbour list of each particle from the uniform grid.
+ * The cell size of the grid may be smaller than the list radius,
+ * so the range of visited cells is derived from the radius.
+ */
+__kernel void sph_neighbors_build(__global sph_vec_t *pos,
+                                  __global float4 *build_pos,
+                                  __global int *cell_head,
+                                  __global int *cell_next,
+                                  __global int *list32,
+                                  __global short *list16,
+                                  __global uint *count,
+                                  __global uint *status,
+                                  float4 volumemin,
+                                  float cellsize,
+                                  int4 gridsize,
+                                  uint max_neighbors,
+                                  uint compressed,
+                                  uint numparticles)
+{
+  int i = get_global_id(0);
+  int n = numparticles;
+  if (i >= n) return;
+
+  float4 pos_i = sph_load(pos, i);
+  float r = sqrt(SPH_LIST_RADIUS2) / SPH_SIM_SCALE;
+  float4 ext = (float4) (r, r, r, 0.0f);
+  int4 cmin = sph_grid_cell_coords(pos_i - ext, volumemin, cellsize, gridsize);
+  int4 cmax = sph_grid_cell_coords(pos_i + ext, volumemin, cellsize, gridsize);
+
+  uint k = 0;
+  uint flags = 0;
+
+  for (int z = cmin.z; z <= cmax.z; ++z)
+  {
+    for (int y = cmin.y; y <= cmax.y; ++y)
+    {
+      for (int x = cmin.x; x <= cmax.x; ++x)
+      {
+        int j = cell_head[sph_grid_cell_index((int4) (x, y, z, 0), gridsize)];
+
+        while (j != GRID_END_OF_LIST)
+        {
+          if (j != i)
+          {
+            float4 d = (pos_i - sph_load(pos, j)) * SPH_SIM_SCALE;
+
+            if (SPH_LIST_RADIUS2 > dot(d, d))
+            {
+              if (k >= max_neighbors)
+              {
+                flags |= NEIGHBORS_TOO_MANY;
+              }
+              else if (compressed)
+              {
+                int rel = j - i;
+                if ((rel < SHRT_MIN) || (rel > SHRT_MAX))
+                {
+                  flags |= NEIGHBORS_OUT_OF_RANGE;
+                }
+                else
+                {
+                  list16[k++ * n + i] = (short) rel;
+                }
+              }
+              else
+              {
+                list32[k++ * n + i] = j;
+              }
+            }
+          }
+
+          j = cell_next[j];
+        }
+      }
+    }
+  }
+
+  count[i] = k;
+  build_pos[i] = pos_i;
+
+  if (flags != 0)
+  {
+    atomic_or(status, flags);
+  }
+}
+
+
+/**
+ * Flags the lists for rebuild when a particle moved
+ * more than half of the skin since the last build
+ */
+__kernel void sph_neighbors_check(__global sph_vec_t *pos,
+                                  __global float4 *build_pos,
+                                  __global uint *status,
+                                  uint numparticles)
+{
+  int i = get_global_id(0);
+  if (i >= numparticles) return;
+
+  float4 d = (sph_load(pos, i) - build_pos[i]) * SPH_SIM_SCALE;
+
+  if (dot(d.xyz, d.xyz) > SPH_MAX_DISPLACEMENT2)
+  {
+    atomic_or(status, NEIGHBORS_REBUILD);
+  }
+}
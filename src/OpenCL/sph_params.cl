@@ -0,0 +1,52 @@
+/*
+ * Copyright (C) 2014 Matus Fedorko <xfedor01@stud.fit.vutbr.cz>
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty.  In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+
+ * 1. The origin of this software must not be misrepresented; you must not
+ *    claim that you wrote the original software. If you use this software
+ *    in a product, an acknowledgment in the product documentation would be
+ *    appreciated but is not required.
+ * 2. Altered source versions must be plainly marked as such, and must not be
+ *    misrepresented as being the original software.
+ * 3. This notice may not be removed or altered from any source distribution.
+ */
+
+/**
+ * Simulation constants that are baked into the SPH program at build time.
+ * FluidSystem passes them as build options (see FluidSystem::Params),
+ * so the compiler can fold them into the kernels instead of loading
+ * them from kernel arguments on every use:
+ *   SPH_SIM_SCALE         - the scale of simulation space to world space
+ *   SPH_SMOOTH_RADIUS     - the smoothing radius (in simulation space)
+ *   SPH_RADIUS2           - the squared smoothing radius
+ *   SPH_MASS              - the mass of a particle
+ *   SPH_MASS_POLYKERN     - mass * poly6 kernel constant
+ *   SPH_REST_DENSITY      - the rest density of the fluid
+ *   SPH_INT_STIFFNESS     - the internal (gas) stiffness
+ *   SPH_VTERM             - viscosity * laplacian kernel constant
+ *   SPH_SPIKYKERN_HALF    - -0.5 * spiky kernel gradient constant
+ *   SPH_SLOPE             - the slope of the bottom wall
+ *   SPH_LEFT_WAVE         - the amplitude of the left wave generator
+ *   SPH_RIGHT_WAVE        - the amplitude of the right wave generator
+ *   SPH_LIMIT             - the acceleration limit
+ *   SPH_EXT_STIFFNESS     - the stiffness of the boundary walls
+ *   SPH_EXT_DAMPING       - the damping of the boundary walls
+ *   SPH_RADIUS            - the particle radius used by wall collisions
+ *   SPH_LIST_RADIUS2      - the squared radius of neighbour lists (with skin)
+ *   SPH_MAX_DISPLACEMENT2 - the squared displacement that invalidates the lists
+ * The grid geometry, the time step and the particle count change at run time
+ * and remain kernel arguments.
+ *
+ * Note: this file has to be the first one in the program.
+ */
+
+#ifndef SPH_SIM_SCALE
+#error "SPH simulation constants have to be passed as build options"
+#endif
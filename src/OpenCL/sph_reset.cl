@@ -35,26 +35,26 @@ float random(ulong seed, float min, float max)
 /**
  * A kernel to initialize particle buffers with reasonable default values
  */
-__kernel void sph_reset(__global float4 *position,
-                        __global float4 *velocity,
-                        __global float4 *prev_velocity,
-                        __global float *pressure,
-                        __global float *density,
+__kernel void sph_reset(__global sph_vec_t *position,
+                        __global sph_vec_t *velocity,
+                        __global sph_vec_t *prev_velocity,
+                        __global float2 *density_pressure,
                         __global float4 *force,
                         float4 volume_min,
                         float4 volume_max,
-                        ulong seed)
+                        ulong seed,
+                        uint numparticles)
 {
   ulong gid = get_global_id(0);
+  if (gid >= numparticles) return;
 
-  position[gid] = (float4) (random(seed + gid + 1ul, volume_min.x, volume_max.x), 
-                            random(seed + gid + 2ul, volume_min.y, volume_max.y),
-                            random(seed + gid + 3ul, volume_min.z, volume_max.z),
-                            1.0f);
-  velocity[gid] = (float4)(0.0f);
-  prev_velocity[gid] = (float4)(0.0f);
-  pressure[gid] = 0;
-  density[gid] = 0;
+  sph_store(position, gid, (float4) (random(seed + gid + 1ul, volume_min.x, volume_max.x), 
+                                     random(seed + gid + 2ul, volume_min.y, volume_max.y),
+                                     random(seed + gid + 3ul, volume_min.z, volume_max.z),
+                                     1.0f));
+  sph_store(velocity, gid, (float4)(0.0f));
+  sph_store(prev_velocity, gid, (float4)(0.0f));
+  density_pressure[gid] = (float2)(0.0f);
   force[gid] = (float4)(0.0f);
 
   //printf("sph_reset: seed == %u\n", seed);
@@ -0,0 +1,119 @@
+/*
+ * Copyright (C) 2014 Matus Fedorko <xfedor01@stud.fit.vutbr.cz>
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty.  In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+
+ * 1. The origin of this software must not be misrepresented; you must not
+ *    claim that you wrote the original software. If you use this software
+ *    in a product, an acknowledgment in the product documentation would be
+ *    appreciated but is not required.
+ * 2. Altered source versions must be plainly marked as such, and must not be
+ *    misrepresented as being the original software.
+ * 3. This notice may not be removed or altered from any source distribution.
+ */
+
+/**
+ * Kernels to reorder particles along a Z-order (Morton) curve
+ * of their grid cells, so that particles that are close in space
+ * are also close in memory.
+ * Depends on helper functions from sph_grid.cl.
+ */
+
+/** Inserts two zero bits after each of the lowest 10 bits of v */
+uint sph_morton_expand_bits(uint v)
+{
+  v = (v * 0x00010001u) & 0xFF0000FFu;
+  v = (v * 0x00000101u) & 0x0F00F00Fu;
+  v = (v * 0x00000011u) & 0xC30C30C3u;
+  v = (v * 0x00000005u) & 0x49249249u;
+  return v;
+}
+
+/** Computes a 30-bit Morton code for the given cell coordinates */
+uint sph_morton_code(int4 c)
+{
+  return (sph_morton_expand_bits(c.z) << 2) |
+         (sph_morton_expand_bits(c.y) << 1) |
+          sph_morton_expand_bits(c.x);
+}
+
+
+/**
+ * Generates the sorting keys (Morton codes of particle cells)
+ * and the initial (identity) permutation
+ */
+__kernel void sph_sort_keys(__global sph_vec_t *pos,
+                            __global uint *keys,
+                            __global uint *values,
+                            float4 volumemin,
+                            float cellsize,
+                            int4 gridsize,
+                            uint numparticles)
+{
+  uint i = get_global_id(0);
+  if (i >= numparticles) return;
+
+  keys[i] = sph_morton_code(sph_grid_cell_coords(sph_load(pos, i), volumemin, cellsize, gridsize));
+  values[i] = i;
+}
+
+
+/**
+ * Generates the sorting keys that partition the owned particles of a slab
+ * (see MultiDeviceFluidSystem) into the ones inside of the slab (0),
+ * the ones within the halo width of a border (1) and the ones that left
+ * the slab (2), and counts the particles in each part
+ */
+__kernel void sph_slab_keys(__global sph_vec_t *pos,
+                            __global uint *keys,
+                            __global uint *values,
+                            __global uint *counts,
+                            uint axis,
+                            float lo,
+                            float hi,
+                            float halowidth,
+                            uint numparticles)
+{
+  uint i = get_global_id(0);
+  if (i >= numparticles) return;
+
+  float4 p = sph_load(pos, i);
+  float c = (axis == 0) ? p.x : ((axis == 1) ? p.y : p.z);
+
+  uint key = 0;
+  if ((c < lo) || (c >= hi)) key = 2;
+  else if ((c < lo + halowidth) || (c >= hi - halowidth)) key = 1;
+
+  keys[i] = key;
+  values[i] = i;
+  atomic_inc(&counts[key]);
+}
+
+
+/**
+ * Gathers per particle data according to the sorted permutation
+ */
+__kernel void sph_reorder(__global const uint *permutation,
+                          __global const sph_vec_t *pos_in,
+                          __global const sph_vec_t *vel_in,
+                          __global const sph_vec_t *prevvel_in,
+                          __global sph_vec_t *pos_out,
+                          __global sph_vec_t *vel_out,
+                          __global sph_vec_t *prevvel_out,
+                          uint numparticles)
+{
+  uint i = get_global_id(0);
+  if (i >= numparticles) return;
+
+  uint j = permutation[i];
+
+  sph_store(pos_out, i, sph_load(pos_in, j));
+  sph_store(vel_out, i, sph_load(vel_in, j));
+  sph_store(prevvel_out, i, sph_load(prevvel_in, j));
+}
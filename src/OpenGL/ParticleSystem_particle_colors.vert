@@ -27,6 +27,8 @@ uniform mat4 proj;         // projection matrix
 layout(location = 0) in vec3 pos;           // model's vertex position
 layout(location = 1) in vec3 normal;        // model's normal
 layout(location = 4) in vec3 particle_pos;  // particle's position
+layout(location = 6) in float particle_pos_y;  // y and z components of particle's position
+layout(location = 7) in float particle_pos_z;  // for the SoA layout (0 otherwise)
 layout(location = 5) in vec3 particle_col;  // particle's color
 
 out vec3 o_normal;
@@ -40,7 +42,7 @@ void main(void)
   o_normal = mv_normal * normal;
 
   /* transform the vertex to camera space and get the incidence position on the odel surface */
-  vec4 tmp = mv * vec4(pos + particle_pos, 1.0f);
+  vec4 tmp = mv * vec4(pos + particle_pos + vec3(0.0f, particle_pos_y, particle_pos_z), 1.0f);
   o_surf_pos = tmp.xyz;
 
   /* calculate the clip-space position of the vertex */
@@ -0,0 +1,32 @@
+/*
+ * Copyright (C) 2014 Matus Fedorko <xfedor01@stud.fit.vutbr.cz>
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty.  In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+
+ * 1. The origin of this software must not be misrepresented; you must not
+ *    claim that you wrote the original software. If you use this software
+ *    in a product, an acknowledgment in the product documentation would be
+ *    appreciated but is not required.
+ * 2. Altered source versions must be plainly marked as such, and must not be
+ *    misrepresented as being the original software.
+ * 3. This notice may not be removed or altered from any source distribution.
+ */
+
+#version 330
+
+uniform vec2 origin;   // the bottom left corner of the graph in normalized device coordinates
+uniform vec2 size;     // the dimensions of the graph in normalized device coordinates
+
+layout(location = 0) in vec2 pos;   // the position inside of the graph (both coordinates in [0, 1])
+
+
+void main(void)
+{
+  gl_Position = vec4(origin + clamp(pos, 0.0f, 1.0f) * size, -0.1f, 1.0f);
+}
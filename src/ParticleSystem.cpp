@@ -25,9 +25,12 @@
 
 #include <glm/gtc/type_ptr.hpp>
 #include <ctime>
+#include <chrono>
 
 
 
+const char *ParticleSystem::m_tuning_db_file = "workgroups.txt";
+
 const char *ParticleSystem::m_vert_shader =
   "#version 330\n"
   ""
@@ -79,6 +82,8 @@ const char *ParticleSystem::m_frag_shader_particle_colors_file = "src/OpenGL/Par
 const char *ParticleSystem::m_vert_shader_uniform_color_file = "src/OpenGL/ParticleSystem_uniform_color.vert";
 const char *ParticleSystem::m_frag_shader_uniform_color_file = "src/OpenGL/ParticleSystem_uniform_color.frag";
 
+cl_device_type ParticleSystem::m_preferred_device_type = CL_DEVICE_TYPE_GPU;
+
 const char *ParticleSystem::m_vert_shader_bounding_volume_file = "src/OpenGL/ParticleSystem_bounding_volume.vert";
 const char *ParticleSystem::m_frag_shader_bounding_volume_file = "src/OpenGL/ParticleSystem_bounding_volume.frag";
 
@@ -105,12 +110,14 @@ bool ParticleSystem::initCL(void)
   std::cerr << "m_cl_queue()        : " << m_cl_queue() << std::endl;
 #endif
 
-  /* select appropriate device and platform */
+  /* select appropriate device and platform,
+     in headless mode any device will do (e.g. a CPU implementation) */
   cl_platform_id platform = nullptr;
   cl_device_id device = nullptr;
 
-  if ((!ocl::selectGLDeviceAndPlatform(&device, &platform)) &&
-      (!ocl::selectPlatformAndDevice(&device, &platform)))
+  if ((ocl::headless() || !ocl::selectGLDeviceAndPlatform(&device, &platform)) &&
+      (!ocl::selectPlatformAndDevice(&device, &platform, m_preferred_device_type)) &&
+      (!ocl::selectPlatformAndDevice(&device, &platform, CL_DEVICE_TYPE_ALL)))
   {
     ERROR("Failed to select an appropriate device or platform");
     return false;
@@ -122,6 +129,11 @@ bool ParticleSystem::initCL(void)
   std::vector<cl::Device> device_list(1, device);
 
   /* setup context */
+  cl_context_properties headless_props[] = {
+    CL_CONTEXT_PLATFORM, (cl_context_properties) platform,
+    0
+  };
+
   cl_context_properties props[] = {
 #if defined(FLUIDSIM_OS_MAC)
     CL_CONTEXT_PROPERTY_USE_CGL_SHAREGROUP_APPLE,
@@ -141,7 +153,7 @@ bool ParticleSystem::initCL(void)
   };
 
   cl_int err = CL_SUCCESS;
-  m_cl_ctx = cl::Context(device_list, props, nullptr, nullptr, &err);
+  m_cl_ctx = cl::Context(device_list, ocl::headless() ? headless_props : props, nullptr, nullptr, &err);
   if (err != CL_SUCCESS)
   {
     ERROR("Failed to create OpenCL context: " << ocl::errorToStr(err));
@@ -156,9 +168,27 @@ bool ParticleSystem::initCL(void)
     return false;
   }
 
+  /* measure the peaks for the roofline report of kernel performance */
+  ocl::DevicePeaks peaks;
+  if (ocl::measureDevicePeaks(m_cl_ctx(), m_cl_queue(), &peaks))
+  {
+    m_stats.setDevicePeaks(peaks);
+  }
+  else
+  {
+    WARN("Failed to measure device peaks, the roofline report will not be relative to them");
+  }
+
+  /* load the work-group sizes tuned for this device */
+  if (!m_tuner.init(device, m_tuning_db_file))
+  {
+    WARN("Failed to load work-group tuning database, using the driver's defaults");
+  }
+
   /* pass the context pointer to OpenGL shared buffers */
   m_particle_pos_buf.setCLContext(m_cl_ctx());
   m_particle_col_buf.setCLContext(m_cl_ctx());
+  if (!ocl::headless()) m_display_pos_buf.init(m_cl_ctx(), device);
 
   INFO("Successfully initialized OpenCL context and command queue");
 
@@ -170,23 +200,28 @@ bool ParticleSystem::initGL(void)
 {
   INFO("Initializing OpenGL subsystem");
 
+  m_shader_particle_colors.reset(new ogl::ShaderProgram);
+  m_shader_uniform_color.reset(new ogl::ShaderProgram);
+  m_shader_bounding_volume.reset(new ogl::ShaderProgram);
+  m_particle_geom.reset(new geom::Model);
+
   /* compile shaders */
   //if (!m_shader.build(m_vert_shader, m_frag_shader))
-  if (!m_shader_particle_colors.buildFiles(utils::fs::AssetsPath(m_vert_shader_particle_colors_file),
+  if (!m_shader_particle_colors->buildFiles(utils::fs::AssetsPath(m_vert_shader_particle_colors_file),
                                            utils::fs::AssetsPath(m_frag_shader_particle_colors_file)))
   {
     ERROR("Failed to compile shaders for particle colors program");
     return false;
   }
 
-  if (!m_shader_uniform_color.buildFiles(utils::fs::AssetsPath(m_vert_shader_uniform_color_file),
+  if (!m_shader_uniform_color->buildFiles(utils::fs::AssetsPath(m_vert_shader_uniform_color_file),
                                          utils::fs::AssetsPath(m_frag_shader_uniform_color_file)))
   {
     ERROR("Failed to compile shaders for uniform color program");
     return false;
   }
 
-  if (!m_shader_bounding_volume.buildFiles(utils::fs::AssetsPath(m_vert_shader_bounding_volume_file),
+  if (!m_shader_bounding_volume->buildFiles(utils::fs::AssetsPath(m_vert_shader_bounding_volume_file),
                                            utils::fs::AssetsPath(m_frag_shader_bounding_volume_file)))
   {
     ERROR("Failed to compile shaders for bounding volume program");
@@ -194,7 +229,7 @@ bool ParticleSystem::initGL(void)
   }
 
   /* per particle colors program */
-  GLuint pc_prog = m_shader_particle_colors.getID();
+  GLuint pc_prog = m_shader_particle_colors->getID();
   
   glUseProgram(pc_prog);
   //glUniform3f(glGetUniformLocation(prog, "light_pos"), 0.0f, 0.0f, -1.0f);     // shader assumes the position is normalized
@@ -205,7 +240,7 @@ bool ParticleSystem::initGL(void)
   glUniform3f(glGetUniformLocation(pc_prog, "light_col_s"), 1.0f, 1.0f, 1.0f);
 
   /* uniform color program */
-  GLuint uc_prog = m_shader_uniform_color.getID();
+  GLuint uc_prog = m_shader_uniform_color->getID();
   
   glUseProgram(uc_prog);
   glUniform3f(glGetUniformLocation(uc_prog, "light_pos"), -10.0f, 10.0f, 15.0f);
@@ -215,7 +250,7 @@ bool ParticleSystem::initGL(void)
   glUniform3f(glGetUniformLocation(uc_prog, "particle_col"), 0.5f, 0.5f, 1.0f);
 
   /* bounding volume program */
-  GLuint bv_prog = m_shader_bounding_volume.getID();
+  GLuint bv_prog = m_shader_bounding_volume->getID();
 
   glUseProgram(bv_prog);
 
@@ -228,8 +263,8 @@ bool ParticleSystem::initGL(void)
   glUseProgram(0);
 
   /* load models */
-  if (!geom::genSphere(m_particle_geom))
-  //if (!geom::genPrism(m_particle_geom))
+  if (!geom::genSphere(*m_particle_geom))
+  //if (!geom::genPrism(*m_particle_geom))
   {
     ERROR("Failed to generate sphere model");
     return false;
@@ -241,22 +276,38 @@ bool ParticleSystem::initGL(void)
 
 void ParticleSystem::render(const glm::mat4 & mv, const glm::mat4 & proj)
 {
+  if (ocl::headless()) return;
+
+  /* nothing has been published yet in pipelined mode */
+  GLuint pos_vbo = m_pipelined ? m_display_pos_buf.beginDraw() : m_particle_pos_buf.getGLID();
+
+  render(pos_vbo, m_num_particles, m_particle_layout, mv, proj);
+
+  if (m_pipelined) m_display_pos_buf.endDraw();
+}
+
+
+void ParticleSystem::render(GLuint pos_vbo, size_t num_particles, ParticleLayout layout,
+                            const glm::mat4 & mv, const glm::mat4 & proj)
+{
+  if (!m_particle_geom) return;
+
   glEnable(GL_DEPTH_TEST);
 
   /* render particle system */
-  glBindVertexArray(m_particle_geom.vao);
+  glBindVertexArray(m_particle_geom->vao);
 
   GLuint shader_id = 0;
 
   if (m_use_uniform_color)
   {
-    m_shader_uniform_color.use();
-    shader_id = m_shader_uniform_color.getID();
+    m_shader_uniform_color->use();
+    shader_id = m_shader_uniform_color->getID();
   }
   else
   {
-    m_shader_particle_colors.use();
-    shader_id = m_shader_particle_colors.getID();
+    m_shader_particle_colors->use();
+    shader_id = m_shader_particle_colors->getID();
     
     glBindBuffer(GL_ARRAY_BUFFER, m_particle_col_buf.getGLID());
     glEnableVertexAttribArray(5);
@@ -271,12 +322,43 @@ void ParticleSystem::render(const glm::mat4 & mv, const glm::mat4 & proj)
   glm::mat3 mv_normal = glm::mat3(mv);   // otherwise add glm::transpose(glm::inverse(mv));
   glUniformMatrix3fv(glGetUniformLocation(shader_id, "mv_normal"), 1, GL_FALSE, glm::value_ptr(mv_normal));
 
-  glBindBuffer(GL_ARRAY_BUFFER, m_particle_pos_buf.getGLID());
+  /* the shaders add the attributes 4, 6 and 7 to get the particle position,
+     so that the SoA layout can feed each component from a separate array */
+  glBindBuffer(GL_ARRAY_BUFFER, pos_vbo);
   glEnableVertexAttribArray(4);
-  glVertexAttribPointer(4, 3, GL_FLOAT, GL_FALSE, sizeof(cl_float4), (void *) (0));
   glVertexAttribDivisor(4, 1);
 
-  glDrawArraysInstanced(m_particle_geom.mode, 0, m_particle_geom.count, m_num_particles);
+  if (layout == LAYOUT_SOA)
+  {
+    size_t stride = num_particles * sizeof(cl_float);
+
+    glVertexAttribPointer(4, 1, GL_FLOAT, GL_FALSE, sizeof(cl_float), (void *) (0));
+    glEnableVertexAttribArray(6);
+    glVertexAttribPointer(6, 1, GL_FLOAT, GL_FALSE, sizeof(cl_float), (void *) (stride));
+    glVertexAttribDivisor(6, 1);
+    glEnableVertexAttribArray(7);
+    glVertexAttribPointer(7, 1, GL_FLOAT, GL_FALSE, sizeof(cl_float), (void *) (2 * stride));
+    glVertexAttribDivisor(7, 1);
+  }
+  else
+  {
+    glVertexAttribPointer(4, 3, GL_FLOAT, GL_FALSE, particleVectorSize(layout), (void *) (0));
+    glDisableVertexAttribArray(6);
+    glVertexAttrib1f(6, 0.0f);
+    glDisableVertexAttribArray(7);
+    glVertexAttrib1f(7, 0.0f);
+  }
+
+  /* the colors are allocated for the current number of particles only */
+  size_t num_instances = std::min(num_particles, m_num_particles);
+
+  if ((pos_vbo != 0) && (num_instances > 0))
+  {
+    glDrawArraysInstanced(m_particle_geom->mode, 0, m_particle_geom->count, num_instances);
+  }
+
+  glDisableVertexAttribArray(6);
+  glDisableVertexAttribArray(7);
 
   glBindBuffer(GL_ARRAY_BUFFER, 0);
 
@@ -285,7 +367,7 @@ void ParticleSystem::render(const glm::mat4 & mv, const glm::mat4 & proj)
   /* render bounding volume */
   if (m_draw_bounding_volume)
   {
-    shader_id = m_shader_bounding_volume.getID();
+    shader_id = m_shader_bounding_volume->getID();
     glUseProgram(shader_id);
 
     glUniformMatrix4fv(glGetUniformLocation(shader_id, "proj"), 1, GL_FALSE, glm::value_ptr(proj));
@@ -297,4 +379,152 @@ void ParticleSystem::render(const glm::mat4 & mv, const glm::mat4 & proj)
   glUseProgram(0);
 
   return;
-}
\ No newline at end of file
+}
+
+bool ParticleSystem::setPipelinedInterop(bool pipelined)
+{
+  if (pipelined && !supportsPipelinedInterop())
+  {
+    WARN("ParticleSystem: This particle system does not support pipelined interoperability");
+    return m_pipelined;
+  }
+
+  if (pipelined && ocl::headless())
+  {
+    WARN("ParticleSystem: There is no OpenGL to pipeline with in headless mode");
+    return m_pipelined;
+  }
+
+  if (pipelined && m_threaded)
+  {
+    WARN("ParticleSystem: Pipelined interoperability is not available while the simulation runs in a thread");
+    return m_pipelined;
+  }
+
+  /* OpenGL may still draw the simulation buffers and OpenCL
+     may still fill the display buffers, so the switch is synchronous */
+  glFinish();
+  clFinish(m_cl_queue());
+  m_display_pos_buf.reset();
+
+  return m_pipelined = pipelined;
+}
+
+
+bool ParticleSystem::publishPositions(cl_command_queue queue)
+{
+  size_t size = m_num_particles * particleVectorSize(m_particle_layout);
+
+  if ((m_display_pos_buf.size() != size) && (!m_display_pos_buf.resize(size)))
+  {
+    ERROR("ParticleSystem: Failed to allocate display buffers");
+    return false;
+  }
+
+  return m_display_pos_buf.publish(queue, m_particle_pos_buf.getCLID());
+}
+
+
+void ParticleSystem::setThreaded(bool threaded)
+{
+  /* the renderer draws its own copy of the positions
+     in threaded mode, so there is nothing to pipeline */
+  if (threaded && m_pipelined)
+  {
+    setPipelinedInterop(false);
+  }
+
+  m_threaded = threaded;
+}
+
+
+bool ParticleSystem::readPositions(std::vector<float> & positions)
+{
+  size_t size = m_num_particles * particleVectorSize(m_particle_layout);
+
+  positions.resize(size / sizeof(cl_float));
+  if (size == 0) return true;
+
+  /* there is no need to wait for OpenGL, when it does not draw the simulation buffers */
+  cl_mem buffer = m_particle_pos_buf.getCLID();
+
+  ocl::GLSyncHandler sync(m_cl_queue(), 1, &buffer, !m_threaded && !m_pipelined);
+  if (!sync) return false;
+
+  cl_int err = clEnqueueReadBuffer(m_cl_queue(), buffer, CL_TRUE, 0, size, positions.data(),
+                                   0, nullptr, m_stats.event("read_positions"));
+  if (err != CL_SUCCESS)
+  {
+    ERROR("ParticleSystem: Failed to read particle positions: " << ocl::errorToStr(err));
+    return false;
+  }
+
+  return true;
+}
+
+
+void ParticleSystem::benchmarkInterop(unsigned int frames, std::ostream & os)
+{
+  if (!supportsPipelinedInterop())
+  {
+    os << "Pipelined interoperability is not supported by this particle system" << std::endl;
+    return;
+  }
+
+  if (m_threaded)
+  {
+    os << "Pipelined interoperability can not be benchmarked while the simulation runs in a thread" << std::endl;
+    return;
+  }
+
+  /* save the settings */
+  bool pipelined = m_pipelined;
+  bool pause = m_pause;
+
+  m_pause = false;
+
+  double frame_time[2] = { 0.0, 0.0 };
+
+  for (int mode = 0; mode < 2; ++mode)
+  {
+    setPipelinedInterop(mode == 1);
+
+    // warm up (two frames fill the pipeline)
+    for (int i = 0; i < 2; ++i)
+    {
+      update();
+      render();
+    }
+    glFinish();
+    clFinish(m_cl_queue());
+
+    std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+
+    for (unsigned int i = 0; i < frames; ++i)
+    {
+      update();
+      render();
+    }
+
+    glFinish();
+    clFinish(m_cl_queue());
+
+    std::chrono::duration<double, std::milli> elapsed = std::chrono::high_resolution_clock::now() - start;
+    frame_time[mode] = elapsed.count() / frames;
+  }
+
+  /* restore the settings */
+  setPipelinedInterop(pipelined);
+  m_pause = pause;
+
+  os << "OpenCL/OpenGL interoperability benchmark (" << m_num_particles << " particles, "
+     << frames << " frames)" << std::endl;
+  os << "  synchronous (glFinish/clFinish) : " << frame_time[0] << " ms/frame" << std::endl;
+  os << "  pipelined (double buffered)     : " << frame_time[1] << " ms/frame" << std::endl;
+  os << "  speedup                         : " << (frame_time[0] / frame_time[1]) << "x" << std::endl;
+  os << "  (pipelined synchronization: "
+     << (m_display_pos_buf.hasGLEvent() ? "cl_khr_gl_event" :
+         (m_display_pos_buf.hasFences() ? "GL fences waited on host" : "glFinish"))
+     << ")" << std::endl;
+}
+
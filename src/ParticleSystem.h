@@ -25,7 +25,9 @@
 #include "ocl_lib.h"
 
 #include <glm/glm.hpp>
+#include <memory>
 #include <stdexcept>
+#include <vector>
 
 
 
@@ -35,22 +37,38 @@
 class ParticleSystem
 {
   public:
-    ParticleSystem(void)
+    // the memory layout of per particle vectors (positions and velocities)
+    enum ParticleLayout {
+      LAYOUT_AOS,      // an array of float4 (the w component is unused)
+      LAYOUT_PACKED,   // an array of tightly packed float3
+      LAYOUT_SOA       // separate arrays of x, y and z components
+    };
+
+  public:
+    // @param require_opencl whether the system can not work without an OpenCL context
+    //                       (a host side simulation needs it only to share buffers with OpenGL)
+    explicit ParticleSystem(bool require_opencl = true)
       : m_shader_particle_colors()
       , m_shader_uniform_color()
+      , m_shader_bounding_volume()
       , m_particle_geom()
       , m_cl_ctx()
       , m_cl_queue()
       , m_particle_pos_buf()
       , m_particle_col_buf()
+      , m_display_pos_buf()
       , m_num_particles(0)
+      , m_particle_layout(LAYOUT_AOS)
       , m_time(0.0f)
       , m_volume_min()
       , m_volume_max()
       , m_use_uniform_color(false)
       , m_draw_bounding_volume(true)
       , m_pause(false)
+      , m_pipelined(false)
+      , m_threaded(false)
       , m_stats()
+      , m_tuner()
     {    
       // initialize bounding volume
       m_volume_min.s[0] = -15.0f; m_volume_min.s[1] = -15.0f; m_volume_min.s[2] = -15.0f; m_volume_min.s[3] = 1.0f;
@@ -74,15 +92,21 @@ class ParticleSystem
       std::cerr << "m_cl_ctx()          : " << m_cl_ctx() << std::endl;
       std::cerr << "m_cl_queue()        : " << m_cl_queue() << std::endl;
 #endif
-      // initialize OpenCL context, compile kernels
-      if (!initCL())
+      // initialize OpenCL context, compile kernels (a host side simulation
+      // does not need the context in headless mode, there is nothing to share)
+      if ((require_opencl || !ocl::headless()) && (!initCL()))
       {
-        throw std::runtime_error("Failed to construct ParticleSystem: OpenCL initialization failed");
+        if (require_opencl)
+        {
+          throw std::runtime_error("Failed to construct ParticleSystem: OpenCL initialization failed");
+        }
+
+        std::cerr << "ParticleSystem: Running without OpenCL" << std::endl;
       }
 
       // initialize OpenGL data structures, load models and compile shaders
-      // and initialize shader data
-      if (!initGL())
+      // and initialize shader data (there is nothing to render in headless mode)
+      if ((!ocl::headless()) && (!initGL()))
       {
         throw std::runtime_error("Failed to construct ParticleSystem: OpenGL initialization failed");
       }
@@ -100,6 +124,47 @@ class ParticleSystem
 
     bool togglePause(void) { return m_pause = !m_pause; }
 
+    // the type of OpenCL device used when there is no device shared with OpenGL
+    // (or in headless mode), has to be set before a particle system is constructed
+    static void setPreferredDeviceType(cl_device_type type) { m_preferred_device_type = type; }
+
+    bool toggleWorkGroupTuning(void) { return m_tuner.toggleTuning(); }
+
+    // pipelined OpenCL/OpenGL interoperability, OpenGL draws a copy of the positions
+    // from the previous step, while OpenCL computes the next step (see ocl::GLDoubleBuffer)
+    bool pipelinedInterop(void) const { return m_pipelined; }
+    bool setPipelinedInterop(bool pipelined);
+    bool togglePipelinedInterop(void) { return setPipelinedInterop(!m_pipelined); }
+
+    // runs and renders the given number of frames with the synchronous
+    // and with the pipelined interoperability and reports the frame times
+    // (note that this advances the simulation)
+    void benchmarkInterop(unsigned int frames, std::ostream & os);
+
+    // when threaded, update is called from a thread without an OpenGL context
+    // and OpenGL does not draw the simulation buffers (see SimulationThread)
+    bool threaded(void) const { return m_threaded; }
+    void setThreaded(bool threaded);
+
+    const cl::Context & context(void) const { return m_cl_ctx; }
+    const cl::CommandQueue & commandQueue(void) const { return m_cl_queue; }
+    void setCommandQueue(const cl::CommandQueue & queue) { m_cl_queue = queue; }
+
+    // the execution times of OpenCL commands (printed when the system is destroyed)
+    ocl::PerfStats & perfStats(void) { return m_stats; }
+
+    size_t numParticles(void) const { return m_num_particles; }
+    ParticleLayout particleLayout(void) const { return m_particle_layout; }
+
+    // copies the current particle positions (in the current layout) to host memory
+    virtual bool readPositions(std::vector<float> & positions);
+
+    // the number of bytes a single per particle vector takes in the given layout
+    static size_t particleVectorSize(ParticleLayout layout)
+    {
+      return (layout == LAYOUT_AOS) ? sizeof(cl_float4) : 3 * sizeof(cl_float);
+    }
+
     // reset the particle system
     // initializes buffers and shared data
     virtual bool reset(unsigned int part_num) = 0;
@@ -112,6 +177,18 @@ class ParticleSystem
     // @param proj projection matrix
     void render(const glm::mat4 & mv = glm::mat4(), const glm::mat4 & proj = glm::mat4());
 
+    // render the given positions instead of the simulation buffers
+    // @param pos_vbo vertex buffer with num_particles positions in the given layout
+    void render(GLuint pos_vbo, size_t num_particles, ParticleLayout layout,
+                const glm::mat4 & mv, const glm::mat4 & proj);
+
+  protected:
+    // whether the system publishes its positions in update when pipelined
+    virtual bool supportsPipelinedInterop(void) const { return false; }
+
+    // copies the current positions to the display buffer (the positions have to be acquired)
+    bool publishPositions(cl_command_queue queue);
+
   private:
     // initializes OpenCL context
     bool initCL(void);
@@ -122,6 +199,9 @@ class ParticleSystem
     void drawBoundingVolume(void);
 
   private:
+    static const char *m_tuning_db_file;
+    static cl_device_type m_preferred_device_type;
+
     static const char *m_vert_shader;
     static const char *m_frag_shader;
 
@@ -135,13 +215,14 @@ class ParticleSystem
     static const char *m_frag_shader_bounding_volume_file;
 
   private:
-    // OpenGL shaders
-    ogl::ShaderProgram m_shader_particle_colors;
-    ogl::ShaderProgram m_shader_uniform_color;
-    ogl::ShaderProgram m_shader_bounding_volume;
+    // OpenGL shaders (the OpenGL objects are created in initGL,
+    // because there is no OpenGL context in headless mode)
+    std::unique_ptr<ogl::ShaderProgram> m_shader_particle_colors;
+    std::unique_ptr<ogl::ShaderProgram> m_shader_uniform_color;
+    std::unique_ptr<ogl::ShaderProgram> m_shader_bounding_volume;
 
     // vertex buffers with sphere geometry (or the geometry of objects that will represent particles)
-    geom::Model m_particle_geom;
+    std::unique_ptr<geom::Model> m_particle_geom;
     
     // point sprite textures
 
@@ -153,9 +234,11 @@ class ParticleSystem
     // memory objects with particle data
     ocl::GLBuffer m_particle_pos_buf;  // a buffer with particle positions (shared with OpenGL)
     ocl::GLBuffer m_particle_col_buf;  // a buffer with particle colors (shared with OpenGL)
+    ocl::GLDoubleBuffer m_display_pos_buf;  // a copy of positions that is drawn in pipelined mode
 
     // helper variables for simulation
     size_t m_num_particles;      // number of particles in simulation
+    ParticleLayout m_particle_layout;  // the layout of particle positions in m_particle_pos_buf
     cl_float m_time;             // simulation time
     cl_float4 m_volume_min;      // bounding volume minimum corner
     cl_float4 m_volume_max;      // bounding volume maximum corner
@@ -164,9 +247,14 @@ class ParticleSystem
     bool m_use_uniform_color;     // whether to use the same color for all particles or per particle color
     bool m_draw_bounding_volume;  // whether to display bounding volume or not
     bool m_pause;                 // whether to pause simulation
+    bool m_pipelined;             // whether OpenCL and OpenGL are pipelined
+    bool m_threaded;              // whether the simulation runs in a separate thread
 
     // statistics
     ocl::PerfStats m_stats;
+
+    // local work sizes of kernels
+    ocl::WorkGroupTuner m_tuner;
 };
 
 #endif
\ No newline at end of file
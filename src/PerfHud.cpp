@@ -0,0 +1,276 @@
+/*
+ * Copyright (C) 2014 Matus Fedorko <xfedor01@stud.fit.vutbr.cz>
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty.  In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+
+ * 1. The origin of this software must not be misrepresented; you must not
+ *    claim that you wrote the original software. If you use this software
+ *    in a product, an acknowledgment in the product documentation would be
+ *    appreciated but is not required.
+ * 2. Altered source versions must be plainly marked as such, and must not be
+ *    misrepresented as being the original software.
+ * 3. This notice may not be removed or altered from any source distribution.
+ */
+
+#include "PerfHud.h"
+#include "Window.h"
+#include "debug.h"
+#include "utils.h"
+
+#include <algorithm>
+#include <cmath>
+#include <functional>
+#include <sstream>
+#include <stdexcept>
+
+
+
+namespace {
+
+// the colors of plotted series (the first one is used for the whole frame time)
+const SDL_Color PALETTE[] = {
+  { 0xE0, 0xE0, 0xE0, 0xFF },
+  { 0xF0, 0xD0, 0x40, 0xFF },
+  { 0x60, 0xD0, 0x60, 0xFF },
+  { 0x50, 0x90, 0xF0, 0xFF },
+  { 0xF0, 0x80, 0x30, 0xFF },
+  { 0xD0, 0x60, 0xD0, 0xFF },
+  { 0x50, 0xD0, 0xD0, 0xFF }
+};
+
+const SDL_Color BACKGROUND_COLOR = { 0x00, 0x00, 0x00, 0xA0 };
+const SDL_Color BORDER_COLOR = { 0x80, 0x80, 0x80, 0xFF };
+const SDL_Color GRID_COLOR = { 0x40, 0x40, 0x40, 0xFF };
+
+const int TITLE_HEIGHT = 18;    // the space reserved for the title of a graph (in pixels)
+const int LEGEND_SPACING = 14;  // the distance of lines in legend (in pixels)
+
+/** rounds the value up to 1, 2 or 5 times a power of ten, so that the scale is easy to read */
+float niceCeil(float val)
+{
+  if (val <= 0.01f) return 0.01f;
+
+  float base = std::pow(10.0f, std::floor(std::log10(val)));
+  if (val <= base) return base;
+  if (val <= 2.0f * base) return 2.0f * base;
+  if (val <= 5.0f * base) return 5.0f * base;
+  return 10.0f * base;
+}
+
+}
+
+
+const char *PerfHud::m_vert_shader_file = "src/OpenGL/PerfHud_plot.vert";
+const char *PerfHud::m_frag_shader_file = "src/OpenGL/PerfHud_plot.frag";
+
+
+PerfHud::PerfHud(Window *target, TextRenderer & text_renderer)
+  : m_target_wnd(target)
+  , m_text_renderer(text_renderer)
+  , m_kernels()
+  , m_vertices()
+  , m_plot()
+  , m_shader()
+{
+  if (!m_shader.buildFiles(utils::fs::AssetsPath(m_vert_shader_file),
+                           utils::fs::AssetsPath(m_frag_shader_file)))
+  {
+    throw std::runtime_error("Failed to construct PerfHud: failed to compile shaders");
+  }
+
+  /* the vertices are uploaded right before each plot */
+  glBindVertexArray(m_plot.vao);
+  glBindBuffer(GL_ARRAY_BUFFER, m_plot.vbo);
+  glEnableVertexAttribArray(0);
+  glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 2 * sizeof(float), (void *) (0));
+  glBindVertexArray(0);
+  glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+
+void PerfHud::update(const ocl::PerfStats *stats)
+{
+  if (stats == nullptr) return;
+
+  std::vector<std::pair<std::string, unsigned long long> > totals;
+  stats->totalExecTimes(totals);
+
+  std::map<std::string, unsigned long long> cur(totals.begin(), totals.end());
+
+  /* the time spent in each kernel since the last frame */
+  for (std::map<std::string, KernelTimes>::iterator it = m_kernels.begin(); it != m_kernels.end(); ++it)
+  {
+    std::map<std::string, unsigned long long>::iterator cur_it = cur.find(it->first);
+    if (cur_it == cur.end())
+    {
+      // the statistics have been cleared, e.g. by a reset of the simulator
+      it->second.last_total = 0;
+      it->second.times.add(0.0f);
+      continue;
+    }
+
+    unsigned long long total = cur_it->second;
+    unsigned long long delta = (total >= it->second.last_total) ? (total - it->second.last_total) : total;
+    it->second.last_total = total;
+    it->second.times.add(float(delta * 1.0e-6));
+
+    cur.erase(cur_it);
+  }
+
+  /* the kernels that have not run before */
+  for (std::map<std::string, unsigned long long>::iterator it = cur.begin(); it != cur.end(); ++it)
+  {
+    KernelTimes & kt = m_kernels[it->first];
+    kt.last_total = it->second;
+    kt.times = utils::stats::RollingSeries(FrameProfiler::DEFAULT_HISTORY);
+  }
+}
+
+
+int PerfHud::render(int x, int y, const FrameProfiler & profiler)
+{
+  /* the whole frame time and its phases */
+  Series frame_series[FrameProfiler::PHASE_COUNT + 1];
+  frame_series[0].name = "frame";
+  frame_series[0].values = &profiler.frameTimes();
+  for (unsigned int i = 0; i < FrameProfiler::PHASE_COUNT; ++i)
+  {
+    frame_series[i + 1].name = FrameProfiler::phaseName(FrameProfiler::Phase(i));
+    frame_series[i + 1].values = &profiler.phaseTimes(FrameProfiler::Phase(i));
+  }
+
+  y = renderGraph(x, y, "Frame time", frame_series, FLUIDSIM_COUNT(frame_series));
+
+  /* the most expensive kernels in the remembered frames */
+  std::vector<std::pair<float, const std::string *> > order;
+  for (std::map<std::string, KernelTimes>::const_iterator it = m_kernels.begin(); it != m_kernels.end(); ++it)
+  {
+    order.push_back(std::make_pair(it->second.times.mean(), &it->first));
+  }
+
+  std::sort(order.begin(), order.end(), std::greater<std::pair<float, const std::string *> >());
+
+  if (order.empty())
+  {
+    m_text_renderer.renderSmall(x, y, "No OpenCL kernel times");
+    return y + TITLE_HEIGHT;
+  }
+
+  Series kernel_series[MAX_KERNELS];
+  unsigned int num_kernels = std::min<unsigned int>((unsigned int) order.size(), MAX_KERNELS);
+  for (unsigned int i = 0; i < num_kernels; ++i)
+  {
+    kernel_series[i].name = order[i].second->c_str();
+    kernel_series[i].values = &m_kernels[*order[i].second].times;
+  }
+
+  return renderGraph(x, y, "OpenCL kernels (device time per frame)", kernel_series, num_kernels);
+}
+
+
+int PerfHud::renderGraph(int x, int y, const char *title, const Series *series, unsigned int count)
+{
+  float scale = 0.0f;
+  for (unsigned int i = 0; i < count; ++i)
+  {
+    scale = std::max(scale, series[i].values->max());
+  }
+
+  scale = niceCeil(scale);
+
+  std::ostringstream title_str;
+  title_str << title << " [0 - " << scale << " ms]";
+  m_text_renderer.renderSmall(x, y, title_str.str().c_str());
+  y += TITLE_HEIGHT;
+
+  /* the background, the border and a grid line in the middle */
+  GLboolean depth_test = glIsEnabled(GL_DEPTH_TEST);
+  glDisable(GL_DEPTH_TEST);
+  glEnable(GL_BLEND);
+  glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+
+  static const float rect[] = { 0.0f, 0.0f, 1.0f, 0.0f, 1.0f, 1.0f, 0.0f, 1.0f };
+  static const float grid[] = { 0.0f, 0.5f, 1.0f, 0.5f };
+
+  m_vertices.assign(rect, rect + FLUIDSIM_COUNT(rect));
+  plot(GL_TRIANGLE_FAN, m_vertices, x, y, GRAPH_WIDTH, GRAPH_HEIGHT, BACKGROUND_COLOR);
+  plot(GL_LINE_LOOP, m_vertices, x, y, GRAPH_WIDTH, GRAPH_HEIGHT, BORDER_COLOR);
+
+  m_vertices.assign(grid, grid + FLUIDSIM_COUNT(grid));
+  plot(GL_LINES, m_vertices, x, y, GRAPH_WIDTH, GRAPH_HEIGHT, GRID_COLOR);
+
+  /* the series are aligned to the right edge, so the graph scrolls to the left */
+  for (unsigned int i = 0; i < count; ++i)
+  {
+    const utils::stats::RollingSeries & values = *series[i].values;
+    const SDL_Color & col = PALETTE[i % FLUIDSIM_COUNT(PALETTE)];
+
+    if (values.size() >= 2)
+    {
+      float dx = 1.0f / float(values.capacity() - 1);
+      float x0 = float(values.capacity() - values.size()) * dx;
+
+      m_vertices.clear();
+      for (unsigned int j = 0; j < values.size(); ++j)
+      {
+        m_vertices.push_back(x0 + j * dx);
+        m_vertices.push_back(values[j] / scale);
+      }
+
+      plot(GL_LINE_STRIP, m_vertices, x, y, GRAPH_WIDTH, GRAPH_HEIGHT, col);
+    }
+
+    std::ostringstream legend;
+    legend.precision(2);
+    legend << std::fixed << series[i].name << ": " << values.last() << " ms (max " << values.max() << ")";
+    m_text_renderer.renderSmall(x + GRAPH_WIDTH + 10, y + i * LEGEND_SPACING, legend.str().c_str(), &col);
+  }
+
+  glDisable(GL_BLEND);
+  if (depth_test) glEnable(GL_DEPTH_TEST);
+
+  return y + std::max<int>(GRAPH_HEIGHT, count * LEGEND_SPACING) + 10;
+}
+
+
+void PerfHud::plot(GLenum mode, const std::vector<float> & vertices,
+                   int x, int y, int w, int h,
+                   const SDL_Color & col)
+{
+  /* get window dimensions */
+  int wnd_w = 0;
+  int wnd_h = 0;
+
+  if (m_target_wnd == nullptr)
+  {
+    WARN("Graph not rendered, because target window is NULL.");
+    return;
+  }
+
+  m_target_wnd->getSize(&wnd_w, &wnd_h);
+
+  glBindBuffer(GL_ARRAY_BUFFER, m_plot.vbo);
+  glBufferData(GL_ARRAY_BUFFER, vertices.size() * sizeof(float), vertices.data(), GL_STREAM_DRAW);
+  glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+  m_shader.use();
+
+  GLuint prog = m_shader.getID();
+
+  // the rectangle in pixels is converted to normalized device coordinates
+  glUniform2f(glGetUniformLocation(prog, "origin"), (2.0f * x / wnd_w) - 1.0f, 1.0f - (2.0f * (y + h) / wnd_h));
+  glUniform2f(glGetUniformLocation(prog, "size"), 2.0f * w / wnd_w, 2.0f * h / wnd_h);
+  glUniform4f(glGetUniformLocation(prog, "color"), col.r / 255.0f, col.g / 255.0f, col.b / 255.0f, col.a / 255.0f);
+
+  glBindVertexArray(m_plot.vao);
+  glDrawArrays(mode, 0, (GLsizei) (vertices.size() / 2));
+  glBindVertexArray(0);
+
+  glUseProgram(0);
+}
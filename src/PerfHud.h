@@ -0,0 +1,110 @@
+/*
+ * Copyright (C) 2014 Matus Fedorko <xfedor01@stud.fit.vutbr.cz>
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty.  In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+
+ * 1. The origin of this software must not be misrepresented; you must not
+ *    claim that you wrote the original software. If you use this software
+ *    in a product, an acknowledgment in the product documentation would be
+ *    appreciated but is not required.
+ * 2. Altered source versions must be plainly marked as such, and must not be
+ *    misrepresented as being the original software.
+ * 3. This notice may not be removed or altered from any source distribution.
+ */
+
+/**
+ * An on-screen display of the frame times and the execution times
+ * of OpenCL kernels in the last frames
+ */
+
+#ifndef PERFHUD_H
+#define PERFHUD_H
+
+#include "FrameProfiler.h"
+#include "TextRenderer.h"
+#include "geom.h"
+#include "ogl_lib.h"
+#include "ocl_lib.h"
+
+#include <map>
+#include <string>
+#include <vector>
+
+
+class Window;
+
+class PerfHud
+{
+  public:
+    static const int GRAPH_WIDTH = 360;       // the dimensions of a single graph in pixels
+    static const int GRAPH_HEIGHT = 100;
+    static const unsigned int MAX_KERNELS = 6;   // the number of the most expensive kernels that are plotted
+
+  private:
+    static const char *m_vert_shader_file;
+    static const char *m_frag_shader_file;
+
+  public:
+    PerfHud(Window *target, TextRenderer & text_renderer);
+
+    /**
+     * Samples the execution times of kernels since the last call,
+     * it is supposed to be called once a frame
+     *
+     * @param stats the statistics of the displayed simulator (may be nullptr)
+     */
+    void update(const ocl::PerfStats *stats);
+
+    // forgets the sampled kernel times (e.g. when the simulator is switched)
+    void clear(void) { m_kernels.clear(); }
+
+    /**
+     * Renders the graphs of phase times and kernel times
+     *
+     * @param x, y the top left corner of the graphs in pixels
+     *
+     * @return the end height where further text can be placed
+     */
+    int render(int x, int y, const FrameProfiler & profiler);
+
+  private:
+    struct Series
+    {
+      const char *name;
+      const utils::stats::RollingSeries *values;
+    };
+
+    struct KernelTimes
+    {
+      unsigned long long last_total;     // the total execution time at the previous update (ns)
+      utils::stats::RollingSeries times; // the execution time in each frame (ms)
+    };
+
+    // renders a single graph with a legend on its right side
+    int renderGraph(int x, int y, const char *title, const Series *series, unsigned int count);
+
+    // plots a polygon with vertices in [0, 1] x [0, 1] to the given rectangle (in pixels)
+    void plot(GLenum mode, const std::vector<float> & vertices,
+              int x, int y, int w, int h,
+              const SDL_Color & col);
+
+  private:
+    PerfHud(const PerfHud & );
+    PerfHud & operator=(const PerfHud & );
+
+  private:
+    Window *m_target_wnd;                         /// the target window
+    TextRenderer & m_text_renderer;               /// renders titles and legends
+    std::map<std::string, KernelTimes> m_kernels; /// the sampled kernel times
+    std::vector<float> m_vertices;                /// a temporary for the plotted vertices
+    geom::Model m_plot;                           /// the buffer with plotted vertices
+    ogl::ShaderProgram m_shader;                  /// the line plot shader
+};
+
+#endif
@@ -0,0 +1,225 @@
+/*
+ * Copyright (C) 2014 Matus Fedorko <xfedor01@stud.fit.vutbr.cz>
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty.  In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+
+ * 1. The origin of this software must not be misrepresented; you must not
+ *    claim that you wrote the original software. If you use this software
+ *    in a product, an acknowledgment in the product documentation would be
+ *    appreciated but is not required.
+ * 2. Altered source versions must be plainly marked as such, and must not be
+ *    misrepresented as being the original software.
+ * 3. This notice may not be removed or altered from any source distribution.
+ */
+
+
+#include "SimulationThread.h"
+#include "debug.h"
+#include "utils.h"
+
+#include <algorithm>
+
+
+
+SimulationThread::~SimulationThread(void)
+{
+  stop();
+  glDeleteBuffers(1, &m_interp_vbo);
+}
+
+
+bool SimulationThread::start(void)
+{
+  if (m_running) return true;
+
+  /* the simulation gets its own command queue on the same device */
+  cl_device_id device = nullptr;
+  cl_int err = clGetCommandQueueInfo(m_system.commandQueue()(), CL_QUEUE_DEVICE,
+                                     sizeof(device), &device, nullptr);
+  if (err != CL_SUCCESS)
+  {
+    ERROR("SimulationThread: Failed to query the device of the command queue: " << ocl::errorToStr(err));
+    return false;
+  }
+
+  m_queue = cl::CommandQueue(m_system.context(), device, CL_QUEUE_PROFILING_ENABLE, &err);
+  if (err != CL_SUCCESS)
+  {
+    ERROR("SimulationThread: Failed to create OpenCL command queue: " << ocl::errorToStr(err));
+    return false;
+  }
+
+  /* all the work enqueued by the render thread has to be finished,
+     before the simulation continues on another queue */
+  m_prev_queue = m_system.commandQueue();
+  clFinish(m_prev_queue());
+
+  m_system.setThreaded(true);
+  m_system.setCommandQueue(m_queue);
+
+  /* forget the states from the previous run */
+  for (unsigned int i = 0; i < FLUIDSIM_COUNT(m_slots); ++i)
+  {
+    m_slots[i] = Snapshot();
+  }
+
+  m_back = 0;
+  m_ready = 1;
+  m_cur = 2;
+  m_prev = 3;
+
+  m_quit = false;
+  m_start = Clock::now();
+  m_thread = std::thread(&SimulationThread::run, this);
+  m_running = true;
+
+  INFO("SimulationThread: Started simulation at " << (1.0 / m_period) << " steps per second");
+
+  return true;
+}
+
+
+void SimulationThread::stop(void)
+{
+  if (!m_running) return;
+
+  m_quit = true;
+  m_thread.join();
+  m_running = false;
+
+  clFinish(m_queue());
+
+  m_system.setCommandQueue(m_prev_queue);
+  m_system.setThreaded(false);
+
+  m_prev_queue = cl::CommandQueue();
+  m_queue = cl::CommandQueue();
+
+  INFO("SimulationThread: Stopped simulation");
+}
+
+
+void SimulationThread::run(void)
+{
+  double accumulator = 0.0;
+  double max_frame_time = MAX_STEPS_PER_ITERATION * m_period;
+  Clock::time_point last = Clock::now();
+
+  while (!m_quit)
+  {
+    Clock::time_point now = Clock::now();
+    double frame_time = std::chrono::duration<double>(now - last).count();
+    last = now;
+
+    /* when the simulation can not keep up, it rather slows down,
+       than spends ever more steps catching up */
+    accumulator += std::min(frame_time, max_frame_time);
+
+    if (accumulator >= m_period)
+    {
+      Snapshot & snapshot = m_slots[m_back];
+      bool valid = false;
+
+      {
+        std::unique_lock<std::mutex> lock(m_step_mutex);
+
+        while (accumulator >= m_period)
+        {
+          m_system.update();
+          accumulator -= m_period;
+        }
+
+        valid = m_system.readPositions(snapshot.positions);
+        snapshot.num_particles = m_system.numParticles();
+        snapshot.layout = m_system.particleLayout();
+        snapshot.order = m_system.particleOrder();
+      }
+
+      /* the state lags behind the wall clock by the unsimulated time */
+      snapshot.clock = std::chrono::duration<double>(now - m_start).count() - accumulator;
+
+      if (valid) publish();
+    }
+
+    /* sleep until the next step is due */
+    std::this_thread::sleep_for(std::chrono::duration<double>(m_period - accumulator));
+  }
+}
+
+
+void SimulationThread::publish(void)
+{
+  m_back = m_ready.exchange(m_back | SLOT_DIRTY, std::memory_order_acq_rel) & ~SLOT_DIRTY;
+}
+
+
+void SimulationThread::consume(void)
+{
+  if ((m_ready.load(std::memory_order_acquire) & SLOT_DIRTY) == 0) return;
+
+  unsigned int ready = m_ready.exchange(m_prev, std::memory_order_acq_rel);
+  m_prev = m_cur;
+  m_cur = ready & ~SLOT_DIRTY;
+}
+
+
+void SimulationThread::render(const glm::mat4 & mv, const glm::mat4 & proj)
+{
+  consume();
+
+  const Snapshot & cur = m_slots[m_cur];
+  const Snapshot & prev = m_slots[m_prev];
+
+  /* the renderer stays one step behind the simulation,
+     so that there is always a newer state to interpolate towards
+     (when the particles were reordered in between, the same index
+     refers to different particles, so the newer state is drawn as is) */
+  float alpha = 1.0f;
+
+  if ((prev.positions.size() == cur.positions.size()) &&
+      (prev.layout == cur.layout) &&
+      (prev.order == cur.order) &&
+      (cur.clock > prev.clock))
+  {
+    double t = elapsed() - m_period;
+    alpha = float(std::max(0.0, std::min(1.0, (t - prev.clock) / (cur.clock - prev.clock))));
+  }
+
+  /* interpolate component wise, this works the same for all the layouts */
+  m_interp.resize(cur.positions.size());
+
+  if (alpha >= 1.0f)
+  {
+    std::copy(cur.positions.begin(), cur.positions.end(), m_interp.begin());
+  }
+  else
+  {
+    for (size_t i = 0; i < m_interp.size(); ++i)
+    {
+      m_interp[i] = prev.positions[i] + alpha * (cur.positions[i] - prev.positions[i]);
+    }
+  }
+
+  if ((m_interp_vbo == 0) && (!m_interp.empty()))
+  {
+    glGenBuffers(1, &m_interp_vbo);
+  }
+
+  if (m_interp_vbo != 0)
+  {
+    glBindBuffer(GL_ARRAY_BUFFER, m_interp_vbo);
+    glBufferData(GL_ARRAY_BUFFER, m_interp.size() * sizeof(float), m_interp.data(), GL_STREAM_DRAW);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+  }
+
+  /* without any published state only the bounding volume is drawn
+     (FluidSystem hides the overloads of render) */
+  ParticleSystem & system = m_system;
+  system.render(m_interp.empty() ? 0 : m_interp_vbo, cur.num_particles, cur.layout, mv, proj);
+}
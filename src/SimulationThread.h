@@ -0,0 +1,149 @@
+/*
+ * Copyright (C) 2014 Matus Fedorko <xfedor01@stud.fit.vutbr.cz>
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty.  In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+
+ * 1. The origin of this software must not be misrepresented; you must not
+ *    claim that you wrote the original software. If you use this software
+ *    in a product, an acknowledgment in the product documentation would be
+ *    appreciated but is not required.
+ * 2. Altered source versions must be plainly marked as such, and must not be
+ *    misrepresented as being the original software.
+ * 3. This notice may not be removed or altered from any source distribution.
+ */
+
+
+/**
+ * A thread that advances a fluid simulation at a fixed rate,
+ * independently of the rate at which the window is redrawn
+ */
+
+#ifndef SIMULATIONTHREAD_H
+#define SIMULATIONTHREAD_H
+
+#include "FluidSystem.h"
+
+#include <glm/glm.hpp>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+
+class SimulationThread
+{
+  public:
+    static const unsigned int DEFAULT_RATE = 60;           // simulation steps per second
+    static const unsigned int MAX_STEPS_PER_ITERATION = 4; // how many steps may be taken to catch up
+
+  public:
+    // @param steps_per_second the rate of simulation steps (a step is a single call to FluidSystem::update)
+    explicit SimulationThread(FluidSystem & system, unsigned int steps_per_second = DEFAULT_RATE)
+      : m_system(system)
+      , m_queue()
+      , m_prev_queue()
+      , m_thread()
+      , m_step_mutex()
+      , m_quit(false)
+      , m_running(false)
+      , m_period(1.0 / steps_per_second)
+      , m_start()
+      , m_back(0)
+      , m_ready(1)
+      , m_cur(2)
+      , m_prev(3)
+      , m_interp()
+      , m_interp_vbo(0)
+    {
+    }
+
+    ~SimulationThread(void);
+
+    // starts the simulation thread,
+    // the fluid system is switched to the thread's own command queue
+    bool start(void);
+
+    // stops the simulation thread and gives the fluid system its original command queue back
+    void stop(void);
+
+    bool running(void) const { return m_running; }
+
+    // the lock has to be held, when the fluid system is accessed from another thread
+    std::unique_lock<std::mutex> lock(void) { return std::unique_lock<std::mutex>(m_step_mutex); }
+
+    // renders the fluid system interpolated between the last two simulation steps
+    // (has to be called from the thread with the OpenGL context)
+    void render(const glm::mat4 & mv, const glm::mat4 & proj);
+
+  private:
+    typedef std::chrono::high_resolution_clock Clock;
+
+    // a copy of the particle positions after a simulation step
+    struct Snapshot {
+      std::vector<float> positions;          // the positions in the layout given below
+      size_t num_particles;
+      ParticleSystem::ParticleLayout layout;
+      double clock;                          // the time the state corresponds to (in seconds since start)
+      unsigned int order;                    // the particle order (see FluidSystem::particleOrder)
+
+      Snapshot(void)
+        : positions(), num_particles(0), layout(ParticleSystem::LAYOUT_AOS), clock(0.0), order(0)
+      {
+      }
+    };
+
+    // flags the ready slot as not yet consumed by the renderer
+    static const unsigned int SLOT_DIRTY = 0x4;
+
+  private:
+    void run(void);
+
+    // the time since the thread has been started in seconds
+    double elapsed(void) const
+    {
+      return std::chrono::duration<double>(Clock::now() - m_start).count();
+    }
+
+    // hands the back slot over to the renderer (simulation thread)
+    void publish(void);
+    // takes the latest published slot (render thread)
+    void consume(void);
+
+  private:
+    // just disable copying
+    SimulationThread(const SimulationThread & );
+    SimulationThread & operator=(const SimulationThread & );
+
+  private:
+    FluidSystem & m_system;
+    cl::CommandQueue m_queue;       // the command queue used by the simulation thread
+    cl::CommandQueue m_prev_queue;  // the command queue of the fluid system before start
+    std::thread m_thread;
+    std::mutex m_step_mutex;        // serializes simulation steps and external access to the fluid system
+    std::atomic<bool> m_quit;
+    bool m_running;
+    double m_period;                // the simulated time step in seconds
+    Clock::time_point m_start;
+
+    // the snapshots are exchanged without locks, the simulation thread owns
+    // the back slot, the renderer owns the current and the previous slot and
+    // the ready slot holds the latest published state (the owners swap indices)
+    Snapshot m_slots[4];
+    unsigned int m_back;
+    std::atomic<unsigned int> m_ready;
+    unsigned int m_cur;
+    unsigned int m_prev;
+
+    // interpolated positions drawn by the renderer
+    std::vector<float> m_interp;
+    GLuint m_interp_vbo;
+};
+
+#endif
@@ -0,0 +1,357 @@
+/*
+ * Copyright (C) 2014 Matus Fedorko <xfedor01@stud.fit.vutbr.cz>
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty.  In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+
+ * 1. The origin of this software must not be misrepresented; you must not
+ *    claim that you wrote the original software. If you use this software
+ *    in a product, an acknowledgment in the product documentation would be
+ *    appreciated but is not required.
+ * 2. Altered source versions must be plainly marked as such, and must not be
+ *    misrepresented as being the original software.
+ * 3. This notice may not be removed or altered from any source distribution.
+ */
+
+
+
+#include "SnapshotReader.h"
+#include "SnapshotWriter.h"
+#include "debug.h"
+
+#include <cstring>
+
+
+
+namespace {
+
+const size_t FILE_HEADER_SIZE = 16;
+const size_t FRAME_HEADER_SIZE = 16;
+const size_t ENCODING_HEADER_SIZE = 32;
+
+const cl_uint ENCODING_RAW = 0;
+const cl_uint ENCODING_QUANTIZED = 1;
+
+/** reads a 32-bit value in little endian order */
+cl_uint getUInt(const unsigned char *src)
+{
+  return (cl_uint) src[0] | ((cl_uint) src[1] << 8) | ((cl_uint) src[2] << 16) | ((cl_uint) src[3] << 24);
+}
+
+float getFloat(const unsigned char *src)
+{
+  cl_uint bits = getUInt(src);
+  float value;
+  memcpy(&value, &bits, sizeof(value));
+  return value;
+}
+
+/** reads bits from a byte array, the most significant bit first (see BitWriter in SnapshotWriter.cpp) */
+class BitReader
+{
+  public:
+    BitReader(const unsigned char *data, size_t size)
+      : m_data(data)
+      , m_size(size)
+      , m_pos(0)
+    {
+    }
+
+    // reads n bits (n <= 64), returns false when the data end first
+    bool get64(unsigned int n, cl_ulong *value)
+    {
+      if (m_pos + n > 8 * m_size) return false;
+
+      cl_ulong v = 0;
+      for (unsigned int i = 0; i < n; ++i, ++m_pos)
+      {
+        v = (v << 1) | ((m_data[m_pos >> 3] >> (7 - (m_pos & 7))) & 1);
+      }
+
+      *value = v;
+      return true;
+    }
+
+    bool get(unsigned int n, unsigned int *value)
+    {
+      cl_ulong v = 0;
+      if (!get64(n, &v)) return false;
+      *value = (unsigned int) v;
+      return true;
+    }
+
+  private:
+    const unsigned char *m_data;
+    size_t m_size;
+    size_t m_pos;   // in bits
+};
+
+/** the inverse of riceEncode in SnapshotWriter.cpp */
+bool riceDecode(BitReader & in, size_t count, cl_ulong *values)
+{
+  for (size_t begin = 0; begin < count; begin += SnapshotWriter::RICE_BLOCK)
+  {
+    size_t end = std::min<size_t>(begin + SnapshotWriter::RICE_BLOCK, count);
+
+    unsigned int k = 0;
+    if (!in.get(6, &k)) return false;
+
+    for (size_t i = begin; i < end; ++i)
+    {
+      /* the unary quotient, RICE_ESCAPE ones without a terminating zero escape the value */
+      unsigned int q = 0;
+      unsigned int bit = 1;
+      while (q < SnapshotWriter::RICE_ESCAPE)
+      {
+        if (!in.get(1, &bit)) return false;
+        if (bit == 0) break;
+        ++q;
+      }
+
+      cl_ulong v = 0;
+      if (bit == 0)
+      {
+        if (!in.get64(k, &v)) return false;
+        v |= (cl_ulong) q << k;
+      }
+      else
+      {
+        unsigned int len = 0;
+        if ((!in.get(7, &len)) || (len > 64) || (!in.get64(len, &v))) return false;
+      }
+
+      values[i] = v;
+    }
+  }
+
+  return true;
+}
+
+/** the inverse of snapshot_morton_expand_bits in snapshot_quantize.cl */
+cl_uint mortonCompactBits(cl_ulong v)
+{
+  v &= 0x1249249249249249ull;
+  v = (v | (v >> 2))  & 0x10C30C30C30C30C3ull;
+  v = (v | (v >> 4))  & 0x100F00F00F00F00Full;
+  v = (v | (v >> 8))  & 0x001F0000FF0000FFull;
+  v = (v | (v >> 16)) & 0x001F00000000FFFFull;
+  v = (v | (v >> 32)) & 0x00000000001FFFFFull;
+  return (cl_uint) v;
+}
+
+}
+
+
+
+bool SnapshotReader::open(const std::string & file_name)
+{
+  close();
+
+  m_file = fopen(file_name.c_str(), "rb");
+  if (m_file == nullptr)
+  {
+    ERROR("SnapshotReader: Failed to open file " << file_name);
+    return false;
+  }
+
+  m_file_name = file_name;
+
+  unsigned char header[FILE_HEADER_SIZE];
+  if (fread(header, sizeof(header), 1, m_file) != 1)
+  {
+    ERROR("SnapshotReader: Failed to read file header of " << file_name);
+    close();
+    return false;
+  }
+
+  cl_uint encoding = getUInt(header + 12);
+
+  if ((memcmp(header, "FSNP", 4) != 0) || (getUInt(header + 4) != SnapshotWriter::FORMAT_VERSION) ||
+      (getUInt(header + 8) != FRAME_HEADER_SIZE) || ((encoding != ENCODING_RAW) && (encoding != ENCODING_QUANTIZED)))
+  {
+    ERROR("SnapshotReader: " << file_name << " is not a snapshot file of version " << SnapshotWriter::FORMAT_VERSION);
+    close();
+    return false;
+  }
+
+  m_compressed = (encoding == ENCODING_QUANTIZED);
+  m_at_end = false;
+  m_key_valid = false;
+
+  return true;
+}
+
+
+void SnapshotReader::close(void)
+{
+  if (m_file == nullptr) return;
+
+  fclose(m_file);
+  m_file = nullptr;
+}
+
+
+bool SnapshotReader::readFrame(Frame & frame)
+{
+  if (m_file == nullptr) return false;
+
+  unsigned char header[FRAME_HEADER_SIZE + ENCODING_HEADER_SIZE];
+  size_t header_size = m_compressed ? sizeof(header) : FRAME_HEADER_SIZE;
+
+  size_t count = fread(header, 1, header_size, m_file);
+  if (count == 0)
+  {
+    m_at_end = true;
+    return false;
+  }
+
+  if (count != header_size)
+  {
+    ERROR("SnapshotReader: Truncated frame header in " << m_file_name);
+    return false;
+  }
+
+  bool is_raw = (memcmp(header, "FRME", 4) == 0);
+  bool is_key = (memcmp(header, "QKEY", 4) == 0);
+  bool is_delta = (memcmp(header, "QDLT", 4) == 0);
+
+  if ((m_compressed) ? (!is_key && !is_delta) : (!is_raw))
+  {
+    ERROR("SnapshotReader: Unknown frame in " << m_file_name);
+    return false;
+  }
+
+  frame.step = getUInt(header + 4);
+  frame.time = getFloat(header + 8);
+  frame.num_particles = getUInt(header + 12);
+  frame.compressed = m_compressed;
+  frame.keyframe = is_key;
+
+  size_t n = frame.num_particles;
+
+  if (!m_compressed)
+  {
+    /* positions, velocities and densities, each of them as a whole */
+    frame.positions.resize(3 * n);
+    frame.velocities.resize(3 * n);
+    frame.densities.resize(n);
+    frame.coords.clear();
+    frame.codes.clear();
+
+    if ((n > 0) &&
+        ((fread(&frame.positions[0], sizeof(float), 3 * n, m_file) != 3 * n) ||
+         (fread(&frame.velocities[0], sizeof(float), 3 * n, m_file) != 3 * n) ||
+         (fread(&frame.densities[0], sizeof(float), n, m_file) != n)))
+    {
+      ERROR("SnapshotReader: Truncated frame of step " << frame.step << " in " << m_file_name);
+      return false;
+    }
+
+    return true;
+  }
+
+  const unsigned char *enc = header + FRAME_HEADER_SIZE;
+  frame.bits = getUInt(enc);
+  for (int i = 0; i < 3; ++i)
+  {
+    frame.volume_min.s[i] = getFloat(enc + 4 + 4 * i);
+    frame.volume_max.s[i] = getFloat(enc + 16 + 4 * i);
+  }
+  frame.volume_min.s[3] = 0.0f;
+  frame.volume_max.s[3] = 0.0f;
+
+  size_t size = getUInt(enc + 28);
+  m_payload.resize(size);
+
+  if ((size > 0) && (fread(&m_payload[0], 1, size, m_file) != size))
+  {
+    ERROR("SnapshotReader: Truncated frame of step " << frame.step << " in " << m_file_name);
+    return false;
+  }
+
+  if (!decode(frame, m_payload.empty() ? nullptr : &m_payload[0], size))
+  {
+    ERROR("SnapshotReader: Failed to decode frame of step " << frame.step << " in " << m_file_name);
+    return false;
+  }
+
+  return true;
+}
+
+
+bool SnapshotReader::decode(Frame & frame, const unsigned char *payload, size_t size)
+{
+  size_t n = frame.num_particles;
+  if ((frame.bits == 0) || (frame.bits > SnapshotWriter::MAX_QUANTIZATION_BITS)) return false;
+
+  BitReader in(payload, size);
+  frame.coords.resize(3 * n);
+  frame.velocities.clear();
+  frame.densities.clear();
+
+  if (frame.keyframe)
+  {
+    frame.codes.resize(2 * n);
+    if ((!riceDecode(in, n, frame.codes.data())) || (!riceDecode(in, n, frame.codes.data() + n))) return false;
+
+    /* the prefix sums give the Morton codes in ascending order and the indices
+       of the particles they belong to, every particle has to occur exactly once */
+    std::vector<bool> seen(n, false);
+    cl_ulong code = 0;
+    cl_ulong index = (cl_ulong) -1;
+
+    for (size_t i = 0; i < n; ++i)
+    {
+      cl_ulong v = frame.codes[n + i];
+      code += frame.codes[i];
+      index += ((v >> 1) ^ (0 - (v & 1))) + 1;
+
+      if ((index >= n) || (seen[(size_t) index])) return false;
+      seen[(size_t) index] = true;
+
+      cl_uint *q = &frame.coords[3 * (size_t) index];
+      q[0] = mortonCompactBits(code);
+      q[1] = mortonCompactBits(code >> 1);
+      q[2] = mortonCompactBits(code >> 2);
+    }
+
+    m_key_coords = frame.coords;
+    m_key_valid = true;
+  }
+  else
+  {
+    if ((!m_key_valid) || (m_key_coords.size() != 3 * n)) return false;
+    frame.codes.resize(3 * n);
+    if (!riceDecode(in, 3 * n, frame.codes.data())) return false;
+
+    /* all x differences, then all y and all z */
+    for (size_t a = 0; a < 3; ++a)
+    {
+      for (size_t i = 0; i < n; ++i)
+      {
+        cl_uint v = (cl_uint) frame.codes[a * n + i];
+        frame.coords[3 * i + a] = m_key_coords[3 * i + a] + ((v >> 1) ^ (0 - (v & 1)));
+      }
+    }
+  }
+
+  /* the inverse of quantization */
+  cl_uint max_coord = (1u << frame.bits) - 1;
+  frame.positions.resize(3 * n);
+
+  for (size_t i = 0; i < 3 * n; ++i)
+  {
+    size_t a = i % 3;
+    if (frame.coords[i] > max_coord) return false;
+
+    frame.positions[i] = frame.volume_min.s[a] +
+                         frame.coords[i] * (frame.volume_max.s[a] - frame.volume_min.s[a]) / max_coord;
+  }
+
+  return true;
+}
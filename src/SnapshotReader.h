@@ -0,0 +1,116 @@
+/*
+ * Copyright (C) 2014 Matus Fedorko <xfedor01@stud.fit.vutbr.cz>
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty.  In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+
+ * 1. The origin of this software must not be misrepresented; you must not
+ *    claim that you wrote the original software. If you use this software
+ *    in a product, an acknowledgment in the product documentation would be
+ *    appreciated but is not required.
+ * 2. Altered source versions must be plainly marked as such, and must not be
+ *    misrepresented as being the original software.
+ * 3. This notice may not be removed or altered from any source distribution.
+ */
+
+/**
+ * Reads the snapshot files written by SnapshotWriter (see SnapshotWriter.h
+ * for the file format) and decodes the compressed frames back to positions.
+ */
+
+#ifndef SNAPSHOTREADER_H
+#define SNAPSHOTREADER_H
+
+#include "ocl_lib.h"
+
+#include <cstdio>
+#include <string>
+#include <vector>
+
+
+class SnapshotReader
+{
+  public:
+    struct Frame
+    {
+      unsigned int step;
+      float time;
+      size_t num_particles;
+      bool compressed;
+      bool keyframe;                   // compressed frames only
+      unsigned int bits;               // bits per axis of compressed frames
+      cl_float4 volume_min;            // the bounds of the quantized positions
+      cl_float4 volume_max;
+      std::vector<float> positions;    // xyz triples
+      std::vector<float> velocities;   // xyz triples (raw frames only)
+      std::vector<float> densities;    // raw frames only
+      std::vector<cl_uint> coords;     // the quantized positions as xyz triples (compressed frames only)
+      std::vector<cl_ulong> codes;     // the Rice decoded values of the payload (compressed frames only)
+
+      Frame(void)
+        : step(0), time(0.0f), num_particles(0)
+        , compressed(false), keyframe(false), bits(0)
+        , volume_min(), volume_max()
+        , positions(), velocities(), densities(), coords(), codes()
+      {
+      }
+    };
+
+  public:
+    SnapshotReader(void)
+      : m_file(nullptr)
+      , m_file_name()
+      , m_compressed(false)
+      , m_at_end(false)
+      , m_key_coords()
+      , m_key_valid(false)
+      , m_payload()
+    {
+    }
+
+    ~SnapshotReader(void) { close(); }
+
+    // opens the file and checks its header
+    bool open(const std::string & file_name);
+    void close(void);
+
+    bool isOpen(void) const { return m_file != nullptr; }
+    // whether the frames of the open file are compressed
+    bool compressed(void) const { return m_compressed; }
+    // whether the last readFrame failed only because there were no more frames
+    bool atEnd(void) const { return m_at_end; }
+
+    // reads and decodes the next frame, returns false at the end of file or on error
+    bool readFrame(Frame & frame);
+
+    /**
+     * Decodes the payload of a compressed frame. The delta frames are relative
+     * to the last keyframe decoded by this reader.
+     *
+     * @param frame the header fields (number of particles, keyframe, bits and volume)
+     *        have to be set, the positions, coordinates and codes are filled in
+     *
+     * @return false if the payload is damaged or a delta frame has no keyframe
+     */
+    bool decode(Frame & frame, const unsigned char *payload, size_t size);
+
+  private:
+    SnapshotReader(const SnapshotReader & );
+    SnapshotReader & operator=(const SnapshotReader & );
+
+  private:
+    FILE *m_file;
+    std::string m_file_name;
+    bool m_compressed;
+    bool m_at_end;
+    std::vector<cl_uint> m_key_coords;       // the quantized positions of the last keyframe
+    bool m_key_valid;
+    std::vector<unsigned char> m_payload;    // the payload of the frame being decoded
+};
+
+#endif
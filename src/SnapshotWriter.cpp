@@ -0,0 +1,875 @@
+/*
+ * Copyright (C) 2014 Matus Fedorko <xfedor01@stud.fit.vutbr.cz>
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty.  In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+
+ * 1. The origin of this software must not be misrepresented; you must not
+ *    claim that you wrote the original software. If you use this software
+ *    in a product, an acknowledgment in the product documentation would be
+ *    appreciated but is not required.
+ * 2. Altered source versions must be plainly marked as such, and must not be
+ *    misrepresented as being the original software.
+ * 3. This notice may not be removed or altered from any source distribution.
+ */
+
+
+
+#include "SnapshotWriter.h"
+#include "debug.h"
+
+#include <chrono>
+#include <cmath>
+#include <cstring>
+
+
+
+namespace {
+
+typedef std::chrono::high_resolution_clock Clock;
+
+const size_t FILE_HEADER_SIZE = 16;
+const size_t FRAME_HEADER_SIZE = 16;
+const size_t ENCODING_HEADER_SIZE = 32;
+
+const cl_uint ENCODING_RAW = 0;
+const cl_uint ENCODING_QUANTIZED = 1;
+
+/** the size of a frame in a staging buffer */
+size_t stagingSize(size_t num_particles, ParticleSystem::ParticleLayout layout)
+{
+  return num_particles * (2 * ParticleSystem::particleVectorSize(layout) + sizeof(cl_float2));
+}
+
+/** writes a 32-bit value in little endian order */
+void putUInt(unsigned char *dst, cl_uint value)
+{
+  dst[0] = (unsigned char) (value);
+  dst[1] = (unsigned char) (value >> 8);
+  dst[2] = (unsigned char) (value >> 16);
+  dst[3] = (unsigned char) (value >> 24);
+}
+
+void putFloat(unsigned char *dst, float value)
+{
+  cl_uint bits;
+  memcpy(&bits, &value, sizeof(bits));
+  putUInt(dst, bits);
+}
+
+/** the size of a raw frame with positions only, the reference for compression ratio */
+size_t rawPositionsSize(size_t num_particles)
+{
+  return FRAME_HEADER_SIZE + num_particles * 3 * sizeof(float);
+}
+
+/** Inserts two zero bits after each of the lowest 21 bits of v (see snapshot_quantize.cl) */
+cl_ulong mortonExpandBits(cl_ulong v)
+{
+  v &= 0x1FFFFFull;
+  v = (v | (v << 32)) & 0x001F00000000FFFFull;
+  v = (v | (v << 16)) & 0x001F0000FF0000FFull;
+  v = (v | (v << 8))  & 0x100F00F00F00F00Full;
+  v = (v | (v << 4))  & 0x10C30C30C30C30C3ull;
+  v = (v | (v << 2))  & 0x1249249249249249ull;
+  return v;
+}
+
+unsigned int bitLength(cl_ulong v)
+{
+  unsigned int len = 0;
+  while (v != 0)
+  {
+    v >>= 1;
+    ++len;
+  }
+  return len;
+}
+
+/** appends bits to a byte vector, the most significant bit first */
+class BitWriter
+{
+  public:
+    explicit BitWriter(std::vector<unsigned char> & out)
+      : m_out(out)
+      , m_acc(0)
+      , m_count(0)
+    {
+    }
+
+    // appends the lowest n bits of value (n <= 32)
+    void put(cl_uint value, unsigned int n)
+    {
+      if (n < 32) value &= (1u << n) - 1;
+      m_acc = (m_acc << n) | value;
+      m_count += n;
+      while (m_count >= 8)
+      {
+        m_count -= 8;
+        m_out.push_back((unsigned char) (m_acc >> m_count));
+      }
+    }
+
+    // appends the lowest n bits of value (n <= 64)
+    void put64(cl_ulong value, unsigned int n)
+    {
+      if (n > 32)
+      {
+        put((cl_uint) (value >> 32), n - 32);
+        n = 32;
+      }
+      put((cl_uint) value, n);
+    }
+
+    // pads the last byte with zeros
+    void flush(void)
+    {
+      if (m_count > 0)
+      {
+        m_out.push_back((unsigned char) (m_acc << (8 - m_count)));
+        m_count = 0;
+      }
+    }
+
+  private:
+    std::vector<unsigned char> & m_out;
+    cl_ulong m_acc;
+    unsigned int m_count;   // the number of bits in m_acc not yet written
+};
+
+/** Rice codes the values, the parameter is adapted to each block of RICE_BLOCK values */
+template <typename T>
+void riceEncode(BitWriter & out, const T *values, size_t count)
+{
+  for (size_t begin = 0; begin < count; begin += SnapshotWriter::RICE_BLOCK)
+  {
+    size_t end = std::min<size_t>(begin + SnapshotWriter::RICE_BLOCK, count);
+
+    /* the parameter close to log2 of the mean is nearly optimal for geometrically distributed values */
+    double sum = 0.0;
+    for (size_t i = begin; i < end; ++i)
+    {
+      sum += (double) values[i];
+    }
+
+    unsigned int k = 0;
+    while ((k < 63) && (std::ldexp((double) (end - begin), k + 1) <= sum)) ++k;
+
+    out.put(k, 6);
+
+    for (size_t i = begin; i < end; ++i)
+    {
+      cl_ulong v = values[i];
+      cl_ulong q = v >> k;
+
+      if (q < SnapshotWriter::RICE_ESCAPE)
+      {
+        out.put(((1u << q) - 1) << 1, (unsigned int) q + 1);
+        out.put64(v, k);
+      }
+      else
+      {
+        unsigned int len = bitLength(v);
+        out.put((1u << SnapshotWriter::RICE_ESCAPE) - 1, SnapshotWriter::RICE_ESCAPE);
+        out.put(len, 7);
+        out.put64(v, len);
+      }
+    }
+  }
+}
+
+/**
+ * Converts the Morton codes of keyframe particles to the values that are entropy coded:
+ * the differences of the codes sorted along the Morton curve, followed by the zigzag
+ * encoded differences of the indices of the sorted particles minus one
+ */
+void sortKeyframe(const cl_ulong *codes, size_t n,
+                  std::vector<std::pair<cl_ulong, cl_uint>> & sorted,
+                  std::vector<cl_ulong> & values)
+{
+  sorted.resize(n);
+  for (size_t i = 0; i < n; ++i)
+  {
+    sorted[i] = std::make_pair(codes[i], (cl_uint) i);
+  }
+
+  // the pairs are unique, so particles in the same cell keep their relative order
+  std::sort(sorted.begin(), sorted.end());
+
+  values.resize(2 * n);
+
+  cl_ulong prev_code = 0;
+  cl_long prev_index = -1;
+
+  for (size_t i = 0; i < n; ++i)
+  {
+    cl_long d = (cl_long) sorted[i].second - prev_index - 1;
+    values[i] = sorted[i].first - prev_code;
+    values[n + i] = ((cl_ulong) d << 1) ^ (cl_ulong) (d >> 63);
+    prev_code = sorted[i].first;
+    prev_index = sorted[i].second;
+  }
+}
+
+/** converts a vector of each particle in the given layout to tightly packed xyz */
+void unpackVectors(const float *src, size_t n, ParticleSystem::ParticleLayout layout, float *dst)
+{
+  for (size_t i = 0; i < n; ++i)
+  {
+    switch (layout)
+    {
+      case ParticleSystem::LAYOUT_AOS:
+        dst[3 * i + 0] = src[4 * i + 0];
+        dst[3 * i + 1] = src[4 * i + 1];
+        dst[3 * i + 2] = src[4 * i + 2];
+        break;
+
+      case ParticleSystem::LAYOUT_PACKED:
+        dst[3 * i + 0] = src[3 * i + 0];
+        dst[3 * i + 1] = src[3 * i + 1];
+        dst[3 * i + 2] = src[3 * i + 2];
+        break;
+
+      case ParticleSystem::LAYOUT_SOA:
+        dst[3 * i + 0] = src[i];
+        dst[3 * i + 1] = src[n + i];
+        dst[3 * i + 2] = src[2 * n + i];
+        break;
+    }
+  }
+}
+
+}
+
+
+
+const char *SnapshotWriter::m_quantize_files[] = {
+  "/src/OpenCL/sph_layout.cl",
+  "/src/OpenCL/snapshot_quantize.cl"
+};
+
+const unsigned int SnapshotWriter::m_quantize_files_size = sizeof(m_quantize_files) /
+                                                           sizeof(*m_quantize_files);
+
+
+bool SnapshotWriter::open(const std::string & file_name)
+{
+  close();
+
+  m_file = fopen(file_name.c_str(), "wb");
+  if (m_file == nullptr)
+  {
+    ERROR("SnapshotWriter: Failed to create file " << file_name);
+    return false;
+  }
+
+  unsigned char header[FILE_HEADER_SIZE];
+  memcpy(header, "FSNP", 4);
+  putUInt(header + 4, FORMAT_VERSION);
+  putUInt(header + 8, FRAME_HEADER_SIZE);
+  putUInt(header + 12, (m_bits > 0) ? ENCODING_QUANTIZED : ENCODING_RAW);
+
+  if (fwrite(header, sizeof(header), 1, m_file) != 1)
+  {
+    ERROR("SnapshotWriter: Failed to write file header to " << file_name);
+    fclose(m_file);
+    m_file = nullptr;
+    return false;
+  }
+
+  /* the staging buffers are allocated on the first capture, when the context and frame size are known */
+  m_slots.clear();
+  m_free.clear();
+  m_pending.clear();
+
+  for (unsigned int i = 0; i < m_num_slots; ++i)
+  {
+    m_slots.push_back(std::unique_ptr<Slot>(new Slot));
+    m_free.push_back(m_slots.back().get());
+  }
+
+  /* the first compressed frame of every file is a keyframe */
+  m_file_bits = m_bits;
+  m_key_valid = false;
+  m_verify_key.clear();
+
+  m_file_name = file_name;
+  m_closing = false;
+  m_stats = Stats();
+  m_thread = std::thread(&SnapshotWriter::run, this);
+
+  return true;
+}
+
+
+void SnapshotWriter::close(void)
+{
+  if (m_file == nullptr) return;
+
+  /* the writer thread quits after all the pending frames have been written */
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_closing = true;
+  }
+
+  m_cond.notify_all();
+  m_thread.join();
+
+  for (size_t i = 0; i < m_slots.size(); ++i)
+  {
+    release(*m_slots[i]);
+  }
+
+  m_slots.clear();
+  m_free.clear();
+
+  releaseQuantization();
+
+  if (fclose(m_file) != 0)
+  {
+    ERROR("SnapshotWriter: Failed to close file " << m_file_name);
+  }
+
+  m_file = nullptr;
+}
+
+
+bool SnapshotWriter::reserve(Slot & slot, cl_command_queue queue, size_t size)
+{
+  if ((slot.capacity >= size) && (slot.queue == queue)) return true;
+
+  release(slot);
+
+  cl_context ctx = nullptr;
+  cl_int err = clGetCommandQueueInfo(queue, CL_QUEUE_CONTEXT, sizeof(ctx), &ctx, nullptr);
+  if (err != CL_SUCCESS)
+  {
+    ERROR("SnapshotWriter: Failed to query the context of command queue: " << ocl::errorToStr(err));
+    return false;
+  }
+
+  slot.buf = clCreateBuffer(ctx, CL_MEM_READ_WRITE | CL_MEM_ALLOC_HOST_PTR, size, nullptr, &err);
+  if (err != CL_SUCCESS)
+  {
+    ERROR("SnapshotWriter: Failed to allocate staging buffer: " << ocl::errorToStr(err));
+    return false;
+  }
+
+  // the mapping is kept for the whole life of the buffer
+  slot.ptr = (unsigned char *) clEnqueueMapBuffer(queue, slot.buf, CL_TRUE, CL_MAP_READ | CL_MAP_WRITE,
+                                                  0, size, 0, nullptr, nullptr, &err);
+  if (err != CL_SUCCESS)
+  {
+    ERROR("SnapshotWriter: Failed to map staging buffer: " << ocl::errorToStr(err));
+    clReleaseMemObject(slot.buf);
+    slot.buf = nullptr;
+    return false;
+  }
+
+  clRetainCommandQueue(queue);
+  slot.queue = queue;
+  slot.capacity = size;
+
+  return true;
+}
+
+
+void SnapshotWriter::release(Slot & slot)
+{
+  if (slot.buf == nullptr) return;
+
+  clEnqueueUnmapMemObject(slot.queue, slot.buf, slot.ptr, 0, nullptr, nullptr);
+  clFinish(slot.queue);
+  clReleaseMemObject(slot.buf);
+  clReleaseCommandQueue(slot.queue);
+
+  slot.buf = nullptr;
+  slot.queue = nullptr;
+  slot.ptr = nullptr;
+  slot.capacity = 0;
+}
+
+
+bool SnapshotWriter::reserveQuantization(cl_command_queue queue,
+                                         size_t num_particles,
+                                         ParticleSystem::ParticleLayout layout)
+{
+  if ((m_quantize_queue == queue) && (m_quantize_particles == num_particles) &&
+      (m_quantize_layout == layout))
+  {
+    return true;
+  }
+
+  releaseQuantization();
+
+  cl_context ctx = nullptr;
+  cl_int err = clGetCommandQueueInfo(queue, CL_QUEUE_CONTEXT, sizeof(ctx), &ctx, nullptr);
+  if (err != CL_SUCCESS)
+  {
+    ERROR("SnapshotWriter: Failed to query the context of command queue: " << ocl::errorToStr(err));
+    return false;
+  }
+
+  /* the kernel reads the positions in the layout of the simulation (see sph_layout.cl) */
+  ocl::ProgramDefines defines;
+  switch (layout)
+  {
+    case ParticleSystem::LAYOUT_AOS:    defines.define("SPH_LAYOUT_AOS"); break;
+    case ParticleSystem::LAYOUT_PACKED: defines.define("SPH_LAYOUT_PACKED"); break;
+    case ParticleSystem::LAYOUT_SOA:
+      defines.define("SPH_LAYOUT_SOA").define("SPH_SOA_STRIDE", (unsigned int) num_particles);
+      break;
+  }
+
+  m_quantize_prog = m_quantize_programs.get(ctx, defines);
+  if (m_quantize_prog() == nullptr)
+  {
+    ERROR("SnapshotWriter: Failed to create quantization program");
+    return false;
+  }
+
+  m_quantize_kernel = cl::Kernel(m_quantize_prog, "snapshot_quantize", &err);
+  if (err != CL_SUCCESS)
+  {
+    ERROR("SnapshotWriter: Failed to create quantization kernel: " << ocl::errorToStr(err));
+    return false;
+  }
+
+  size_t size = 3 * num_particles * sizeof(cl_uint);
+
+  m_key_buf = clCreateBuffer(ctx, CL_MEM_READ_WRITE, size, nullptr, &err);
+  if (err == CL_SUCCESS)
+  {
+    m_code_buf = clCreateBuffer(ctx, CL_MEM_READ_WRITE, size, nullptr, &err);
+  }
+
+  if (err != CL_SUCCESS)
+  {
+    ERROR("SnapshotWriter: Failed to allocate quantization buffers: " << ocl::errorToStr(err));
+    releaseQuantization();
+    return false;
+  }
+
+  clRetainCommandQueue(queue);
+  m_quantize_queue = queue;
+  m_quantize_particles = num_particles;
+  m_quantize_layout = layout;
+
+  return true;
+}
+
+
+void SnapshotWriter::releaseQuantization(void)
+{
+  if (m_key_buf != nullptr) clReleaseMemObject(m_key_buf);
+  if (m_code_buf != nullptr) clReleaseMemObject(m_code_buf);
+  if (m_quantize_queue != nullptr) clReleaseCommandQueue(m_quantize_queue);
+
+  m_key_buf = nullptr;
+  m_code_buf = nullptr;
+  m_quantize_queue = nullptr;
+  m_quantize_kernel = cl::Kernel();
+  m_quantize_prog = cl::Program();
+  m_quantize_particles = 0;
+
+  // the next frame cannot refer to the lost keyframe
+  m_key_valid = false;
+}
+
+
+bool SnapshotWriter::quantize(cl_command_queue queue, cl_mem pos, Slot & slot, unsigned int order, ocl::PerfStats *stats)
+{
+  size_t n = slot.num_particles;
+  if ((n == 0) || (!reserveQuantization(queue, n, slot.layout)))
+  {
+    return false;
+  }
+
+  /* a new keyframe is needed when the deltas would be large or could not be decoded */
+  bool same_volume = (memcmp(&slot.volume_min, &m_key_volume_min, sizeof(cl_float4)) == 0) &&
+                     (memcmp(&slot.volume_max, &m_key_volume_max, sizeof(cl_float4)) == 0);
+
+  ++m_frames_since_key;
+
+  slot.keyframe = (!m_key_valid) || (!same_volume) || (order != m_key_order) ||
+                  (m_frames_since_key >= m_keyframe_interval);
+
+  cl_uint max_coord = (1u << m_file_bits) - 1;
+  cl_float4 scale;
+  for (int i = 0; i < 3; ++i)
+  {
+    scale.s[i] = max_coord / std::max(slot.volume_max.s[i] - slot.volume_min.s[i], 1e-6f);
+  }
+  scale.s[3] = 0.0f;
+
+  bool ok = ocl::KernelArgs(m_quantize_kernel, "snapshot_quantize")
+                .arg(pos)
+                .arg(m_key_buf)
+                .arg(m_code_buf)
+                .arg(slot.volume_min)
+                .arg(scale)
+                .arg(max_coord)
+                .arg((cl_uint) n)
+                .arg((cl_int) slot.keyframe);
+
+  if (ok)
+  {
+    size_t global = n;
+    cl_int err = clEnqueueNDRangeKernel(queue, m_quantize_kernel(), 1, nullptr, &global, nullptr, 0, nullptr,
+                                        (stats != nullptr) ? (cl_event *) stats->event("snapshot_quantize") : nullptr);
+    if (err != CL_SUCCESS)
+    {
+      ERROR("SnapshotWriter: Failed to enqueue quantization kernel: " << ocl::errorToStr(err));
+      ok = false;
+    }
+  }
+
+  if (!ok)
+  {
+    // a failed keyframe may have left the keyframe buffer half written
+    if (slot.keyframe) m_key_valid = false;
+    return false;
+  }
+
+  if (slot.keyframe)
+  {
+    m_key_valid = true;
+    m_key_order = order;
+    m_frames_since_key = 0;
+    m_key_volume_min = slot.volume_min;
+    m_key_volume_max = slot.volume_max;
+  }
+
+  return true;
+}
+
+
+bool SnapshotWriter::capture(cl_command_queue queue,
+                             cl_mem pos,
+                             cl_mem vel,
+                             cl_mem density_pressure,
+                             size_t num_particles,
+                             ParticleSystem::ParticleLayout layout,
+                             unsigned int step,
+                             float time,
+                             const cl_float4 & volume_min,
+                             const cl_float4 & volume_max,
+                             unsigned int order,
+                             ocl::PerfStats *stats)
+{
+  if (m_file == nullptr) return false;
+
+  Clock::time_point start = Clock::now();
+
+  Slot *slot = nullptr;
+
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (m_free.empty())
+    {
+      m_stats.frames_dropped++;
+      return false;
+    }
+
+    slot = m_free.back();
+    m_free.pop_back();
+  }
+
+  size_t vec_size = num_particles * ParticleSystem::particleVectorSize(layout);
+  size_t dp_size = num_particles * sizeof(cl_float2);
+
+  slot->num_particles = num_particles;
+  slot->layout = layout;
+  slot->step = step;
+  slot->time = time;
+  slot->volume_min = volume_min;
+  slot->volume_max = volume_max;
+
+  bool ok = false;
+
+  if (m_file_bits > 0)
+  {
+    /* compressed frames: only the quantized positions are copied */
+    size_t code_size = 3 * num_particles * sizeof(cl_uint);
+
+    ok = reserve(*slot, queue, code_size) && quantize(queue, pos, *slot, order, stats);
+    if (ok)
+    {
+      // keyframes have a single 64-bit code per particle
+      if (slot->keyframe) code_size = num_particles * sizeof(cl_ulong);
+
+      slot->event = ocl::Event();
+
+      cl_int err = clEnqueueReadBuffer(queue, m_code_buf, CL_FALSE, 0, code_size, slot->ptr, 0, nullptr,
+                                       (stats != nullptr) ? (cl_event *) stats->event(slot->event, "snapshot_read_codes")
+                                                          : (cl_event *) slot->event);
+      if (err != CL_SUCCESS)
+      {
+        ERROR("SnapshotWriter: Failed to enqueue copy of quantized positions: " << ocl::errorToStr(err));
+        if (slot->keyframe) m_key_valid = false;
+        ok = false;
+      }
+
+      clFlush(queue);
+    }
+  }
+  else if (reserve(*slot, queue, stagingSize(num_particles, layout)))
+  {
+    ok = true;
+
+    /* the copies are ordered in the queue, so the last one signals the whole frame */
+    slot->event = ocl::Event();
+
+    cl_int err = clEnqueueReadBuffer(queue, pos, CL_FALSE, 0, vec_size, slot->ptr, 0, nullptr,
+                                     (stats != nullptr) ? (cl_event *) stats->event("snapshot_read_pos") : nullptr);
+    if (err == CL_SUCCESS)
+    {
+      err = clEnqueueReadBuffer(queue, vel, CL_FALSE, 0, vec_size, slot->ptr + vec_size, 0, nullptr,
+                                (stats != nullptr) ? (cl_event *) stats->event("snapshot_read_vel") : nullptr);
+    }
+
+    if (err == CL_SUCCESS)
+    {
+      err = clEnqueueReadBuffer(queue, density_pressure, CL_FALSE, 0, dp_size, slot->ptr + 2 * vec_size, 0, nullptr,
+                                (stats != nullptr) ? (cl_event *) stats->event(slot->event, "snapshot_read_density")
+                                                   : (cl_event *) slot->event);
+    }
+
+    if (err != CL_SUCCESS)
+    {
+      ERROR("SnapshotWriter: Failed to enqueue copy of particle data: " << ocl::errorToStr(err));
+      ok = false;
+    }
+
+    clFlush(queue);
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    if (ok) m_pending.push_back(slot);
+    else m_free.push_back(slot);
+
+    m_stats.capture_seconds += std::chrono::duration<double>(Clock::now() - start).count();
+  }
+
+  if (ok) m_cond.notify_all();
+
+  return ok;
+}
+
+
+SnapshotWriter::Stats SnapshotWriter::stats(void) const
+{
+  std::lock_guard<std::mutex> lock(m_mutex);
+  return m_stats;
+}
+
+
+void SnapshotWriter::run(void)
+{
+  std::unique_lock<std::mutex> lock(m_mutex);
+
+  while (true)
+  {
+    m_cond.wait(lock, [this] { return m_closing || !m_pending.empty(); });
+
+    if (m_pending.empty()) break;   // closing and nothing left to write
+
+    Slot *slot = m_pending.front();
+    m_pending.pop_front();
+    lock.unlock();
+
+    Clock::time_point start = Clock::now();
+
+    size_t size = 0;
+    double encode_seconds = 0.0;
+
+    cl_event event = slot->event;
+    cl_int err = clWaitForEvents(1, &event);
+    bool ok = (err == CL_SUCCESS) &&
+              ((m_file_bits > 0) ? writeCompressedFrame(*slot, &size, &encode_seconds) : writeFrame(*slot, &size));
+    if (!ok)
+    {
+      ERROR("SnapshotWriter: Failed to write frame of step " << slot->step << " to " << m_file_name);
+    }
+
+    bool verified = (ok) && (m_file_bits > 0) && (m_verify);
+    bool matches = (!verified) || (verifyCompressedFrame(*slot));
+
+    double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+
+    lock.lock();
+
+    if (ok)
+    {
+      m_stats.frames_written++;
+      if ((m_file_bits > 0) && (slot->keyframe)) m_stats.keyframes_written++;
+      m_stats.bytes_written += size;
+      if ((m_file_bits > 0) && (slot->keyframe)) m_stats.keyframe_bytes += size;
+      m_stats.raw_bytes += rawPositionsSize(slot->num_particles);
+    }
+
+    if (verified)
+    {
+      m_stats.frames_verified++;
+      if (!matches) m_stats.frames_mismatched++;
+    }
+
+    m_stats.write_seconds += seconds;
+    m_stats.encode_seconds += encode_seconds;
+    m_free.push_back(slot);
+  }
+}
+
+
+bool SnapshotWriter::writeFrame(const Slot & slot, size_t *size)
+{
+  size_t n = slot.num_particles;
+  size_t vec_size = n * ParticleSystem::particleVectorSize(slot.layout);
+
+  unsigned char header[FRAME_HEADER_SIZE];
+  memcpy(header, "FRME", 4);
+  putUInt(header + 4, slot.step);
+  putFloat(header + 8, slot.time);
+  putUInt(header + 12, (cl_uint) n);
+
+  /* positions and velocities as xyz triples, the densities are stored inverted on device */
+  m_frame_data.resize(7 * n);
+
+  unpackVectors((const float *) slot.ptr, n, slot.layout, &m_frame_data[0]);
+  unpackVectors((const float *) (slot.ptr + vec_size), n, slot.layout, &m_frame_data[3 * n]);
+
+  const cl_float2 *dp = (const cl_float2 *) (slot.ptr + 2 * vec_size);
+  for (size_t i = 0; i < n; ++i)
+  {
+    m_frame_data[6 * n + i] = 1.0f / dp[i].s[0];
+  }
+
+  *size = sizeof(header) + 7 * n * sizeof(float);
+
+  return (fwrite(header, sizeof(header), 1, m_file) == 1) &&
+         ((n == 0) || (fwrite(&m_frame_data[0], sizeof(float), 7 * n, m_file) == 7 * n));
+}
+
+
+bool SnapshotWriter::writeCompressedFrame(const Slot & slot, size_t *size, double *encode_seconds)
+{
+  size_t n = slot.num_particles;
+
+  /* entropy code the output of quantization kernel */
+  Clock::time_point start = Clock::now();
+
+  m_encode_buf.clear();
+  BitWriter bits(m_encode_buf);
+
+  if (slot.keyframe)
+  {
+    // the codes and the indices are coded separately, so that no block mixes them
+    sortKeyframe((const cl_ulong *) slot.ptr, n, m_key_sort, m_key_values);
+    riceEncode(bits, m_key_values.data(), n);
+    riceEncode(bits, m_key_values.data() + n, n);
+  }
+  else
+  {
+    riceEncode(bits, (const cl_uint *) slot.ptr, 3 * n);
+  }
+
+  bits.flush();
+
+  *encode_seconds = std::chrono::duration<double>(Clock::now() - start).count();
+
+  unsigned char header[FRAME_HEADER_SIZE + ENCODING_HEADER_SIZE];
+  memcpy(header, slot.keyframe ? "QKEY" : "QDLT", 4);
+  putUInt(header + 4, slot.step);
+  putFloat(header + 8, slot.time);
+  putUInt(header + 12, (cl_uint) n);
+
+  unsigned char *enc = header + FRAME_HEADER_SIZE;
+  putUInt(enc, m_file_bits);
+  for (int i = 0; i < 3; ++i)
+  {
+    putFloat(enc + 4 + 4 * i, slot.volume_min.s[i]);
+    putFloat(enc + 16 + 4 * i, slot.volume_max.s[i]);
+  }
+  putUInt(enc + 28, (cl_uint) m_encode_buf.size());
+
+  *size = sizeof(header) + m_encode_buf.size();
+
+  return (fwrite(header, sizeof(header), 1, m_file) == 1) &&
+         ((m_encode_buf.empty()) || (fwrite(&m_encode_buf[0], 1, m_encode_buf.size(), m_file) == m_encode_buf.size()));
+}
+
+
+bool SnapshotWriter::verifyCompressedFrame(const Slot & slot)
+{
+  size_t n = slot.num_particles;
+
+  SnapshotReader::Frame & frame = m_verify_frame;
+  frame.step = slot.step;
+  frame.time = slot.time;
+  frame.num_particles = n;
+  frame.compressed = true;
+  frame.keyframe = slot.keyframe;
+  frame.bits = m_file_bits;
+  frame.volume_min = slot.volume_min;
+  frame.volume_max = slot.volume_max;
+
+  if (!m_verifier.decode(frame, m_encode_buf.empty() ? nullptr : &m_encode_buf[0], m_encode_buf.size()))
+  {
+    ERROR("SnapshotWriter: Failed to decode frame of step " << slot.step);
+    return false;
+  }
+
+  /* the entropy coding round trip */
+  size_t count = slot.keyframe ? 2 * n : 3 * n;
+  for (size_t i = 0; i < count; ++i)
+  {
+    cl_ulong value = slot.keyframe ? m_key_values[i] : ((const cl_uint *) slot.ptr)[i];
+    if (frame.codes[i] != value)
+    {
+      ERROR("SnapshotWriter: Value " << i << " of frame of step " << slot.step << " decoded as "
+            << frame.codes[i] << " instead of " << value);
+      return false;
+    }
+  }
+
+  /* the decoded positions quantized again have to give the output of the kernel
+     (this checks the prefix sums, the order of particles and the de-interleaving
+     of Morton codes of keyframes) */
+  for (size_t i = 0; i < n; ++i)
+  {
+    const cl_uint *q = &frame.coords[3 * i];
+    bool same = true;
+
+    if (slot.keyframe)
+    {
+      cl_ulong code = (mortonExpandBits(q[2]) << 2) | (mortonExpandBits(q[1]) << 1) | mortonExpandBits(q[0]);
+      same = (code == ((const cl_ulong *) slot.ptr)[i]);
+    }
+    else
+    {
+      for (size_t a = 0; (a < 3) && (same); ++a)
+      {
+        cl_uint d = q[a] - m_verify_key[3 * i + a];
+        same = (((d << 1) ^ (0 - (d >> 31))) == ((const cl_uint *) slot.ptr)[a * n + i]);
+      }
+    }
+
+    if (!same)
+    {
+      ERROR("SnapshotWriter: Particle " << i << " of frame of step " << slot.step
+            << " does not decode to its quantized position");
+      return false;
+    }
+  }
+
+  if (slot.keyframe) m_verify_key = frame.coords;
+
+  return true;
+}
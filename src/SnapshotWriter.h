@@ -0,0 +1,323 @@
+/*
+ * Copyright (C) 2014 Matus Fedorko <xfedor01@stud.fit.vutbr.cz>
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty.  In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+
+ * 1. The origin of this software must not be misrepresented; you must not
+ *    claim that you wrote the original software. If you use this software
+ *    in a product, an acknowledgment in the product documentation would be
+ *    appreciated but is not required.
+ * 2. Altered source versions must be plainly marked as such, and must not be
+ *    misrepresented as being the original software.
+ * 3. This notice may not be removed or altered from any source distribution.
+ */
+
+
+/**
+ * Streams the particle state from an OpenCL device to a file.
+ *
+ * The particle buffers are copied with non-blocking reads to a ring
+ * of pinned (CL_MEM_ALLOC_HOST_PTR) staging buffers and a background thread
+ * converts and writes the frames, so neither the copies nor the disk
+ * stall the simulation. When all the staging buffers are waiting
+ * for the disk the frame is dropped instead.
+ *
+ * The file format (the values are stored in the byte order of the host,
+ * which is little endian on all the supported platforms):
+ *
+ *   file header
+ *     char[4]   magic "FSNP"
+ *     uint32    format version (2)
+ *     uint32    the size of frame header in bytes (16)
+ *     uint32    encoding of frames (0 - raw, 1 - compressed positions)
+ *
+ *   frames, each of them starts with a frame header
+ *     char[4]   magic "FRME" (raw), "QKEY" (compressed keyframe) or "QDLT" (compressed delta frame)
+ *     uint32    the number of the simulation step
+ *     float32   simulation time
+ *     uint32    the number of particles n
+ *
+ *   raw frames are followed by the particle data
+ *     float32   positions[n][3]
+ *     float32   velocities[n][3]
+ *     float32   densities[n]
+ *
+ *   compressed frames contain only positions, which are quantized on the device
+ *   (see snapshot_quantize.cl) to a grid of 2^bits points along each axis of the volume
+ *     uint32    bits per axis
+ *     float32   volume_min[3]
+ *     float32   volume_max[3]
+ *     uint32    the size of the payload in bytes
+ *     uint8     payload[]
+ *   the payload is a bit stream (most significant bit first) of Rice coded unsigned values,
+ *   split to blocks of 64 values (the last one may be shorter), each block starts with
+ *   a 6-bit parameter k and each value v is either
+ *     q = v >> k ones (q < 24), a zero and the lowest k bits of v
+ *     or 24 ones, the 7-bit length l of v and the lowest l bits of v
+ *   a keyframe holds n differences of the Morton codes of the particles sorted along
+ *   the Morton curve (the first one is relative to 0) followed by n zigzag encoded
+ *   differences of the indices of these particles minus one (the first one is relative to -1,
+ *   the indices start with a new block),
+ *   particles that are already in Morton order (the grid mode of the simulation sorts them)
+ *   cost a single bit of the index stream, a delta frame holds 3n zigzag encoded differences
+ *   of the quantized coordinates from the last keyframe (all x, then all y, then all z),
+ *   zigzag encoding maps 0, -1, 1, -2, ... to 0, 1, 2, 3, ...
+ *   A quantized coordinate q maps back to volume_min + q * (volume_max - volume_min) / (2^bits - 1).
+ */
+
+#ifndef SNAPSHOTWRITER_H
+#define SNAPSHOTWRITER_H
+
+#include "ParticleSystem.h"
+#include "SnapshotReader.h"
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstdio>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+
+class SnapshotWriter
+{
+  public:
+    static const unsigned int DEFAULT_SLOTS = 3;   // the number of staging buffers
+    static const unsigned int FORMAT_VERSION = 2;
+    static const unsigned int DEFAULT_KEYFRAME_INTERVAL = 16;
+    static const unsigned int MAX_QUANTIZATION_BITS = 21;
+    static const unsigned int RICE_BLOCK = 64;      // the number of values sharing a Rice parameter
+    static const unsigned int RICE_ESCAPE = 24;     // quotients from this value on are stored verbatim
+
+    struct Stats
+    {
+      unsigned int frames_written;
+      unsigned int frames_dropped;     // frames skipped, because no staging buffer was free
+      unsigned int keyframes_written;  // compressed frames that do not depend on previous frames
+      unsigned long long bytes_written;
+      unsigned long long keyframe_bytes;   // the part of bytes_written taken by keyframes
+      unsigned long long raw_bytes;    // the size of the written frames as raw float32 positions
+      double capture_seconds;          // the time spent in capture by the simulation thread
+      double write_seconds;            // the time the writer thread was busy
+      double encode_seconds;           // the part of write_seconds spent by entropy coding
+      unsigned int frames_verified;    // compressed frames decoded again (see setVerification)
+      unsigned int frames_mismatched;  // verified frames that did not decode to the quantized positions
+
+      Stats(void)
+        : frames_written(0)
+        , frames_dropped(0)
+        , keyframes_written(0)
+        , bytes_written(0)
+        , keyframe_bytes(0)
+        , raw_bytes(0)
+        , capture_seconds(0.0)
+        , write_seconds(0.0)
+        , encode_seconds(0.0)
+        , frames_verified(0)
+        , frames_mismatched(0)
+      {
+      }
+    };
+
+  public:
+    // the sources of the quantization program (relative to the assets directory)
+    static const char *m_quantize_files[];
+    static const unsigned int m_quantize_files_size;
+
+  public:
+    explicit SnapshotWriter(unsigned int num_slots = DEFAULT_SLOTS)
+      : m_num_slots(std::max(num_slots, 1u))
+      , m_slots()
+      , m_free()
+      , m_pending()
+      , m_file(nullptr)
+      , m_file_name()
+      , m_thread()
+      , m_mutex()
+      , m_cond()
+      , m_closing(false)
+      , m_stats()
+      , m_frame_data()
+      , m_bits(0)
+      , m_keyframe_interval(DEFAULT_KEYFRAME_INTERVAL)
+      , m_file_bits(0)
+      , m_quantize_programs(m_quantize_files, m_quantize_files_size)
+      , m_quantize_prog()
+      , m_quantize_kernel()
+      , m_quantize_queue(nullptr)
+      , m_key_buf(nullptr)
+      , m_code_buf(nullptr)
+      , m_quantize_particles(0)
+      , m_quantize_layout(ParticleSystem::LAYOUT_AOS)
+      , m_key_valid(false)
+      , m_key_order(0)
+      , m_frames_since_key(0)
+      , m_key_volume_min()
+      , m_key_volume_max()
+      , m_encode_buf()
+      , m_key_sort()
+      , m_key_values()
+      , m_verify(false)
+      , m_verifier()
+      , m_verify_frame()
+      , m_verify_key()
+    {
+    }
+
+    ~SnapshotWriter(void) { close(); }
+
+    // creates the file and starts the writer thread
+    bool open(const std::string & file_name);
+
+    // writes all the frames that have been captured and closes the file
+    void close(void);
+
+    bool isOpen(void) const { return m_file != nullptr; }
+    const std::string & fileName(void) const { return m_file_name; }
+
+    // selects compressed frames with positions quantized to the given number of bits
+    // per axis (0 selects raw frames), a keyframe is written at least every keyframe_interval
+    // frames, this takes effect when the next file is opened
+    void setCompression(unsigned int bits, unsigned int keyframe_interval = DEFAULT_KEYFRAME_INTERVAL)
+    {
+      m_bits = std::min(bits, MAX_QUANTIZATION_BITS);
+      m_keyframe_interval = std::max(keyframe_interval, 1u);
+    }
+    unsigned int compressionBits(void) const { return m_bits; }
+
+    // decodes every compressed frame again after it is written and compares it with
+    // the output of the quantization kernel (slow, for testing), it has to be set
+    // before the file is opened
+    void setVerification(bool verify) { m_verify = verify; }
+    bool verification(void) const { return m_verify; }
+
+    /**
+     * Enqueues non-blocking copies of the particle buffers to a free staging buffer.
+     * The buffers have to be acquired from OpenGL (if shared) until the copies are enqueued.
+     *
+     * @param pos the positions in the given layout
+     * @param vel the velocities in the given layout
+     * @param density_pressure the interleaved inverse densities and pressures
+     * @param volume_min, volume_max the bounds of quantized positions (compressed frames only)
+     * @param order changes whenever the particles are reordered, compressed frames
+     *        always start a new keyframe then, because the deltas would be large
+     * @param stats the execution times of the copies are recorded here, if given
+     *
+     * @return false if the frame was dropped or the copies failed
+     */
+    bool capture(cl_command_queue queue,
+                 cl_mem pos,
+                 cl_mem vel,
+                 cl_mem density_pressure,
+                 size_t num_particles,
+                 ParticleSystem::ParticleLayout layout,
+                 unsigned int step,
+                 float time,
+                 const cl_float4 & volume_min,
+                 const cl_float4 & volume_max,
+                 unsigned int order,
+                 ocl::PerfStats *stats = nullptr);
+
+    Stats stats(void) const;
+
+  private:
+    // a pinned staging buffer with a single frame
+    struct Slot
+    {
+      cl_mem buf;                 // allocated with CL_MEM_ALLOC_HOST_PTR and mapped while it exists
+      cl_command_queue queue;     // the queue the buffer is mapped with
+      unsigned char *ptr;
+      size_t capacity;
+      ocl::Event event;           // the completion of the last copy
+      size_t num_particles;
+      ParticleSystem::ParticleLayout layout;
+      unsigned int step;
+      float time;
+      bool keyframe;              // the encoding of compressed frames
+      cl_float4 volume_min;
+      cl_float4 volume_max;
+
+      Slot(void)
+        : buf(nullptr), queue(nullptr), ptr(nullptr), capacity(0), event()
+        , num_particles(0), layout(ParticleSystem::LAYOUT_AOS), step(0), time(0.0f)
+        , keyframe(false), volume_min(), volume_max()
+      {
+      }
+    };
+
+  private:
+    // makes sure the slot can hold a frame of the given size
+    bool reserve(Slot & slot, cl_command_queue queue, size_t size);
+    void release(Slot & slot);
+    // the body of the writer thread
+    void run(void);
+    // converts a frame to the file format and writes it
+    bool writeFrame(const Slot & slot, size_t *size);
+    // entropy codes the quantized positions and writes them
+    bool writeCompressedFrame(const Slot & slot, size_t *size, double *encode_seconds);
+    // decodes the last written compressed frame and checks it against the staging buffer
+    bool verifyCompressedFrame(const Slot & slot);
+
+    // makes sure the quantization kernel and buffers are set up for the given particles
+    bool reserveQuantization(cl_command_queue queue, size_t num_particles, ParticleSystem::ParticleLayout layout);
+    void releaseQuantization(void);
+    // enqueues the quantization of positions to m_code_buf and decides whether it is a keyframe
+    bool quantize(cl_command_queue queue, cl_mem pos, Slot & slot, unsigned int order, ocl::PerfStats *stats);
+
+  private:
+    SnapshotWriter(const SnapshotWriter & );
+    SnapshotWriter & operator=(const SnapshotWriter & );
+
+  private:
+    unsigned int m_num_slots;
+    std::vector<std::unique_ptr<Slot>> m_slots;
+    std::vector<Slot *> m_free;         // staging buffers available for capture
+    std::deque<Slot *> m_pending;       // captured frames in the order they are written
+    FILE *m_file;
+    std::string m_file_name;
+    std::thread m_thread;
+    mutable std::mutex m_mutex;         // guards m_free, m_pending, m_closing and m_stats
+    std::condition_variable m_cond;
+    bool m_closing;
+    Stats m_stats;
+    std::vector<float> m_frame_data;    // conversion buffer of the writer thread
+
+    // compressed frames (the quantization state is used only by the capturing thread)
+    unsigned int m_bits;                       // bits per axis of quantized positions (0 - raw frames)
+    unsigned int m_keyframe_interval;
+    unsigned int m_file_bits;                  // the encoding of the open file
+    ocl::ProgramCache m_quantize_programs;     // the builds of quantization program for particle layouts
+    cl::Program m_quantize_prog;
+    cl::Kernel m_quantize_kernel;
+    cl_command_queue m_quantize_queue;         // the queue the buffers below are used with
+    cl_mem m_key_buf;                          // the quantized positions of the last keyframe
+    cl_mem m_code_buf;                         // the output of the quantization kernel
+    size_t m_quantize_particles;               // the particle count and layout the kernel is set up for
+    ParticleSystem::ParticleLayout m_quantize_layout;
+    bool m_key_valid;                          // whether m_key_buf holds a keyframe written to this file
+    unsigned int m_key_order;                  // the particle order of the keyframe
+    unsigned int m_frames_since_key;
+    cl_float4 m_key_volume_min;                // the bounds of the keyframe
+    cl_float4 m_key_volume_max;
+    std::vector<unsigned char> m_encode_buf;   // the payload of compressed frames (writer thread)
+    std::vector<std::pair<cl_ulong, cl_uint>> m_key_sort;  // keyframe Morton codes and particle indices
+    std::vector<cl_ulong> m_key_values;        // the values entropy coded in the last keyframe
+
+    // verification of compressed frames (writer thread)
+    bool m_verify;
+    SnapshotReader m_verifier;                 // decodes the payloads and keeps the last keyframe
+    SnapshotReader::Frame m_verify_frame;
+    std::vector<cl_uint> m_verify_key;         // the decoded quantized positions of the last keyframe
+};
+
+#endif
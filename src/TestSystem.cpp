@@ -92,8 +92,9 @@ bool TestSystem::reset(unsigned int part_num)
   /* initialize kernel arguments */
   if (!ocl::KernelArgs(m_test_kernel, "m_test_kernel")
             .arg(m_particle_pos_buf.getCLID())
-            .arg(m_particle_col_buf.getCLID()))
+            .arg(m_particle_col_buf.getCLID())
             //.arg((cl_ulong) (time(nullptr))))
+            .arg((cl_uint) (part_num), 3))
   {
     return false;
   }
@@ -102,7 +103,8 @@ bool TestSystem::reset(unsigned int part_num)
   if (!ocl::KernelArgs(m_polar_spiral_kernel, "m_polar_spiral_kernel")
             .arg(m_particle_pos_buf.getCLID())
             .arg(m_particle_col_buf.getCLID())
-            .arg(position))
+            .arg(position)
+            .arg((cl_uint) (part_num), 4))
   {
     return false;
   }
@@ -166,15 +168,11 @@ void TestSystem::update(float time_step)
 
   if (m_spiral)
   {
-    err = clEnqueueNDRangeKernel(queue, m_polar_spiral_kernel(), 1,
-                                 nullptr, &m_num_particles, nullptr,
-                                 0, nullptr, m_stats.event("polar_spiral"));
+    err = m_tuner.enqueue(queue, m_polar_spiral_kernel(), "polar_spiral", m_num_particles, m_stats);
   }
   else
   {
-    err = clEnqueueNDRangeKernel(queue, m_test_kernel(), 1,
-                                 nullptr, &m_num_particles, nullptr,
-                                 0, nullptr, m_stats.event("gen_part_positions"));
+    err = m_tuner.enqueue(queue, m_test_kernel(), "gen_part_positions", m_num_particles, m_stats);
   }
 
   if (err != CL_SUCCESS)
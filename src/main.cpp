@@ -20,12 +20,17 @@
 
 #include "Application.h"
 #include "MainWindow.h"
+#include "HeadlessSimulation.h"
+#include "BenchmarkSuite.h"
 #include "test_TextRendererWindow.h"
 #include "test_OGLWindow.h"
 #include "debug.h"
+#include "utils.h"
 
 #include <fstream>
 #include <iostream>
+#include <chrono>
+#include <cstring>
 
 
 
@@ -44,6 +49,37 @@ int main(int argc, char ** argv)
     }
     
     std::clog.rdbuf(ofs.rdbuf());
+
+    // batch simulation without any window (e.g. on compute nodes without a display)
+    if ((argc > 1) && (strcmp(argv[1], "--headless") == 0))
+    {
+      HeadlessSimulation::Options opts;
+      if (!HeadlessSimulation::parseArgs(argc - 2, argv + 2, &opts))
+      {
+        HeadlessSimulation::printUsage(argv[0], std::cerr);
+        return 1;
+      }
+
+      utils::cache::setDirectory("cache");
+
+      return HeadlessSimulation(opts).run(std::cout);
+    }
+
+    // a sweep of particle counts and neighbour searches (the JSON results go to standard output
+    // unless written to a file, so the progress is reported to the error stream)
+    if ((argc > 1) && (strcmp(argv[1], "--benchmark") == 0))
+    {
+      BenchmarkSuite::Options opts;
+      if (!BenchmarkSuite::parseArgs(argc - 2, argv + 2, &opts))
+      {
+        BenchmarkSuite::printUsage(argv[0], std::cerr);
+        return 1;
+      }
+
+      utils::cache::setDirectory("cache");
+
+      return BenchmarkSuite(opts).run(std::cerr);
+    }
     
     Application & app = Application::instance();
 
@@ -52,6 +88,10 @@ int main(int argc, char ** argv)
       app.setAssetsRootDir(argv[1]);
     }
 
+    // compiled OpenCL programs and shader programs are cached in the working directory
+    // (delete the directory to measure a cold start)
+    utils::cache::setDirectory("cache");
+
     if (!app.init())
     {
       return 1;
@@ -60,7 +100,18 @@ int main(int argc, char ** argv)
     //app.registerWindow(new Window("SDL Window manager", 800, 600));
     //app.registerWindow(new Window("Hello, World", 640, 480));
 
+    std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+
     app.registerWindow(new MainWindow("Fluid Simulator", 800, 600));
+
+    {
+      std::chrono::duration<double, std::milli> startup = std::chrono::high_resolution_clock::now() - start;
+      const utils::cache::Stats & cs = utils::cache::stats();
+      std::cerr << "Startup time: " << startup.count() << " ms ("
+                << (((cs.misses == 0) && (cs.hits > 0)) ? "warm" : "cold") << " start, "
+                << cs.hits << " programs loaded from cache, "
+                << cs.misses << " programs compiled)" << std::endl;
+    }
     //app.registerWindow(new TextRendererWindow("TextRendererWindow", 800, 600));
     //app.registerWindow(new OGLWindow("OGLWindow", 800, 600));
 
@@ -24,6 +24,11 @@
 #include "utils.h"
 
 #include <iomanip>
+#include <sstream>
+#include <fstream>
+#include <algorithm>
+#include <cmath>
+#include <limits>
 
 
 
@@ -222,9 +227,352 @@ bool selectPlatformAndDevice(cl_device_id *device, cl_platform_id *platform,
 }
 
 
+namespace {
+
+bool g_headless = false;
+double g_peak_gflops = 0.0;
+
+std::mutex g_peaks_mutex;                        // guards g_peaks
+std::map<cl_device_id, DevicePeaks> g_peaks;     // the peaks measured so far
+
+const size_t MIN_BANDWIDTH_PROBE = 64 << 20;     // the size of the copy that measures the bandwidth
+const size_t MAX_BANDWIDTH_PROBE = 128 << 20;
+
+/** the single precision lanes of a compute unit as reported by OpenCL */
+double lanesPerComputeUnit(cl_device_type type, cl_uint vendor_id, cl_uint vector_width)
+{
+  if (type & CL_DEVICE_TYPE_CPU) return 2.0 * std::max<cl_uint>(vector_width, 1);
+
+  switch (vendor_id)
+  {
+    case 0x10DE: return 128.0;   // NVIDIA, a streaming multiprocessor
+    case 0x1002: return 64.0;    // AMD, a compute unit
+    case 0x8086: return 8.0;     // Intel, an execution unit
+  }
+
+  return 64.0;
+}
+
+/** queries the limits of the device and measures its memory bandwidth */
+bool measurePeaks(cl_context ctx, cl_command_queue queue, cl_device_id device, DevicePeaks *peaks)
+{
+  cl_device_type type = 0;
+  cl_uint vendor_id = 0;
+  cl_uint vector_width = 0;
+  char name[256] = { 0 };
+
+  clGetDeviceInfo(device, CL_DEVICE_NAME, sizeof(name) - 1, name, nullptr);
+  peaks->name = name;
+  clGetDeviceInfo(device, CL_DEVICE_TYPE, sizeof(type), &type, nullptr);
+  clGetDeviceInfo(device, CL_DEVICE_VENDOR_ID, sizeof(vendor_id), &vendor_id, nullptr);
+  clGetDeviceInfo(device, CL_DEVICE_MAX_COMPUTE_UNITS, sizeof(peaks->compute_units), &peaks->compute_units, nullptr);
+  clGetDeviceInfo(device, CL_DEVICE_MAX_CLOCK_FREQUENCY, sizeof(peaks->clock_mhz), &peaks->clock_mhz, nullptr);
+  clGetDeviceInfo(device, CL_DEVICE_GLOBAL_MEM_SIZE, sizeof(peaks->global_mem_size), &peaks->global_mem_size, nullptr);
+  clGetDeviceInfo(device, CL_DEVICE_GLOBAL_MEM_CACHE_SIZE, sizeof(peaks->global_mem_cache_size), &peaks->global_mem_cache_size, nullptr);
+  clGetDeviceInfo(device, CL_DEVICE_GLOBAL_MEM_CACHELINE_SIZE, sizeof(peaks->global_mem_cacheline), &peaks->global_mem_cacheline, nullptr);
+  clGetDeviceInfo(device, CL_DEVICE_PREFERRED_VECTOR_WIDTH_FLOAT, sizeof(vector_width), &vector_width, nullptr);
+
+  peaks->gflops = 2.0 * lanesPerComputeUnit(type, vendor_id, vector_width) * peaks->compute_units * peaks->clock_mhz * 1.0e-3;
+  peaks->gflops_estimated = true;
+
+  /* the copy has to be larger than the caches to measure the memory itself,
+     but it should not take a noticeable part of the device memory */
+  size_t size = (size_t) std::min<cl_ulong>(peaks->global_mem_cache_size * 4, MAX_BANDWIDTH_PROBE);
+  size = std::max(size, MIN_BANDWIDTH_PROBE);
+  size = (size_t) std::min<cl_ulong>(size, peaks->global_mem_size / 8);
+  size &= ~(size_t) 0xFFF;
+
+  cl_int err = CL_SUCCESS;
+  cl_mem src = clCreateBuffer(ctx, CL_MEM_READ_WRITE, size, nullptr, &err);
+  cl_mem dst = (err == CL_SUCCESS) ? clCreateBuffer(ctx, CL_MEM_READ_WRITE, size, nullptr, &err) : nullptr;
+
+  double best_seconds = 0.0;
+
+  // the first copy also touches the memory, only the fastest copy counts
+  for (int i = 0; (err == CL_SUCCESS) && (i < 4); ++i)
+  {
+    Event ev;
+    cl_ulong start = 0;
+    cl_ulong end = 0;
+
+    err = clEnqueueCopyBuffer(queue, src, dst, 0, 0, size, 0, nullptr, ev);
+    if (err == CL_SUCCESS) err = clWaitForEvents(1, ev);
+    if (err == CL_SUCCESS) err = clGetEventProfilingInfo(ev, CL_PROFILING_COMMAND_START, sizeof(start), &start, nullptr);
+    if (err == CL_SUCCESS) err = clGetEventProfilingInfo(ev, CL_PROFILING_COMMAND_END, sizeof(end), &end, nullptr);
+
+    if ((err == CL_SUCCESS) && (i > 0) && (end > start))
+    {
+      double seconds = (end - start) * 1.0e-9;
+      if ((best_seconds == 0.0) || (seconds < best_seconds)) best_seconds = seconds;
+    }
+  }
+
+  if (dst != nullptr) clReleaseMemObject(dst);
+  if (src != nullptr) clReleaseMemObject(src);
+
+  if ((err != CL_SUCCESS) || (best_seconds <= 0.0))
+  {
+    ERROR("Failed to measure the memory bandwidth of " << peaks->name << ": " << errorToStr(err));
+    return false;
+  }
+
+  // each byte is read once and written once
+  peaks->bandwidth = 2.0 * size / best_seconds * 1.0e-9;
+
+  return true;
+}
+
+}
+
+
+void setHeadless(bool headless)
+{
+  g_headless = headless;
+}
+
+
+bool headless(void)
+{
+  return g_headless;
+}
+
+
+void setPeakGFlops(double gflops)
+{
+  g_peak_gflops = std::max(gflops, 0.0);
+}
+
+
+double peakGFlops(void)
+{
+  return g_peak_gflops;
+}
+
+
+bool measureDevicePeaks(cl_context ctx, cl_command_queue queue, DevicePeaks *peaks)
+{
+  cl_device_id device = nullptr;
+  cl_int err = clGetCommandQueueInfo(queue, CL_QUEUE_DEVICE, sizeof(device), &device, nullptr);
+  if (err != CL_SUCCESS)
+  {
+    ERROR("Failed to query the device of command queue: " << errorToStr(err));
+    return false;
+  }
+
+  // the systems of a process usually share the device, a single measurement is enough
+  std::lock_guard<std::mutex> lock(g_peaks_mutex);
+
+  std::map<cl_device_id, DevicePeaks>::const_iterator it = g_peaks.find(device);
+  if (it != g_peaks.end())
+  {
+    *peaks = it->second;
+  }
+  else
+  {
+    if (!measurePeaks(ctx, queue, device, peaks)) return false;
+    g_peaks[device] = *peaks;
+  }
+
+  if (g_peak_gflops > 0.0)
+  {
+    peaks->gflops = g_peak_gflops;
+    peaks->gflops_estimated = false;
+  }
+
+  return true;
+}
+
+
 ///////////////////////////////////////////////////////////////////////////////
 // Kernel and program management
 
+namespace {
+
+/** returns the devices of the given context */
+std::vector<cl_device_id> contextDevices(cl_context ctx)
+{
+  std::vector<cl_device_id> devices;
+  size_t size = 0;
+
+  if ((clGetContextInfo(ctx, CL_CONTEXT_DEVICES, 0, nullptr, &size) == CL_SUCCESS) && (size > 0))
+  {
+    devices.resize(size / sizeof(cl_device_id));
+    if (clGetContextInfo(ctx, CL_CONTEXT_DEVICES, size, &devices.front(), nullptr) != CL_SUCCESS)
+    {
+      devices.clear();
+    }
+  }
+
+  return devices;
+}
+
+/** string properties of devices and platforms (empty on error) */
+std::string deviceInfo(cl_device_id device, cl_device_info param)
+{
+  char buf[256] = { 0 };
+  clGetDeviceInfo(device, param, sizeof(buf) - 1, buf, nullptr);
+  return buf;
+}
+
+std::string platformInfo(cl_platform_id platform, cl_platform_info param)
+{
+  char buf[256] = { 0 };
+  clGetPlatformInfo(platform, param, sizeof(buf) - 1, buf, nullptr);
+  return buf;
+}
+
+/** adds the identification of the device and its driver to hash */
+void hashDevice(utils::cache::Hash & hash, cl_device_id device)
+{
+  cl_platform_id platform = nullptr;
+  clGetDeviceInfo(device, CL_DEVICE_PLATFORM, sizeof(platform), &platform, nullptr);
+
+  hash.add(platformInfo(platform, CL_PLATFORM_NAME))
+      .add(platformInfo(platform, CL_PLATFORM_VERSION))
+      .add(deviceInfo(device, CL_DEVICE_NAME))
+      .add(deviceInfo(device, CL_DEVICE_VENDOR))
+      .add(deviceInfo(device, CL_DEVICE_VERSION))
+      .add(deviceInfo(device, CL_DRIVER_VERSION));
+}
+
+/**
+ * Computes the cache key of a program, the key identifies the sources,
+ * the build options and the devices (including their driver versions),
+ * because program binaries can not be used with any other driver
+ */
+uint64_t programCacheKey(const std::vector<cl_device_id> & devices,
+                         const char * const sources[],
+                         unsigned int num,
+                         const char *built_options)
+{
+  utils::cache::Hash hash;
+
+  for (size_t i = 0; i < devices.size(); ++i)
+  {
+    hashDevice(hash, devices[i]);
+  }
+
+  for (unsigned int i = 0; i < num; ++i)
+  {
+    hash.add(sources[i]);
+  }
+
+  hash.add(built_options);
+
+  return hash.value();
+}
+
+/**
+ * Creates a program from the binaries in cache,
+ * the cached data consist of the number of devices followed by
+ * the size and the binary for each device of the context
+ *
+ * @return the built program or nullptr when the binaries are not available
+ */
+cl_program loadCachedProgram(cl_context ctx, const std::vector<cl_device_id> & devices,
+                             uint64_t key, const char *built_options)
+{
+  std::vector<unsigned char> data;
+  if (!utils::cache::load("cl", key, &data)) return nullptr;
+
+  /* parse the binaries */
+  std::vector<size_t> sizes;
+  std::vector<const unsigned char *> binaries;
+  size_t pos = 0;
+  cl_uint num = 0;
+
+  if (data.size() >= sizeof(num))
+  {
+    memcpy(&num, &data[pos], sizeof(num));
+    pos += sizeof(num);
+  }
+
+  for (cl_uint i = 0; (i < num) && (pos + sizeof(cl_ulong) <= data.size()); ++i)
+  {
+    cl_ulong size = 0;
+    memcpy(&size, &data[pos], sizeof(size));
+    pos += sizeof(size);
+    if ((size == 0) || (pos + size > data.size())) break;
+    sizes.push_back((size_t) size);
+    binaries.push_back(&data[pos]);
+    pos += (size_t) size;
+  }
+
+  if ((num != devices.size()) || (binaries.size() != devices.size()))
+  {
+    WARN("Ignoring cached OpenCL program binaries for different devices");
+    utils::cache::reject();
+    return nullptr;
+  }
+
+  /* create and build the program, the build of a binary only links it for the device */
+  cl_int err = CL_SUCCESS;
+  cl_program program = clCreateProgramWithBinary(ctx, num, &devices.front(), &sizes.front(),
+                                                 &binaries.front(), nullptr, &err);
+  if (err == CL_SUCCESS)
+  {
+    err = clBuildProgram(program, 0, nullptr, built_options, nullptr, nullptr);
+    if (err != CL_SUCCESS) clReleaseProgram(program);
+  }
+
+  if (err != CL_SUCCESS)
+  {
+    WARN("Failed to load cached OpenCL program binaries: " << errorToStr(err));
+    utils::cache::reject();
+    return nullptr;
+  }
+
+  return program;
+}
+
+/** stores the binaries of a built program in cache */
+void storeCachedProgram(cl_program program, uint64_t key)
+{
+  cl_uint num = 0;
+  cl_int err = clGetProgramInfo(program, CL_PROGRAM_NUM_DEVICES, sizeof(num), &num, nullptr);
+  if ((err != CL_SUCCESS) || (num == 0)) return;
+
+  std::vector<size_t> sizes(num);
+  err = clGetProgramInfo(program, CL_PROGRAM_BINARY_SIZES, num * sizeof(size_t), &sizes.front(), nullptr);
+  if (err != CL_SUCCESS) return;
+
+  /* serialize the binaries for all devices in a single buffer */
+  size_t total = sizeof(num);
+  for (cl_uint i = 0; i < num; ++i)
+  {
+    if (sizes[i] == 0) return;   // the program was not built for some device
+    total += sizeof(cl_ulong) + sizes[i];
+  }
+
+  std::vector<unsigned char> data(total);
+  std::vector<unsigned char *> binaries(num);
+  size_t pos = 0;
+
+  memcpy(&data[pos], &num, sizeof(num));
+  pos += sizeof(num);
+
+  for (cl_uint i = 0; i < num; ++i)
+  {
+    cl_ulong size = sizes[i];
+    memcpy(&data[pos], &size, sizeof(size));
+    pos += sizeof(size);
+    binaries[i] = &data[pos];
+    pos += sizes[i];
+  }
+
+  err = clGetProgramInfo(program, CL_PROGRAM_BINARIES, num * sizeof(unsigned char *), &binaries.front(), nullptr);
+  if (err != CL_SUCCESS)
+  {
+    WARN("Failed to retrieve OpenCL program binaries: " << errorToStr(err));
+    return;
+  }
+
+  utils::cache::store("cl", key, &data.front(), data.size());
+}
+
+}
+
+
 
 cl_program buildProgram(const cl_context ctx,
                         const char * const program_files[],
@@ -252,9 +600,7 @@ cl_program buildProgram(const cl_context ctx,
     }
   }
 
-  /* construct the program object */
-  cl_int err = CL_SUCCESS;
-  cl_program program = clCreateProgramWithSource(ctx, num, programs, nullptr, &err);
+  cl_program program = buildProgramSource(ctx, programs, num, built_options);
 
   /* free all the programs once the program is created */
   for (unsigned int i = 0; i < num; ++i)
@@ -262,6 +608,34 @@ cl_program buildProgram(const cl_context ctx,
     delete [] programs[i];
   }
 
+  return program;
+}
+
+
+cl_program buildProgramSource(const cl_context ctx,
+                              const char * const sources[],
+                              const unsigned int num,
+                              const char *built_options)
+{
+  /* try to skip the compilation with binaries from the previous run */
+  std::vector<cl_device_id> devices(contextDevices(ctx));
+  uint64_t cache_key = 0;
+
+  if (utils::cache::enabled() && (!devices.empty()))
+  {
+    cache_key = programCacheKey(devices, sources, num, built_options);
+
+    cl_program program = loadCachedProgram(ctx, devices, cache_key, built_options);
+    if (program != nullptr)
+    {
+      return program;
+    }
+  }
+
+  /* construct the program object */
+  cl_int err = CL_SUCCESS;
+  cl_program program = clCreateProgramWithSource(ctx, num, (const char **) sources, nullptr, &err);
+
   /* check if program creation succeeded */
   if (err != CL_SUCCESS)
   {
@@ -289,10 +663,131 @@ cl_program buildProgram(const cl_context ctx,
     return nullptr;
   }
 
+  if (utils::cache::enabled() && (!devices.empty()))
+  {
+    storeCachedProgram(program, cache_key);
+  }
+
   return program;
 }
 
 
+ProgramDefines & ProgramDefines::define(const std::string & name, float value)
+{
+  // the stream would write them as inf or nan, which are no literals
+  if (std::isnan(value))
+  {
+    m_defines[name] = "NAN";
+    return *this;
+  }
+
+  if (std::isinf(value))
+  {
+    m_defines[name] = (value < 0.0f) ? "(-INFINITY)" : "INFINITY";
+    return *this;
+  }
+
+  std::ostringstream oss;
+  oss << std::setprecision(9) << value;
+
+  std::string str(oss.str());
+  if (str.find_first_of(".en") == std::string::npos) str += ".0";  // make it a floating point literal
+  str += 'f';
+
+  if (value < 0.0f) str = "(" + str + ")";
+
+  m_defines[name] = str;
+
+  return *this;
+}
+
+
+ProgramDefines & ProgramDefines::define(const std::string & name, int value)
+{
+  std::ostringstream oss;
+  if (value < 0) oss << "(" << value << ")";
+  else oss << value;
+  m_defines[name] = oss.str();
+  return *this;
+}
+
+
+ProgramDefines & ProgramDefines::define(const std::string & name, unsigned int value)
+{
+  std::ostringstream oss;
+  oss << value << 'u';
+  m_defines[name] = oss.str();
+  return *this;
+}
+
+
+std::string ProgramDefines::str(void) const
+{
+  std::ostringstream oss;
+
+  for (std::map<std::string, std::string>::const_iterator it = m_defines.begin(); it != m_defines.end(); ++it)
+  {
+    if (it != m_defines.begin()) oss << ' ';
+    oss << "-D " << it->first;
+    if (!it->second.empty()) oss << '=' << it->second;
+  }
+
+  return oss.str();
+}
+
+
+cl_program buildProgram(const cl_context ctx,
+                        const char * const program_files[],
+                        const unsigned int num,
+                        const ProgramDefines & defines,
+                        const char *built_options)
+{
+  std::string options(defines.str());
+  if ((built_options != nullptr) && (*built_options != '\0'))
+  {
+    options += ' ';
+    options += built_options;
+  }
+
+  return buildProgram(ctx, program_files, num, options.c_str());
+}
+
+
+cl::Program ProgramCache::get(cl_context ctx, const ProgramDefines & defines, const char *built_options)
+{
+  if (ctx != m_ctx)
+  {
+    m_programs.clear();
+    m_ctx = ctx;
+  }
+
+  std::string key(defines.str());
+  if (built_options != nullptr)
+  {
+    key += '\n';
+    key += built_options;
+  }
+
+  tProgramMap::iterator it = m_programs.find(key);
+  if (it != m_programs.end())
+  {
+    ++m_hits;
+    return it->second;
+  }
+
+  cl::Program prog(buildProgram(ctx, m_program_files, m_num, defines, built_options));
+  if (prog() == nullptr)
+  {
+    return prog;
+  }
+
+  ++m_misses;
+  m_programs[key] = prog;
+
+  return prog;
+}
+
+
 ///////////////////////////////////////////////////////////////////////////////
 // OpenGL interoperability
 
@@ -300,6 +795,24 @@ bool GLBuffer::bufferData(const GLvoid *data, GLsizeiptr size, AccessType at, GL
 {
   assert(m_ctx != nullptr);
 
+  /* a plain device buffer, when there is no OpenGL to share with */
+  if (headless())
+  {
+    cl_int err = CL_SUCCESS;
+    cl_mem_flags flags = at | ((data != nullptr) ? CL_MEM_COPY_HOST_PTR : 0);
+    cl_mem mem = clCreateBuffer(m_ctx, flags, size, const_cast<GLvoid *>(data), &err);
+    if (err != CL_SUCCESS)
+    {
+      ERROR("Failed to create OpenCL buffer: " << ocl::errorToStr(err));
+      return false;
+    }
+
+    clReleaseMemObject(m_mem);
+    m_mem = mem;
+
+    return true;
+  }
+
   glBindBuffer(GL_ARRAY_BUFFER, m_vbo);
   glBufferData(GL_ARRAY_BUFFER, size, data, usage);
 
@@ -330,74 +843,1322 @@ bool GLBuffer::bufferData(const GLvoid *data, GLsizeiptr size, AccessType at, GL
 }
 
 
-///////////////////////////////////////////////////////////////////////////////
-// Performance counters
-
-void PerfStatsRecord::print(const std::string & name, std::ostream & os)
+void GLDoubleBuffer::init(cl_context ctx, cl_device_id device)
 {
-  os << "+----------------------------------------------------------------------+" << std::endl;
-  os << "| " << std::setw(50) << std::left << name << " | " << std::setw(8) << std::right << m_count << " events |" << std::endl;
-  os << "+----------------+-----------------+-----------------+-----------------+" << std::endl;
-  os << "|    Type        |     min (ms)    |     max (ms)    |     avg (ms)    |" << std::endl;
-  os << "+----------------+-----------------+-----------------+-----------------+" << std::endl;
+  m_ctx = ctx;
+  m_buffers[0].setCLContext(ctx);
+  m_buffers[1].setCLContext(ctx);
+
+  /* the extension string may be longer than any reasonable fixed size buffer */
+  std::string extensions;
+  size_t size = 0;
+  if ((clGetDeviceInfo(device, CL_DEVICE_EXTENSIONS, 0, nullptr, &size) == CL_SUCCESS) && (size > 0))
+  {
+    std::vector<char> buf(size + 1, 0);
+    if (clGetDeviceInfo(device, CL_DEVICE_EXTENSIONS, size, &buf.front(), nullptr) == CL_SUCCESS)
+    {
+      extensions = &buf.front();
+    }
+  }
 
-  os << std::left;
-  os << "| Queue time     | " << std::setw(15) << (m_queue_time.min() * 1.0e-6)  << " | "
-                              << std::setw(15) << (m_queue_time.max() * 1.0e-6)  << " | "
-                              << std::setw(15) << (m_queue_time.avg() * 1.0e-6)  << " |"
-                              << std::endl;
-  os << "| Submit time    | " << std::setw(15) << (m_submit_time.min() * 1.0e-6) << " | "
-                              << std::setw(15) << (m_submit_time.max() * 1.0e-6) << " | "
-                              << std::setw(15) << (m_submit_time.avg() * 1.0e-6) << " |"
-                              << std::endl;
-  os << "| Execution time | " << std::setw(15) << (m_exec_time.min() * 1.0e-6)   << " | "
-                              << std::setw(15) << (m_exec_time.max() * 1.0e-6)   << " | "
-                              << std::setw(15) << (m_exec_time.avg() * 1.0e-6)   << " |"
-                              << std::endl;
-  os << "+----------------+-----------------+-----------------+-----------------+" << std::endl;
+  m_has_fences = (GLEW_VERSION_3_2 || GLEW_ARB_sync);
 
-  os << std::right;
+  m_create_event_from_sync = nullptr;
+  if (m_has_fences && (extensions.find("cl_khr_gl_event") != std::string::npos))
+  {
+    m_create_event_from_sync = (clCreateEventFromGLsyncKHR_fn) clGetExtensionFunctionAddress("clCreateEventFromGLsyncKHR");
+  }
 
-  return;
+  INFO("Pipelined OpenCL/OpenGL synchronization: "
+       << (hasGLEvent() ? "GL fences as OpenCL events (cl_khr_gl_event)" :
+           (m_has_fences ? "GL fences waited on host" : "glFinish")));
 }
 
 
-void CL_CALLBACK PerfStats::cl_callback(cl_event ev, cl_int status, void *stats_rec)
+bool GLDoubleBuffer::resize(size_t size)
 {
-  cl_ulong time_queued = 0;
-  cl_ulong time_submited = 0;
-  cl_ulong time_started = 0;
-  cl_ulong time_finished = 0;
-  cl_int err = CL_SUCCESS;
-  
-  err = clGetEventProfilingInfo(ev, CL_PROFILING_COMMAND_QUEUED, sizeof(time_queued), &time_queued, nullptr);
-  if (err != CL_SUCCESS) WARN("Failed to query queued time: " << ocl::errorToStr(err) << " (" << err << ")");
+  reset();
 
-  err = clGetEventProfilingInfo(ev, CL_PROFILING_COMMAND_SUBMIT, sizeof(time_submited), &time_submited, nullptr);
-  if (err != CL_SUCCESS) WARN("Failed to query submit time: " << ocl::errorToStr(err) << " (" << err << ")");
+  for (int i = 0; i < 2; ++i)
+  {
+    if (!m_buffers[i].bufferData(nullptr, size, GLBuffer::WRITE_ONLY))
+    {
+      m_size = 0;
+      return false;
+    }
+  }
 
-  err = clGetEventProfilingInfo(ev, CL_PROFILING_COMMAND_START, sizeof(time_started), &time_started, nullptr);
-  if (err != CL_SUCCESS) WARN("Failed to query start time: " << ocl::errorToStr(err) << " (" << err << ")");
+  m_size = size;
 
-  err = clGetEventProfilingInfo(ev, CL_PROFILING_COMMAND_END, sizeof(time_finished), &time_finished, nullptr);
-  if (err != CL_SUCCESS) WARN("Failed to query end time: " << ocl::errorToStr(err) << " (" << err << ")");
+  return true;
+}
 
-  //LIBOCL_INFO("time_queued   : " << time_queued);
-  //LIBOCL_INFO("time_submited : " << time_submited);
-  //LIBOCL_INFO("time_started  : " << time_started);
-  //LIBOCL_INFO("time_finished : " << time_finished);
 
-  //LIBOCL_INFO("queued   : " << (time_submited - time_queued));
-  //LIBOCL_INFO("submited : " << (time_started - time_submited));
-  //LIBOCL_INFO("finished : " << (time_finished - time_started));
+bool GLDoubleBuffer::publish(cl_command_queue queue, cl_mem src)
+{
+  int back = 1 - m_front;
+  cl_mem dst = m_buffers[back].getCLID();
 
-  static_cast<PerfStatsRecord *>(stats_rec)->add(time_submited - time_queued,
-                                                 time_started - time_submited,
-                                                 time_finished - time_started);
-  
-  //clReleaseEvent(ev);
+  /* the previous copy to this buffer was enqueued two frames ago,
+     once it completes the fence it waited for is not needed anymore */
+  if (m_copy_event[back] != nullptr)
+  {
+    clWaitForEvents(1, &m_copy_event[back]);
+    clReleaseEvent(m_copy_event[back]);
+    m_copy_event[back] = nullptr;
+  }
+
+  if (m_wait_fence[back] != nullptr) glDeleteSync(m_wait_fence[back]);
+  m_wait_fence[back] = m_draw_fence[back];
+  m_draw_fence[back] = nullptr;
+
+  /* make OpenCL wait until OpenGL finished drawing the back buffer */
+  cl_event gl_done = nullptr;
+  if (m_wait_fence[back] != nullptr)
+  {
+    cl_int err = CL_SUCCESS;
+    if (m_create_event_from_sync != nullptr)
+    {
+      gl_done = m_create_event_from_sync(m_ctx, (cl_GLsync) m_wait_fence[back], &err);
+    }
+
+    if ((gl_done == nullptr) || (err != CL_SUCCESS))
+    {
+      gl_done = nullptr;
+      GLenum res = glClientWaitSync(m_wait_fence[back], GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000ull);
+      if ((res != GL_ALREADY_SIGNALED) && (res != GL_CONDITION_SATISFIED))
+      {
+        glFinish();
+      }
+    }
+  }
+  else if ((!m_has_fences) && m_has_front)
+  {
+    glFinish();
+  }
+
+  cl_int err = clEnqueueAcquireGLObjects(queue, 1, &dst,
+                                         (gl_done != nullptr) ? 1 : 0,
+                                         (gl_done != nullptr) ? &gl_done : nullptr,
+                                         nullptr);
+  clReleaseEvent(gl_done);
+  if (err != CL_SUCCESS)
+  {
+    ERROR("Failed to acquire the back buffer: " << errorToStr(err));
+    return false;
+  }
+
+  err = clEnqueueCopyBuffer(queue, src, dst, 0, 0, m_size, 0, nullptr, nullptr);
+  if (err != CL_SUCCESS)
+  {
+    ERROR("Failed to copy data to the back buffer: " << errorToStr(err));
+  }
+
+  cl_int rel_err = clEnqueueReleaseGLObjects(queue, 1, &dst, 0, nullptr, &m_copy_event[back]);
+  if (rel_err != CL_SUCCESS)
+  {
+    ERROR("Failed to release the back buffer: " << errorToStr(rel_err));
+    m_copy_event[back] = nullptr;
+    return false;
+  }
+
+  clFlush(queue);
+
+  m_back_ready = (err == CL_SUCCESS);
+
+  return m_back_ready;
+}
+
+
+GLuint GLDoubleBuffer::beginDraw(void)
+{
+  if (!m_has_front) return 0;
+
+  /* without cl_khr_gl_event the release does not synchronize with OpenGL */
+  if ((m_create_event_from_sync == nullptr) && (m_copy_event[m_front] != nullptr))
+  {
+    clWaitForEvents(1, &m_copy_event[m_front]);
+  }
+
+  return m_buffers[m_front].getGLID();
+}
+
+
+void GLDoubleBuffer::endDraw(void)
+{
+  if (m_has_front && m_has_fences)
+  {
+    if (m_draw_fence[m_front] != nullptr) glDeleteSync(m_draw_fence[m_front]);
+    m_draw_fence[m_front] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    glFlush();
+  }
+
+  if (m_back_ready)
+  {
+    m_front = 1 - m_front;
+    m_has_front = true;
+    m_back_ready = false;
+  }
+}
+
+
+void GLDoubleBuffer::reset(void)
+{
+  for (int i = 0; i < 2; ++i)
+  {
+    if (m_copy_event[i] != nullptr)
+    {
+      clWaitForEvents(1, &m_copy_event[i]);
+      clReleaseEvent(m_copy_event[i]);
+      m_copy_event[i] = nullptr;
+    }
+  }
+
+  if (m_has_front) glFinish();
+
+  for (int i = 0; i < 2; ++i)
+  {
+    if (m_draw_fence[i] != nullptr) glDeleteSync(m_draw_fence[i]);
+    if (m_wait_fence[i] != nullptr) glDeleteSync(m_wait_fence[i]);
+    m_draw_fence[i] = nullptr;
+    m_wait_fence[i] = nullptr;
+  }
+
+  m_has_front = false;
+  m_back_ready = false;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// Performance counters
+
+void TraceRecorder::setEnabled(bool enabled)
+{
+  std::lock_guard<std::mutex> lock(m_mutex);
+
+  if ((enabled) && (m_events.empty()))
+  {
+    m_events.resize(DEFAULT_EVENT_CAPACITY);
+    m_frames.resize(DEFAULT_FRAME_CAPACITY);
+  }
+
+  m_enabled.store(enabled, std::memory_order_relaxed);
+}
+
+
+void TraceRecorder::clear(void)
+{
+  std::lock_guard<std::mutex> lock(m_mutex);
+  m_num_events = 0;
+  m_num_frames = 0;
+}
+
+
+bool TraceRecorder::calibrate(cl_command_queue queue)
+{
+  /* the queued timestamp of a marker is taken by the host during the enqueue,
+     the shortest of several enqueues gives the most precise offset */
+  long long best_window = std::numeric_limits<long long>::max();
+
+  for (int i = 0; i < 5; ++i)
+  {
+    cl_event ev = nullptr;
+
+    long long before = hostTime();
+    cl_int err = clEnqueueMarker(queue, &ev);
+    long long after = hostTime();
+
+    if (err == CL_SUCCESS) err = clWaitForEvents(1, &ev);
+
+    cl_ulong queued = 0;
+    if (err == CL_SUCCESS)
+    {
+      err = clGetEventProfilingInfo(ev, CL_PROFILING_COMMAND_QUEUED, sizeof(queued), &queued, nullptr);
+    }
+
+    if (ev != nullptr) clReleaseEvent(ev);
+
+    if (err != CL_SUCCESS)
+    {
+      WARN("Failed to calibrate device timestamps: " << ocl::errorToStr(err));
+      return false;
+    }
+
+    if (after - before < best_window)
+    {
+      best_window = after - before;
+      m_offset = before + (after - before) / 2 - (long long) queued;
+    }
+  }
+
+  return true;
+}
+
+
+unsigned int TraceRecorder::beginFrame(void)
+{
+  unsigned int index = m_frame++;
+
+  /* one more frame passed since the last dumped frame, so its commands have finished */
+  if ((dumpPending()) && (index > m_dump_last + 1))
+  {
+    finishDump();
+  }
+
+  if (enabled())
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    Frame & f = m_frames[m_num_frames % m_frames.size()];
+    f.index = index;
+    f.begin = hostTime();
+    f.end = f.begin;
+    ++m_num_frames;
+  }
+
+  return index;
+}
+
+
+void TraceRecorder::endFrame(void)
+{
+  if (!enabled()) return;
+
+  std::lock_guard<std::mutex> lock(m_mutex);
+  if (m_num_frames == 0) return;
+
+  Frame & f = m_frames[(m_num_frames - 1) % m_frames.size()];
+  if (f.index + 1 == m_frame) f.end = hostTime();
+}
+
+
+void TraceRecorder::add(const std::string *name, cl_ulong queued, cl_ulong submitted, cl_ulong started, cl_ulong finished)
+{
+  if (!enabled()) return;
+
+  std::lock_guard<std::mutex> lock(m_mutex);
+  if (m_events.empty()) return;
+
+  Command & c = m_events[m_num_events % m_events.size()];
+  c.name = name;
+  c.queued = queued;
+  c.submitted = submitted;
+  c.started = started;
+  c.finished = finished;
+  ++m_num_events;
+}
+
+
+bool TraceRecorder::requestDump(cl_command_queue queue, unsigned int first, unsigned int last, const std::string & file_name)
+{
+  if ((last < first) || (last - first >= DEFAULT_FRAME_CAPACITY))
+  {
+    ERROR("Invalid range of traced frames: " << first << " - " << last);
+    return false;
+  }
+
+  if (!calibrate(queue))
+  {
+    return false;
+  }
+
+  if (m_dump_queue != nullptr) clReleaseCommandQueue(m_dump_queue);
+  clRetainCommandQueue(queue);
+
+  m_dump_queue = queue;
+  m_dump_first = first;
+  m_dump_last = last;
+  m_dump_file = file_name;
+  setEnabled(true);
+
+  return true;
+}
+
+
+bool TraceRecorder::finishDump(void)
+{
+  if (!dumpPending()) return false;
+
+  clFinish(m_dump_queue);
+  bool ok = dump(m_dump_first, m_dump_last, m_dump_file);
+
+  clReleaseCommandQueue(m_dump_queue);
+  m_dump_queue = nullptr;
+  m_dump_file.clear();
+  setEnabled(false);
+
+  return ok;
+}
+
+
+bool TraceRecorder::dump(unsigned int first, unsigned int last, const std::string & file_name)
+{
+  std::vector<Frame> frames;
+  std::vector<Command> commands;
+  long long offset = 0;
+
+  /* copy the entries, so that the callbacks are not blocked by writing */
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    unsigned long long num_frames = std::min<unsigned long long>(m_num_frames, m_frames.size());
+    for (unsigned long long i = m_num_frames - num_frames; i < m_num_frames; ++i)
+    {
+      const Frame & f = m_frames[i % m_frames.size()];
+      if ((f.index >= first) && (f.index <= last)) frames.push_back(f);
+    }
+
+    unsigned long long num_events = std::min<unsigned long long>(m_num_events, m_events.size());
+    for (unsigned long long i = m_num_events - num_events; i < m_num_events; ++i)
+    {
+      commands.push_back(m_events[i % m_events.size()]);
+    }
+
+    offset = m_offset;
+  }
+
+  if (frames.empty())
+  {
+    ERROR("Trace: None of the frames " << first << " - " << last << " was recorded");
+    return false;
+  }
+
+  std::ofstream os(file_name.c_str());
+  if (!os)
+  {
+    ERROR("Trace: Failed to create file " << file_name);
+    return false;
+  }
+
+  long long begin = frames.front().begin;
+  long long end = frames.back().end;
+
+  // the times are in microseconds
+  os << std::fixed << std::setprecision(3);
+  os << "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n";
+  os << "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"args\":{\"name\":\"fluid simulation\"}},\n";
+  os << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":1,\"args\":{\"name\":\"host frames\"}},\n";
+  os << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":2,\"args\":{\"name\":\"device execution\"}},\n";
+  os << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":3,\"args\":{\"name\":\"device queue\"}}";
+
+  for (size_t i = 0; i < frames.size(); ++i)
+  {
+    os << ",\n{\"name\":\"frame " << frames[i].index << "\",\"ph\":\"X\",\"pid\":1,\"tid\":1"
+       << ",\"ts\":" << (frames[i].begin * 1.0e-3) << ",\"dur\":" << ((frames[i].end - frames[i].begin) * 1.0e-3) << "}";
+  }
+
+  size_t num_commands = 0;
+
+  for (size_t i = 0; i < commands.size(); ++i)
+  {
+    const Command & c = commands[i];
+
+    // the commands enqueued during the frames
+    long long queued = (long long) c.queued + offset;
+    if ((queued < begin) || (queued > end)) continue;
+
+    std::string name;
+    for (const char *p = (c.name != nullptr) ? c.name->c_str() : "unknown"; *p != 0; ++p)
+    {
+      if ((*p == '"') || (*p == '\\')) name += '\\';
+      name += *p;
+    }
+
+    os << ",\n{\"name\":\"" << name << "\",\"ph\":\"X\",\"pid\":1,\"tid\":3"
+       << ",\"ts\":" << (queued * 1.0e-3) << ",\"dur\":" << ((c.started - c.queued) * 1.0e-3)
+       << ",\"args\":{\"submit_delay_us\":" << ((c.submitted - c.queued) * 1.0e-3) << "}}";
+
+    os << ",\n{\"name\":\"" << name << "\",\"ph\":\"X\",\"pid\":1,\"tid\":2"
+       << ",\"ts\":" << (((long long) c.started + offset) * 1.0e-3) << ",\"dur\":" << ((c.finished - c.started) * 1.0e-3) << "}";
+
+    ++num_commands;
+  }
+
+  os << "\n]}\n";
+
+  if (!os)
+  {
+    ERROR("Trace: Failed to write file " << file_name);
+    return false;
+  }
+
+  INFO("Trace: " << frames.size() << " frames and " << num_commands << " commands written to " << file_name);
+
+  return true;
+}
+
+
+void PerfStatsRecord::print(const std::string & name, std::ostream & os) const
+{
+  static const struct {
+    Metric metric;
+    const char *name;
+  } rows[] = {
+    { QUEUE_TIME,  "Queue time     " },
+    { SUBMIT_TIME, "Submit time    " },
+    { EXEC_TIME,   "Execution time " }
+  };
+
+  static const double percentiles[] = { 50.0, 90.0, 99.0, 99.9 };
+
+  os << "+-----------------------------------------------------------------------------------------------+" << std::endl;
+  os << "| " << std::setw(76) << std::left << name << " | " << std::setw(8) << std::right << count() << " events |" << std::endl;
+  os << "+-----------------+------------+------------+------------+------------+------------+------------+" << std::endl;
+  os << "|    Type (ms)    |    min     |    p50     |    p90     |    p99     |   p99.9    |    max     |" << std::endl;
+  os << "+-----------------+------------+------------+------------+------------+------------+------------+" << std::endl;
+
+  os << std::left;
+
+  for (unsigned int i = 0; i < FLUIDSIM_COUNT(rows); ++i)
+  {
+    const utils::stats::Histogram & h = time(rows[i].metric);
+
+    os << "| " << rows[i].name << " | " << std::setw(10) << (h.min() * 1.0e-6) << " | ";
+    for (unsigned int j = 0; j < FLUIDSIM_COUNT(percentiles); ++j)
+    {
+      os << std::setw(10) << (h.percentile(percentiles[j]) * 1.0e-6) << " | ";
+    }
+    os << std::setw(10) << (h.max() * 1.0e-6) << " |" << std::endl;
+  }
+
+  os << "+-----------------+------------+------------+------------+------------+------------+------------+" << std::endl;
+
+  os << std::right;
 
   return;
 }
 
+
+void PerfStats::printRoofline(std::ostream & os) const
+{
+  static const char *border = "+----------------------------------+----------+----------+----------+----------+----------+---------+";
+
+  bool has_peaks = (m_peaks.bandwidth > 0.0) && (m_peaks.gflops > 0.0);
+  double ridge = has_peaks ? m_peaks.gflops / m_peaks.bandwidth : 0.0;
+  bool header = false;
+
+  for (tCostContainer::const_iterator it = m_costs.begin(); it != m_costs.end(); ++it)
+  {
+    tContainer::const_iterator rec_it = m_stats.find(it->first);
+    if (rec_it == m_stats.end()) continue;
+
+    const PerfStatsRecord & rec = *rec_it->second;
+    const KernelCost & cost = it->second;
+    double seconds = rec.totalExecTime() * 1.0e-9;
+    if ((seconds <= 0.0) || (rec.items() == 0)) continue;
+
+    double bytes = rec.items() * cost.bytes_per_item + rec.pairs() * cost.bytes_per_pair;
+    double flops = rec.items() * cost.flops_per_item + rec.pairs() * cost.flops_per_pair;
+    double gbytes_per_second = bytes / seconds * 1.0e-9;
+    double gflops = flops / seconds * 1.0e-9;
+    double intensity = (bytes > 0.0) ? flops / bytes : 0.0;
+
+    if (!header)
+    {
+      os << "Roofline (global memory traffic requested by kernels, cache hits included):" << std::endl;
+      if (has_peaks)
+      {
+        os << "  " << m_peaks.name << ": " << m_peaks.compute_units << " compute units at " << m_peaks.clock_mhz << " MHz, "
+           << (m_peaks.global_mem_size >> 20) << " MB global memory, " << (m_peaks.global_mem_cache_size >> 10) << " KB cache with "
+           << m_peaks.global_mem_cacheline << " B lines" << std::endl;
+        os << "  peaks: " << m_peaks.bandwidth << " GB/s (measured copy), " << m_peaks.gflops << " GFLOP/s (" << (m_peaks.gflops_estimated ? "estimated" : "given") << "), "
+           << "ridge point " << ridge << " FLOP/byte" << std::endl;
+      }
+      os << border << std::endl;
+      // the arithmetic peak is only an estimate from the device type, unless it was given
+      os << "|              Kernel              |   GB/s   | GFLOP/s  |  FLOP/B  | % of BW  "
+         << (m_peaks.gflops_estimated ? "|%FLOP(est)" : "| % of FLOP") << "|  bound  |" << std::endl;
+      os << border << std::endl;
+      header = true;
+    }
+
+    os << "| " << std::left << std::setw(32) << it->first << std::right
+       << " | " << std::setw(8) << gbytes_per_second
+       << " | " << std::setw(8) << gflops
+       << " | " << std::setw(8) << intensity
+       << " | " << std::setw(8) << (has_peaks ? 100.0 * gbytes_per_second / m_peaks.bandwidth : 0.0)
+       << " | " << std::setw(8) << (has_peaks ? 100.0 * gflops / m_peaks.gflops : 0.0)
+       << " | " << std::left << std::setw(7) << (!has_peaks ? "-" : ((intensity < ridge) ? "memory" : "compute")) << std::right
+       << " |" << std::endl;
+  }
+
+  if (header)
+  {
+    os << border << std::endl;
+  }
+}
+
+
+void CL_CALLBACK PerfStats::cl_callback(cl_event ev, cl_int status, void *stats_rec)
+{
+  cl_ulong time_queued = 0;
+  cl_ulong time_submited = 0;
+  cl_ulong time_started = 0;
+  cl_ulong time_finished = 0;
+  cl_int err = CL_SUCCESS;
+  bool ok = (status == CL_COMPLETE);
+  
+  err = clGetEventProfilingInfo(ev, CL_PROFILING_COMMAND_QUEUED, sizeof(time_queued), &time_queued, nullptr);
+  if (err != CL_SUCCESS) { WARN("Failed to query queued time: " << ocl::errorToStr(err) << " (" << err << ")"); ok = false; }
+
+  err = clGetEventProfilingInfo(ev, CL_PROFILING_COMMAND_SUBMIT, sizeof(time_submited), &time_submited, nullptr);
+  if (err != CL_SUCCESS) { WARN("Failed to query submit time: " << ocl::errorToStr(err) << " (" << err << ")"); ok = false; }
+
+  err = clGetEventProfilingInfo(ev, CL_PROFILING_COMMAND_START, sizeof(time_started), &time_started, nullptr);
+  if (err != CL_SUCCESS) { WARN("Failed to query start time: " << ocl::errorToStr(err) << " (" << err << ")"); ok = false; }
+
+  err = clGetEventProfilingInfo(ev, CL_PROFILING_COMMAND_END, sizeof(time_finished), &time_finished, nullptr);
+  if (err != CL_SUCCESS) { WARN("Failed to query end time: " << ocl::errorToStr(err) << " (" << err << ")"); ok = false; }
+
+  // the partial timestamps of failed commands would only spoil the histograms
+  if ((!ok) || (time_submited < time_queued) || (time_started < time_submited) || (time_finished < time_started))
+  {
+    return;
+  }
+
+  //LIBOCL_INFO("time_queued   : " << time_queued);
+  //LIBOCL_INFO("time_submited : " << time_submited);
+  //LIBOCL_INFO("time_started  : " << time_started);
+  //LIBOCL_INFO("time_finished : " << time_finished);
+
+  //LIBOCL_INFO("queued   : " << (time_submited - time_queued));
+  //LIBOCL_INFO("submited : " << (time_started - time_submited));
+  //LIBOCL_INFO("finished : " << (time_finished - time_started));
+
+  // this runs on a thread of the OpenCL driver, but adding to a record is lock-free
+  PerfStatsRecord *rec = static_cast<PerfStatsRecord *>(stats_rec);
+  rec->add(time_submited - time_queued, time_started - time_submited, time_finished - time_started);
+
+  if ((rec->trace() != nullptr) && (rec->trace()->enabled()))
+  {
+    rec->trace()->add(rec->name(), time_queued, time_submited, time_started, time_finished);
+  }
+  
+  //clReleaseEvent(ev);
+
+  return;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// Work-group size tuning
+
+bool WorkGroupTuner::init(cl_device_id device, const std::string & db_file)
+{
+  utils::cache::Hash hash;
+  hashDevice(hash, device);
+
+  m_device = device;
+  m_device_key = hash.value();
+  m_db_file = db_file;
+  m_sizes.clear();
+  m_other_devices.clear();
+  m_trials.clear();
+  m_max_local_sizes.clear();
+  m_tuning = false;
+
+  std::ifstream ifs(db_file.c_str());
+  if (!ifs)
+  {
+    INFO("No work-group tuning database found (" << db_file << "), using the driver's defaults");
+    return true;
+  }
+
+  /* each line contains the device key, the kernel name and its local size */
+  std::string line;
+  unsigned int line_num = 0;
+  while (std::getline(ifs, line))
+  {
+    ++line_num;
+    if (line.empty()) continue;
+
+    std::istringstream iss(line);
+    uint64_t key = 0;
+    std::string name;
+    size_t local = 0;
+
+    if (!(iss >> std::hex >> key >> name >> std::dec >> local))
+    {
+      ERROR("Malformed work-group tuning database " << db_file << " at line " << line_num);
+      m_sizes.clear();
+      m_other_devices.clear();
+      return false;
+    }
+
+    if (key == m_device_key)
+    {
+      m_sizes[name] = local;
+    }
+    else
+    {
+      m_other_devices.push_back(line);
+    }
+  }
+
+  INFO("Loaded tuned work-group sizes of " << m_sizes.size() << " kernels from " << db_file);
+
+  return true;
+}
+
+
+void WorkGroupTuner::setTuning(bool enable)
+{
+  if (enable && !m_tuning)
+  {
+    m_trials.clear();
+    m_restart = true;
+  }
+
+  m_tuning = enable;
+}
+
+
+size_t WorkGroupTuner::localSize(const std::string & name) const
+{
+  tSizeMap::const_iterator it = m_sizes.find(name);
+  return (it == m_sizes.end()) ? 0 : it->second;
+}
+
+
+cl_int WorkGroupTuner::enqueue(cl_command_queue queue, cl_kernel kernel,
+                               const char *name, size_t n, PerfStats & stats,
+                               unsigned long long pairs)
+{
+  size_t local = localSize(name);
+  Trial *trial = nullptr;
+
+  if (m_tuning)
+  {
+    if (m_restart)
+    {
+      /* make sure no callback of the previous session is pending */
+      clFinish(queue);
+      m_trial_stats.clear();
+      m_restart = false;
+    }
+
+    Trial & t = m_trials[name];
+    if (t.candidates.empty())
+    {
+      t.candidates = candidates(kernel);
+    }
+
+    if ((!t.done) && (!finishTrial(name, t)))
+    {
+      trial = &t;
+      local = t.candidates[t.next];
+      t.next = (t.next + 1) % t.candidates.size();
+    }
+    else
+    {
+      local = localSize(name);
+    }
+  }
+
+  /* a size tuned for a different variant of the kernel may be too large */
+  if ((local > 0) && (local > maxLocalSize(kernel)))
+  {
+    local = 0;
+  }
+
+  /* pad the global size to a multiple of the local size */
+  size_t global = (local > 0) ? ((n + local - 1) / local) * local : n;
+
+  Event ev;
+  cl_int err = clEnqueueNDRangeKernel(queue, kernel, 1,
+                                      nullptr, &global, (local > 0) ? &local : nullptr,
+                                      0, nullptr, ev);
+  if (err != CL_SUCCESS)
+  {
+    return err;
+  }
+
+  stats.event(ev, name);
+  stats.addWork(name, n, pairs);
+
+  if (trial != nullptr)
+  {
+    m_trial_stats.event(ev, trialName(name, local));
+  }
+
+  return CL_SUCCESS;
+}
+
+
+std::vector<size_t> WorkGroupTuner::candidates(cl_kernel kernel) const
+{
+  std::vector<size_t> sizes(1, 0);   // the driver's choice
+
+  size_t multiple = 0;
+  cl_int err = clGetKernelWorkGroupInfo(kernel, m_device, CL_KERNEL_PREFERRED_WORK_GROUP_SIZE_MULTIPLE,
+                                        sizeof(multiple), &multiple, nullptr);
+  if ((err != CL_SUCCESS) || (multiple == 0))
+  {
+    WARN("WorkGroupTuner: Failed to query preferred work-group size multiple: " << errorToStr(err));
+    return sizes;
+  }
+
+  size_t max_size = maxLocalSize(kernel);
+  for (size_t local = multiple; local <= max_size; local *= 2)
+  {
+    sizes.push_back(local);
+  }
+
+  return sizes;
+}
+
+
+bool WorkGroupTuner::finishTrial(const std::string & name, Trial & trial)
+{
+  size_t best = 0;
+  float best_time = std::numeric_limits<float>::max();
+
+  for (size_t i = 0; i < trial.candidates.size(); ++i)
+  {
+    const PerfStatsRecord *rec = m_trial_stats.record(trialName(name, trial.candidates[i]));
+    if ((rec == nullptr) || (rec->count() < RUNS))
+    {
+      return false;
+    }
+
+    if (rec->execTime().mean() < best_time)
+    {
+      best_time = (float) rec->execTime().mean();
+      best = trial.candidates[i];
+    }
+  }
+
+  trial.done = true;
+  m_sizes[name] = best;
+
+  INFO("Tuned " << trialName(name, best) << " (" << (best_time * 1.0e-6f) << " ms, "
+       << trial.candidates.size() << " candidates)");
+
+  if (!save())
+  {
+    WARN("WorkGroupTuner: Failed to save tuning database " << m_db_file);
+  }
+
+  return true;
+}
+
+
+size_t WorkGroupTuner::maxLocalSize(cl_kernel kernel) const
+{
+  tKernelSizeMap::const_iterator it = m_max_local_sizes.find(kernel);
+  if (it != m_max_local_sizes.end()) return it->second;
+
+  size_t max_size = 0;
+  cl_int err = clGetKernelWorkGroupInfo(kernel, m_device, CL_KERNEL_WORK_GROUP_SIZE,
+                                        sizeof(max_size), &max_size, nullptr);
+  if (err != CL_SUCCESS) return 0;  // not cached, the query is retried next time
+
+  m_max_local_sizes[kernel] = max_size;
+  return max_size;
+}
+
+
+bool WorkGroupTuner::save(void) const
+{
+  if (m_db_file.empty()) return false;
+
+  std::ofstream ofs(m_db_file.c_str());
+  if (!ofs) return false;
+
+  for (size_t i = 0; i < m_other_devices.size(); ++i)
+  {
+    ofs << m_other_devices[i] << std::endl;
+  }
+
+  for (tSizeMap::const_iterator it = m_sizes.begin(); it != m_sizes.end(); ++it)
+  {
+    ofs << std::hex << std::setw(16) << std::setfill('0') << m_device_key
+        << std::dec << std::setfill(' ') << ' ' << it->first << ' ' << it->second << std::endl;
+  }
+
+  return ofs.good();
+}
+
+
+std::string WorkGroupTuner::trialName(const std::string & name, size_t local)
+{
+  std::ostringstream oss;
+  oss << name << '@';
+  if (local > 0) oss << local;
+  else oss << "default";
+  return oss.str();
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// Parallel primitives
+
+const char *RadixSort::m_kernel_file = "/src/OpenCL/radix_sort.cl";
+
+
+bool RadixSort::init(cl_context ctx)
+{
+  std::ostringstream opts;
+  opts << "-D RADIX_BITS=" << RADIX_BITS
+       << " -D RADIX_BLOCK=" << RADIX_BLOCK
+       << " -D SCAN_WG=" << SCAN_WG;
+
+  m_prog = buildProgram(ctx, &m_kernel_file, 1, opts.str().c_str());
+  if (m_prog() == nullptr)
+  {
+    ERROR("Failed to create radix sort program");
+    return false;
+  }
+
+  clRetainContext(ctx);   // cl::Context takes the ownership
+  m_ctx = cl::Context(ctx);
+
+  cl_int err = CL_SUCCESS;
+  m_histogram_kernel = cl::Kernel(m_prog, "radix_histogram", &err);
+  if (err != CL_SUCCESS)
+  {
+    ERROR("Failed to create radix_histogram kernel: " << errorToStr(err));
+    return false;
+  }
+
+  m_scan_local_kernel = cl::Kernel(m_prog, "radix_scan_local", &err);
+  if (err != CL_SUCCESS)
+  {
+    ERROR("Failed to create radix_scan_local kernel: " << errorToStr(err));
+    return false;
+  }
+
+  m_scan_add_kernel = cl::Kernel(m_prog, "radix_scan_add", &err);
+  if (err != CL_SUCCESS)
+  {
+    ERROR("Failed to create radix_scan_add kernel: " << errorToStr(err));
+    return false;
+  }
+
+  m_scatter_kernel = cl::Kernel(m_prog, "radix_scatter", &err);
+  if (err != CL_SUCCESS)
+  {
+    ERROR("Failed to create radix_scatter kernel: " << errorToStr(err));
+    return false;
+  }
+
+  m_capacity = 0;
+
+  return true;
+}
+
+
+cl_int RadixSort::enqueue(cl_command_queue queue, cl_kernel kernel,
+                          size_t global, const size_t *local,
+                          const char *name, PerfStats *stats)
+{
+  cl_int err = CL_SUCCESS;
+
+  if (stats != nullptr)
+  {
+    err = clEnqueueNDRangeKernel(queue, kernel, 1, nullptr, &global, local,
+                                 0, nullptr, stats->event(name));
+  }
+  else
+  {
+    err = clEnqueueNDRangeKernel(queue, kernel, 1, nullptr, &global, local,
+                                 0, nullptr, nullptr);
+  }
+
+  if (err != CL_SUCCESS)
+  {
+    WARN("RadixSort: Failed to enqueue " << name << " kernel: " << errorToStr(err));
+  }
+
+  return err;
+}
+
+
+bool RadixSort::reserve(size_t n)
+{
+  if (n <= m_capacity) return true;
+
+  cl_int err = CL_SUCCESS;
+
+  m_tmp_keys_buf = cl::Buffer(m_ctx, CL_MEM_READ_WRITE, n * sizeof(cl_uint), nullptr, &err);
+  if (err != CL_SUCCESS)
+  {
+    ERROR("RadixSort: Failed to allocate temporary key buffer: " << errorToStr(err));
+    return false;
+  }
+
+  m_tmp_values_buf = cl::Buffer(m_ctx, CL_MEM_READ_WRITE, n * sizeof(cl_uint), nullptr, &err);
+  if (err != CL_SUCCESS)
+  {
+    ERROR("RadixSort: Failed to allocate temporary value buffer: " << errorToStr(err));
+    return false;
+  }
+
+  size_t num_items = (n + RADIX_BLOCK - 1) / RADIX_BLOCK;
+  size_t hist_size = num_items << RADIX_BITS;
+
+  m_histogram_buf = cl::Buffer(m_ctx, CL_MEM_READ_WRITE, hist_size * sizeof(cl_uint), nullptr, &err);
+  if (err != CL_SUCCESS)
+  {
+    ERROR("RadixSort: Failed to allocate histogram buffer: " << errorToStr(err));
+    return false;
+  }
+
+  /* each level of the scan needs a buffer for its block sums */
+  m_scan_sums_bufs.clear();
+
+  size_t m = hist_size;
+  while (true)
+  {
+    size_t blocks = (m + 2 * SCAN_WG - 1) / (2 * SCAN_WG);
+    m_scan_sums_bufs.push_back(cl::Buffer(m_ctx, CL_MEM_READ_WRITE, blocks * sizeof(cl_uint), nullptr, &err));
+    if (err != CL_SUCCESS)
+    {
+      ERROR("RadixSort: Failed to allocate scan buffer: " << errorToStr(err));
+      return false;
+    }
+
+    if (blocks <= 1) break;
+    m = blocks;
+  }
+
+  m_capacity = n;
+
+  return true;
+}
+
+
+bool RadixSort::scan(cl_command_queue queue, cl_mem data, size_t n, unsigned int level, PerfStats *stats)
+{
+  assert(level < m_scan_sums_bufs.size());
+
+  size_t blocks = (n + 2 * SCAN_WG - 1) / (2 * SCAN_WG);
+  size_t local = SCAN_WG;
+  cl_mem sums = m_scan_sums_bufs[level]();
+
+  /* scan each block separately */
+  if (!KernelArgs(m_scan_local_kernel, "radix_scan_local")
+            .arg(data)
+            .arg(sums)
+            .arg(cl::Local(2 * SCAN_WG * sizeof(cl_uint)))
+            .arg((cl_uint) n))
+  {
+    return false;
+  }
+
+  if (enqueue(queue, m_scan_local_kernel(), blocks * SCAN_WG, &local, "radix_scan_local", stats) != CL_SUCCESS)
+  {
+    return false;
+  }
+
+  if (blocks <= 1) return true;
+
+  /* scan the block sums and add them to the elements of each block */
+  if (!scan(queue, sums, blocks, level + 1, stats))
+  {
+    return false;
+  }
+
+  if (!KernelArgs(m_scan_add_kernel, "radix_scan_add")
+            .arg(data)
+            .arg(sums)
+            .arg((cl_uint) n))
+  {
+    return false;
+  }
+
+  return enqueue(queue, m_scan_add_kernel(), n, nullptr, "radix_scan_add", stats) == CL_SUCCESS;
+}
+
+
+bool RadixSort::sort(cl_command_queue queue,
+                     cl_mem keys,
+                     cl_mem values,
+                     size_t n,
+                     unsigned int key_bits,
+                     PerfStats *stats)
+{
+  if (n == 0) return true;
+
+  if (!reserve(n)) return false;
+
+  size_t num_items = (n + RADIX_BLOCK - 1) / RADIX_BLOCK;
+  size_t hist_size = num_items << RADIX_BITS;
+  unsigned int passes = (key_bits + RADIX_BITS - 1) / RADIX_BITS;
+
+  cl_mem src_keys = keys;
+  cl_mem src_values = values;
+  cl_mem dst_keys = m_tmp_keys_buf();
+  cl_mem dst_values = m_tmp_values_buf();
+
+  for (unsigned int pass = 0; pass < passes; ++pass)
+  {
+    cl_uint shift = pass * RADIX_BITS;
+
+    /* count the digits in each block */
+    if (!KernelArgs(m_histogram_kernel, "radix_histogram")
+              .arg(src_keys)
+              .arg(m_histogram_buf)
+              .arg((cl_uint) n)
+              .arg(shift))
+    {
+      return false;
+    }
+
+    if (enqueue(queue, m_histogram_kernel(), num_items, nullptr, "radix_histogram", stats) != CL_SUCCESS)
+    {
+      return false;
+    }
+
+    /* convert the counts to output offsets */
+    if (!scan(queue, m_histogram_buf(), hist_size, 0, stats))
+    {
+      return false;
+    }
+
+    /* move the elements */
+    if (!KernelArgs(m_scatter_kernel, "radix_scatter")
+              .arg(src_keys)
+              .arg(src_values)
+              .arg(dst_keys)
+              .arg(dst_values)
+              .arg(m_histogram_buf)
+              .arg((cl_uint) n)
+              .arg(shift))
+    {
+      return false;
+    }
+
+    if (enqueue(queue, m_scatter_kernel(), num_items, nullptr, "radix_scatter", stats) != CL_SUCCESS)
+    {
+      return false;
+    }
+
+    std::swap(src_keys, dst_keys);
+    std::swap(src_values, dst_values);
+  }
+
+  /* an odd number of passes leaves the result in temporary buffers */
+  if (src_keys != keys)
+  {
+    cl_int err = clEnqueueCopyBuffer(queue, src_keys, keys, 0, 0, n * sizeof(cl_uint), 0, nullptr, nullptr);
+    if (err == CL_SUCCESS)
+    {
+      err = clEnqueueCopyBuffer(queue, src_values, values, 0, 0, n * sizeof(cl_uint), 0, nullptr, nullptr);
+    }
+
+    if (err != CL_SUCCESS)
+    {
+      WARN("RadixSort: Failed to copy the sorted data: " << errorToStr(err));
+      return false;
+    }
+  }
+
+  return true;
+}
+
+
+const char *ReductionBase::m_kernel_file = "/src/OpenCL/reduction.cl";
+
+
+bool ReductionBase::init(cl_context ctx,
+                         Op op,
+                         const char *type,
+                         unsigned int components,
+                         bool is_float,
+                         const char *map_expr,
+                         const char *in_type,
+                         const char *in2_type,
+                         const char *load_expr)
+{
+  /* generate the definitions of the reduction operator */
+  const char *combine = nullptr;
+  const char *identity = nullptr;
+  const char *subgroup = nullptr;
+
+  switch (op)
+  {
+    case MIN:
+      combine = is_float ? "fmin((a), (b))" : "min((a), (b))";
+      identity = is_float ? "INFINITY" : "UINT_MAX";
+      subgroup = "sub_group_reduce_min";
+      break;
+
+    case MAX:
+      combine = is_float ? "fmax((a), (b))" : "max((a), (b))";
+      identity = is_float ? "(-INFINITY)" : "0u";
+      subgroup = "sub_group_reduce_max";
+      break;
+
+    case SUM:
+    case SUM_SQR:
+      combine = "((a) + (b))";
+      identity = is_float ? "0.0f" : "0u";
+      subgroup = "sub_group_reduce_add";
+      break;
+  }
+
+  std::ostringstream header;
+  header << "#define RED_T " << type << "\n"
+         << "#define RED_IN_T " << in_type << "\n";
+  if (in2_type != nullptr)
+  {
+    header << "#define RED_IN2_T " << in2_type << "\n";
+  }
+  header << "#define RED_LOAD(p, i) " << ((load_expr != nullptr) ? load_expr : "((p)[i])") << "\n"
+         << "#define RED_MAP(x, y) ((" << type << ") (" << map_expr << "))\n"
+         << "#define RED_PREPARE(v) " << ((op == SUM_SQR) ? "((v) * (v))" : "(v)") << "\n"
+         << "#define RED_COMBINE(a, b) " << combine << "\n"
+         << "#define RED_IDENTITY ((" << type << ") (" << identity << "))\n";
+
+  /* sub-group functions only take scalars, so vectors are reduced per component */
+  if (components == 1)
+  {
+    header << "#define RED_SUBGROUP_REDUCE(v) " << subgroup << "(v)\n";
+  }
+  else
+  {
+    static const char *swizzle[] = { "x", "y", "z", "w" };
+    header << "#define RED_SUBGROUP_REDUCE(v) ((" << type << ") (";
+    for (unsigned int i = 0; i < components; ++i)
+    {
+      header << ((i > 0) ? ", " : "") << subgroup << "((v)." << swizzle[i] << ")";
+    }
+    header << "))\n";
+  }
+
+  /* prepend the definitions to the generic kernel */
+  const char *src = utils::fs::loadFile(utils::fs::AssetsPath(m_kernel_file));
+  if (src == nullptr)
+  {
+    ERROR("Failed to load program file: " << utils::fs::AssetsPath(m_kernel_file));
+    return false;
+  }
+
+  std::string header_str(header.str());
+  const char *sources[] = { header_str.c_str(), src };
+  m_prog = buildProgramSource(ctx, sources, 2);
+  delete [] src;
+
+  if (m_prog() == nullptr)
+  {
+    ERROR("Failed to create reduction program");
+    return false;
+  }
+
+  clRetainContext(ctx);   // cl::Context takes the ownership
+  m_ctx = cl::Context(ctx);
+
+  cl_int err = CL_SUCCESS;
+  m_kernel = cl::Kernel(m_prog, "reduce", &err);
+  if (err != CL_SUCCESS)
+  {
+    ERROR("Failed to create reduce kernel: " << errorToStr(err));
+    return false;
+  }
+
+  /* the tree reduction requires a power of two work-group size,
+     the kernel may run on any device of the context, so it has to fit all of them */
+  std::vector<cl_device_id> devices(contextDevices(ctx));
+  size_t wg_size = MAX_WG_SIZE;
+
+  if (devices.empty())
+  {
+    WARN("Reduction: Failed to query the devices of the context");
+  }
+
+  for (size_t i = 0; i < devices.size(); ++i)
+  {
+    size_t device_wg_size = 0;
+    err = clGetKernelWorkGroupInfo(m_kernel(), devices[i], CL_KERNEL_WORK_GROUP_SIZE,
+                                   sizeof(device_wg_size), &device_wg_size, nullptr);
+    if (err != CL_SUCCESS)
+    {
+      WARN("Reduction: Failed to query the work-group size: " << errorToStr(err));
+      continue;
+    }
+
+    wg_size = std::min(wg_size, device_wg_size);
+  }
+
+  m_wg_size = MAX_WG_SIZE;
+  while (m_wg_size > wg_size) m_wg_size /= 2;
+
+  m_partial_buf = cl::Buffer(m_ctx, CL_MEM_READ_WRITE, MAX_GROUPS * m_elem_size, nullptr, &err);
+  if (err != CL_SUCCESS)
+  {
+    ERROR("Reduction: Failed to allocate partial results buffer: " << errorToStr(err));
+    return false;
+  }
+
+  m_partial.resize(MAX_GROUPS * m_elem_size);
+  m_event = Event();
+  m_num_groups = 0;
+  m_has_input2 = (in2_type != nullptr);
+  m_op = op;
+
+  return true;
+}
+
+
+bool ReductionBase::enqueue(cl_command_queue queue,
+                            cl_mem input,
+                            size_t n,
+                            cl_mem input2,
+                            PerfStats *stats,
+                            const char *name)
+{
+  if ((n == 0) || (m_kernel() == nullptr)) return false;
+
+  KernelArgs args(m_kernel, "reduce");
+  args.arg(input);
+  if (m_has_input2) args.arg(input2);
+  args.arg(m_partial_buf)
+      .arg(cl::Local(m_wg_size * m_elem_size))
+      .arg((cl_uint) n);
+  if (!args) return false;
+
+  size_t groups = std::min<size_t>(MAX_GROUPS, (n + m_wg_size - 1) / m_wg_size);
+  size_t global = groups * m_wg_size;
+
+  cl_int err = clEnqueueNDRangeKernel(queue, m_kernel(), 1, nullptr, &global, &m_wg_size,
+                                      0, nullptr, (stats != nullptr) ? stats->event(name) : nullptr);
+  if (err != CL_SUCCESS)
+  {
+    WARN("Reduction: Failed to enqueue " << name << " kernel: " << errorToStr(err));
+    return false;
+  }
+
+  /* read the partial results without blocking, they are combined in result() */
+  m_event = Event();
+  err = clEnqueueReadBuffer(queue, m_partial_buf(), CL_FALSE, 0, groups * m_elem_size,
+                            m_partial.data(), 0, nullptr, m_event);
+  if (err != CL_SUCCESS)
+  {
+    WARN("Reduction: Failed to read partial results of " << name << ": " << errorToStr(err));
+    return false;
+  }
+
+  m_num_groups = groups;
+
+  return true;
+}
+
+
+bool ReductionBase::wait(void)
+{
+  cl_event ev = m_event;
+  if (ev == nullptr) return false;
+
+  cl_int err = clWaitForEvents(1, &ev);
+  m_event = Event();
+
+  if (err != CL_SUCCESS)
+  {
+    WARN("Reduction: Failed to wait for partial results: " << errorToStr(err));
+    return false;
+  }
+
+  return true;
+}
+
 }
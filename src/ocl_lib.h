@@ -31,8 +31,15 @@
 #include <stdexcept>
 #include <iostream>
 #include <unordered_map>
+#include <map>
+#include <string>
 #include <ostream>
 #include <memory>
+#include <vector>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <mutex>
 
 
 
@@ -88,6 +95,66 @@ bool selectGLDeviceAndPlatform(cl_device_id *device, cl_platform_id *platform);
 bool selectPlatformAndDevice(cl_device_id *device, cl_platform_id *platform,
                              cl_device_type dev_type = CL_DEVICE_TYPE_GPU);
 
+/**
+ * Switches the OpenCL/OpenGL interoperability off for the whole process,
+ * so that no OpenGL context is needed (e.g. for batch simulations on servers).
+ * Headless GLBuffers are plain OpenCL buffers without a vertex buffer object
+ * and GLSyncHandler does not synchronize with OpenGL.
+ * Has to be set before any GLBuffer is constructed.
+ */
+void setHeadless(bool headless);
+bool headless(void);
+
+/**
+ * The limits of a device for the roofline view of kernel performance
+ */
+struct DevicePeaks
+{
+  std::string name;
+  cl_uint compute_units;
+  cl_uint clock_mhz;
+  cl_ulong global_mem_size;        /// CL_DEVICE_GLOBAL_MEM_SIZE
+  cl_ulong global_mem_cache_size;  /// CL_DEVICE_GLOBAL_MEM_CACHE_SIZE
+  cl_uint global_mem_cacheline;    /// CL_DEVICE_GLOBAL_MEM_CACHELINE_SIZE
+  double bandwidth;                /// the global memory bandwidth in GB/s
+  double gflops;                   /// the single precision arithmetic throughput in GFLOP/s
+  bool gflops_estimated;           /// whether gflops is derived from the device type (see setPeakGFlops)
+
+  DevicePeaks(void)
+    : name()
+    , compute_units(0)
+    , clock_mhz(0)
+    , global_mem_size(0)
+    , global_mem_cache_size(0)
+    , global_mem_cacheline(0)
+    , bandwidth(0.0)
+    , gflops(0.0)
+    , gflops_estimated(true)
+  {
+  }
+};
+
+/**
+ * Determines the peaks of the device of the given queue.
+ * OpenCL does not report the memory bandwidth, so it is measured by a device
+ * to device buffer copy, the arithmetic peak is estimated from the number of
+ * compute units and their clock as one fused multiply-add per lane and cycle,
+ * unless it is given by setPeakGFlops. The lanes per compute unit depend
+ * on the vendor of a GPU (128 per NVIDIA SM, 64 per AMD CU, 8 per Intel EU,
+ * 64 otherwise), a CPU core has the preferred float vector width times two pipelines.
+ * Each device is measured only once per process, later calls return the same peaks.
+ *
+ * @return true on success, false otherwise
+ */
+bool measureDevicePeaks(cl_context ctx, cl_command_queue queue, DevicePeaks *peaks);
+
+/**
+ * Overrides the arithmetic peak of devices in GFLOP/s (e.g. from the data sheet),
+ * 0 restores the estimate. Has to be set before the peaks are measured.
+ */
+void setPeakGFlops(double gflops);
+double peakGFlops(void);
+
 ///////////////////////////////////////////////////////////////////////////////
 // Kernel and program management
 
@@ -105,6 +172,109 @@ cl_program buildProgram(const cl_context ctx,
                         const unsigned int num,
                         const char *built_options = nullptr);
 
+/**
+ * The same as buildProgram, but the program is created
+ * from an array of source strings instead of files.
+ *
+ * @param sources an array of pointers to OpenCL source code
+ * @param num the number of source strings
+ *
+ * @return a newly created Program or a NULL program on Error
+ */
+cl_program buildProgramSource(const cl_context ctx,
+                              const char * const sources[],
+                              const unsigned int num,
+                              const char *built_options = nullptr);
+
+/**
+ * Preprocessor definitions passed to the OpenCL compiler as -D build options,
+ * so that the values become compile time constants the compiler can fold.
+ * The definitions are kept sorted by name, so the same set of definitions
+ * always gives the same build options.
+ */
+class ProgramDefines
+{
+  public:
+    ProgramDefines(void) : m_defines() { }
+
+    // defines a flag (a macro without a value)
+    ProgramDefines & define(const std::string & name) { m_defines[name] = std::string(); return *this; }
+    // defines a macro with the value given as OpenCL C source
+    ProgramDefines & define(const std::string & name, const std::string & value) { m_defines[name] = value; return *this; }
+    // defines a macro with a numeric value (floats are written exactly, with the f suffix,
+    // infinities and NaNs as the INFINITY and NAN macros of OpenCL C)
+    ProgramDefines & define(const std::string & name, float value);
+    ProgramDefines & define(const std::string & name, int value);
+    ProgramDefines & define(const std::string & name, unsigned int value);
+
+    void clear(void) { m_defines.clear(); }
+    bool empty(void) const { return m_defines.empty(); }
+
+    // converts the definitions to build options
+    std::string str(void) const;
+
+    bool operator==(const ProgramDefines & other) const { return m_defines == other.m_defines; }
+    bool operator!=(const ProgramDefines & other) const { return m_defines != other.m_defines; }
+
+  private:
+    std::map<std::string, std::string> m_defines;
+};
+
+/**
+ * The same as buildProgram, the definitions are passed
+ * as -D options in front of the other build options.
+ */
+cl_program buildProgram(const cl_context ctx,
+                        const char * const program_files[],
+                        const unsigned int num,
+                        const ProgramDefines & defines,
+                        const char *built_options = nullptr);
+
+/**
+ * Caches the programs built from the same set of files with different
+ * definitions, so that switching back to an already used specialization
+ * of a program does not compile it again.
+ * The cache is meant to be used with a single OpenCL context, a different
+ * context discards all the cached programs.
+ */
+class ProgramCache
+{
+  public:
+    ProgramCache(const char * const program_files[], unsigned int num)
+      : m_program_files(program_files)
+      , m_num(num)
+      , m_ctx(nullptr)
+      , m_programs()
+      , m_hits(0)
+      , m_misses(0)
+    {
+    }
+
+    /**
+     * Returns the program specialized by the given definitions,
+     * the program is built when it is requested for the first time.
+     *
+     * @return the program or a NULL program on error
+     */
+    cl::Program get(cl_context ctx, const ProgramDefines & defines, const char *built_options = nullptr);
+
+    void clear(void) { m_programs.clear(); }
+    size_t size(void) const { return m_programs.size(); }
+    unsigned int hits(void) const { return m_hits; }
+    unsigned int misses(void) const { return m_misses; }
+
+  private:
+    typedef std::unordered_map<std::string, cl::Program> tProgramMap;
+
+  private:
+    const char * const *m_program_files;   /// the source files of the program
+    unsigned int m_num;                    /// the number of source files
+    cl_context m_ctx;                      /// the context the programs are built for
+    tProgramMap m_programs;                /// programs by their build options
+    unsigned int m_hits;                   /// the number of requests served from cache
+    unsigned int m_misses;                 /// the number of programs built
+};
+
 /**
  * A class to initialize kernel arguments
  */
@@ -131,13 +301,11 @@ class KernelArgs
 
     template <typename T>
     KernelArgs & arg(T param, cl_uint index)
-    { return setArgIndex(sizeof(T), &param, , index); }
+    { return setArgIndex(sizeof(T), &param, index); }
 
-    template <typename T>
     KernelArgs & arg(cl::LocalSpaceArg param)
     { return setArgNext(param.size_, nullptr); }
     
-    template <typename T>
     KernelArgs & arg(cl::LocalSpaceArg param, cl_uint index)
     { return setArgIndex(param.size_, nullptr, index); }
 
@@ -204,6 +372,8 @@ class GLBuffer
         m_mem(nullptr),
         m_ctx(ctx)
     {
+      if (headless()) return;
+
       glGenBuffers(1, &m_vbo);
       GLenum err = glGetError();
       if (err != GL_NO_ERROR) throw Exception("Failed to construct GLBuffer", err);
@@ -220,7 +390,7 @@ class GLBuffer
     ~GLBuffer(void)
     {
       clReleaseMemObject(m_mem);
-      glDeleteBuffers(1, &m_vbo);
+      if (m_vbo != 0) glDeleteBuffers(1, &m_vbo);
     }
 
     GLBuffer & operator=(GLBuffer && other)
@@ -251,6 +421,13 @@ class GLBuffer
       m_ctx = ctx;
     }
 
+    void swap(GLBuffer & other)
+    {
+      std::swap(m_vbo, other.m_vbo);
+      std::swap(m_mem, other.m_mem);
+      std::swap(m_ctx, other.m_ctx);
+    }
+
     bool bufferData(const GLvoid *data,               // a pointer to data that will be stored in the buffer
                     GLsizeiptr size,                  // the size of the data that will be stored (in bytes)
                     AccessType at = READ_WRITE,       // the access type of OpenCL's memory object
@@ -269,7 +446,11 @@ class GLBuffer
 };
 
 /**
- * A class to synchronize OpenGL and OpenCL memory objects
+ * A class to synchronize OpenGL and OpenCL memory objects.
+ * A blocking handler waits for OpenGL to finish before the buffers are acquired
+ * and for OpenCL to finish after they are released. A non-blocking handler only
+ * flushes the queue, so it may be used only for buffers that OpenGL does not
+ * access in the meantime (see GLDoubleBuffer).
  */
 class GLSyncHandler
 {
@@ -282,9 +463,9 @@ class GLSyncHandler
       acquireGLObjects();
     }
 #endif
-    GLSyncHandler(cl_command_queue queue, cl_uint num_buffers, const cl_mem *buffers)
+    GLSyncHandler(cl_command_queue queue, cl_uint num_buffers, const cl_mem *buffers, bool blocking = true)
       : m_queue(queue), m_num_buffers(num_buffers),
-        m_buffers(buffers), m_err(CL_SUCCESS)
+        m_buffers(buffers), m_blocking(blocking), m_err(CL_SUCCESS)
     {
       acquireGLObjects();
     }
@@ -292,15 +473,19 @@ class GLSyncHandler
     ~GLSyncHandler(void)
     {
       /* unlock the vertex buffer object, so that OpenGL can continue using it */
-      m_err = clEnqueueReleaseGLObjects(m_queue, m_num_buffers, m_buffers, 0, nullptr, nullptr);
-      if (m_err != CL_SUCCESS)
+      if (!headless())
       {
-        std::cerr << "Failed to release an exclusive access to one of OpenGL's vertex buffer objects: "
-                  << errorToStr(m_err) << std::endl;
+        m_err = clEnqueueReleaseGLObjects(m_queue, m_num_buffers, m_buffers, 0, nullptr, nullptr);
+        if (m_err != CL_SUCCESS)
+        {
+          std::cerr << "Failed to release an exclusive access to one of OpenGL's vertex buffer objects: "
+                    << errorToStr(m_err) << std::endl;
+        }
       }
       
       /* wait for OpenCL to finish processing */
-      clFinish(m_queue);
+      if (m_blocking) clFinish(m_queue);
+      else clFlush(m_queue);
     }
 
     bool hasError(void) const { return m_err != CL_SUCCESS; }
@@ -312,8 +497,11 @@ class GLSyncHandler
       assert(m_queue != nullptr);
       assert(m_buffers != nullptr);
 
+      /* there is nothing to share in headless mode */
+      if (headless()) return;
+
       /* wait for OpenGL to finish rendering */
-      glFinish();
+      if (m_blocking) glFinish();
 
       /* acquire access to the shared vertex buffer object */
       m_err = clEnqueueAcquireGLObjects(m_queue, m_num_buffers, m_buffers, 0, nullptr, nullptr);
@@ -337,9 +525,98 @@ class GLSyncHandler
     cl_command_queue m_queue;
     cl_uint m_num_buffers;
     const cl_mem *m_buffers;
+    bool m_blocking;
     cl_int m_err;
 };
 
+/**
+ * A pair of shared buffers to pipeline OpenCL and OpenGL.
+ *
+ * OpenCL copies the results of a step to the back buffer while OpenGL draws
+ * the front buffer filled in one of the previous frames, the buffers are swapped
+ * after drawing, so neither the CPU nor either of the APIs has to wait for the
+ * other one to become idle.
+ * OpenCL waits for OpenGL to finish drawing the back buffer via a GL fence
+ * converted to an OpenCL event (cl_khr_gl_event). If the extension
+ * is missing, the host waits for the fence (or calls glFinish without GL sync objects).
+ * OpenGL relies on the implicit synchronization of cl_khr_gl_event before it draws
+ * the front buffer, without the extension the host waits for the copy to finish.
+ */
+class GLDoubleBuffer
+{
+  public:
+    explicit GLDoubleBuffer(cl_context ctx = nullptr)
+      : m_size(0)
+      , m_front(0)
+      , m_has_front(false)
+      , m_back_ready(false)
+      , m_ctx(ctx)
+      , m_create_event_from_sync(nullptr)
+      , m_has_fences(false)
+    {
+      m_buffers[0].setCLContext(ctx);
+      m_buffers[1].setCLContext(ctx);
+      for (int i = 0; i < 2; ++i)
+      {
+        m_draw_fence[i] = nullptr;
+        m_wait_fence[i] = nullptr;
+        m_copy_event[i] = nullptr;
+      }
+    }
+
+    ~GLDoubleBuffer(void) { reset(); }
+
+    /**
+     * Checks which synchronization mechanisms are available
+     * for the given device and the current OpenGL context.
+     */
+    void init(cl_context ctx, cl_device_id device);
+
+    /** (re)allocates both buffers, nothing is drawn until the first publish */
+    bool resize(size_t size);
+    size_t size(void) const { return m_size; }
+
+    /** whether OpenCL waits for OpenGL on device (true) or on host (false) */
+    bool hasGLEvent(void) const { return m_create_event_from_sync != nullptr; }
+    bool hasFences(void) const { return m_has_fences; }
+
+    /**
+     * Enqueues a copy of the first size bytes of src to the back buffer,
+     * src has to be acquired by OpenCL already.
+     */
+    bool publish(cl_command_queue queue, cl_mem src);
+
+    /**
+     * Makes sure the front buffer may be drawn
+     *
+     * @return the OpenGL buffer object to draw or 0 if nothing has been published yet
+     */
+    GLuint beginDraw(void);
+
+    /** fences the drawing of the front buffer and swaps the buffers if a new frame is ready */
+    void endDraw(void);
+
+    /** waits for both APIs and drops all synchronization objects */
+    void reset(void);
+
+  private:
+    GLDoubleBuffer(const GLDoubleBuffer & );
+    GLDoubleBuffer & operator=(const GLDoubleBuffer & );
+
+  private:
+    GLBuffer m_buffers[2];        /// the front and the back buffer
+    size_t m_size;                /// the size of each buffer in bytes
+    int m_front;                  /// the index of the front buffer
+    bool m_has_front;             /// whether the front buffer contains anything to draw
+    bool m_back_ready;            /// whether a new frame has been published to the back buffer
+    GLsync m_draw_fence[2];       /// signalled when OpenGL finished the last draw of a buffer
+    GLsync m_wait_fence[2];       /// the fence the last copy to a buffer waits for
+    cl_event m_copy_event[2];     /// signalled when the last copy to a buffer has been released
+    cl_context m_ctx;             /// OpenCL context (not owned by this class)
+    clCreateEventFromGLsyncKHR_fn m_create_event_from_sync;  /// the entry point of cl_khr_gl_event if available
+    bool m_has_fences;            /// whether OpenGL sync objects are available
+};
+
 ///////////////////////////////////////////////////////////////////////////////
 // Performance counters and event handlers
 
@@ -350,7 +627,7 @@ class Event
     Event(Event && other) : m_event(other.m_event) { other.m_event = nullptr; }
     ~Event(void) { clReleaseEvent(m_event); }
 
-    Event & operator=(Event && other) { std::swap(m_event, other.m_event); }
+    Event & operator=(Event && other) { std::swap(m_event, other.m_event); return *this; }
 
     void setCallback(void (CL_CALLBACK * cb)(cl_event, cl_int, void *),
                      void *data = nullptr,
@@ -379,32 +656,206 @@ class Event
     cl_event m_event;
 };
 
+/**
+ * Keeps the raw timestamps of OpenCL commands and the host time spans
+ * of frames in bounded ring buffers (the oldest entries are overwritten)
+ * and writes them as a Chrome trace (JSON Trace Event Format),
+ * which can be viewed in chrome://tracing or in Perfetto.
+ *
+ * The device timestamps are converted to host time with an offset
+ * measured by calibrate, so the gaps between host and device work are visible.
+ */
+class TraceRecorder
+{
+  public:
+    static const size_t DEFAULT_EVENT_CAPACITY = 1 << 16;
+    static const size_t DEFAULT_FRAME_CAPACITY = 1 << 10;
+
+  public:
+    TraceRecorder(void)
+      : m_mutex()
+      , m_enabled(false)
+      , m_events()
+      , m_num_events(0)
+      , m_frames()
+      , m_num_frames(0)
+      , m_frame(0)
+      , m_epoch(std::chrono::steady_clock::now())
+      , m_offset(0)
+      , m_dump_first(0)
+      , m_dump_last(0)
+      , m_dump_file()
+      , m_dump_queue(nullptr)
+    {
+    }
+
+    ~TraceRecorder(void) { if (m_dump_queue != nullptr) clReleaseCommandQueue(m_dump_queue); }
+
+    // the commands and frames are recorded only when enabled,
+    // the ring buffers are allocated when enabled for the first time
+    void setEnabled(bool enabled);
+    bool enabled(void) const { return m_enabled.load(std::memory_order_relaxed); }
+    void clear(void);
+
+    // measures the offset of device timestamps from host time
+    // (the queue has to have profiling enabled)
+    bool calibrate(cl_command_queue queue);
+
+    // marks the host time span of a frame (a simulation step),
+    // a pending dump is written when its last frame is complete
+    unsigned int beginFrame(void);
+    void endFrame(void);
+    // the number of frames begun so far (the index of the next frame)
+    unsigned int frames(void) const { return m_frame; }
+
+    // records an OpenCL command (called from the callback threads of the driver)
+    void add(const std::string *name, cl_ulong queued, cl_ulong submitted, cl_ulong started, cl_ulong finished);
+
+    // records the given frames and writes them to a file as soon as the last of them
+    // is complete (the recording is enabled until then)
+    bool requestDump(cl_command_queue queue, unsigned int first, unsigned int last, const std::string & file_name);
+    bool dumpPending(void) const { return !m_dump_file.empty(); }
+    // writes the pending dump right away (the frames that were not recorded yet are left out)
+    bool finishDump(void);
+
+    // writes the recorded frames in the given range (and the commands enqueued during them)
+    bool dump(unsigned int first, unsigned int last, const std::string & file_name);
+
+  private:
+    struct Command
+    {
+      const std::string *name;
+      cl_ulong queued;     // device timestamps in nanoseconds
+      cl_ulong submitted;
+      cl_ulong started;
+      cl_ulong finished;
+    };
+
+    struct Frame
+    {
+      unsigned int index;
+      long long begin;     // host time in nanoseconds since m_epoch
+      long long end;
+    };
+
+  private:
+    long long hostTime(void) const
+    {
+      return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - m_epoch).count();
+    }
+
+  private:
+    TraceRecorder(const TraceRecorder & );
+    TraceRecorder & operator=(const TraceRecorder & );
+
+  private:
+    std::mutex m_mutex;                  /// guards the ring buffers
+    std::atomic<bool> m_enabled;
+    std::vector<Command> m_events;       /// a ring buffer of commands
+    unsigned long long m_num_events;     /// the number of commands recorded so far
+    std::vector<Frame> m_frames;         /// a ring buffer of frames
+    unsigned long long m_num_frames;
+    unsigned int m_frame;                /// the index of the next frame
+    std::chrono::steady_clock::time_point m_epoch;
+    long long m_offset;                  /// host time = device time + m_offset
+    unsigned int m_dump_first;           /// the pending dump (none when the file name is empty)
+    unsigned int m_dump_last;
+    std::string m_dump_file;
+    cl_command_queue m_dump_queue;
+};
+
+/**
+ * Latency histograms of a single kind of OpenCL commands.
+ * The records are added from the callback threads of OpenCL driver,
+ * so adding is lock-free and it may run concurrently with the queries.
+ */
 class PerfStatsRecord
 {
   public:
-    PerfStatsRecord(void)
-      : m_count(0)
-      , m_queue_time()
-      , m_submit_time()
-      , m_exec_time()
+    enum Metric {
+      QUEUE_TIME,    // from enqueueing to the submission to device
+      SUBMIT_TIME,   // from the submission to the start of execution
+      EXEC_TIME,     // the execution itself
+      NUM_METRICS
+    };
+
+  public:
+    PerfStatsRecord(const std::string *name = nullptr, TraceRecorder *trace = nullptr)
+      : m_active(0)
+      , m_windowed(false)
+      , m_total_exec_time(0)
+      , m_items(0)
+      , m_pairs(0)
+      , m_name(name)
+      , m_trace(trace)
     {
     }
-   
+
     void add(cl_ulong queue_time, cl_ulong submit_time, cl_ulong exec_time)
     {
-      m_queue_time.add(queue_time, m_count);
-      m_submit_time.add(submit_time, m_count);
-      m_exec_time.add(exec_time, m_count);
-      m_count++;
+      unsigned int active = m_active.load(std::memory_order_relaxed);
+      m_time[active][QUEUE_TIME].add(queue_time);
+      m_time[active][SUBMIT_TIME].add(submit_time);
+      m_time[active][EXEC_TIME].add(exec_time);
+      m_total_exec_time.fetch_add(exec_time, std::memory_order_relaxed);
     }
 
-    void print(const std::string & name, std::ostream & os);
+    /**
+     * Starts a new time window, the statistics then report the window
+     * that has just been finished (instead of the whole life of the record)
+     */
+    void nextWindow(void)
+    {
+      unsigned int next = m_active.load(std::memory_order_relaxed) ^ 1;
+      for (unsigned int i = 0; i < NUM_METRICS; ++i)
+      {
+        m_time[next][i].clear();
+      }
+      m_active.store(next, std::memory_order_relaxed);
+      m_windowed = true;
+    }
+
+    void print(const std::string & name, std::ostream & os) const;
+
+    // the histograms of the last finished window (or of the whole life without windows)
+    const utils::stats::Histogram & time(Metric metric) const
+    {
+      unsigned int active = m_active.load(std::memory_order_relaxed);
+      return m_time[m_windowed ? (active ^ 1) : active][metric];
+    }
+
+    unsigned int count(void) const { return time(EXEC_TIME).count(); }
+    const utils::stats::Histogram & execTime(void) const { return time(EXEC_TIME); }
+
+    // the execution time of all the recorded commands (not affected by windows)
+    unsigned long long totalExecTime(void) const { return m_total_exec_time.load(std::memory_order_relaxed); }
+
+    // the work-items and the evaluated particle pairs of all the enqueued commands
+    void addWork(unsigned long long items, unsigned long long pairs)
+    {
+      m_items.fetch_add(items, std::memory_order_relaxed);
+      m_pairs.fetch_add(pairs, std::memory_order_relaxed);
+    }
+
+    unsigned long long items(void) const { return m_items.load(std::memory_order_relaxed); }
+    unsigned long long pairs(void) const { return m_pairs.load(std::memory_order_relaxed); }
+
+    const std::string *name(void) const { return m_name; }
+    TraceRecorder *trace(void) const { return m_trace; }
+
+  private:
+    PerfStatsRecord(const PerfStatsRecord & );
+    PerfStatsRecord & operator=(const PerfStatsRecord & );
 
   private:
-    unsigned int m_count;                              /// the number of times this record has been recorded
-    utils::stats::Aggregator<cl_ulong> m_queue_time;   /// aggregated statistical records for in queue time
-    utils::stats::Aggregator<cl_ulong> m_submit_time;  /// aggregated statistical records for submit time
-    utils::stats::Aggregator<cl_ulong> m_exec_time;    /// aggregated statistical records for execution time
+    utils::stats::Histogram m_time[2][NUM_METRICS];     /// the current and the last finished window
+    std::atomic<unsigned int> m_active;                 /// the window the new records are added to
+    bool m_windowed;                                    /// whether any window has been finished
+    std::atomic<unsigned long long> m_total_exec_time;  /// the sum of all execution times in nanoseconds
+    std::atomic<unsigned long long> m_items;            /// the work-items of all commands
+    std::atomic<unsigned long long> m_pairs;            /// the particle pairs evaluated by all commands
+    const std::string *m_name;                          /// the name of the record (owned by PerfStats)
+    TraceRecorder *m_trace;                             /// the timeline of commands (owned by PerfStats)
 };
 
 class PerfStats
@@ -447,39 +898,155 @@ class PerfStats
 
     static void CL_CALLBACK cl_callback(cl_event ev, cl_int status, void *stats_rec);
 
+  public:
+    /**
+     * The global memory traffic and the floating point operations of a kernel
+     * per work-item and per evaluated particle pair, the traffic is the one
+     * requested by the kernel (the accesses served by caches are included)
+     */
+    struct KernelCost
+    {
+      double bytes_per_item;
+      double flops_per_item;
+      double bytes_per_pair;
+      double flops_per_pair;
+
+      KernelCost(double bytes_per_item = 0.0, double flops_per_item = 0.0,
+                 double bytes_per_pair = 0.0, double flops_per_pair = 0.0)
+        : bytes_per_item(bytes_per_item)
+        , flops_per_item(flops_per_item)
+        , bytes_per_pair(bytes_per_pair)
+        , flops_per_pair(flops_per_pair)
+      {
+      }
+    };
+
   private:
     typedef std::unordered_map<std::string, std::unique_ptr<PerfStatsRecord>> tContainer;
+    typedef std::map<std::string, KernelCost> tCostContainer;
+    typedef std::chrono::steady_clock tClock;
 
   public:
-    PerfStats(void) : m_stats() { }
+    PerfStats(void)
+      : m_stats()
+      , m_costs()
+      , m_peaks()
+      , m_mutex()
+      , m_window(0.0)
+      , m_window_start(tClock::now())
+      , m_trace()
+    {
+    }
+
+    // the trace refers to the names of records, so it is cleared too
+    void clear(void) { std::lock_guard<std::mutex> lock(m_mutex); m_trace.clear(); m_stats.clear(); }
+
+    // the timeline of the recorded commands
+    TraceRecorder & trace(void) { return m_trace; }
+
+    /**
+     * Reports only the last finished window of the given length (in seconds)
+     * instead of the whole life of the records (0 disables the windows).
+     * The windows are switched when the events are recorded.
+     */
+    void setWindow(double seconds)
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_window = seconds;
+      m_window_start = tClock::now();
+    }
+    double window(void) const { return m_window; }
+
+    // finishes the current window of all the records right away
+    void nextWindow(void)
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      nextWindowLocked();
+    }
 
-    void clear(void) { return m_stats.clear(); }
-    
     EventProxyRef event(Event & event, const std::string & name = std::string())
     { return EventProxyRef(event, insertStat(name)); }
     
     EventProxy event(const std::string & name = std::string())
     { return EventProxy(insertStat(name)); }
 
+    /** returns the record with the given name or nullptr if there is none */
+    const PerfStatsRecord *record(const std::string & name) const
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      tContainer::const_iterator it = m_stats.find(name);
+      return (it == m_stats.end()) ? nullptr : it->second.get();
+    }
+
+    /**
+     * Declares the cost of a kernel, the records with a declared cost are
+     * listed in the roofline report with the achieved bandwidth and FLOP rate
+     * (the declarations survive clear)
+     */
+    void declareCost(const std::string & name, const KernelCost & cost)
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_costs[name] = cost;
+    }
+
+    // the roofline report compares the kernels with these peaks
+    void setDevicePeaks(const DevicePeaks & peaks)
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_peaks = peaks;
+    }
+
+    // counts the work-items and the evaluated particle pairs of an enqueued command
+    void addWork(const std::string & name, unsigned long long items, unsigned long long pairs = 0)
+    { insertStat(name)->addWork(items, pairs); }
+
+    /** appends the names and the total execution times of all the records */
+    void totalExecTimes(std::vector<std::pair<std::string, unsigned long long> > & times) const
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      for (tContainer::const_iterator it = m_stats.begin(); it != m_stats.end(); ++it)
+      {
+        times.push_back(std::make_pair(it->first, it->second->totalExecTime()));
+      }
+    }
+
     friend std::ostream & operator<<(std::ostream & os, const PerfStats & stats)
     {
+      std::lock_guard<std::mutex> lock(stats.m_mutex);
+      if (stats.m_window > 0.0)
+      {
+        os << "(the last " << stats.m_window << " s window)" << std::endl;
+      }
+
       for (auto & it : stats.m_stats)
       {
         it.second->print(it.first, os);
         os << std::endl;
       }
+
+      stats.printRoofline(os);
+
       return os;
     }
 
   private:
     PerfStatsRecord *insertStat(const std::string & name)
     {
+      std::lock_guard<std::mutex> lock(m_mutex);
+
+      if ((m_window > 0.0) &&
+          (std::chrono::duration<double>(tClock::now() - m_window_start).count() >= m_window))
+      {
+        nextWindowLocked();
+      }
+
       tContainer::iterator it = m_stats.find(name);
       if (it == m_stats.end())
       {
-        PerfStatsRecord *ptr = new PerfStatsRecord;
-        m_stats.insert(std::make_pair(name, std::unique_ptr<PerfStatsRecord>(ptr)));
-        return ptr;
+        // the keys of an unordered_map do not move, so the record can point to its name
+        it = m_stats.insert(std::make_pair(name, std::unique_ptr<PerfStatsRecord>())).first;
+        it->second.reset(new PerfStatsRecord(&it->first, &m_trace));
+        return it->second.get();
       }
       else
       {
@@ -487,8 +1054,435 @@ class PerfStats
       }
     }
 
+    // prints the achieved bandwidth and FLOP rate of kernels with a declared cost (the mutex has to be locked)
+    void printRoofline(std::ostream & os) const;
+
+    void nextWindowLocked(void)
+    {
+      for (auto & it : m_stats)
+      {
+        it.second->nextWindow();
+      }
+      m_window_start = tClock::now();
+    }
+
   private:
     tContainer m_stats;
+    tCostContainer m_costs;         /// the declared costs of kernels
+    DevicePeaks m_peaks;            /// the device the kernels run on
+    mutable std::mutex m_mutex;     /// guards the containers (the records themselves are lock-free)
+    double m_window;                /// the length of statistics window in seconds (0 - no windows)
+    tClock::time_point m_window_start;
+    TraceRecorder m_trace;
+};
+
+///////////////////////////////////////////////////////////////////////////////
+// Work-group size tuning
+
+/**
+ * Selects the local work size of one dimensional kernels.
+ *
+ * Normally a kernel is run with the local size stored in the tuning database
+ * for the current device, or with the driver's choice if there is none.
+ * In tuning mode each kernel is run several times with each of the candidate
+ * local sizes (the driver's choice and multiples of
+ * CL_KERNEL_PREFERRED_WORK_GROUP_SIZE_MULTIPLE up to CL_KERNEL_WORK_GROUP_SIZE)
+ * and the fastest one according to the profiling information is written
+ * to the database.
+ * The global size is padded to a multiple of the local size,
+ * so the kernels have to check the number of elements themselves.
+ */
+class WorkGroupTuner
+{
+  public:
+    WorkGroupTuner(void)
+      : m_device(nullptr)
+      , m_device_key(0)
+      , m_db_file()
+      , m_sizes()
+      , m_other_devices()
+      , m_tuning(false)
+      , m_restart(false)
+      , m_trials()
+      , m_trial_stats()
+      , m_max_local_sizes()
+    {
+    }
+
+    /**
+     * Loads the local sizes tuned for the given device from the database file
+     * (a missing file is not an error, all kernels use the driver's choice then).
+     *
+     * @return true on success, false if the database could not be parsed
+     */
+    bool init(cl_device_id device, const std::string & db_file);
+
+    /** starts or stops tuning of the kernels enqueued from now on */
+    void setTuning(bool enable);
+    bool tuning(void) const { return m_tuning; }
+    bool toggleTuning(void) { setTuning(!m_tuning); return m_tuning; }
+
+    /** the tuned local size of the given kernel (0 means the driver's choice) */
+    size_t localSize(const std::string & name) const;
+
+    /**
+     * Enqueues a one dimensional kernel over n elements and records
+     * its execution time and work (n work-items and the given number
+     * of evaluated particle pairs) to stats under the given name.
+     */
+    cl_int enqueue(cl_command_queue queue, cl_kernel kernel,
+                   const char *name, size_t n, PerfStats & stats,
+                   unsigned long long pairs = 0);
+
+    /**
+     * Forgets the cached properties of kernels, this has to be called
+     * whenever the kernels are recreated (a new kernel may get the handle
+     * of a released one).
+     */
+    void forgetKernels(void) { m_max_local_sizes.clear(); }
+
+  private:
+    // the candidate local sizes of a kernel and the one to try next
+    struct Trial
+    {
+      std::vector<size_t> candidates;
+      size_t next;
+      bool done;
+
+      Trial(void) : candidates(), next(0), done(false) { }
+    };
+
+    typedef std::map<std::string, size_t> tSizeMap;
+    typedef std::map<cl_kernel, size_t> tKernelSizeMap;
+
+  private:
+    // generates the candidate local sizes for the given kernel
+    std::vector<size_t> candidates(cl_kernel kernel) const;
+    // picks the winner once all candidates of a trial have been run enough times
+    bool finishTrial(const std::string & name, Trial & trial);
+    // the maximum work-group size of the kernel on tuner's device (queried once per kernel)
+    size_t maxLocalSize(cl_kernel kernel) const;
+    // writes the tuned sizes of all devices to the database file
+    bool save(void) const;
+
+    static std::string trialName(const std::string & name, size_t local);
+
+  private:
+    static const unsigned int RUNS = 10;   /// the number of runs per candidate
+
+  private:
+    WorkGroupTuner(const WorkGroupTuner & );
+    WorkGroupTuner & operator=(const WorkGroupTuner & );
+
+  private:
+    cl_device_id m_device;                       /// the device kernels are tuned for
+    uint64_t m_device_key;                       /// identifies the device and its driver in database
+    std::string m_db_file;                       /// the path to tuning database
+    tSizeMap m_sizes;                            /// tuned local sizes of this device
+    std::vector<std::string> m_other_devices;    /// database entries of other devices
+    bool m_tuning;                               /// whether the tuning mode is on
+    bool m_restart;                              /// whether trial statistics have to be cleared
+    std::map<std::string, Trial> m_trials;       /// per kernel tuning state
+    PerfStats m_trial_stats;                     /// kernel times per candidate local size
+    mutable tKernelSizeMap m_max_local_sizes;    /// CL_KERNEL_WORK_GROUP_SIZE of the kernels seen so far
+};
+
+///////////////////////////////////////////////////////////////////////////////
+// Parallel primitives
+
+/**
+ * A stable GPU radix sort of (key, value) pairs of unsigned 32-bit integers
+ */
+class RadixSort
+{
+  public:
+    RadixSort(void)
+      : m_ctx()
+      , m_prog()
+      , m_histogram_kernel()
+      , m_scan_local_kernel()
+      , m_scan_add_kernel()
+      , m_scatter_kernel()
+      , m_tmp_keys_buf()
+      , m_tmp_values_buf()
+      , m_histogram_buf()
+      , m_scan_sums_bufs()
+      , m_capacity(0)
+    {
+    }
+
+    /**
+     * Compiles the sorting kernels for the given context.
+     *
+     * @return true on success, false otherwise
+     */
+    bool init(cl_context ctx);
+
+    /**
+     * Sorts the n (key, value) pairs in place.
+     * The work is only enqueued, no synchronisation is done.
+     *
+     * @param queue the command queue to enqueue the sorting kernels to
+     * @param keys a buffer with n keys
+     * @param values a buffer with n values that will be permuted along with the keys
+     * @param n the number of pairs to sort
+     * @param key_bits only the lowest key_bits bits of each key are considered
+     * @param stats optional performance statistics to record kernel times to
+     *
+     * @return true on success, false otherwise
+     */
+    bool sort(cl_command_queue queue,
+              cl_mem keys,
+              cl_mem values,
+              size_t n,
+              unsigned int key_bits = 32,
+              PerfStats *stats = nullptr);
+
+  private:
+    // enqueues a 1D kernel and records its execution time (if stats are given)
+    cl_int enqueue(cl_command_queue queue, cl_kernel kernel,
+                   size_t global, const size_t *local,
+                   const char *name, PerfStats *stats);
+    // makes sure the temporary buffers are large enough for n elements
+    bool reserve(size_t n);
+    // an exclusive prefix sum over the given buffer
+    bool scan(cl_command_queue queue, cl_mem data, size_t n, unsigned int level, PerfStats *stats);
+
+  public:
+    static const unsigned int RADIX_BITS = 4;     /// the number of bits processed in a single pass
+    static const unsigned int RADIX_BLOCK = 64;   /// the number of elements processed by a single work-item
+    static const unsigned int SCAN_WG = 128;      /// the work-group size of scan kernels
+
+  private:
+    static const char *m_kernel_file;
+
+  private:
+    RadixSort(const RadixSort & );
+    RadixSort & operator=(const RadixSort & );
+
+  private:
+    cl::Context m_ctx;                         /// the context the sort was initialized for
+    cl::Program m_prog;                        /// sorting program
+    cl::Kernel m_histogram_kernel;             /// per block digit histogram
+    cl::Kernel m_scan_local_kernel;            /// per work-group exclusive scan
+    cl::Kernel m_scan_add_kernel;              /// adds scanned block sums
+    cl::Kernel m_scatter_kernel;               /// moves the elements to their sorted position
+    cl::Buffer m_tmp_keys_buf;                 /// ping-pong buffer for keys
+    cl::Buffer m_tmp_values_buf;               /// ping-pong buffer for values
+    cl::Buffer m_histogram_buf;                /// digit histograms (later offsets) of all blocks
+    std::vector<cl::Buffer> m_scan_sums_bufs;  /// block sums for each level of the scan
+    size_t m_capacity;                         /// the number of elements the temporary buffers can hold
+};
+
+/**
+ * The type independent part of Reduction
+ */
+class ReductionBase
+{
+  public:
+    enum Op {
+      MIN,      /// the minimum of the mapped values
+      MAX,      /// the maximum of the mapped values
+      SUM,      /// the sum of the mapped values
+      SUM_SQR   /// the sum of squares of the mapped values
+    };
+
+  public:
+    /**
+     * Enqueues the reduction of n elements and a non-blocking read
+     * of the partial results, the result can be obtained later via result().
+     *
+     * @param queue the command queue to enqueue the reduction to
+     * @param input a buffer with at least n input elements
+     * @param n the number of elements to reduce
+     * @param input2 a buffer with at least n elements of the second input
+     *        (only when the reduction was initialized with a second input type)
+     * @param stats optional performance statistics to record kernel time to
+     * @param name the name of the record in stats
+     *
+     * @return true on success, false otherwise
+     */
+    bool enqueue(cl_command_queue queue,
+                 cl_mem input,
+                 size_t n,
+                 cl_mem input2 = nullptr,
+                 PerfStats *stats = nullptr,
+                 const char *name = "reduce");
+
+    /** whether a result has been enqueued and not collected yet */
+    bool pending(void) const { return (cl_event) m_event != nullptr; }
+
+    Op op(void) const { return m_op; }
+
+  protected:
+    ReductionBase(size_t elem_size)
+      : m_ctx()
+      , m_prog()
+      , m_kernel()
+      , m_partial_buf()
+      , m_partial()
+      , m_event()
+      , m_elem_size(elem_size)
+      , m_wg_size(0)
+      , m_num_groups(0)
+      , m_has_input2(false)
+      , m_op(SUM)
+    {
+    }
+
+    // generates and builds the reduction program
+    bool init(cl_context ctx,
+              Op op,
+              const char *type,
+              unsigned int components,
+              bool is_float,
+              const char *map_expr,
+              const char *in_type,
+              const char *in2_type,
+              const char *load_expr);
+
+    // waits for the pending read of partial results
+    bool wait(void);
+
+  public:
+    static const unsigned int MAX_WG_SIZE = 256;   /// the maximal work-group size
+    static const unsigned int MAX_GROUPS = 64;     /// the maximal number of partial results
+
+  private:
+    static const char *m_kernel_file;
+
+  private:
+    ReductionBase(const ReductionBase & );
+    ReductionBase & operator=(const ReductionBase & );
+
+  protected:
+    cl::Context m_ctx;                   /// the context the reduction was initialized for
+    cl::Program m_prog;                  /// the generated program
+    cl::Kernel m_kernel;                 /// the reduction kernel
+    cl::Buffer m_partial_buf;            /// partial results of work-groups
+    std::vector<unsigned char> m_partial;  /// host copy of the partial results
+    Event m_event;                       /// pending read of partial results
+    size_t m_elem_size;                  /// the size of the result type
+    size_t m_wg_size;                    /// the work-group size
+    size_t m_num_groups;                 /// the number of partial results of the last reduction
+    bool m_has_input2;                   /// whether the kernel takes a second input
+    Op m_op;                             /// the reduction operator
+};
+
+/**
+ * Describes the types that can be reduced
+ */
+template <typename T> struct ReductionTraits;
+
+template <> struct ReductionTraits<cl_float>
+{
+  typedef cl_float scalar_type;
+  static const unsigned int COMPONENTS = 1;
+  static const bool IS_FLOAT = true;
+  static const char *name(void) { return "float"; }
+  static scalar_type & component(cl_float & v, unsigned int ) { return v; }
+};
+
+template <> struct ReductionTraits<cl_float4>
+{
+  typedef cl_float scalar_type;
+  static const unsigned int COMPONENTS = 4;
+  static const bool IS_FLOAT = true;
+  static const char *name(void) { return "float4"; }
+  static scalar_type & component(cl_float4 & v, unsigned int i) { return v.s[i]; }
+};
+
+template <> struct ReductionTraits<cl_uint>
+{
+  typedef cl_uint scalar_type;
+  static const unsigned int COMPONENTS = 1;
+  static const bool IS_FLOAT = false;
+  static const char *name(void) { return "uint"; }
+  static scalar_type & component(cl_uint & v, unsigned int ) { return v; }
+};
+
+/**
+ * A GPU reduction of a buffer to a single value of type T (cl_float, cl_float4 or cl_uint).
+ *
+ * The input elements are first converted by a map expression written in OpenCL C
+ * in terms of x (the input element) and y (the element of the optional second input),
+ * e.g. "dot(x.xyz, x.xyz)" reduces float4 velocities to squared speeds.
+ * The elements are loaded as p[i] by default, a different load expression
+ * in terms of p and i can be given for data that are not stored as plain arrays.
+ * Only small partial results are read back (asynchronously), so the reduction
+ * does not stall the command queue.
+ *
+ * Usage:
+ *   ocl::Reduction<cl_float> max_speed2;
+ *   max_speed2.init(ctx, ocl::Reduction<cl_float>::MAX, "dot(x.xyz, x.xyz)", "float4");
+ *   max_speed2.enqueue(queue, velocity_buf, n);
+ *   ...
+ *   cl_float v2;
+ *   if (max_speed2.result(v2)) ...
+ */
+template <typename T>
+class Reduction : public ReductionBase
+{
+  private:
+    typedef ReductionTraits<T> tTraits;
+
+  public:
+    Reduction(void) : ReductionBase(sizeof(T)) { }
+
+    /**
+     * Generates and compiles the reduction kernel.
+     *
+     * @param ctx the OpenCL context
+     * @param op the reduction operator
+     * @param map_expr the expression converting input elements to T
+     * @param in_type the OpenCL type of input elements
+     * @param in2_type the OpenCL type of elements of the second input (nullptr when not used)
+     * @param load_expr the expression loading the i-th element from buffer p (nullptr for p[i])
+     *
+     * @return true on success, false otherwise
+     */
+    bool init(cl_context ctx,
+              Op op,
+              const char *map_expr = "x",
+              const char *in_type = tTraits::name(),
+              const char *in2_type = nullptr,
+              const char *load_expr = nullptr)
+    {
+      return ReductionBase::init(ctx, op, tTraits::name(), tTraits::COMPONENTS, tTraits::IS_FLOAT,
+                                 map_expr, in_type, in2_type, load_expr);
+    }
+
+    /**
+     * Waits for the last enqueued reduction and combines its partial results.
+     *
+     * @return true on success, false if no reduction is pending or it failed
+     */
+    bool result(T & value)
+    {
+      if (!wait()) return false;
+
+      const T *partial = (const T *) m_partial.data();
+      value = partial[0];
+
+      for (size_t i = 1; i < m_num_groups; ++i)
+      {
+        T p = partial[i];
+        for (unsigned int c = 0; c < tTraits::COMPONENTS; ++c)
+        {
+          typename tTraits::scalar_type & a = tTraits::component(value, c);
+          typename tTraits::scalar_type b = tTraits::component(p, c);
+
+          switch (m_op)
+          {
+            case MIN: a = std::min(a, b); break;
+            case MAX: a = std::max(a, b); break;
+            default:  a += b;             break;
+          }
+        }
+      }
+
+      return true;
+    }
 };
 
 }
@@ -24,7 +24,9 @@
 #include "debug.h"
 
 #include <iostream>
+#include <vector>
 #include <cstdarg>
+#include <cstring>
 
 
 
@@ -417,6 +419,122 @@ bool ShaderProgram::link(void)
   return status != GL_FALSE;
 }
 
+
+bool ShaderProgram::build(const char *vert_shader_source, const char *frag_shader_source)
+{
+  // program binaries are available since OpenGL 4.1
+  bool use_cache = utils::cache::enabled() && (GLEW_VERSION_4_1 || GLEW_ARB_get_program_binary);
+  uint64_t key = 0;
+
+  if (use_cache)
+  {
+    GLint num_formats = 0;
+    glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &num_formats);
+    use_cache = (num_formats > 0);
+  }
+
+  if (use_cache)
+  {
+    /* the binary is valid only for the same driver */
+    key = utils::cache::Hash()
+             .add((const char *) glGetString(GL_VENDOR))
+             .add((const char *) glGetString(GL_RENDERER))
+             .add((const char *) glGetString(GL_VERSION))
+             .add(vert_shader_source)
+             .add(frag_shader_source)
+             .value();
+
+    if (loadBinary(key)) return true;
+
+    glProgramParameteri(m_program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+  }
+
+  if (!(attachShader(GL_VERTEX_SHADER, vert_shader_source)   &&
+        attachShader(GL_FRAGMENT_SHADER, frag_shader_source) &&
+        link()))
+  {
+    return false;
+  }
+
+  if (use_cache) storeBinary(key);
+
+  return true;
+}
+
+
+bool ShaderProgram::buildFiles(const char *vert_shader_file, const char *frag_shader_file)
+{
+  std::string vert_source;
+  std::string frag_source;
+
+  if ((!utils::fs::loadFile(vert_shader_file, &vert_source)) ||
+      (!utils::fs::loadFile(frag_shader_file, &frag_source)))
+  {
+    return false;
+  }
+
+  return build(vert_source.c_str(), frag_source.c_str());
+}
+
+
+bool ShaderProgram::loadBinary(uint64_t key)
+{
+  assert(glIsProgram(m_program));
+
+  /* the cached data consist of the binary format followed by the binary itself */
+  std::vector<unsigned char> data;
+  if (!utils::cache::load("gl", key, &data)) return false;
+
+  if (data.size() <= sizeof(GLenum))
+  {
+    utils::cache::reject();
+    return false;
+  }
+
+  GLenum format = 0;
+  memcpy(&format, &data.front(), sizeof(format));
+
+  glProgramBinary(m_program, format, &data[sizeof(format)], (GLsizei) (data.size() - sizeof(format)));
+
+  // the driver may reject the binary (e.g. after an update),
+  // the program is then built from sources as usual
+  GLint status = GL_FALSE;
+  glGetProgramiv(m_program, GL_LINK_STATUS, &status);
+  if (status == GL_FALSE)
+  {
+    WARN("Cached shader program binary was rejected by the driver");
+    utils::cache::reject();
+    return false;
+  }
+
+  return true;
+}
+
+
+void ShaderProgram::storeBinary(uint64_t key)
+{
+  assert(glIsProgram(m_program));
+
+  GLint size = 0;
+  glGetProgramiv(m_program, GL_PROGRAM_BINARY_LENGTH, &size);
+  if (size <= 0) return;
+
+  std::vector<unsigned char> data(sizeof(GLenum) + size);
+  GLenum format = 0;
+  GLsizei length = 0;
+
+  glGetProgramBinary(m_program, size, &length, &format, &data[sizeof(format)]);
+  if ((glGetError() != GL_NO_ERROR) || (length <= 0))
+  {
+    WARN("Failed to retrieve shader program binary");
+    return;
+  }
+
+  memcpy(&data.front(), &format, sizeof(format));
+
+  utils::cache::store("gl", key, &data.front(), sizeof(format) + length);
+}
+
 ///////////////////////////////////////////////////////////////////////////////
 // Texture management
 
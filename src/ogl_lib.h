@@ -34,6 +34,7 @@
 #include <stdexcept>
 #include <string>
 #include <cassert>
+#include <cstdint>
 
 
 // Forward declartions
@@ -191,21 +192,18 @@ class ShaderProgram
     bool link(void);
 
     // compiles vertex and fragment shader from given sources and links them
-    // with program
-    bool build(const char *vert_shader_source, const char *frag_shader_source)
-    {
-      return attachShader(GL_VERTEX_SHADER, vert_shader_source)   &&
-             attachShader(GL_FRAGMENT_SHADER, frag_shader_source) &&
-             link();
-    }
+    // with program, the linked program binary is cached (see utils::cache),
+    // so the next build of the same sources on the same driver skips the compilation
+    bool build(const char *vert_shader_source, const char *frag_shader_source);
 
     // compiles given vertex and fragment shader files and links them with program
-    bool buildFiles(const char *vert_shader_file, const char *frag_shader_file)
-    {
-      return attachShaderFile(GL_VERTEX_SHADER, vert_shader_file)   &&
-             attachShaderFile(GL_FRAGMENT_SHADER, frag_shader_file) &&
-             link();
-    }
+    bool buildFiles(const char *vert_shader_file, const char *frag_shader_file);
+
+  private:
+    // loads the program from a cached binary
+    bool loadBinary(uint64_t key);
+    // stores the binary of the linked program in cache
+    void storeBinary(uint64_t key);
 
   private:
     ShaderProgram(const ShaderProgram & );
@@ -23,8 +23,10 @@
 #ifndef UTILS_H
 #define UTILS_H
 
+#include "utils/utils_cache.h"
 #include "utils/utils_fs.h"
 #include "utils/utils_stats.h"
+#include "utils/utils_tasks.h"
 #include "utils/utils_graphics.h"
 
 #define FLUIDSIM_COUNT(array) (sizeof((array)) / sizeof(*(array)))
@@ -0,0 +1,183 @@
+/*
+ * Copyright (C) 2014 Matus Fedorko <xfedor01@stud.fit.vutbr.cz>
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty.  In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+
+ * 1. The origin of this software must not be misrepresented; you must not
+ *    claim that you wrote the original software. If you use this software
+ *    in a product, an acknowledgment in the product documentation would be
+ *    appreciated but is not required.
+ * 2. Altered source versions must be plainly marked as such, and must not be
+ *    misrepresented as being the original software.
+ * 3. This notice may not be removed or altered from any source distribution.
+ */
+
+#include "utils_cache.h"
+#include "utils_fs.h"
+#include "global.h"
+
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <iomanip>
+#include <cstdio>
+#include <cstring>
+
+
+
+namespace utils {
+
+namespace cache {
+
+namespace {
+
+const char MAGIC[4] = { 'G', 'M', 'U', 'C' };
+const uint32_t VERSION = 1;
+
+/** the header of each cache file */
+struct Header
+{
+  char magic[4];
+  uint32_t version;
+  uint64_t key;
+  uint64_t size;
+};
+
+std::string g_directory;
+Stats g_stats = { 0, 0, 0 };
+
+std::string fileName(const char *kind, uint64_t key)
+{
+  std::ostringstream oss;
+  oss << g_directory;
+  if ((g_directory.back() != '/') && (g_directory.back() != '\\')) oss << '/';
+  oss << kind << '_' << std::hex << std::setw(16) << std::setfill('0') << key << ".bin";
+  return oss.str();
+}
+
+}
+
+
+void setDirectory(const char *dir)
+{
+  g_directory = (dir == nullptr) ? "" : dir;
+}
+
+
+const std::string & directory(void)
+{
+  return g_directory;
+}
+
+
+bool load(const char *kind, uint64_t key, std::vector<unsigned char> *data)
+{
+  if (g_directory.empty()) return false;
+
+  std::ifstream stream(fileName(kind, key).c_str(), std::ios::in | std::ios::binary);
+  if (!stream)
+  {
+    ++g_stats.misses;
+    return false;
+  }
+
+  /* the length of the file is needed to validate the size in its header */
+  stream.seekg(0, std::ios::end);
+  std::streamoff length = stream.tellg();
+  stream.seekg(0, std::ios::beg);
+
+  /* check that the file is a complete binary stored under the same key */
+  Header hdr;
+  if ((length < (std::streamoff) sizeof(hdr)) ||
+      (!stream.read((char *) &hdr, sizeof(hdr))) ||
+      (memcmp(hdr.magic, MAGIC, sizeof(MAGIC)) != 0) ||
+      (hdr.version != VERSION) ||
+      (hdr.key != key))
+  {
+    std::cerr << "Ignoring invalid cache file " << fileName(kind, key) << std::endl;
+    ++g_stats.misses;
+    return false;
+  }
+
+  // a damaged size must not cause a huge allocation
+  if (hdr.size != (uint64_t) (length - (std::streamoff) sizeof(hdr)))
+  {
+    std::cerr << "Ignoring invalid cache file " << fileName(kind, key) << std::endl;
+    ++g_stats.misses;
+    return false;
+  }
+
+  data->resize((size_t) hdr.size);
+  if ((hdr.size > 0) && (!stream.read((char *) &data->front(), data->size())))
+  {
+    std::cerr << "Ignoring truncated cache file " << fileName(kind, key) << std::endl;
+    ++g_stats.misses;
+    return false;
+  }
+
+  ++g_stats.hits;
+
+  return true;
+}
+
+
+bool store(const char *kind, uint64_t key, const void *data, size_t size)
+{
+  if (g_directory.empty()) return false;
+
+  if (!utils::fs::makeDirectory(g_directory.c_str()))
+  {
+    std::cerr << "Failed to create cache directory \'" << g_directory << "\'" << std::endl;
+    return false;
+  }
+
+  std::string file(fileName(kind, key));
+  std::ofstream stream(file.c_str(), std::ios::out | std::ios::binary | std::ios::trunc);
+  if (!stream)
+  {
+    std::cerr << "Failed to create cache file \'" << file << "\'" << std::endl;
+    return false;
+  }
+
+  Header hdr;
+  memcpy(hdr.magic, MAGIC, sizeof(MAGIC));
+  hdr.version = VERSION;
+  hdr.key = key;
+  hdr.size = size;
+
+  if ((!stream.write((const char *) &hdr, sizeof(hdr))) ||
+      (!stream.write((const char *) data, size)))
+  {
+    std::cerr << "Failed to write cache file \'" << file << "\'" << std::endl;
+    stream.close();
+    remove(file.c_str());
+    return false;
+  }
+
+  ++g_stats.stores;
+
+  return true;
+}
+
+
+void reject(void)
+{
+  if (g_stats.hits > 0) --g_stats.hits;
+  ++g_stats.misses;
+}
+
+
+const Stats & stats(void)
+{
+  return g_stats;
+}
+
+} // End of cache namespace
+
+} // End of utils namespace
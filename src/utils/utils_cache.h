@@ -0,0 +1,118 @@
+/*
+ * Copyright (C) 2014 Matus Fedorko <xfedor01@stud.fit.vutbr.cz>
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty.  In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+
+ * 1. The origin of this software must not be misrepresented; you must not
+ *    claim that you wrote the original software. If you use this software
+ *    in a product, an acknowledgment in the product documentation would be
+ *    appreciated but is not required.
+ * 2. Altered source versions must be plainly marked as such, and must not be
+ *    misrepresented as being the original software.
+ * 3. This notice may not be removed or altered from any source distribution.
+ */
+
+/**
+ * A persistent cache of compiled binaries (OpenCL programs, OpenGL shader programs)
+ * stored as files in a cache directory, so that the compilation can be skipped
+ * on the next start of the application.
+ */
+
+#ifndef UTILS_CACHE_H
+#define UTILS_CACHE_H
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <cstring>
+
+
+namespace utils {
+
+namespace cache {
+
+/**
+ * 64-bit FNV-1a hash, used to build cache keys
+ * from sources, build options and device identity
+ */
+class Hash
+{
+  public:
+    Hash(void) : m_hash(14695981039346656037ULL) { }
+
+    Hash & add(const void *data, size_t size)
+    {
+      const unsigned char *p = (const unsigned char *) data;
+      for (size_t i = 0; i < size; ++i)
+      {
+        m_hash ^= p[i];
+        m_hash *= 1099511628211ULL;
+      }
+      return *this;
+    }
+
+    // the terminating null character is hashed too,
+    // so that "ab" + "c" and "a" + "bc" give different hashes
+    Hash & add(const char *str)
+    {
+      if (str == nullptr) str = "";
+      return add(str, strlen(str) + 1);
+    }
+
+    Hash & add(const std::string & str) { return add(str.c_str(), str.size() + 1); }
+
+    uint64_t value(void) const { return m_hash; }
+
+  private:
+    uint64_t m_hash;
+};
+
+/** cache usage statistics */
+struct Stats
+{
+  unsigned int hits;     /// the number of binaries loaded from the cache
+  unsigned int misses;   /// the number of binaries that were not found (or were invalid)
+  unsigned int stores;   /// the number of binaries written to the cache
+};
+
+/**
+ * Sets the directory of the cache, the directory is created
+ * when the first binary is stored. An empty path disables the cache.
+ */
+void setDirectory(const char *dir);
+const std::string & directory(void);
+inline bool enabled(void) { return !directory().empty(); }
+
+/**
+ * Loads a binary of the given kind (e.g. "cl", "gl") stored under the given key.
+ *
+ * @return true if the binary was found, false otherwise
+ */
+bool load(const char *kind, uint64_t key, std::vector<unsigned char> *data);
+
+/**
+ * Stores a binary of the given kind under the given key
+ *
+ * @return true on success, false otherwise
+ */
+bool store(const char *kind, uint64_t key, const void *data, size_t size);
+
+/**
+ * Counts a binary that was rejected by the driver after it was loaded,
+ * so that it is reported as a miss instead of a hit.
+ */
+void reject(void);
+
+const Stats & stats(void);
+
+} // End of cache namespace
+
+} // End of utils namespace
+
+#endif
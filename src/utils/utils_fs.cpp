@@ -19,10 +19,23 @@
  */
 
 #include "utils_fs.h"
+#include "global.h"
 
 #include <fstream>
 #include <iterator>
 #include <iostream>
+#include <cerrno>
+
+#ifdef FLUIDSIM_OS_WIN
+# include <direct.h>
+# include <windows.h>
+#else
+# include <sys/mman.h>
+# include <sys/stat.h>
+# include <sys/types.h>
+# include <fcntl.h>
+# include <unistd.h>
+#endif
 
 
 
@@ -83,6 +96,106 @@ const char *loadFile(const char * const filename, size_t *file_size)
   return str;
 }
 
+
+bool makeDirectory(const char *dir)
+{
+#ifdef FLUIDSIM_OS_WIN
+  int ret = _mkdir(dir);
+#else
+  int ret = mkdir(dir, 0755);
+#endif
+  return (ret == 0) || (errno == EEXIST);
+}
+
+
+bool MappedFile::open(const char *filename)
+{
+  close();
+
+#ifdef FLUIDSIM_OS_WIN
+  HANDLE file = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, nullptr,
+                            OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+  if (file == INVALID_HANDLE_VALUE)
+  {
+    std::cerr << "Failed to open file \'" << filename << "\'" << std::endl;
+    return false;
+  }
+
+  LARGE_INTEGER size;
+  if ((!GetFileSizeEx(file, &size)) || (size.QuadPart == 0))
+  {
+    std::cerr << "Failed to map file \'" << filename << "\': the file is empty" << std::endl;
+    CloseHandle(file);
+    return false;
+  }
+
+  HANDLE mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+  void *data = (mapping != nullptr) ? MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0) : nullptr;
+  if (data == nullptr)
+  {
+    std::cerr << "Failed to map file \'" << filename << "\'" << std::endl;
+    if (mapping != nullptr) CloseHandle(mapping);
+    CloseHandle(file);
+    return false;
+  }
+
+  m_file = file;
+  m_mapping = mapping;
+  m_size = (size_t) size.QuadPart;
+#else
+  int fd = ::open(filename, O_RDONLY);
+  if (fd < 0)
+  {
+    std::cerr << "Failed to open file \'" << filename << "\'" << std::endl;
+    return false;
+  }
+
+  struct stat st;
+  if ((fstat(fd, &st) != 0) || (st.st_size == 0))
+  {
+    std::cerr << "Failed to map file \'" << filename << "\': the file is empty" << std::endl;
+    ::close(fd);
+    return false;
+  }
+
+  void *data = mmap(nullptr, (size_t) st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (data == MAP_FAILED)
+  {
+    std::cerr << "Failed to map file \'" << filename << "\'" << std::endl;
+    ::close(fd);
+    return false;
+  }
+
+  m_fd = fd;
+  m_size = (size_t) st.st_size;
+#endif
+
+  m_data = (const unsigned char *) data;
+
+  return true;
+}
+
+
+void MappedFile::close(void)
+{
+  if (m_data == nullptr) return;
+
+#ifdef FLUIDSIM_OS_WIN
+  UnmapViewOfFile(m_data);
+  CloseHandle(m_mapping);
+  CloseHandle(m_file);
+  m_mapping = nullptr;
+  m_file = nullptr;
+#else
+  munmap((void *) m_data, m_size);
+  ::close(m_fd);
+  m_fd = -1;
+#endif
+
+  m_data = nullptr;
+  m_size = 0;
+}
+
 } // End of fs namespace
 
 } // End of utils namespace
\ No newline at end of file
@@ -24,6 +24,7 @@
 #define UTILS_FS_H
 
 #include "Application.h"
+#include "global.h"
 
 #include <string>
 
@@ -39,6 +40,52 @@ bool loadFile(const char * const filename, std::string *source_code);
    Note that caller is responsible for deallocating the string */
 const char *loadFile(const char * const filename, size_t *file_size = nullptr);
 
+/* create a directory (its parent has to exist), an already existing directory is not an error */
+bool makeDirectory(const char *dir);
+
+/**
+ * A read-only memory mapping of a whole file,
+ * the pages are loaded by the operating system as they are accessed
+ */
+class MappedFile
+{
+  public:
+    MappedFile(void)
+      : m_data(nullptr)
+      , m_size(0)
+#ifdef FLUIDSIM_OS_WIN
+      , m_file(nullptr)
+      , m_mapping(nullptr)
+#else
+      , m_fd(-1)
+#endif
+    {
+    }
+
+    ~MappedFile(void) { close(); }
+
+    bool open(const char *filename);
+    void close(void);
+
+    bool isOpen(void) const { return m_data != nullptr; }
+    const unsigned char *data(void) const { return m_data; }
+    size_t size(void) const { return m_size; }
+
+  private:
+    MappedFile(const MappedFile & );
+    MappedFile & operator=(const MappedFile & );
+
+  private:
+    const unsigned char *m_data;
+    size_t m_size;
+#ifdef FLUIDSIM_OS_WIN
+    void *m_file;       // HANDLE of the file
+    void *m_mapping;    // HANDLE of the file mapping object
+#else
+    int m_fd;
+#endif
+};
+
 /** A helper class to assemble an Assets path */
 struct AssetsPath
 {
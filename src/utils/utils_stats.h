@@ -23,39 +23,245 @@
 #ifndef UTILS_STATS_H
 #define UTILS_STATS_H
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
 #include <limits>
+#include <vector>
 
 
 namespace utils {
 
 namespace stats {
 
-template <class T>
-class Aggregator
+/**
+ * A histogram of latencies with logarithmic buckets (in the style of HdrHistogram).
+ *
+ * Values below 2 * SUB_BUCKETS are counted exactly, every larger power of two
+ * is split to SUB_BUCKETS linear buckets, so the relative error of any reported
+ * value is below 1 / SUB_BUCKETS (about 3 %). Values above MAX_VALUE are clamped.
+ *
+ * Recording is lock-free and can be done from any number of threads,
+ * the queries may run concurrently with recording, they just do not
+ * need to see the values that are being added.
+ */
+class Histogram
 {
   public:
-    Aggregator(void)
-      : m_min(std::numeric_limits<T>::max())
-      , m_max(std::numeric_limits<T>::min())
-      , m_avg(0.0f)
+    typedef unsigned long long tValue;
+
+    static const unsigned int SUB_BUCKET_BITS = 5;
+    static const unsigned int SUB_BUCKETS = 1 << SUB_BUCKET_BITS;
+    static const unsigned int MAX_VALUE_BITS = 40;   // up to about 18 minutes in nanoseconds
+    static const unsigned int NUM_BUCKETS = 2 * SUB_BUCKETS + (MAX_VALUE_BITS - SUB_BUCKET_BITS - 1) * SUB_BUCKETS;
+
+  public:
+    Histogram(void) { clear(); }
+
+    // adds a single value
+    void add(tValue val)
     {
+      val = std::min(val, maxValue());
+
+      m_counts[bucketIndex(val)].fetch_add(1, std::memory_order_relaxed);
+      m_count.fetch_add(1, std::memory_order_relaxed);
+      m_sum.fetch_add(val, std::memory_order_relaxed);
+
+      tValue cur = m_min.load(std::memory_order_relaxed);
+      while ((val < cur) && (!m_min.compare_exchange_weak(cur, val, std::memory_order_relaxed))) { }
+
+      cur = m_max.load(std::memory_order_relaxed);
+      while ((val > cur) && (!m_max.compare_exchange_weak(cur, val, std::memory_order_relaxed))) { }
     }
 
-    T min(void) const { return m_min; }
-    T max(void) const { return m_max; }
-    float avg(void) const { return m_avg; }
+    // removes all values, the values added concurrently may be partially lost
+    void clear(void)
+    {
+      for (unsigned int i = 0; i < NUM_BUCKETS; ++i)
+      {
+        m_counts[i].store(0, std::memory_order_relaxed);
+      }
 
-    void add(T val, unsigned int count)
+      m_count.store(0, std::memory_order_relaxed);
+      m_sum.store(0, std::memory_order_relaxed);
+      m_min.store(std::numeric_limits<tValue>::max(), std::memory_order_relaxed);
+      m_max.store(0, std::memory_order_relaxed);
+    }
+
+    unsigned int count(void) const { return m_count.load(std::memory_order_relaxed); }
+    tValue min(void) const { return (count() > 0) ? m_min.load(std::memory_order_relaxed) : 0; }
+    tValue max(void) const { return m_max.load(std::memory_order_relaxed); }
+
+    double mean(void) const
+    {
+      unsigned int n = count();
+      return (n > 0) ? (double) m_sum.load(std::memory_order_relaxed) / n : 0.0;
+    }
+
+    // the value below which the given percentage of values lies (p in [0, 100])
+    tValue percentile(double p) const
     {
-      if (val > m_max) m_max = val;
-      if (val < m_min) m_min = val;
-      m_avg = (m_avg * count + val) / (count + 1);
+      tValue total = 0;
+      for (unsigned int i = 0; i < NUM_BUCKETS; ++i)
+      {
+        total += m_counts[i].load(std::memory_order_relaxed);
+      }
+
+      if (total == 0) return 0;
+
+      tValue rank = (tValue) std::ceil(std::max(0.0, std::min(p, 100.0)) * 0.01 * total);
+      if (rank == 0) rank = 1;
+
+      tValue seen = 0;
+      for (unsigned int i = 0; i < NUM_BUCKETS; ++i)
+      {
+        seen += m_counts[i].load(std::memory_order_relaxed);
+        if (seen >= rank)
+        {
+          // the middle of the bucket, but never outside of the recorded range
+          tValue val = bucketLow(i) + (bucketWidth(i) - 1) / 2;
+          return std::max(min(), std::min(val, max()));
+        }
+      }
+
+      return max();
     }
 
   private:
-    T m_min;
-    T m_max;
-    float m_avg;
+    static tValue maxValue(void) { return (tValue(1) << MAX_VALUE_BITS) - 1; }
+
+    static unsigned int bitLength(tValue val)
+    {
+      unsigned int len = 0;
+      while (val != 0)
+      {
+        val >>= 1;
+        ++len;
+      }
+      return len;
+    }
+
+    static unsigned int bucketIndex(tValue val)
+    {
+      if (val < 2 * SUB_BUCKETS) return (unsigned int) val;
+
+      // the top SUB_BUCKET_BITS + 1 bits select the bucket
+      unsigned int shift = bitLength(val) - SUB_BUCKET_BITS - 1;
+      return 2 * SUB_BUCKETS + (shift - 1) * SUB_BUCKETS + (unsigned int) ((val >> shift) - SUB_BUCKETS);
+    }
+
+    static tValue bucketLow(unsigned int index)
+    {
+      if (index < 2 * SUB_BUCKETS) return index;
+
+      unsigned int shift = (index - 2 * SUB_BUCKETS) / SUB_BUCKETS + 1;
+      tValue top = SUB_BUCKETS + (index - 2 * SUB_BUCKETS) % SUB_BUCKETS;
+      return top << shift;
+    }
+
+    static tValue bucketWidth(unsigned int index)
+    {
+      if (index < 2 * SUB_BUCKETS) return 1;
+      return tValue(1) << ((index - 2 * SUB_BUCKETS) / SUB_BUCKETS + 1);
+    }
+
+  private:
+    Histogram(const Histogram & );
+    Histogram & operator=(const Histogram & );
+
+  private:
+    std::atomic<unsigned int> m_counts[NUM_BUCKETS];
+    std::atomic<unsigned int> m_count;
+    std::atomic<tValue> m_sum;
+    std::atomic<tValue> m_min;
+    std::atomic<tValue> m_max;
+};
+
+
+/**
+ * The last N samples of a value (e.g. the frame times), the oldest samples
+ * are overwritten by the new ones
+ */
+class RollingSeries
+{
+  public:
+    explicit RollingSeries(unsigned int capacity = 0)
+      : m_values(capacity, 0.0f)
+      , m_next(0)
+      , m_size(0)
+    {
+    }
+
+    void add(float val)
+    {
+      if (m_values.empty()) return;
+      m_values[m_next] = val;
+      m_next = (m_next + 1) % m_values.size();
+      m_size = std::min<unsigned int>(m_size + 1, (unsigned int) m_values.size());
+    }
+
+    void clear(void) { m_next = 0; m_size = 0; }
+
+    unsigned int size(void) const { return m_size; }
+    unsigned int capacity(void) const { return (unsigned int) m_values.size(); }
+
+    // the samples are indexed from the oldest to the newest one
+    float operator[](unsigned int i) const
+    {
+      return m_values[(m_next + m_values.size() - m_size + i) % m_values.size()];
+    }
+
+    float last(void) const { return (m_size > 0) ? (*this)[m_size - 1] : 0.0f; }
+
+    float max(void) const
+    {
+      float res = 0.0f;
+      for (unsigned int i = 0; i < m_size; ++i) res = std::max(res, (*this)[i]);
+      return res;
+    }
+
+    float mean(void) const
+    {
+      float sum = 0.0f;
+      for (unsigned int i = 0; i < m_size; ++i) sum += (*this)[i];
+      return (m_size > 0) ? sum / m_size : 0.0f;
+    }
+
+  private:
+    std::vector<float> m_values;
+    unsigned int m_next;   /// the position of the next sample
+    unsigned int m_size;   /// the number of valid samples
+};
+
+
+/**
+ * Adds the time spent in the enclosing scope (in milliseconds) to the given accumulator
+ */
+class ScopedTimer
+{
+  public:
+    typedef std::chrono::high_resolution_clock tClock;
+
+  public:
+    explicit ScopedTimer(double & acc)
+      : m_acc(acc)
+      , m_start(tClock::now())
+    {
+    }
+
+    ~ScopedTimer(void)
+    {
+      m_acc += std::chrono::duration<double, std::milli>(tClock::now() - m_start).count();
+    }
+
+  private:
+    ScopedTimer(const ScopedTimer & );
+    ScopedTimer & operator=(const ScopedTimer & );
+
+  private:
+    double & m_acc;
+    tClock::time_point m_start;
 };
 
 } // End of stats namespace
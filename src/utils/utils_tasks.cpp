@@ -0,0 +1,185 @@
+/*
+ * Copyright (C) 2014 Matus Fedorko <xfedor01@stud.fit.vutbr.cz>
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty.  In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+
+ * 1. The origin of this software must not be misrepresented; you must not
+ *    claim that you wrote the original software. If you use this software
+ *    in a product, an acknowledgment in the product documentation would be
+ *    appreciated but is not required.
+ * 2. Altered source versions must be plainly marked as such, and must not be
+ *    misrepresented as being the original software.
+ * 3. This notice may not be removed or altered from any source distribution.
+ */
+
+
+#include "utils_tasks.h"
+
+#include <algorithm>
+
+
+
+namespace utils {
+
+namespace tasks {
+
+ThreadPool::ThreadPool(unsigned int num_threads)
+  : m_workers()
+  , m_queues()
+  , m_mutex()
+  , m_start_cond()
+  , m_done_cond()
+  , m_generation(0)
+  , m_quit(false)
+  , m_func(nullptr)
+  , m_pending(0)
+{
+  if (num_threads == 0)
+  {
+    num_threads = std::max(1u, std::thread::hardware_concurrency());
+  }
+
+  for (unsigned int i = 0; i < num_threads; ++i)
+  {
+    m_queues.push_back(std::unique_ptr<Queue>(new Queue));
+  }
+
+  for (unsigned int i = 0; i + 1 < num_threads; ++i)
+  {
+    m_workers.push_back(std::thread(&ThreadPool::workerLoop, this, i));
+  }
+}
+
+
+ThreadPool::~ThreadPool(void)
+{
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_quit = true;
+  }
+
+  m_start_cond.notify_all();
+
+  for (std::thread & t : m_workers)
+  {
+    t.join();
+  }
+}
+
+
+void ThreadPool::parallelFor(size_t count, size_t grain, const RangeFunc & func)
+{
+  if (count == 0) return;
+
+  grain = std::max<size_t>(grain, 1);
+
+  /* a single chunk is not worth waking up the workers */
+  if ((m_workers.empty()) || (count <= grain))
+  {
+    func(0, count);
+    return;
+  }
+
+  size_t num_chunks = (count + grain - 1) / grain;
+  size_t num_queues = m_queues.size();
+
+  /* the loop body has to be set before any chunk becomes visible,
+     a worker still looking for chunks of the previous loop may take it */
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_func = &func;
+    m_pending = num_chunks;
+    ++m_generation;
+  }
+
+  /* split the range into contiguous blocks of chunks, one per thread */
+  for (size_t c = 0; c < num_chunks; ++c)
+  {
+    Chunk chunk = { c * grain, std::min(count, (c + 1) * grain) };
+    Queue & q = *m_queues[(c * num_queues) / num_chunks];
+    std::lock_guard<std::mutex> lock(q.mutex);
+    q.chunks.push_front(chunk);
+  }
+
+  m_start_cond.notify_all();
+
+  /* help the workers */
+  unsigned int id = (unsigned int) (num_queues - 1);
+  while (runChunk(id)) { }
+
+  std::unique_lock<std::mutex> lock(m_mutex);
+  m_done_cond.wait(lock, [this] { return m_pending == 0; });
+  m_func = nullptr;
+}
+
+
+void ThreadPool::workerLoop(unsigned int id)
+{
+  unsigned int generation = 0;
+
+  for (;;)
+  {
+    {
+      std::unique_lock<std::mutex> lock(m_mutex);
+      m_start_cond.wait(lock, [&] { return m_quit || (m_generation != generation); });
+      if (m_quit) return;
+      generation = m_generation;
+    }
+
+    while (runChunk(id)) { }
+  }
+}
+
+
+bool ThreadPool::runChunk(unsigned int id)
+{
+  Chunk chunk;
+  bool found = false;
+
+  /* the own queue is processed from the back ... */
+  {
+    Queue & q = *m_queues[id];
+    std::lock_guard<std::mutex> lock(q.mutex);
+    if (!q.chunks.empty())
+    {
+      chunk = q.chunks.back();
+      q.chunks.pop_back();
+      found = true;
+    }
+  }
+
+  /* ... and the other queues are robbed from the front */
+  for (size_t i = 1; (!found) && (i < m_queues.size()); ++i)
+  {
+    Queue & q = *m_queues[(id + i) % m_queues.size()];
+    std::lock_guard<std::mutex> lock(q.mutex);
+    if (!q.chunks.empty())
+    {
+      chunk = q.chunks.front();
+      q.chunks.pop_front();
+      found = true;
+    }
+  }
+
+  if (!found) return false;
+
+  (*m_func)(chunk.begin, chunk.end);
+
+  if (--m_pending == 0)
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_done_cond.notify_all();
+  }
+
+  return true;
+}
+
+} // End of tasks namespace
+
+} // End of utils namespace
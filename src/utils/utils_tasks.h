@@ -0,0 +1,106 @@
+/*
+ * Copyright (C) 2014 Matus Fedorko <xfedor01@stud.fit.vutbr.cz>
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty.  In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+
+ * 1. The origin of this software must not be misrepresented; you must not
+ *    claim that you wrote the original software. If you use this software
+ *    in a product, an acknowledgment in the product documentation would be
+ *    appreciated but is not required.
+ * 2. Altered source versions must be plainly marked as such, and must not be
+ *    misrepresented as being the original software.
+ * 3. This notice may not be removed or altered from any source distribution.
+ */
+
+
+/** Utility functions concerning parallel execution on the host */
+
+#ifndef UTILS_TASKS_H
+#define UTILS_TASKS_H
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+
+namespace utils {
+
+namespace tasks {
+
+/**
+ * A pool of worker threads that execute parallel loops.
+ * The iteration range is split into chunks that are dealt to per thread
+ * queues, each thread takes chunks from the back of its own queue and when
+ * it runs out of work, it steals chunks from the front of the other queues,
+ * so uneven chunks (e.g. grid cells with a different number of particles)
+ * are balanced automatically. The calling thread takes part in the work too.
+ */
+class ThreadPool
+{
+  public:
+    // processes the iterations [begin, end)
+    typedef std::function<void (size_t begin, size_t end)> RangeFunc;
+
+  public:
+    // @param num_threads the number of threads including the calling one (0 means all hardware threads)
+    explicit ThreadPool(unsigned int num_threads = 0);
+    ~ThreadPool(void);
+
+    unsigned int numThreads(void) const { return (unsigned int) m_queues.size(); }
+
+    // calls func for chunks of at most grain iterations from [0, count) and waits until all of them finish
+    void parallelFor(size_t count, size_t grain, const RangeFunc & func);
+
+  private:
+    struct Chunk {
+      size_t begin;
+      size_t end;
+    };
+
+    struct Queue {
+      std::mutex mutex;
+      std::deque<Chunk> chunks;
+    };
+
+  private:
+    void workerLoop(unsigned int id);
+
+    // runs a single chunk from the thread's own queue or a stolen one
+    // @return false if there is no chunk left in any queue
+    bool runChunk(unsigned int id);
+
+  private:
+    // just disable copying
+    ThreadPool(const ThreadPool & );
+    ThreadPool & operator=(const ThreadPool & );
+
+  private:
+    std::vector<std::thread> m_workers;
+    std::vector<std::unique_ptr<Queue> > m_queues;  // the last queue belongs to the calling thread
+
+    std::mutex m_mutex;
+    std::condition_variable m_start_cond;   // signals a new loop (or quit) to workers
+    std::condition_variable m_done_cond;    // signals the end of a loop to the calling thread
+    unsigned int m_generation;              // the number of started loops
+    bool m_quit;
+
+    const RangeFunc *m_func;                // the body of the current loop
+    std::atomic<size_t> m_pending;          // the number of unfinished chunks of the current loop
+};
+
+} // End of tasks namespace
+
+} // End of utils namespace
+
+#endif